@@ -0,0 +1,768 @@
+/**********************************************************************
+File name: main.cpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ffengine/io/log.hpp"
+
+#include "ffengine/sim/epoll_server.hpp"
+#include "ffengine/sim/server.hpp"
+
+#include "netserver_control.pb.h"
+#include "world_command.pb.h"
+
+
+static io::Logger &logger = io::logging().get_logger("netbench");
+
+typedef std::chrono::steady_clock Clock;
+
+
+struct BenchConfig
+{
+    unsigned long clients = 8;
+    double duration = 10.;
+    double rate = 60.;
+    unsigned long window = 64;
+    unsigned long respond_every = 1;
+    unsigned long level_every = 10;
+    unsigned long ping_every = 30;
+    unsigned long brush_size = 16;
+    unsigned long seed = 1;
+    unsigned int terrain_size = 0;
+};
+
+
+struct ClientStats
+{
+    std::uint64_t commands_sent = 0;
+    std::uint64_t responses = 0;
+    std::uint64_t failed_commands = 0;
+    std::uint64_t lost_responses = 0;
+    std::uint64_t pings_sent = 0;
+    std::uint64_t bytes_sent = 0;
+    std::uint64_t bytes_received = 0;
+    std::vector<Clock::duration> command_latencies;
+    std::vector<Clock::duration> ping_rtts;
+    std::chrono::nanoseconds cpu_time{0};
+    bool failed = false;
+};
+
+
+static std::chrono::nanoseconds thread_cpu_time()
+{
+    timespec ts;
+    ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+}
+
+static std::chrono::nanoseconds process_cpu_time()
+{
+    rusage usage;
+    ::getrusage(RUSAGE_SELF, &usage);
+    return std::chrono::seconds(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)
+            + std::chrono::microseconds(usage.ru_utime.tv_usec
+                                        + usage.ru_stime.tv_usec);
+}
+
+static double to_ms(const Clock::duration d)
+{
+    return std::chrono::duration<double, std::milli>(d).count();
+}
+
+static double to_s(const Clock::duration d)
+{
+    return std::chrono::duration<double>(d).count();
+}
+
+/**
+ * Return the \a p-th quantile of the sorted \a values, using the
+ * nearest-rank method.
+ */
+static Clock::duration percentile(const std::vector<Clock::duration> &values,
+                                  const double p)
+{
+    if (values.empty()) {
+        return Clock::duration::zero();
+    }
+    const std::size_t rank = std::size_t(std::ceil(p * values.size()));
+    return values[std::max<std::size_t>(rank, 1) - 1];
+}
+
+
+/**
+ * Generates the command stream of a synthetic player: brush drags across
+ * the terrain, interspersed with levelling strokes.
+ *
+ * Each drag is a random walk with a slowly changing direction, starting at
+ * a random position; consecutive commands of a drag overlap, like those of a
+ * player dragging the mouse.
+ */
+class CommandGenerator
+{
+public:
+    CommandGenerator(const BenchConfig &config, const unsigned int seed):
+        m_config(config),
+        m_rng(seed),
+        m_density_map(config.brush_size*config.brush_size),
+        m_counter(0),
+        m_drag_remaining(0),
+        m_x(0),
+        m_y(0),
+        m_angle(0),
+        m_strength(0)
+    {
+        // radial falloff, as produced by the brush tools of the client
+        const float radius = config.brush_size / 2.f;
+        for (unsigned int y = 0; y < config.brush_size; ++y) {
+            for (unsigned int x = 0; x < config.brush_size; ++x) {
+                const float dx = (x + 0.5f - radius) / radius;
+                const float dy = (y + 0.5f - radius) / radius;
+                m_density_map[y*config.brush_size+x] =
+                        std::max(0.f, 1.f - std::sqrt(dx*dx + dy*dy));
+            }
+        }
+    }
+
+private:
+    const BenchConfig &m_config;
+    std::mt19937 m_rng;
+    std::vector<float> m_density_map;
+
+    std::uint64_t m_counter;
+    unsigned int m_drag_remaining;
+    float m_x;
+    float m_y;
+    float m_angle;
+    float m_strength;
+
+private:
+    void start_drag()
+    {
+        const float size = m_config.terrain_size;
+        std::uniform_real_distribution<float> pos(0.f, size);
+        std::uniform_real_distribution<float> angle(0.f, 2*M_PI);
+        std::uniform_int_distribution<unsigned int> length(30, 120);
+        m_x = pos(m_rng);
+        m_y = pos(m_rng);
+        m_angle = angle(m_rng);
+        m_strength = (m_rng() % 2 == 0 ? 0.05f : -0.05f);
+        m_drag_remaining = length(m_rng);
+    }
+
+    void step()
+    {
+        std::uniform_real_distribution<float> turn(-0.2f, 0.2f);
+        const float size = m_config.terrain_size;
+        const float step = m_config.brush_size / 4.f;
+        m_angle += turn(m_rng);
+        m_x += std::cos(m_angle) * step;
+        m_y += std::sin(m_angle) * step;
+        // bounce off the edges of the terrain
+        if (m_x < 0 || m_x >= size) {
+            m_angle = M_PI - m_angle;
+            m_x = std::min(std::max(m_x, 0.f), size - 1);
+        }
+        if (m_y < 0 || m_y >= size) {
+            m_angle = -m_angle;
+            m_y = std::min(std::max(m_y, 0.f), size - 1);
+        }
+    }
+
+public:
+    void next(sim::messages::WorldCommand &dest)
+    {
+        if (m_drag_remaining == 0) {
+            start_drag();
+        }
+        step();
+        --m_drag_remaining;
+
+        dest.Clear();
+        if (m_config.level_every > 0 &&
+                ++m_counter % m_config.level_every == 0)
+        {
+            sim::messages::TerraformLevel &cmd = *dest.mutable_tf_level();
+            cmd.set_xc(m_x);
+            cmd.set_yc(m_y);
+            cmd.set_brush_size(m_config.brush_size);
+            cmd.mutable_density_map()->Add(m_density_map.begin(),
+                                           m_density_map.end());
+            cmd.set_brush_strength(0.5f);
+            cmd.set_reference_height(sim::Terrain::default_height);
+        } else {
+            sim::messages::TerraformRaise &cmd = *dest.mutable_tf_raise();
+            cmd.set_xc(m_x);
+            cmd.set_yc(m_y);
+            cmd.set_brush_size(m_config.brush_size);
+            cmd.mutable_density_map()->Add(m_density_map.begin(),
+                                           m_density_map.end());
+            cmd.set_brush_strength(m_strength);
+        }
+    }
+
+};
+
+
+/**
+ * A synthetic client, connected to the server via loopback TCP.
+ *
+ * The client sends commands at a fixed rate, keeping at most a configured
+ * number of commands with a pending response in flight, and measures the
+ * time until the server responds. As the server responds to a command at
+ * the end of the game frame in which it was executed, this is the
+ * command-to-execution latency plus one loopback transfer.
+ *
+ * Pings are answered by the network thread of the server without involving
+ * the game loop; their round trip time is the latency of the network
+ * frontend alone.
+ */
+class SyntheticClient: public sim::IMessageHandler
+{
+public:
+    SyntheticClient(const BenchConfig &config,
+                    const unsigned int index,
+                    const std::uint16_t port):
+        m_config(config),
+        m_port(port),
+        m_generator(config, config.seed*7919 + index),
+        m_parser(std::bind(&SyntheticClient::link_control_received,
+                           this, std::placeholders::_1),
+                 std::bind(&SyntheticClient::parser_failed, this),
+                 index),
+        m_fd(-1),
+        m_next_token(0)
+    {
+        m_parser.set_message_handler(this);
+    }
+
+    ~SyntheticClient() override
+    {
+        if (m_fd >= 0) {
+            ::close(m_fd);
+        }
+    }
+
+private:
+    static constexpr int MAX_IOV = 64;
+
+    const BenchConfig &m_config;
+    const std::uint16_t m_port;
+    CommandGenerator m_generator;
+    sim::NetMessageParser m_parser;
+    sim::NetFrameBuilder m_send_frames;
+    int m_fd;
+
+    std::uint32_t m_next_token;
+    std::unordered_map<std::uint32_t, Clock::time_point> m_pending;
+    ClientStats m_stats;
+
+    sim::messages::WorldCommand m_command;
+    sim::messages::NetWorldControl m_ping;
+
+private:
+    void link_control_received(
+            std::shared_ptr<sim::messages::NetWorldControl> &&msg)
+    {
+        if (!msg->has_pong()) {
+            return;
+        }
+        const Clock::time_point sent{
+            Clock::duration(Clock::duration::rep(msg->pong().payload()))};
+        m_stats.ping_rtts.push_back(Clock::now() - sent);
+    }
+
+    void parser_failed()
+    {
+        logger.log(io::LOG_ERROR) << "received malformed data" << io::submit;
+        m_stats.failed = true;
+    }
+
+    void connect()
+    {
+        m_fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (m_fd < 0) {
+            throw std::system_error(errno, std::system_category(), "socket");
+        }
+        const int one = 1;
+        ::setsockopt(m_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(m_port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (::connect(m_fd, reinterpret_cast<sockaddr*>(&addr),
+                      sizeof(addr)) != 0 && errno != EINPROGRESS)
+        {
+            throw std::system_error(errno, std::system_category(), "connect");
+        }
+    }
+
+    void enqueue_command(const Clock::time_point now)
+    {
+        m_generator.next(m_command);
+        const std::uint64_t seq = m_stats.commands_sent++;
+        if (seq % m_config.respond_every == 0) {
+            const std::uint32_t token = m_next_token++;
+            m_command.set_token(token);
+            m_pending.emplace(token, now);
+        }
+        m_send_frames.append(sim::MSGCLASS_WORLD_COMMAND, m_command);
+
+        if (m_config.ping_every > 0 && seq % m_config.ping_every == 0) {
+            m_ping.mutable_ping()->set_token(m_stats.pings_sent++);
+            m_ping.mutable_ping()->set_payload(now.time_since_epoch().count());
+            m_send_frames.append(sim::MSGCLASS_LINK_CONTROL, m_ping);
+        }
+    }
+
+    bool send_pending()
+    {
+        std::array<struct iovec, MAX_IOV> iov;
+        int count;
+        while ((count = m_send_frames.pending(iov.data(), iov.size())) > 0) {
+            msghdr msg{};
+            msg.msg_iov = iov.data();
+            msg.msg_iovlen = count;
+            const ssize_t bytes_sent = ::sendmsg(m_fd, &msg, MSG_NOSIGNAL);
+            if (bytes_sent >= 0) {
+                m_send_frames.consume(bytes_sent);
+                m_stats.bytes_sent += bytes_sent;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            } else if (errno != EINTR) {
+                logger.log(io::LOG_ERROR) << "failed to send: "
+                                          << std::strerror(errno)
+                                          << io::submit;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool receive()
+    {
+        while (!m_stats.failed) {
+            char *dest;
+            std::size_t size;
+            std::tie(dest, size) = m_parser.next_buffer();
+            const ssize_t bytes_read = ::recv(m_fd, dest, size, 0);
+            if (bytes_read > 0) {
+                m_stats.bytes_received += bytes_read;
+                m_parser.written(bytes_read);
+            } else if (bytes_read == 0) {
+                m_parser.written(0);
+                logger.log(io::LOG_ERROR) << "server closed the connection"
+                                          << io::submit;
+                return false;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                m_parser.written(0);
+                return true;
+            } else if (errno != EINTR) {
+                m_parser.written(0);
+                logger.log(io::LOG_ERROR) << "failed to receive: "
+                                          << std::strerror(errno)
+                                          << io::submit;
+                return false;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Wait until the socket is ready or \a until has passed and process the
+     * socket.
+     */
+    bool poll_socket(const Clock::time_point until)
+    {
+        const Clock::time_point now = Clock::now();
+        int timeout_ms = 0;
+        if (until > now) {
+            timeout_ms = int(std::ceil(to_ms(until - now)));
+        }
+
+        pollfd pfd{};
+        pfd.fd = m_fd;
+        pfd.events = POLLIN;
+        if (m_send_frames.pending_bytes() > 0) {
+            pfd.events |= POLLOUT;
+        }
+        const int ready = ::poll(&pfd, 1, timeout_ms);
+        if (ready < 0) {
+            return errno == EINTR;
+        }
+        if (ready == 0) {
+            return true;
+        }
+        if (pfd.revents & (POLLERR | POLLHUP)) {
+            logger.log(io::LOG_ERROR) << "connection failed" << io::submit;
+            return false;
+        }
+        if ((pfd.revents & POLLOUT) && !send_pending()) {
+            return false;
+        }
+        if ((pfd.revents & POLLIN) && !receive()) {
+            return false;
+        }
+        return !m_stats.failed;
+    }
+
+protected:
+    bool msg_unhandled(sim::AbstractMessagePtr &&) override
+    {
+        logger.log(io::LOG_ERROR) << "received unexpected message"
+                                  << io::submit;
+        return false;
+    }
+
+public:
+    bool msg_world_command_response(
+            std::shared_ptr<sim::messages::WorldCommandResponse> &&response) override
+    {
+        auto iter = m_pending.find(response->token());
+        if (iter == m_pending.end()) {
+            logger.log(io::LOG_ERROR) << "received response with unknown "
+                                      << "token " << response->token()
+                                      << io::submit;
+            return false;
+        }
+        m_stats.command_latencies.push_back(Clock::now() - iter->second);
+        m_pending.erase(iter);
+        ++m_stats.responses;
+        if (response->result() != sim::NO_ERROR) {
+            ++m_stats.failed_commands;
+        }
+        return true;
+    }
+
+public:
+    inline ClientStats &stats()
+    {
+        return m_stats;
+    }
+
+    /**
+     * Run the client until \a deadline, then wait up to \a drain_timeout for
+     * the outstanding responses.
+     */
+    void run(const Clock::time_point deadline,
+             const Clock::duration drain_timeout)
+    {
+        try {
+            connect();
+        } catch (const std::system_error &err) {
+            logger.log(io::LOG_ERROR) << err.what() << io::submit;
+            m_stats.failed = true;
+            return;
+        }
+
+        const Clock::duration interval =
+                m_config.rate > 0
+                ? std::chrono::duration_cast<Clock::duration>(
+                      std::chrono::duration<double>(1. / m_config.rate))
+                : Clock::duration::zero();
+        Clock::time_point next_send = Clock::now();
+        Clock::time_point now = next_send;
+
+        while (now < deadline) {
+            // do not try to catch up with more than a second of backlog
+            if (now - next_send > std::chrono::seconds(1)) {
+                next_send = now;
+            }
+            while (next_send <= now && m_pending.size() < m_config.window) {
+                enqueue_command(now);
+                next_send += interval;
+            }
+            if (!send_pending()) {
+                m_stats.failed = true;
+                break;
+            }
+
+            Clock::time_point wakeup = deadline;
+            if (m_pending.size() < m_config.window) {
+                wakeup = std::min(wakeup, next_send);
+            }
+            if (!poll_socket(wakeup)) {
+                m_stats.failed = true;
+                break;
+            }
+            now = Clock::now();
+        }
+
+        const Clock::time_point drain_deadline = Clock::now() + drain_timeout;
+        while (!m_stats.failed && !m_pending.empty() &&
+               Clock::now() < drain_deadline)
+        {
+            if (!poll_socket(drain_deadline)) {
+                m_stats.failed = true;
+            }
+        }
+        m_stats.lost_responses = m_pending.size();
+
+        ::close(m_fd);
+        m_fd = -1;
+        m_stats.cpu_time = thread_cpu_time();
+    }
+
+};
+
+
+static void usage(const char *argv0)
+{
+    std::cerr << "usage: " << argv0
+              << " [--clients N] [--duration SECONDS] [--rate COMMANDS/S]"
+              << " [--window N] [--respond-every N] [--level-every N]"
+              << " [--ping-every N] [--brush-size N] [--seed N]"
+              << std::endl
+              << std::endl
+              << "Runs a sim::Server with the epoll network frontend on the"
+              << " loopback interface" << std::endl
+              << "and connects N synthetic clients which send terraforming"
+              << " brush drags at the" << std::endl
+              << "given rate per client. A rate of zero sends as fast as the"
+              << " window of" << std::endl
+              << "unanswered commands permits." << std::endl;
+}
+
+static bool parse_args(int argc, char **argv, BenchConfig &config)
+{
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg(argv[i]);
+        if (i + 1 >= argc) {
+            return false;
+        }
+        const char *value = argv[++i];
+        char *end = nullptr;
+        if (arg == "--duration" || arg == "--rate") {
+            const double parsed = std::strtod(value, &end);
+            if (*end != '\0' || !(parsed >= 0)) {
+                return false;
+            }
+            (arg == "--duration" ? config.duration : config.rate) = parsed;
+            continue;
+        }
+
+        const unsigned long parsed = std::strtoul(value, &end, 10);
+        if (*end != '\0') {
+            return false;
+        }
+        if (arg == "--clients") {
+            config.clients = parsed;
+        } else if (arg == "--window") {
+            config.window = parsed;
+        } else if (arg == "--respond-every") {
+            config.respond_every = parsed;
+        } else if (arg == "--level-every") {
+            config.level_every = parsed;
+        } else if (arg == "--ping-every") {
+            config.ping_every = parsed;
+        } else if (arg == "--brush-size") {
+            config.brush_size = parsed;
+        } else if (arg == "--seed") {
+            config.seed = parsed;
+        } else {
+            return false;
+        }
+    }
+    return config.clients > 0 && config.window > 0 &&
+            config.respond_every > 0 && config.brush_size > 0 &&
+            config.brush_size <= 128;
+}
+
+static void print_latencies(const char *name,
+                            std::vector<Clock::duration> &values)
+{
+    std::sort(values.begin(), values.end());
+    std::printf("%-20s n=%zu p50=%.2f ms p90=%.2f ms p99=%.2f ms "
+                "max=%.2f ms\n",
+                name, values.size(),
+                to_ms(percentile(values, 0.5)),
+                to_ms(percentile(values, 0.9)),
+                to_ms(percentile(values, 0.99)),
+                to_ms(percentile(values, 1.0)));
+}
+
+int main(int argc, char **argv)
+{
+    BenchConfig config;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg(argv[i]);
+        if (arg == "--help" || arg == "-h") {
+            usage(argv[0]);
+            return 0;
+        }
+    }
+    if (!parse_args(argc, argv, config)) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    io::logging().attach_sink<io::LogTTYSink>()->set_level(io::LOG_WARNING);
+
+    sim::Server server;
+    config.terrain_size = server.state().terrain().size();
+
+    // only accessed from the event loop of the network server
+    std::unordered_map<sim::ServerClientBase*,
+                       std::unique_ptr<sim::ServerCommandHandler> > handlers;
+
+    sim::EpollNetServer net_server;
+    net_server.client_connected().connect(
+                [&server, &handlers](sim::ServerClientBase &client){
+                    auto handler = std::make_unique<sim::ServerCommandHandler>(
+                                server, client);
+                    client.set_message_handler(handler.get());
+                    handlers.emplace(&client, std::move(handler));
+                });
+    net_server.client_closed().connect(
+                [&handlers](sim::ServerClientBase &client){
+                    client.set_message_handler(nullptr);
+                    handlers.erase(&client);
+                });
+    try {
+        net_server.listen("127.0.0.1", 0);
+    } catch (const std::system_error &err) {
+        logger.log(io::LOG_EXCEPTION) << "failed to listen: " << err.what()
+                                      << io::submit;
+        return 1;
+    }
+    net_server.start();
+
+    // the simulation keeps running without clients; measure its baseline
+    // load first, so that it can be subtracted from the load with clients
+    const Clock::duration idle_period = std::chrono::seconds(1);
+    const std::chrono::nanoseconds idle_cpu_start = process_cpu_time();
+    std::this_thread::sleep_for(idle_period);
+    const std::chrono::nanoseconds idle_cpu =
+            process_cpu_time() - idle_cpu_start;
+
+    std::vector<std::unique_ptr<SyntheticClient> > clients;
+    for (unsigned int i = 0; i < config.clients; ++i) {
+        clients.emplace_back(std::make_unique<SyntheticClient>(
+                                 config, i, net_server.port()));
+    }
+
+    const std::chrono::nanoseconds cpu_start = process_cpu_time();
+    const Clock::time_point t_start = Clock::now();
+    const Clock::time_point deadline = t_start +
+            std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>(config.duration));
+    std::vector<std::thread> threads;
+    for (auto &client: clients) {
+        threads.emplace_back(&SyntheticClient::run, client.get(),
+                             deadline, std::chrono::seconds(2));
+    }
+    for (auto &thread: threads) {
+        thread.join();
+    }
+    const Clock::duration elapsed = Clock::now() - t_start;
+    const std::chrono::nanoseconds total_cpu = process_cpu_time() - cpu_start;
+    const sim::FrameTimingSummary frames = server.frame_timing_summary();
+
+    net_server.stop();
+
+    ClientStats total;
+    unsigned int failed_clients = 0;
+    for (auto &client: clients) {
+        ClientStats &stats = client->stats();
+        total.commands_sent += stats.commands_sent;
+        total.responses += stats.responses;
+        total.failed_commands += stats.failed_commands;
+        total.lost_responses += stats.lost_responses;
+        total.pings_sent += stats.pings_sent;
+        total.bytes_sent += stats.bytes_sent;
+        total.bytes_received += stats.bytes_received;
+        total.cpu_time += stats.cpu_time;
+        total.command_latencies.insert(total.command_latencies.end(),
+                                       stats.command_latencies.begin(),
+                                       stats.command_latencies.end());
+        total.ping_rtts.insert(total.ping_rtts.end(),
+                               stats.ping_rtts.begin(),
+                               stats.ping_rtts.end());
+        if (stats.failed) {
+            ++failed_clients;
+        }
+    }
+
+    // the clients run in this process; their CPU time is measured per
+    // thread and does not count towards the server
+    const double seconds = to_s(elapsed);
+    const double server_cpu = to_s(total_cpu - total.cpu_time);
+    const double idle_load = to_s(idle_cpu) / to_s(idle_period);
+    const double server_load = server_cpu / seconds;
+
+    std::printf("clients:             %lu (%u failed)\n",
+                config.clients, failed_clients);
+    std::printf("duration:            %.2f s\n", seconds);
+    std::printf("commands sent:       %llu (%.1f/s)\n",
+                (unsigned long long)total.commands_sent,
+                total.commands_sent / seconds);
+    std::printf("responses:           %llu (%llu failed, %llu lost)\n",
+                (unsigned long long)total.responses,
+                (unsigned long long)total.failed_commands,
+                (unsigned long long)total.lost_responses);
+    std::printf("traffic:             %.1f KiB/s sent, %.1f KiB/s received\n",
+                total.bytes_sent / 1024. / seconds,
+                total.bytes_received / 1024. / seconds);
+    print_latencies("command latency:", total.command_latencies);
+    print_latencies("ping rtt:", total.ping_rtts);
+    std::printf("server cpu:          %.1f%% (idle %.1f%%, %.2f%% per "
+                "client)\n",
+                server_load * 100., idle_load * 100.,
+                std::max(0., server_load - idle_load) * 100. / config.clients);
+    std::printf("client cpu:          %.1f%%\n",
+                to_s(total.cpu_time) / seconds * 100.);
+    std::printf("game frames:         %zu, p50=%.2f ms p99=%.2f ms "
+                "max=%.2f ms, %u dropped\n",
+                frames.frames,
+                to_ms(frames.total.p50), to_ms(frames.total.p99),
+                to_ms(frames.total.max), frames.dropped_frames);
+
+    return failed_clients > 0 ? 1 : 0;
+}
@@ -0,0 +1,256 @@
+/**********************************************************************
+File name: main.cpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "ffengine/io/log.hpp"
+
+#include "ffengine/sim/command_log.hpp"
+#include "ffengine/sim/server.hpp"
+
+#include "world_command.pb.h"
+
+
+static io::Logger &logger = io::logging().get_logger("replay");
+
+typedef std::chrono::steady_clock Clock;
+
+
+struct ReplayConfig
+{
+    std::string path;
+    bool skip_idle = false;
+    unsigned long max_idle_frames = 0;
+};
+
+
+static double to_ms(const Clock::duration d)
+{
+    return std::chrono::duration<double, std::milli>(d).count();
+}
+
+static double to_s(const Clock::duration d)
+{
+    return std::chrono::duration<double>(d).count();
+}
+
+/**
+ * Return the \a p-th quantile of the sorted \a values, using the
+ * nearest-rank method.
+ */
+static Clock::duration percentile(const std::vector<Clock::duration> &values,
+                                  const double p)
+{
+    if (values.empty()) {
+        return Clock::duration::zero();
+    }
+    const std::size_t rank = std::size_t(std::ceil(p * values.size()));
+    return values[std::max<std::size_t>(rank, 1) - 1];
+}
+
+static void usage(const char *argv0)
+{
+    std::cerr << "usage: " << argv0
+              << " [--skip-idle] [--max-idle-frames N] LOG"
+              << std::endl
+              << std::endl
+              << "Replays a command log written by the dedicated server"
+              << " (--command-log) into" << std::endl
+              << "a headless sim::Server as fast as possible. Each logged"
+              << " frame is executed as" << std::endl
+              << "one game frame; the idle frames between logged frames are"
+              << " run as well, unless" << std::endl
+              << "--skip-idle is given or more than --max-idle-frames"
+              << " (if non-zero) pass." << std::endl;
+}
+
+static bool parse_args(int argc, char **argv, ReplayConfig &config)
+{
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg(argv[i]);
+        if (arg == "--skip-idle") {
+            config.skip_idle = true;
+            continue;
+        }
+        if (arg == "--max-idle-frames") {
+            if (i + 1 >= argc) {
+                return false;
+            }
+            char *end = nullptr;
+            config.max_idle_frames = std::strtoul(argv[++i], &end, 10);
+            if (*end != '\0') {
+                return false;
+            }
+            continue;
+        }
+        if (!config.path.empty() || arg.empty() || arg[0] == '-') {
+            return false;
+        }
+        config.path = arg;
+    }
+    return !config.path.empty();
+}
+
+int main(int argc, char **argv)
+{
+    ReplayConfig config;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg(argv[i]);
+        if (arg == "--help" || arg == "-h") {
+            usage(argv[0]);
+            return 0;
+        }
+    }
+    if (!parse_args(argc, argv, config)) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    io::logging().attach_sink<io::LogTTYSink>()->set_level(io::LOG_WARNING);
+
+    std::unique_ptr<sim::CommandLogReader> reader;
+    try {
+        reader = std::make_unique<sim::CommandLogReader>(config.path);
+    } catch (const std::system_error &err) {
+        logger.log(io::LOG_EXCEPTION) << "failed to open " << config.path
+                                      << ": " << err.what() << io::submit;
+        return 1;
+    }
+
+    sim::Server server(sim::FramePacing::MANUAL);
+
+    // the first game frame of a server is frame 1; frame 0 is the initial
+    // view
+    std::uint64_t next_frame = 1;
+    std::uint64_t logged_frames = 0;
+    std::uint64_t idle_frames = 0;
+    std::uint64_t skipped_frames = 0;
+    std::uint64_t commands_replayed = 0;
+    std::uint64_t commands_rejected = 0;
+    std::vector<Clock::duration> step_times;
+
+    std::uint64_t frame = 0;
+    std::vector<std::shared_ptr<sim::messages::WorldCommand> > commands;
+    std::vector<std::uint32_t> unfused;
+    const Clock::time_point t_start = Clock::now();
+    try {
+        while (reader->next_frame(frame, commands, unfused)) {
+            if (frame < next_frame) {
+                logger.logf(io::LOG_ERROR,
+                            "frame %llu out of order (expected >= %llu)",
+                            static_cast<unsigned long long>(frame),
+                            static_cast<unsigned long long>(next_frame));
+                return 1;
+            }
+
+            std::uint64_t gap = frame - next_frame;
+            if (config.skip_idle ||
+                    (config.max_idle_frames > 0 && gap > config.max_idle_frames))
+            {
+                skipped_frames += gap;
+                gap = 0;
+            }
+            if (gap > 0) {
+                server.step(gap);
+                idle_frames += gap;
+            }
+
+            auto next_unfused = unfused.begin();
+            for (std::uint32_t i = 0; i < commands.size(); ++i) {
+                // the server does not fuse operations with a callback, so
+                // those which had one are given a dummy to fuse the same
+                const bool has_callback = next_unfused != unfused.end() &&
+                        *next_unfused == i;
+                if (has_callback) {
+                    ++next_unfused;
+                }
+
+                sim::WorldOperationPtr op =
+                        sim::WorldOperation::from_message(commands[i]);
+                if (!op) {
+                    ++commands_rejected;
+                    continue;
+                }
+                if (has_callback) {
+                    server.enqueue_op(std::move(op),
+                                      [](sim::WorldOperationResult){});
+                } else {
+                    server.enqueue_op(std::move(op));
+                }
+                ++commands_replayed;
+            }
+
+            const Clock::time_point t_step = Clock::now();
+            server.step();
+            step_times.push_back(Clock::now() - t_step);
+            ++logged_frames;
+            next_frame = frame + 1;
+        }
+    } catch (const std::runtime_error &err) {
+        logger.log(io::LOG_EXCEPTION) << "failed to read " << config.path
+                                      << ": " << err.what() << io::submit;
+        return 1;
+    }
+    const Clock::duration elapsed = Clock::now() - t_start;
+    const sim::FrameTimingSummary frames = server.frame_timing_summary();
+
+    const double seconds = to_s(elapsed);
+    const std::uint64_t frames_run = logged_frames + idle_frames;
+    std::sort(step_times.begin(), step_times.end());
+
+    std::printf("log:                 %s%s\n", config.path.c_str(),
+                reader->truncated() ? " (truncated)" : "");
+    std::printf("frames:              %llu logged, %llu idle, %llu skipped\n",
+                (unsigned long long)logged_frames,
+                (unsigned long long)idle_frames,
+                (unsigned long long)skipped_frames);
+    std::printf("commands:            %llu (%llu rejected)\n",
+                (unsigned long long)commands_replayed,
+                (unsigned long long)commands_rejected);
+    std::printf("duration:            %.2f s (%.1f frames/s, %.1f "
+                "commands/s)\n",
+                seconds, frames_run / seconds, commands_replayed / seconds);
+    std::printf("logged frame step:   p50=%.2f ms p90=%.2f ms p99=%.2f ms "
+                "max=%.2f ms\n",
+                to_ms(percentile(step_times, 0.5)),
+                to_ms(percentile(step_times, 0.9)),
+                to_ms(percentile(step_times, 0.99)),
+                to_ms(percentile(step_times, 1.0)));
+    std::printf("recent game frames:  %zu, p50=%.2f ms p99=%.2f ms "
+                "max=%.2f ms\n",
+                frames.frames,
+                to_ms(frames.total.p50), to_ms(frames.total.p99),
+                to_ms(frames.total.max));
+
+    return 0;
+}
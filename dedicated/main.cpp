@@ -0,0 +1,157 @@
+/**********************************************************************
+File name: main.cpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+
+#include <pthread.h>
+
+#include "ffengine/io/log.hpp"
+
+#include "ffengine/sim/epoll_server.hpp"
+#include "ffengine/sim/server.hpp"
+
+
+static io::Logger &logger = io::logging().get_logger("dedicated");
+
+static const std::uint16_t DEFAULT_PORT = 7350;
+
+
+static void usage(const char *argv0)
+{
+    std::cerr << "usage: " << argv0
+              << " [--bind ADDRESS] [--port PORT] [--stats-interval SECONDS]"
+              << " [--command-log PATH]"
+              << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    std::string bind_address = "::";
+    unsigned long port = DEFAULT_PORT;
+    unsigned long stats_interval = 10;
+    std::string command_log_path;
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg(argv[i]);
+        if (arg == "--help" || arg == "-h") {
+            usage(argv[0]);
+            return 0;
+        }
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 2;
+        }
+        const char *value = argv[++i];
+        char *end = nullptr;
+        if (arg == "--bind") {
+            bind_address = value;
+        } else if (arg == "--port") {
+            port = std::strtoul(value, &end, 10);
+            if (*end != '\0' || port > 65535) {
+                usage(argv[0]);
+                return 2;
+            }
+        } else if (arg == "--stats-interval") {
+            stats_interval = std::strtoul(value, &end, 10);
+            if (*end != '\0') {
+                usage(argv[0]);
+                return 2;
+            }
+        } else if (arg == "--command-log") {
+            command_log_path = value;
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    io::logging().attach_sink<io::LogTTYSink>()->set_level(io::LOG_INFO);
+
+    // block the termination signals in all threads; they are received
+    // synchronously by the main thread below
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, nullptr);
+
+    sim::Server server;
+    server.set_frame_timing_log_interval(std::chrono::seconds(stats_interval));
+    if (!command_log_path.empty()) {
+        try {
+            server.set_command_log(std::make_unique<sim::CommandLogWriter>(
+                                       command_log_path));
+        } catch (const std::system_error &err) {
+            logger.log(io::LOG_EXCEPTION) << "failed to open command log "
+                                          << command_log_path << ": "
+                                          << err.what() << io::submit;
+            return 1;
+        }
+        logger.log(io::LOG_INFO) << "logging commands to "
+                                 << command_log_path << io::submit;
+    }
+
+    // only accessed from the event loop of the network server
+    std::unordered_map<sim::ServerClientBase*,
+                       std::unique_ptr<sim::ServerCommandHandler> > handlers;
+
+    sim::EpollNetServer net_server;
+    net_server.client_connected().connect(
+                [&server, &handlers](sim::ServerClientBase &client){
+                    auto handler = std::make_unique<sim::ServerCommandHandler>(
+                                server, client);
+                    client.set_message_handler(handler.get());
+                    handlers.emplace(&client, std::move(handler));
+                });
+    net_server.client_closed().connect(
+                [&handlers](sim::ServerClientBase &client){
+                    client.set_message_handler(nullptr);
+                    handlers.erase(&client);
+                });
+    try {
+        net_server.listen(bind_address, port);
+    } catch (const std::system_error &err) {
+        logger.log(io::LOG_EXCEPTION) << "failed to listen on "
+                                      << bind_address << " port " << port
+                                      << ": " << err.what() << io::submit;
+        return 1;
+    }
+    net_server.start();
+    logger.log(io::LOG_INFO) << "listening on " << bind_address
+                             << " port " << net_server.port() << io::submit;
+
+    int received = 0;
+    sigwait(&stop_signals, &received);
+    logger.log(io::LOG_INFO) << "received signal " << received
+                             << ", shutting down" << io::submit;
+
+    net_server.stop();
+    return 0;
+}
@@ -0,0 +1,308 @@
+/**********************************************************************
+File name: epoch.hpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#ifndef SCC_ENGINE_COMMON_EPOCH_HPP
+#define SCC_ENGINE_COMMON_EPOCH_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace ffe {
+
+/**
+ * Epoch-based reclamation for data published by a single writer and read by
+ * any number of threads.
+ *
+ * Readers pin() the domain for as long as they access published data. The
+ * writer replaces published data and retire()s the old version, which is
+ * only destroyed once no reader which could still see it is pinned. The
+ * writer never waits for readers; readers only wait when all reader slots are
+ * taken.
+ *
+ * Pinning stores the current epoch into one of a fixed number of reader
+ * slots. Each retire() advances the epoch; a retired version is freed as soon
+ * as all pinned slots carry a later epoch. Collection is amortized: it runs
+ * once half of the maximum number of retired versions has accumulated. If
+ * that maximum is exceeded because readers stay pinned, the retired versions
+ * are kept (and a warning is logged) until a later collection can free them;
+ * see saturated().
+ *
+ * pin() may be called from any thread, including recursively;
+ * retire() and collect() only from the writer thread.
+ */
+class EpochDomain
+{
+public:
+    /**
+     * A pinned reader slot; the domain is unpinned when the guard is
+     * destroyed.
+     */
+    class Guard
+    {
+    public:
+        Guard();
+        Guard(EpochDomain *domain, std::size_t slot);
+        Guard(Guard &&src);
+        Guard &operator=(Guard &&src);
+        Guard(const Guard &ref) = delete;
+        Guard &operator=(const Guard &ref) = delete;
+        ~Guard();
+
+    private:
+        EpochDomain *m_domain;
+        std::size_t m_slot;
+
+    public:
+        inline explicit operator bool() const
+        {
+            return m_domain;
+        }
+
+        void release();
+
+    };
+
+private:
+    struct alignas(64) Slot
+    {
+        std::atomic<std::uint64_t> epoch;
+    };
+
+    struct Retired
+    {
+        std::uint64_t epoch;
+        std::function<void()> deleter;
+    };
+
+    static constexpr std::uint64_t IDLE = 0;
+
+public:
+    /**
+     * @param reader_slots Maximum number of concurrently pinned readers;
+     * further readers wait in pin() until a slot becomes free.
+     * @param max_retired Number of retired versions which are expected to be
+     * kept alive for pinned readers at most; exceeding it is logged.
+     */
+    explicit EpochDomain(const std::size_t reader_slots = 64,
+                         const std::size_t max_retired = 16);
+    EpochDomain(const EpochDomain &ref) = delete;
+    EpochDomain &operator=(const EpochDomain &ref) = delete;
+
+    /**
+     * Free all retired versions. No reader must be pinned anymore.
+     */
+    ~EpochDomain();
+
+private:
+    const std::size_t m_slot_count;
+    std::unique_ptr<Slot[]> m_slots;
+    std::atomic<std::uint64_t> m_epoch;
+
+    /* writer only */
+    const std::size_t m_max_retired;
+    std::vector<Retired> m_retired;
+    bool m_saturated;
+
+private:
+    void unpin(const std::size_t slot);
+
+public:
+    /**
+     * Pin the current epoch for the calling reader.
+     *
+     * All data loaded from an EpochPointer of this domain while the guard
+     * is alive stays valid.
+     */
+    Guard pin();
+
+    /**
+     * Advance the epoch and schedule \a deleter to run once no reader which
+     * pinned an earlier epoch is pinned anymore.
+     *
+     * The retired data must have been unpublished before calling this.
+     * This never waits for pinned readers.
+     */
+    void retire(std::function<void()> &&deleter);
+
+    /**
+     * Run the deleters of all retired versions which cannot be seen by any
+     * pinned reader.
+     *
+     * @return Number of versions freed.
+     */
+    std::size_t collect();
+
+    inline std::uint64_t epoch() const
+    {
+        return m_epoch.load();
+    }
+
+    inline std::size_t max_retired() const
+    {
+        return m_max_retired;
+    }
+
+    /**
+     * Number of retired versions which have not been freed yet.
+     */
+    inline std::size_t retired_count() const
+    {
+        return m_retired.size();
+    }
+
+    /**
+     * Whether more than max_retired() versions are held by pinned readers
+     * since the last collection.
+     */
+    inline bool saturated() const
+    {
+        return m_saturated;
+    }
+
+};
+
+
+/**
+ * A pointer to an immutable object of type \a T, which a single writer
+ * replaces by publishing new versions and which readers load without
+ * blocking.
+ *
+ * Replaced versions are retired in the EpochDomain and freed once no reader
+ * can see them anymore.
+ */
+template <typename T>
+class EpochPointer
+{
+public:
+    /**
+     * A loaded version together with the guard which keeps it alive.
+     */
+    class Ref
+    {
+    public:
+        Ref():
+            m_ptr(nullptr)
+        {
+
+        }
+
+        Ref(EpochDomain::Guard &&guard, const T *ptr):
+            m_guard(std::move(guard)),
+            m_ptr(ptr)
+        {
+
+        }
+
+    private:
+        EpochDomain::Guard m_guard;
+        const T *m_ptr;
+
+    public:
+        inline const T *get() const
+        {
+            return m_ptr;
+        }
+
+        inline const T &operator*() const
+        {
+            return *m_ptr;
+        }
+
+        inline const T *operator->() const
+        {
+            return m_ptr;
+        }
+
+        inline explicit operator bool() const
+        {
+            return m_ptr;
+        }
+
+    };
+
+public:
+    explicit EpochPointer(EpochDomain &domain,
+                          std::unique_ptr<const T> &&initial = nullptr):
+        m_domain(domain),
+        m_ptr(initial.release())
+    {
+
+    }
+
+    EpochPointer(const EpochPointer &ref) = delete;
+    EpochPointer &operator=(const EpochPointer &ref) = delete;
+
+    /**
+     * Delete the current version. No reader must hold a Ref anymore.
+     */
+    ~EpochPointer()
+    {
+        delete m_ptr.load();
+    }
+
+private:
+    EpochDomain &m_domain;
+    std::atomic<const T*> m_ptr;
+
+public:
+    /**
+     * Pin the domain and load the current version, which may be null.
+     */
+    Ref load() const
+    {
+        EpochDomain::Guard guard = m_domain.pin();
+        const T *ptr = m_ptr.load();
+        return Ref(std::move(guard), ptr);
+    }
+
+    /**
+     * Return the current version without pinning the domain. Only the
+     * writer may call this, as only the writer can rule out that the
+     * version is retired concurrently.
+     */
+    inline const T *current() const
+    {
+        return m_ptr.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Replace the current version with \a value and retire the previous
+     * one. Only the writer may call this.
+     */
+    void publish(std::unique_ptr<const T> &&value)
+    {
+        const T *old = m_ptr.exchange(value.release());
+        if (old) {
+            m_domain.retire([old](){ delete old; });
+        }
+    }
+
+};
+
+}
+
+#endif
@@ -0,0 +1,171 @@
+/**********************************************************************
+File name: mpsc_queue.hpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#ifndef SCC_ENGINE_COMMON_MPSC_QUEUE_HPP
+#define SCC_ENGINE_COMMON_MPSC_QUEUE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+namespace ffe {
+
+/**
+ * A bounded lock-free queue for many producers and a single consumer.
+ *
+ * The queue is a ring buffer of cells, each carrying a sequence number
+ * which tells producers and the consumer whether the cell is free or
+ * filled for the current lap. Producers claim a position with a single
+ * compare-and-swap; the consumer does not need any read-modify-write
+ * operation at all.
+ *
+ * try_push() may be called from any number of threads concurrently,
+ * try_pop() only from one thread at a time.
+ *
+ * @param T Element type; must be default constructible and move
+ * assignable.
+ */
+template <typename T>
+class MPSCQueue
+{
+private:
+    struct Cell
+    {
+        std::atomic<std::size_t> sequence;
+        T value;
+    };
+
+public:
+    /**
+     * Create a queue which holds at least \a capacity elements.
+     *
+     * The capacity is rounded up to the next power of two.
+     */
+    explicit MPSCQueue(const std::size_t capacity):
+        m_mask(round_capacity(capacity) - 1),
+        m_cells(new Cell[m_mask + 1]),
+        m_enqueue_pos(0),
+        m_dequeue_pos(0)
+    {
+        for (std::size_t i = 0; i <= m_mask; ++i) {
+            m_cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    MPSCQueue(const MPSCQueue &ref) = delete;
+    MPSCQueue &operator=(const MPSCQueue &ref) = delete;
+
+private:
+    const std::size_t m_mask;
+    std::unique_ptr<Cell[]> m_cells;
+
+    // keep the producer and consumer positions on separate cache lines
+    alignas(64) std::atomic<std::size_t> m_enqueue_pos;
+    alignas(64) std::size_t m_dequeue_pos;
+
+private:
+    static std::size_t round_capacity(const std::size_t capacity)
+    {
+        std::size_t result = 2;
+        while (result < capacity) {
+            result <<= 1;
+        }
+        return result;
+    }
+
+public:
+    inline std::size_t capacity() const
+    {
+        return m_mask + 1;
+    }
+
+    /**
+     * Append \a value to the queue.
+     *
+     * @return \c true if the value was enqueued, \c false if the queue is
+     * full. In the latter case, \a value is left untouched.
+     */
+    template <typename U>
+    bool try_push(U &&value)
+    {
+        std::size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+        Cell *cell;
+        while (true) {
+            cell = &m_cells[pos & m_mask];
+            const std::size_t sequence = cell->sequence.load(
+                        std::memory_order_acquire);
+            const std::intptr_t diff = std::intptr_t(sequence) -
+                    std::intptr_t(pos);
+            if (diff == 0) {
+                if (m_enqueue_pos.compare_exchange_weak(
+                            pos, pos + 1,
+                            std::memory_order_relaxed))
+                {
+                    break;
+                }
+            } else if (diff < 0) {
+                // the consumer has not freed this cell yet
+                return false;
+            } else {
+                pos = m_enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->value = std::forward<U>(value);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Remove the oldest element from the queue and move it to \a dest.
+     *
+     * Elements pushed by the same producer are popped in the order in which
+     * they were pushed.
+     *
+     * @return \c true if an element was dequeued, \c false if the queue is
+     * empty.
+     */
+    bool try_pop(T &dest)
+    {
+        Cell *cell = &m_cells[m_dequeue_pos & m_mask];
+        const std::size_t sequence = cell->sequence.load(
+                    std::memory_order_acquire);
+        if (sequence != m_dequeue_pos + 1) {
+            return false;
+        }
+
+        dest = std::move(cell->value);
+        cell->value = T();
+        cell->sequence.store(m_dequeue_pos + m_mask + 1,
+                             std::memory_order_release);
+        ++m_dequeue_pos;
+        return true;
+    }
+
+};
+
+}
+
+#endif
@@ -0,0 +1,90 @@
+/**********************************************************************
+File name: rle.hpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#ifndef SCC_ENGINE_COMMON_RLE_HPP
+#define SCC_ENGINE_COMMON_RLE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace ffe {
+
+/**
+ * Append the run-length encoded form of \a src to \a dest.
+ *
+ * The encoding is the PackBits scheme: a control byte \c n in the range
+ * [0, 127] is followed by \c n+1 literal bytes, a control byte in the range
+ * [129, 255] is followed by a single byte which is repeated \c 257-n times.
+ * The control byte 128 is never emitted and skipped by the decoder.
+ *
+ * @param src Data to encode.
+ * @param len Number of bytes in \a src.
+ * @param dest Buffer to append the encoded data to.
+ */
+void rle_encode(const std::uint8_t *src, const std::size_t len,
+                std::vector<std::uint8_t> &dest);
+
+/**
+ * Decode data encoded with rle_encode().
+ *
+ * @param src Encoded data.
+ * @param len Number of bytes in \a src.
+ * @param dest Buffer to write the decoded data to.
+ * @param dest_len Exact number of bytes the decoded data must have.
+ * @throws std::runtime_error if the encoded data is malformed or does not
+ * decode to exactly \a dest_len bytes.
+ */
+void rle_decode(const std::uint8_t *src, const std::size_t len,
+                std::uint8_t *dest, const std::size_t dest_len);
+
+/**
+ * Split an array of \a count elements of \a element_size bytes each into
+ * byte planes.
+ *
+ * The first plane contains the first byte of each element, the second plane
+ * the second byte and so on. For numeric data with few distinct values in
+ * the upper bytes (such as small differences of floats), this greatly
+ * increases the length of runs for rle_encode().
+ *
+ * @param src Source elements.
+ * @param count Number of elements.
+ * @param element_size Size of a single element in bytes.
+ * @param dest Buffer of at least \a count times \a element_size bytes.
+ */
+void byte_shuffle(const void *src,
+                  const std::size_t count,
+                  const std::size_t element_size,
+                  std::uint8_t *dest);
+
+/**
+ * Reverse the operation of byte_shuffle().
+ */
+void byte_unshuffle(const std::uint8_t *src,
+                    const std::size_t count,
+                    const std::size_t element_size,
+                    void *dest);
+
+}
+
+#endif
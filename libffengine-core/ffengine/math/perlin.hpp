@@ -44,6 +44,19 @@ private:
 public:
     VectorFloat get(const Vector2 &pos) const;
 
+    /**
+     * Sample \a count values along a row, at the positions
+     * (\a x0 + i, \a y) for i in [0, \a count), and store them in \a dest.
+     *
+     * This yields the same values as calling get() for each position, but
+     * shares the per-row and per-octave work between all samples and
+     * evaluates the lattice lookups and interpolation in batches which
+     * the compiler can vectorize.
+     */
+    void get_row(const VectorFloat x0, const VectorFloat y,
+                 const unsigned int count,
+                 VectorFloat *dest) const;
+
 };
 
 
@@ -162,7 +162,7 @@ public:
     }
 
     template<typename other_coord_t>
-    bool overlaps(const GenericRect<other_coord_t> &other)
+    bool overlaps(const GenericRect<other_coord_t> &other) const
     {
         if (other == NotARect) {
             return false;
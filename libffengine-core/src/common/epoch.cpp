@@ -0,0 +1,186 @@
+/**********************************************************************
+File name: epoch.cpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#include "ffengine/common/epoch.hpp"
+
+#include "ffengine/io/log.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <thread>
+
+namespace ffe {
+
+static io::Logger &logger = io::logging().get_logger("common.epoch");
+
+
+/* ffe::EpochDomain::Guard */
+
+EpochDomain::Guard::Guard():
+    m_domain(nullptr),
+    m_slot(0)
+{
+
+}
+
+EpochDomain::Guard::Guard(EpochDomain *domain, std::size_t slot):
+    m_domain(domain),
+    m_slot(slot)
+{
+
+}
+
+EpochDomain::Guard::Guard(EpochDomain::Guard &&src):
+    m_domain(src.m_domain),
+    m_slot(src.m_slot)
+{
+    src.m_domain = nullptr;
+}
+
+EpochDomain::Guard &EpochDomain::Guard::operator=(EpochDomain::Guard &&src)
+{
+    release();
+    m_domain = src.m_domain;
+    m_slot = src.m_slot;
+    src.m_domain = nullptr;
+    return *this;
+}
+
+EpochDomain::Guard::~Guard()
+{
+    release();
+}
+
+void EpochDomain::Guard::release()
+{
+    if (m_domain) {
+        m_domain->unpin(m_slot);
+        m_domain = nullptr;
+    }
+}
+
+
+/* ffe::EpochDomain */
+
+EpochDomain::EpochDomain(const std::size_t reader_slots,
+                         const std::size_t max_retired):
+    m_slot_count(std::max<std::size_t>(reader_slots, 1)),
+    m_slots(new Slot[m_slot_count]),
+    m_epoch(IDLE + 1),
+    m_max_retired(std::max<std::size_t>(max_retired, 1)),
+    m_saturated(false)
+{
+    for (std::size_t i = 0; i < m_slot_count; ++i) {
+        m_slots[i].epoch.store(IDLE, std::memory_order_relaxed);
+    }
+    m_retired.reserve(m_max_retired + 1);
+}
+
+EpochDomain::~EpochDomain()
+{
+    for (auto &retired: m_retired) {
+        retired.deleter();
+    }
+}
+
+void EpochDomain::unpin(const std::size_t slot)
+{
+    m_slots[slot].epoch.store(IDLE, std::memory_order_release);
+}
+
+EpochDomain::Guard EpochDomain::pin()
+{
+    // start at a per-thread position, so that concurrent readers do not all
+    // compete for the first slots
+    const std::size_t start =
+            std::hash<std::thread::id>()(std::this_thread::get_id())
+            % m_slot_count;
+
+    while (true) {
+        for (std::size_t i = 0; i < m_slot_count; ++i) {
+            const std::size_t slot = (start + i) % m_slot_count;
+            std::uint64_t expected = IDLE;
+            // the epoch is read before the slot is claimed; a stale epoch
+            // only delays reclamation, it never makes it unsafe
+            const std::uint64_t epoch = m_epoch.load();
+            if (m_slots[slot].epoch.load(std::memory_order_relaxed) == IDLE &&
+                    m_slots[slot].epoch.compare_exchange_strong(expected, epoch))
+            {
+                return Guard(this, slot);
+            }
+        }
+        std::this_thread::yield();
+    }
+}
+
+void EpochDomain::retire(std::function<void()> &&deleter)
+{
+    // readers which pinned before this increment may still see the retired
+    // data; readers pinning afterwards load the new version
+    const std::uint64_t epoch = m_epoch.fetch_add(1) + 1;
+    m_retired.push_back(Retired{epoch, std::move(deleter)});
+
+    if (m_retired.size() < (m_max_retired + 1) / 2) {
+        return;
+    }
+
+    collect();
+    // never wait for the readers here: the list grows beyond the maximum
+    // and is trimmed by later collections once the readers unpin
+    if (m_retired.size() > m_max_retired && !m_saturated) {
+        m_saturated = true;
+        logger.logf(io::LOG_WARNING,
+                    "%zu retired versions held by pinned readers "
+                    "(maximum is %zu)",
+                    m_retired.size(), m_max_retired);
+    }
+}
+
+std::size_t EpochDomain::collect()
+{
+    std::uint64_t min_pinned = std::numeric_limits<std::uint64_t>::max();
+    for (std::size_t i = 0; i < m_slot_count; ++i) {
+        const std::uint64_t epoch = m_slots[i].epoch.load();
+        if (epoch != IDLE) {
+            min_pinned = std::min(min_pinned, epoch);
+        }
+    }
+
+    // retired versions are ordered by epoch
+    auto end = m_retired.begin();
+    while (end != m_retired.end() && end->epoch <= min_pinned) {
+        end->deleter();
+        ++end;
+    }
+    const std::size_t freed = end - m_retired.begin();
+    m_retired.erase(m_retired.begin(), end);
+
+    if (m_saturated && m_retired.size() <= m_max_retired) {
+        m_saturated = false;
+        logger.logf(io::LOG_INFO,
+                    "retired versions are below the maximum again");
+    }
+    return freed;
+}
+
+}
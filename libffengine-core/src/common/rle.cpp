@@ -0,0 +1,139 @@
+/**********************************************************************
+File name: rle.cpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#include "ffengine/common/rle.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+
+namespace ffe {
+
+static const std::size_t RLE_MAX_RUN = 128;
+static const std::size_t RLE_MIN_RUN = 3;
+
+static inline std::size_t run_length(const std::uint8_t *src,
+                                     const std::size_t len)
+{
+    const std::size_t max = std::min(len, RLE_MAX_RUN);
+    std::size_t result = 1;
+    while (result < max && src[result] == src[0]) {
+        ++result;
+    }
+    return result;
+}
+
+void rle_encode(const std::uint8_t *src, const std::size_t len,
+                std::vector<std::uint8_t> &dest)
+{
+    std::size_t i = 0;
+    while (i < len) {
+        const std::size_t run = run_length(&src[i], len - i);
+        if (run >= RLE_MIN_RUN) {
+            dest.push_back(257 - run);
+            dest.push_back(src[i]);
+            i += run;
+            continue;
+        }
+
+        // collect literals until the next run which is worth encoding
+        const std::size_t literal_start = i;
+        std::size_t literal_len = 0;
+        while (i < len && literal_len < RLE_MAX_RUN) {
+            if (run_length(&src[i], len - i) >= RLE_MIN_RUN) {
+                break;
+            }
+            ++i;
+            ++literal_len;
+        }
+
+        dest.push_back(literal_len - 1);
+        dest.insert(dest.end(), &src[literal_start], &src[i]);
+    }
+}
+
+void rle_decode(const std::uint8_t *src, const std::size_t len,
+                std::uint8_t *dest, const std::size_t dest_len)
+{
+    std::size_t i = 0;
+    std::size_t written = 0;
+    while (i < len) {
+        const std::uint8_t control = src[i++];
+        if (control < 128) {
+            const std::size_t count = std::size_t(control) + 1;
+            if (count > len - i) {
+                throw std::runtime_error("truncated literal in RLE data");
+            }
+            if (count > dest_len - written) {
+                throw std::runtime_error("RLE data exceeds output buffer");
+            }
+            std::copy(&src[i], &src[i+count], &dest[written]);
+            i += count;
+            written += count;
+        } else if (control > 128) {
+            const std::size_t count = 257 - std::size_t(control);
+            if (i >= len) {
+                throw std::runtime_error("truncated run in RLE data");
+            }
+            if (count > dest_len - written) {
+                throw std::runtime_error("RLE data exceeds output buffer");
+            }
+            std::fill(&dest[written], &dest[written+count], src[i++]);
+            written += count;
+        }
+    }
+
+    if (written != dest_len) {
+        throw std::runtime_error("RLE data shorter than output buffer");
+    }
+}
+
+void byte_shuffle(const void *src,
+                  const std::size_t count,
+                  const std::size_t element_size,
+                  std::uint8_t *dest)
+{
+    const std::uint8_t *src_bytes = static_cast<const std::uint8_t*>(src);
+    for (std::size_t plane = 0; plane < element_size; ++plane) {
+        std::uint8_t *dest_plane = &dest[plane*count];
+        for (std::size_t i = 0; i < count; ++i) {
+            dest_plane[i] = src_bytes[i*element_size+plane];
+        }
+    }
+}
+
+void byte_unshuffle(const std::uint8_t *src,
+                    const std::size_t count,
+                    const std::size_t element_size,
+                    void *dest)
+{
+    std::uint8_t *dest_bytes = static_cast<std::uint8_t*>(dest);
+    for (std::size_t plane = 0; plane < element_size; ++plane) {
+        const std::uint8_t *src_plane = &src[plane*count];
+        for (std::size_t i = 0; i < count; ++i) {
+            dest_bytes[i*element_size+plane] = src_plane[i];
+        }
+    }
+}
+
+}
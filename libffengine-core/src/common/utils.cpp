@@ -50,9 +50,12 @@ void NotifiableWorker::worker_thread()
     nw_logger.logf(io::LOG_DEBUG, "%p started", this);
     while (!m_terminate)
     {
-        while (!m_notified) {
+        while (!m_notified && !m_terminate) {
             m_wakeup.wait(state_lock);
         }
+        if (m_terminate) {
+            break;
+        }
         m_notified = false;
         state_lock.unlock();
         nw_logger.logf(io::LOG_DEBUG, "%p woke up", this);
@@ -82,6 +85,7 @@ void NotifiableWorker::tear_down()
             std::lock_guard<std::mutex> guard(m_state_mutex);
             m_terminate = true;
         }
+        m_wakeup.notify_all();
         m_worker_thread.join();
     }
 }
@@ -23,8 +23,26 @@ the AUTHORS file.
 **********************************************************************/
 #include "ffengine/math/perlin.hpp"
 
+#include <cmath>
+
 #include "ffengine/math/algo.hpp"
 
+
+/**
+ * Number of samples which are processed in one batch by
+ * PerlinNoiseGenerator::get_row(); the scratch buffers for one batch live
+ * on the stack.
+ */
+static const unsigned int PERLIN_BATCH_SIZE = 256;
+
+
+static inline VectorFloat perlin_hash(const unsigned int n)
+{
+    const unsigned int m = (n << 13) ^ n;
+    return (1.0 - double((m * (m * m * 15731 + 789221) + 1376312589) & 0x7fffffff) / 1073741824.0);
+}
+
+
 /* PerlinNoiseGenerator */
 
 PerlinNoiseGenerator::PerlinNoiseGenerator(
@@ -63,11 +81,65 @@ VectorFloat PerlinNoiseGenerator::get(const Vector2 &pos) const
     return result;
 }
 
+void PerlinNoiseGenerator::get_row(const VectorFloat x0, const VectorFloat y,
+                                   const unsigned int count,
+                                   VectorFloat *dest) const
+{
+    VectorFloat position_x[PERLIN_BATCH_SIZE];
+    int int_x[PERLIN_BATCH_SIZE];
+    VectorFloat frac_x[PERLIN_BATCH_SIZE];
+
+    const VectorFloat position_y = y * m_scale[eY] + m_offset[eY];
+
+    for (unsigned int batch0 = 0; batch0 < count; batch0 += PERLIN_BATCH_SIZE)
+    {
+        const std::size_t batch_size = std::min(count - batch0,
+                                                PERLIN_BATCH_SIZE);
+        VectorFloat *const out = &dest[batch0];
+        for (std::size_t i = 0; i < batch_size; ++i) {
+            out[i] = m_offset[eZ];
+            position_x[i] = (x0 + VectorFloat(batch0 + i)) * m_scale[eX] + m_offset[eX];
+        }
+
+        VectorFloat frequency = m_base_frequency;
+        VectorFloat amplitude = m_scale[eZ];
+
+        for (unsigned int level = 0; level < m_octaves; level++) {
+            // the y coordinate is shared by the whole row
+            const VectorFloat oct_y = position_y * frequency;
+            const int int_y = floor(oct_y);
+            const VectorFloat frac_y = std::abs(oct_y - VectorFloat(int_y));
+            const unsigned int row0 = int_y * 57;
+            const unsigned int row1 = (int_y + 1) * 57;
+
+            for (std::size_t i = 0; i < batch_size; ++i) {
+                const VectorFloat oct_x = position_x[i] * frequency;
+                int_x[i] = floor(oct_x);
+                frac_x[i] = std::abs(oct_x - VectorFloat(int_x[i]));
+            }
+
+            for (std::size_t i = 0; i < batch_size; ++i) {
+                const unsigned int n = int_x[i];
+                const double v00 = perlin_hash(n + row0);
+                const double v10 = perlin_hash(n + 1 + row0);
+                const double v01 = perlin_hash(n + row1);
+                const double v11 = perlin_hash(n + 1 + row1);
+
+                const double iv0 = interp_linear(v10, v00, frac_x[i]);
+                const double iv1 = interp_linear(v11, v01, frac_x[i]);
+
+                out[i] += interp_linear(iv1, iv0, frac_y) * amplitude;
+            }
+
+            frequency *= 2.0;
+            amplitude *= m_persistence;
+        }
+    }
+}
+
 VectorFloat perlin_rng(const int x, const int y)
 {
-    const unsigned int n = x + y * 57;
-    const unsigned int m = (n << 13) ^ n;
-    return (1.0 - double((m * (m * m * 15731 + 789221) + 1376312589) & 0x7fffffff) / 1073741824.0);
+    return perlin_hash(x + y * 57);
 }
 
 VectorFloat perlin_rng_interpolated(const Vector2 &pos)
@@ -39,7 +39,16 @@ public:
     typedef std::vector<element_t> NTField;
 
 public:
-    NTMapGenerator(const sim::Terrain &source);
+    /**
+     * Create a generator for the normal/tangent map of \a source.
+     *
+     * Updates are split into tiles of TerrainWorker::DEFAULT_TILE_SIZE which
+     * are computed on \a threads threads in parallel; each tile is published
+     * on its own, so that readers of the field are only blocked for the time
+     * it takes to copy a single tile.
+     */
+    explicit NTMapGenerator(const sim::Terrain &source,
+                            const unsigned int threads = default_threads());
     ~NTMapGenerator() override;
 
 private:
@@ -48,6 +57,8 @@ private:
     mutable std::shared_timed_mutex m_data_mutex;
     NTField m_field;
 
+    /* serialises emissions of m_field_updated from the worker threads */
+    std::mutex m_emit_mutex;
     sigc::signal<void, sim::TerrainRect> m_field_updated;
 
 protected:
@@ -67,6 +78,9 @@ public:
         return m_source.size();
     }
 
+public:
+    static unsigned int default_threads();
+
 };
 
 /**
@@ -100,6 +114,7 @@ private:
 
 protected:
     void any_updated(const sim::TerrainRect &at);
+    void terrain_updated(const sim::TerrainRegion &region);
 
 public:
     inline unsigned int size() const
@@ -26,6 +26,7 @@ the AUTHORS file.
 #include "ffengine/math/algo.hpp"
 #include "ffengine/math/intersect.hpp"
 
+#include <cmath>
 #include <cstring>
 #include <iostream>
 
@@ -41,8 +42,42 @@ namespace ffe {
 static io::Logger &logger = io::logging().get_logger("render.fancyterraindata");
 
 
-NTMapGenerator::NTMapGenerator(const sim::Terrain &source):
-    m_source(source)
+/**
+ * Compute one row of normal/tangent data from central differences.
+ *
+ * The rows \a row_m and \a row_p are the rows above and below the row
+ * being computed; \a row_l and \a row_r are the same row shifted one sample
+ * to the left and to the right. The output is written as four floats per
+ * sample (normal x, y, z and the tangent z component).
+ *
+ * The loop is kept free of branches and uses plain float arrays so that it
+ * is vectorized by the compiler.
+ */
+static void nt_row(const float *row_m,
+                   const float *row_l,
+                   const float *row_r,
+                   const float *row_p,
+                   const std::size_t width,
+                   float *dest)
+{
+    for (std::size_t x = 0; x < width; ++x) {
+        const float dx = row_r[x] - row_l[x];
+        const float dy = row_p[x] - row_m[x];
+        const float inv_len = 1.f / std::sqrt(dx*dx + dy*dy + 4.f);
+        dest[4*x+0] = -dx * inv_len;
+        dest[4*x+1] = -dy * inv_len;
+        dest[4*x+2] = 2.f * inv_len;
+        dest[4*x+3] = dx / 2.f;
+    }
+}
+
+
+NTMapGenerator::NTMapGenerator(const sim::Terrain &source,
+                               const unsigned int threads):
+    // normals of the neighbouring samples depend on the updated heights, too
+    sim::TerrainWorker(threads, DEFAULT_TILE_SIZE, 1),
+    m_source(source),
+    m_field(source.size()*source.size())
 {
     start();
 }
@@ -54,172 +89,109 @@ NTMapGenerator::~NTMapGenerator()
 
 void NTMapGenerator::worker_impl(const sim::TerrainRect &updated)
 {
+    static_assert(sizeof(element_t) == 4*sizeof(float),
+                  "NTField elements must be tightly packed floats");
+
     const unsigned int source_size = m_source.size();
 
-    sim::TerrainRect to_update = updated;
-    if (to_update.x0() > 0) {
-        to_update.set_x0(to_update.x0() - 1);
-    }
-    if (to_update.y0() > 0) {
-        to_update.set_y0(to_update.y0() - 1);
-    }
-    if (to_update.x1() < source_size) {
-        to_update.set_x1(to_update.x1() + 1);
-    }
-    if (to_update.y1() < source_size) {
-        to_update.set_y1(to_update.y1() + 1);
+    const sim::TerrainRect to_update(
+                std::min(updated.x0(), source_size),
+                std::min(updated.y0(), source_size),
+                std::min(updated.x1(), source_size),
+                std::min(updated.y1(), source_size));
+    if (to_update.x1() <= to_update.x0() || to_update.y1() <= to_update.y0()) {
+        return;
     }
 
-    const unsigned int dst_width = (to_update.x1() - to_update.x0());
-    const unsigned int dst_height = (to_update.y1() - to_update.y0());
-    const unsigned int src_xoffset = (to_update.x0() == 0 ? 0 : 1);
-    const unsigned int src_yoffset = (to_update.y0() == 0 ? 0 : 1);
-    const unsigned int src_x0 = to_update.x0() - src_xoffset;
-    const unsigned int src_y0 = to_update.y0() - src_yoffset;
-    const unsigned int src_width = dst_width
-            + (to_update.x0() == 0 ? 0 : 1)
-            + (to_update.x1() == source_size ? 0 : 1);
-    const unsigned int src_height = dst_height
-            + (to_update.y0() == 0 ? 0 : 1)
-            + (to_update.y1() == source_size ? 0 : 1);
-
-
-    sim::Terrain::Field source_latch(src_width*src_height);
-    // this worker really takes a long time, we will copy the source
+    const unsigned int width = to_update.x1() - to_update.x0();
+    const unsigned int height = to_update.y1() - to_update.y0();
+    const unsigned int latch_width = width + 2;
+    const unsigned int latch_height = height + 2;
+
+    // the latch holds only the heights of to_update plus a border of one
+    // sample; samples outside of the terrain are filled in below
+    std::vector<float> latch(latch_width*latch_height);
     {
+        const unsigned int src_x0 = (to_update.x0() > 0 ? to_update.x0() - 1 : 0);
+        const unsigned int src_x1 = std::min(to_update.x1() + 1, source_size);
+        const unsigned int latch_x0 = src_x0 + 1 - to_update.x0();
+
         const sim::Terrain::Field *heightmap = nullptr;
         auto source_lock = m_source.readonly_field(heightmap);
-        for (unsigned int ysrc = src_y0, ylatch = 0;
-             ylatch < src_height;
-             ylatch++, ysrc++)
-        {
-            memcpy(&source_latch[ylatch*src_width],
-                    &(*heightmap)[ysrc*source_size+src_x0],
-                    sizeof(sim::Terrain::Field::value_type)*src_width);
-        }
-
-    }
-
-    NTField dest(dst_width*dst_height);
-
-    bool has_ym = to_update.y0() > 0;
-    for (unsigned int y = 0;
-         y < dst_height;
-         y++)
-    {
-        bool has_xm = to_update.x0() > 0;
-        bool has_yp = to_update.y1() < source_size || y < dst_height - 1;
-        for (unsigned int x = 0;
-             x < dst_width;
-             x++)
-        {
-            const bool has_xp = to_update.x1() < source_size || x < dst_width - 1;
-            Vector3f normal(0, 0, 0);
-            float tangent_eZ = 0;
-
-
-            const sim::Terrain::height_t y0x0 = source_latch[(y+src_yoffset)*src_width+x+src_xoffset][sim::Terrain::HEIGHT_ATTR];
-            sim::Terrain::height_t ymx0;
-            sim::Terrain::height_t ypx0;
-            sim::Terrain::height_t y0xm;
-            sim::Terrain::height_t y0xp;
-
-            Vector3f tangent_x1;
-            Vector3f tangent_x2;
-
-            Vector3f tangent_y1;
-            Vector3f tangent_y2;
-
-            if (has_ym)
-            {
-                ymx0 = source_latch[(y+src_yoffset-1)*src_width+x+src_xoffset][sim::Terrain::HEIGHT_ATTR];
-                tangent_y1 = Vector3f(0, 1, y0x0 - ymx0);
-            }
-            if (has_yp)
-            {
-                ypx0 = source_latch[(y+src_yoffset+1)*src_width+x+src_xoffset][sim::Terrain::HEIGHT_ATTR];
-                tangent_y2 = Vector3f(0, 1, ypx0 - y0x0);
+        for (unsigned int ylatch = 0; ylatch < latch_height; ++ylatch) {
+            const int ysrc = int(to_update.y0() + ylatch) - 1;
+            if (ysrc < 0 || ysrc >= int(source_size)) {
+                continue;
             }
-            if (has_xm)
-            {
-                y0xm = source_latch[(y+src_yoffset)*src_width+x+src_xoffset-1][sim::Terrain::HEIGHT_ATTR];
-                const float z = y0x0 - y0xm;
-                tangent_x1 = Vector3f(1, 0, z);
-                tangent_eZ += z;
-            }
-            if (has_xp)
-            {
-                y0xp = source_latch[(y+src_yoffset)*src_width+x+src_xoffset+1][sim::Terrain::HEIGHT_ATTR];
-                const float z = y0xp - y0x0;
-                tangent_x2 = Vector3f(1, 0, z);
-                tangent_eZ += z;
-                if (!has_xm) {
-                    // correct for division by two later on
-                    tangent_eZ *= 2;
-                }
-            } else {
-                // correct for division by two later on
-                tangent_eZ *= 2;
-            }
-
-            assert((has_xm || has_xp) && (has_ym || has_yp));
 
-            if (has_xm && has_ym) {
-                // above left face
-                normal += tangent_x1 % tangent_y1;
-            }
-            if (has_xp && has_ym) {
-                // above right face
-                normal += tangent_x2 % tangent_y1;
+            const sim::Terrain::Field::value_type *src =
+                    &(*heightmap)[ysrc*source_size];
+            float *dest = &latch[ylatch*latch_width + latch_x0];
+            for (unsigned int xsrc = src_x0; xsrc < src_x1; ++xsrc) {
+                *dest++ = src[xsrc][sim::Terrain::HEIGHT_ATTR];
             }
+        }
+    }
 
-            if (has_xm && has_yp) {
-                // below left face
-                normal += tangent_x1 % tangent_y2;
+    // extrapolate linearly beyond the terrain edges, which makes the central
+    // differences degrade to one-sided differences there
+    if (to_update.x0() == 0 || to_update.x1() == source_size) {
+        for (unsigned int ylatch = 1; ylatch < latch_height - 1; ++ylatch) {
+            float *row = &latch[ylatch*latch_width];
+            if (to_update.x0() == 0) {
+                row[0] = 2*row[1] - row[2];
             }
-            if (has_xp && has_yp) {
-                // below right face
-                normal += tangent_x2 % tangent_y2;
+            if (to_update.x1() == source_size) {
+                row[latch_width-1] = 2*row[latch_width-2] - row[latch_width-3];
             }
-
-            /* if (!has_xm || !has_ym || !has_yp || !has_xp) {
-                std::cerr << x << " " << y << std::endl;
-            } */
-
-            normal.normalize();
-
-            dest[y*dst_width+x] = Vector4f(normal, tangent_eZ / 2.);
-
-            has_xm = true;
         }
-        has_ym = true;
     }
-
-    /*std::cerr << dst_width*dst_height << std::endl;
-    if (dst_width*dst_height < 1000) {
-        for (unsigned int y = 0; y < dst_height; y++) {
-            for (unsigned int x = 0; x < dst_width; x++) {
-                std::cerr << "y = " << y << "; x = " << x << "; " << dest[y*dst_width+x] << std::endl;
-            }
+    if (to_update.y0() == 0) {
+        for (unsigned int x = 0; x < latch_width; ++x) {
+            latch[x] = 2*latch[latch_width+x] - latch[2*latch_width+x];
+        }
+    }
+    if (to_update.y1() == source_size) {
+        float *row = &latch[(latch_height-1)*latch_width];
+        const float *row_m1 = row - latch_width;
+        const float *row_m2 = row_m1 - latch_width;
+        for (unsigned int x = 0; x < latch_width; ++x) {
+            row[x] = 2*row_m1[x] - row_m2[x];
         }
-    }*/
+    }
+
+    std::vector<float> dest(4*width*height);
+    for (std::size_t y = 0; y < height; ++y) {
+        // the latch has a border of one sample on each side
+        const float *row = &latch[(y+1)*latch_width + 1];
+
+        nt_row(row - latch_width,
+               row - 1,
+               row + 1,
+               row + latch_width,
+               width,
+               &dest[4*y*width]);
+    }
 
     {
         std::unique_lock<std::shared_timed_mutex> lock(m_data_mutex);
-        m_field.resize(source_size*source_size);
-        for (unsigned int ydst = 0, ystore = src_y0+src_yoffset;
-             ydst < dst_height;
-             ystore++, ydst++)
-        {
-            memcpy(&m_field[ystore*source_size+src_x0+src_xoffset],
-                    &dest[ydst*dst_width],
-                    sizeof(Vector4f)*dst_width);
+        for (std::size_t y = 0; y < height; ++y) {
+            memcpy(m_field[(to_update.y0()+y)*source_size + to_update.x0()].as_array,
+                   &dest[4*y*width],
+                   sizeof(element_t)*width);
         }
     }
 
-    m_field_updated.emit(updated);
+    std::lock_guard<std::mutex> lock(m_emit_mutex);
+    m_field_updated.emit(to_update);
+}
+
+unsigned int NTMapGenerator::default_threads()
+{
+    return std::max(1U, std::thread::hardware_concurrency() / 2);
 }
 
+
 std::shared_lock<std::shared_timed_mutex> NTMapGenerator::readonly_field(
         const NTField *&field) const
 {
@@ -245,11 +217,11 @@ FancyTerrainInterface::FancyTerrainInterface(const sim::Terrain &terrain,
     m_any_updated_conns.emplace_back(
                 m_terrain.heightmap_updated().connect(
                     sigc::mem_fun(*this,
-                                  &FancyTerrainInterface::any_updated)));
+                                  &FancyTerrainInterface::terrain_updated)));
     m_any_updated_conns.emplace_back(
                 m_terrain.attributes_updated().connect(
                     sigc::mem_fun(*this,
-                                  &FancyTerrainInterface::any_updated)));
+                                  &FancyTerrainInterface::terrain_updated)));
 
     const unsigned int tiles = ((terrain.size()-1) / (m_grid_size-1));
 
@@ -283,6 +255,13 @@ void FancyTerrainInterface::any_updated(const sim::TerrainRect &part)
     m_field_updated.emit(part);
 }
 
+void FancyTerrainInterface::terrain_updated(const sim::TerrainRegion &region)
+{
+    for (const sim::TerrainRect &rect: region) {
+        any_updated(rect);
+    }
+}
+
 std::tuple<Vector3f, bool> FancyTerrainInterface::hittest(const Ray &ray)
 {
 #ifdef TIMELOG_HITTEST
@@ -0,0 +1,228 @@
+/**********************************************************************
+File name: command_log.hpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#ifndef SCC_SIM_COMMAND_LOG_H
+#define SCC_SIM_COMMAND_LOG_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+namespace sim {
+
+class NetFrameBuilder;
+
+namespace messages {
+
+class CommandLogFrame;
+class WorldCommand;
+
+}
+
+/**
+ * Append-only log of the world commands executed by a Server.
+ *
+ * The log uses the framing of the networld protocol (see NetMessageParser):
+ * each record consists of the message class and the payload size, both as
+ * 32 bit little endian integers, followed by the serialised message. A
+ * MSGCLASS_COMMAND_LOG_FRAME record (messages::CommandLogFrame) starts the
+ * commands executed in one game frame, each of which is stored as a
+ * MSGCLASS_WORLD_COMMAND record. Frames without commands are not recorded;
+ * the frame numbers preserve the gaps.
+ *
+ * The frame record also lists the commands which were executed with a
+ * completion callback. Server::fuse_ops() never fuses those with other
+ * operations, so a replay has to treat them the same way to reproduce the
+ * executed operations.
+ *
+ * append_frame() only moves the commands to a queue; serialisation and
+ * writing happen on a dedicated thread, so that a slow disk does not delay
+ * the game loop. If the writer falls behind by more than
+ * MAX_PENDING_COMMANDS commands, or writing fails, further frames are
+ * dropped and counted in dropped_commands().
+ */
+class CommandLogWriter
+{
+public:
+    typedef std::unique_ptr<messages::WorldCommand> CommandPtr;
+
+    static constexpr std::size_t MAX_PENDING_COMMANDS = 65536;
+
+public:
+    /**
+     * Open \a path for appending, creating it if necessary.
+     *
+     * @throws std::system_error if the file cannot be opened.
+     */
+    explicit CommandLogWriter(const std::string &path);
+    CommandLogWriter(const CommandLogWriter &ref) = delete;
+    CommandLogWriter &operator=(const CommandLogWriter &ref) = delete;
+
+    /**
+     * Write all appended frames and close the file.
+     */
+    ~CommandLogWriter();
+
+private:
+    struct Frame
+    {
+        std::uint64_t frame;
+        std::vector<CommandPtr> commands;
+        std::vector<std::uint32_t> unfused;
+    };
+
+    const int m_fd;
+
+    /* guarded by m_mutex */
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::vector<Frame> m_pending;
+    std::size_t m_pending_commands;
+    std::uint64_t m_frames_appended;
+    std::uint64_t m_frames_written;
+    bool m_failed;
+    bool m_terminated;
+
+    std::atomic<std::uint64_t> m_dropped_commands;
+
+    /* used by m_thread */
+    std::vector<Frame> m_writing;
+    std::unique_ptr<NetFrameBuilder> m_send_frames;
+    std::unique_ptr<messages::CommandLogFrame> m_frame_msg;
+
+    std::thread m_thread;
+
+private:
+    bool write_pending();
+    void writer_thread();
+
+public:
+    /**
+     * Thread-safely append the \a commands executed in \a frame.
+     *
+     * The commands are moved out of \a commands and the indices out of
+     * \a unfused; both are left empty.
+     *
+     * @param frame Number of the game frame.
+     * @param commands Commands executed in the frame, in order.
+     * @param unfused Ascending indices into \a commands of the commands
+     * which were executed with a completion callback (and were thus not
+     * fused with other operations).
+     */
+    void append_frame(const std::uint64_t frame,
+                      std::vector<CommandPtr> &commands,
+                      std::vector<std::uint32_t> &unfused);
+
+    /**
+     * Block until all frames appended so far have been written.
+     *
+     * @return false if writing failed.
+     */
+    bool flush();
+
+    /**
+     * Number of commands which were dropped because the writer fell behind
+     * or failed.
+     */
+    inline std::uint64_t dropped_commands() const
+    {
+        return m_dropped_commands;
+    }
+
+};
+
+
+/**
+ * Sequential reader for logs written by CommandLogWriter.
+ *
+ * The file is mapped into memory, so that reading does not copy the data
+ * more than necessary.
+ */
+class CommandLogReader
+{
+public:
+    /**
+     * @throws std::system_error if the file cannot be opened or mapped.
+     */
+    explicit CommandLogReader(const std::string &path);
+    CommandLogReader(const CommandLogReader &ref) = delete;
+    CommandLogReader &operator=(const CommandLogReader &ref) = delete;
+    ~CommandLogReader();
+
+private:
+    const char *m_data;
+    std::size_t m_size;
+    std::size_t m_pos;
+    bool m_truncated;
+    std::unique_ptr<messages::CommandLogFrame> m_frame_msg;
+
+private:
+    /**
+     * Read the header of the record at m_pos.
+     *
+     * @return false if the remaining data does not contain a complete
+     * record.
+     */
+    bool peek_record(std::uint32_t &msgclass, std::uint32_t &msgsize) const;
+
+public:
+    /**
+     * Return true if the log ended with an incomplete record, which happens
+     * if the writer was interrupted.
+     */
+    inline bool truncated() const
+    {
+        return m_truncated;
+    }
+
+    /**
+     * Read the next frame.
+     *
+     * An incomplete record at the end of the log is treated as the end of
+     * the log (see truncated()).
+     *
+     * @param frame Receives the frame number.
+     * @param commands Receives the commands of the frame; previous contents
+     * are replaced.
+     * @param unfused Receives the ascending indices into \a commands of the
+     * commands which were executed with a completion callback; a replay must
+     * not fuse those with other operations (e.g. by enqueueing them with a
+     * callback, too). Previous contents are replaced.
+     * @return false at the end of the log.
+     * @throws std::runtime_error if the log is malformed.
+     */
+    bool next_frame(std::uint64_t &frame,
+                    std::vector<std::shared_ptr<messages::WorldCommand> > &commands,
+                    std::vector<std::uint32_t> &unfused);
+
+};
+
+}
+
+#endif
@@ -0,0 +1,288 @@
+/**********************************************************************
+File name: epoll_server.hpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#ifndef SCC_SIM_EPOLL_SERVER_H
+#define SCC_SIM_EPOLL_SERVER_H
+
+#include <sigc++/signal.h>
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "ffengine/sim/networld.hpp"
+
+namespace sim {
+
+class EpollNetServer;
+
+
+/**
+ * A client connection handled by an EpollNetServer.
+ *
+ * In contrast to NetServerClient, this does not use the Qt event loop: all
+ * socket I/O happens on the event loop thread of the server. flush() and
+ * terminate() may be called directly from any thread; they hand the request
+ * to the event loop.
+ *
+ * Incoming messages are passed to the message handler on the event loop
+ * thread.
+ *
+ * Outgoing messages are serialised into a NetFrameBuilder and sent with a
+ * single vectored write per flush(). If the peer does not keep up, data is
+ * kept until the socket becomes writable; a client which accumulates more
+ * than MAX_PENDING_BYTES of unsent data is disconnected.
+ */
+class EpollServerClient: public ServerClientBase
+{
+public:
+    // clients with more unsent data than this are disconnected
+    static constexpr std::size_t MAX_PENDING_BYTES = 8*1024*1024;
+
+public:
+    EpollServerClient(EpollNetServer &server,
+                      const int fd,
+                      const NetConnectionID id);
+    EpollServerClient(const EpollServerClient &ref) = delete;
+    EpollServerClient &operator=(const EpollServerClient &ref) = delete;
+    ~EpollServerClient() override;
+
+private:
+    EpollNetServer &m_server;
+    const int m_fd;
+    const NetConnectionID m_id;
+    bool m_failed;
+    NetMessageParser m_message_parser;
+
+    /* guarded by m_send_mutex */
+    std::mutex m_send_mutex;
+    NetFrameBuilder m_send_frames;
+    bool m_send_overflow;
+
+private:
+    void fail();
+    void link_control_received(std::shared_ptr<messages::NetWorldControl> &&msg);
+
+protected:
+    bool msg_unhandled(AbstractMessagePtr &&msg) override;
+
+public:
+    inline NetConnectionID id() const
+    {
+        return m_id;
+    }
+
+    inline int fd() const
+    {
+        return m_fd;
+    }
+
+    /**
+     * Read and parse all data available on the socket.
+     *
+     * Only the event loop calls this.
+     *
+     * @return false if the connection was closed by the peer or has failed
+     * and must be closed.
+     */
+    bool receive();
+
+    /**
+     * Write as much of the pending data as the socket accepts, using as few
+     * writev() calls as possible.
+     *
+     * Only the event loop calls this.
+     *
+     * @return false if the connection has failed and must be closed.
+     */
+    bool send_pending();
+
+    /**
+     * Thread-safely append a message to the send buffer.
+     *
+     * The message is sent on the next flush().
+     *
+     * @param msgclass Class of the message, written to the header.
+     * @param msg The message to serialise.
+     */
+    void send_message(const NetMessageClass msgclass,
+                      const google::protobuf::Message &msg);
+
+    /**
+     * Thread-safely return the number of bytes which have been enqueued, but
+     * not sent yet.
+     */
+    std::size_t pending_bytes();
+
+public:
+    void flush() override;
+    void terminate() override;
+    void request_flush() override;
+    void request_terminate() override;
+    void send_message(const messages::WorldCommandResponse &msg) override;
+    void send_message(const messages::ReplicationUpdate &msg) override;
+    void set_message_handler(IMessageHandler *handler) override;
+
+};
+
+
+/**
+ * A headless TCP server for the networld protocol, built on epoll.
+ *
+ * All sockets are non-blocking and registered with a single epoll instance,
+ * which is served by one event loop thread. Client sockets are
+ * edge-triggered; the listening socket is level-triggered, so that pending
+ * connections are not lost if accepting them fails (e.g. because the
+ * process ran out of file descriptors). Requests from
+ * other threads (flush, terminate, stop) are passed to the loop through an
+ * eventfd.
+ *
+ * This is an alternative to NetServer for processes without a Qt event loop,
+ * such as dedicated servers. It is only available on Linux.
+ */
+class EpollNetServer
+{
+public:
+    EpollNetServer();
+    EpollNetServer(const EpollNetServer &ref) = delete;
+    EpollNetServer &operator=(const EpollNetServer &ref) = delete;
+
+    /**
+     * Stop the server, if it is running.
+     */
+    ~EpollNetServer();
+
+private:
+    static constexpr std::uint64_t LISTEN_TOKEN = ~std::uint64_t(0);
+    static constexpr std::uint64_t WAKEUP_TOKEN = ~std::uint64_t(0) - 1;
+
+    int m_epoll_fd;
+    int m_wakeup_fd;
+    int m_listen_fd;
+    /**
+     * Spare descriptor (on /dev/null) which is given up to accept and
+     * immediately close connections while the process is out of file
+     * descriptors.
+     */
+    int m_reserve_fd;
+
+    std::atomic_bool m_terminated;
+    std::atomic<std::size_t> m_client_count;
+    std::thread m_loop_thread;
+
+    /* used by the event loop only */
+    NetConnectionID m_next_id;
+    std::unordered_map<NetConnectionID, std::unique_ptr<EpollServerClient> > m_clients;
+    sigc::signal<void, ServerClientBase&> m_client_connected;
+    sigc::signal<void, ServerClientBase&> m_client_closed;
+
+    /* guarded by m_requests_mutex */
+    std::mutex m_requests_mutex;
+    std::vector<NetConnectionID> m_flush_requests;
+    std::vector<NetConnectionID> m_close_requests;
+
+private:
+    void accept_pending();
+    void close_client(const NetConnectionID id, const bool emit_disconnected);
+    void loop();
+    void process_requests();
+    void request_close(const NetConnectionID id);
+    void request_flush(const NetConnectionID id);
+    void wakeup();
+
+    friend class EpollServerClient;
+
+public:
+    /**
+     * Number of currently connected clients.
+     */
+    inline std::size_t client_count() const
+    {
+        return m_client_count;
+    }
+
+    /**
+     * Emitted on the event loop thread for each accepted connection.
+     *
+     * Connected slots typically set the message handler of the client. The
+     * client is owned by the server; it must not be used after it emitted
+     * ServerClientBase::disconnected() or after it has been terminated.
+     */
+    inline sigc::signal<void, ServerClientBase&> &client_connected()
+    {
+        return m_client_connected;
+    }
+
+    /**
+     * Emitted on the event loop thread for each connection which is closed,
+     * for whatever reason (including terminate() and stop()).
+     *
+     * The client is destroyed right after the signal has been emitted.
+     */
+    inline sigc::signal<void, ServerClientBase&> &client_closed()
+    {
+        return m_client_closed;
+    }
+
+    /**
+     * Bind the listening socket.
+     *
+     * This must be called before start().
+     *
+     * @param address Numeric IPv4 or IPv6 address or host name to bind to.
+     * @param port TCP port to bind to; zero selects a free port.
+     * @param backlog Maximum length of the queue of pending connections.
+     * @throws std::system_error if the socket cannot be set up.
+     */
+    void listen(const std::string &address,
+                const std::uint16_t port,
+                const int backlog = 128);
+
+    /**
+     * Return the port the listening socket is bound to, or zero if listen()
+     * has not been called.
+     */
+    std::uint16_t port() const;
+
+    /**
+     * Start the event loop thread.
+     */
+    void start();
+
+    /**
+     * Stop the event loop and close all connections.
+     *
+     * All clients emit ServerClientBase::disconnected() before they are
+     * destroyed.
+     */
+    void stop();
+
+};
+
+}
+
+#endif
@@ -116,7 +116,7 @@ private:
 protected:
     void map_source(Source *obj);
     TerrainRect source_rect(Source *obj) const;
-    void terrain_updated(TerrainRect r);
+    void terrain_updated(const TerrainRegion &r);
     void validate_sources();
 
 public:
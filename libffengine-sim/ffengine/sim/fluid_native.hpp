@@ -45,7 +45,7 @@ private:
 
     /* guarded by m_terrain_update_mutex */
     std::mutex m_terrain_update_mutex;
-    TerrainRect m_terrain_update;
+    TerrainRegion m_terrain_update;
 
     /* guarded by m_ocean_level_update_mutex */
     std::mutex m_ocean_level_update_mutex;
@@ -0,0 +1,284 @@
+/**********************************************************************
+File name: frame_timing.hpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#ifndef SCC_SIM_FRAME_TIMING_H
+#define SCC_SIM_FRAME_TIMING_H
+
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#include "ffengine/sim/world.hpp"
+
+
+namespace sim {
+
+typedef std::chrono::nanoseconds FrameDuration;
+
+/**
+ * Timing breakdown of a single game frame.
+ *
+ * The stages correspond to the phases of Server::game_frame().
+ */
+struct FrameTiming
+{
+    /**
+     * Time at which the frame started.
+     */
+    WorldClock::time_point start;
+
+    /**
+     * Wall-clock time of the whole frame.
+     */
+    FrameDuration total;
+
+    /**
+     * Time spent executing world operations, in both stages.
+     */
+    FrameDuration ops;
+
+    /**
+     * Time spent reshaping the graph.
+     */
+    FrameDuration reshape;
+
+    /**
+     * Time spent waiting for the fluid step of the previous frame.
+     */
+    FrameDuration fluid_wait;
+
+    /**
+     * Time spent paging in terrain and running the Sandifier.
+     */
+    FrameDuration sandifier;
+
+    /**
+     * Time spent flushing terrain notifications and starting the next fluid
+     * step.
+     */
+    FrameDuration fluid_start;
+
+    /**
+     * Time spent publishing the WorldView of the frame and requesting the
+     * clients to be flushed.
+     */
+    FrameDuration publish;
+
+    /**
+     * Number of frame slots which were dropped by the FramePacer after this
+     * frame.
+     */
+    unsigned int dropped_frames;
+};
+
+
+/**
+ * Percentiles of one duration over a range of frames.
+ */
+struct FrameDurationStats
+{
+    FrameDuration p50;
+    FrameDuration p99;
+    FrameDuration max;
+};
+
+
+/**
+ * Summary of a range of frame timings, as returned by
+ * FrameTimingBuffer::summary().
+ */
+struct FrameTimingSummary
+{
+    /**
+     * Number of frames the summary covers; all other members are zero if
+     * this is zero.
+     */
+    std::size_t frames;
+
+    /**
+     * Total number of dropped frame slots within the covered frames.
+     */
+    unsigned int dropped_frames;
+
+    FrameDurationStats total;
+    FrameDurationStats ops;
+    FrameDurationStats reshape;
+    FrameDurationStats fluid_wait;
+    FrameDurationStats sandifier;
+    FrameDurationStats fluid_start;
+    FrameDurationStats publish;
+};
+
+
+/**
+ * Thread-safe ring buffer of the timings of the most recent frames.
+ *
+ * The game thread pushes one entry per frame; any thread may query the
+ * buffer. Queries copy the buffer under a mutex which is only held briefly
+ * by push(), so they do not disturb the game loop.
+ */
+class FrameTimingBuffer
+{
+public:
+    /**
+     * @param capacity Number of frames to keep; must be at least one.
+     */
+    explicit FrameTimingBuffer(const std::size_t capacity = 1024);
+
+private:
+    mutable std::mutex m_mutex;
+    std::vector<FrameTiming> m_timings;
+    std::size_t m_next;
+    std::size_t m_size;
+
+public:
+    inline std::size_t capacity() const
+    {
+        return m_timings.size();
+    }
+
+    /**
+     * Drop all recorded timings.
+     */
+    void clear();
+
+    /**
+     * Record the timing of a frame, replacing the oldest entry if the buffer
+     * is full.
+     */
+    void push(const FrameTiming &timing);
+
+    /**
+     * Return a copy of the recorded timings, oldest first.
+     */
+    std::vector<FrameTiming> recent() const;
+
+    /**
+     * Compute percentiles over the recorded timings.
+     */
+    FrameTimingSummary summary() const;
+
+};
+
+
+/**
+ * Compute the percentiles of the frame timings in \a timings.
+ *
+ * Percentiles use the nearest-rank method.
+ */
+FrameTimingSummary summarize_frame_timings(
+        const std::vector<FrameTiming> &timings);
+
+
+/**
+ * Policy for a game loop which cannot keep up with its frame period.
+ */
+enum class FramePacing
+{
+    /**
+     * Run the missed frames back-to-back until the loop has caught up. At
+     * most a configured number of frames is kept pending; older frame slots
+     * are dropped.
+     */
+    CATCH_UP,
+
+    /**
+     * Drop all missed frame slots except the most recent one, which is run
+     * immediately.
+     */
+    DROP,
+
+    /**
+     * Do not run frames on a schedule at all; frames are run on request
+     * only (see Server::step()), as fast as they complete. This is used to
+     * replay recorded sessions and in tests. A FramePacer treats this like
+     * DROP.
+     */
+    MANUAL
+};
+
+
+/**
+ * Compute the deadlines of a fixed-period game loop.
+ *
+ * The FramePacer is not thread-safe.
+ */
+class FramePacer
+{
+public:
+    FramePacer(const FrameDuration period,
+               const FramePacing policy = FramePacing::CATCH_UP,
+               const unsigned int max_catch_up_frames = 4);
+
+private:
+    FrameDuration m_period;
+    FramePacing m_policy;
+    unsigned int m_max_catch_up_frames;
+    WorldClock::time_point m_deadline;
+
+public:
+    inline FrameDuration period() const
+    {
+        return m_period;
+    }
+
+    inline FramePacing policy() const
+    {
+        return m_policy;
+    }
+
+    inline unsigned int max_catch_up_frames() const
+    {
+        return m_max_catch_up_frames;
+    }
+
+    /**
+     * Time at which the next frame is due.
+     */
+    inline WorldClock::time_point deadline() const
+    {
+        return m_deadline;
+    }
+
+    void set_policy(const FramePacing policy,
+                    const unsigned int max_catch_up_frames);
+
+    /**
+     * Make the next frame due at \a now.
+     */
+    void reset(const WorldClock::time_point now);
+
+    /**
+     * Advance the deadline after a frame has finished at \a now.
+     *
+     * @return The number of frame slots which were dropped according to the
+     * pacing policy.
+     */
+    unsigned int frame_done(const WorldClock::time_point now);
+
+};
+
+
+}
+
+#endif
@@ -0,0 +1,189 @@
+/**********************************************************************
+File name: interest.hpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#ifndef SCC_SIM_INTEREST_H
+#define SCC_SIM_INTEREST_H
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "ffengine/sim/terrain.hpp"
+
+
+namespace sim {
+
+/**
+ * Spatial index of the parts of the terrain which clients are interested
+ * in.
+ *
+ * The terrain is divided into cells of WorldView::TILE_SIZE × TILE_SIZE,
+ * matching the tiles of a WorldView. For each cell, the grid keeps the list
+ * of subscribers whose interest rectangles overlap it. Looking up who is
+ * affected by a change thus costs time proportional to the number of
+ * changed cells and their subscribers, independent of the total number of
+ * subscribers and of the size of the world.
+ *
+ * The InterestGrid is not thread-safe.
+ */
+class InterestGrid
+{
+public:
+    typedef std::uint64_t Subscriber;
+
+public:
+    /**
+     * @param terrain_size Size of the terrain; may be zero to create an
+     * empty grid which is set up later with reset().
+     */
+    explicit InterestGrid(const unsigned int terrain_size = 0);
+
+private:
+    unsigned int m_terrain_size;
+    unsigned int m_cells_per_axis;
+    std::vector<std::vector<Subscriber> > m_cells;
+
+    /**
+     * Cells each subscriber is registered in.
+     */
+    std::unordered_map<Subscriber, std::vector<unsigned int> > m_subscriptions;
+
+    /**
+     * Used to visit each cell at most once when walking a set of
+     * (possibly overlapping) rectangles.
+     */
+    mutable std::vector<std::uint32_t> m_cell_marks;
+    mutable std::uint32_t m_current_mark;
+
+private:
+    std::uint32_t next_mark() const;
+    void unsubscribe_cells(const Subscriber subscriber,
+                           const std::vector<unsigned int> &cells);
+
+public:
+    inline unsigned int terrain_size() const
+    {
+        return m_terrain_size;
+    }
+
+    inline unsigned int cells_per_axis() const
+    {
+        return m_cells_per_axis;
+    }
+
+    /**
+     * Return the subscribers interested in a cell, in no particular order.
+     */
+    inline const std::vector<Subscriber> &subscribers(
+            const unsigned int cx, const unsigned int cy) const
+    {
+        return m_cells[cy*m_cells_per_axis + cx];
+    }
+
+    /**
+     * Return the number of registered subscribers.
+     */
+    inline std::size_t size() const
+    {
+        return m_subscriptions.size();
+    }
+
+    /**
+     * Call \a cell_func for each cell overlapping any of the \a rects, once
+     * per cell, with the cell coordinates.
+     */
+    template <typename rects_t, typename callable_t>
+    void for_each_cell(const rects_t &rects, callable_t &&cell_func) const
+    {
+        const std::uint32_t mark = next_mark();
+        for (const TerrainRect &rect: rects) {
+            const TerrainRect clipped = rect & TerrainRect(0, 0,
+                                                           m_terrain_size,
+                                                           m_terrain_size);
+            if (clipped.empty()) {
+                continue;
+            }
+            const unsigned int cx0 = clipped.x0() / cell_size;
+            const unsigned int cy0 = clipped.y0() / cell_size;
+            const unsigned int cx1 = (clipped.x1() + cell_size - 1) / cell_size;
+            const unsigned int cy1 = (clipped.y1() + cell_size - 1) / cell_size;
+            for (unsigned int cy = cy0; cy < cy1; ++cy) {
+                for (unsigned int cx = cx0; cx < cx1; ++cx) {
+                    const unsigned int index = cy*m_cells_per_axis + cx;
+                    if (m_cell_marks[index] == mark) {
+                        continue;
+                    }
+                    m_cell_marks[index] = mark;
+                    cell_func(cx, cy);
+                }
+            }
+        }
+    }
+
+    /**
+     * Call \a func for each subscriber interested in any cell overlapping
+     * \a region, with the subscriber and the cell coordinates.
+     *
+     * A subscriber is reported once per affected cell.
+     */
+    template <typename callable_t>
+    void for_each_subscriber(const TerrainRegion &region,
+                             callable_t &&func) const
+    {
+        for_each_cell(region, [this, &func](const unsigned int cx,
+                                            const unsigned int cy){
+            for (const Subscriber subscriber: subscribers(cx, cy)) {
+                func(subscriber, cx, cy);
+            }
+        });
+    }
+
+    /**
+     * Remove all subscribers and change the size of the terrain.
+     */
+    void reset(const unsigned int terrain_size);
+
+    /**
+     * Set the area \a subscriber is interested in, replacing the previous
+     * interest.
+     *
+     * @param subscriber Subscriber to register or update.
+     * @param rects Rectangles of interest, in terrain cells; they may
+     * overlap and are clipped to the terrain.
+     */
+    void set_interest(const Subscriber subscriber,
+                      const std::vector<TerrainRect> &rects);
+
+    /**
+     * Remove a subscriber; unknown subscribers are ignored.
+     */
+    void remove(const Subscriber subscriber);
+
+public:
+    static const unsigned int cell_size;
+
+};
+
+}
+
+#endif
@@ -0,0 +1,205 @@
+/**********************************************************************
+File name: journal.hpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#ifndef SCC_SIM_JOURNAL_H
+#define SCC_SIM_JOURNAL_H
+
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include "ffengine/sim/world.hpp"
+
+
+namespace sim {
+
+/**
+ * Journal of executed world operations for undo and redo.
+ *
+ * For each recorded operation, the journal keeps the difference of the
+ * terrain heights and fluid heights within the region the operation
+ * declares via WorldOperation::touched_terrain_rect() and
+ * WorldOperation::touched_fluid_rect(). The differences are byte-shuffled
+ * and run-length encoded, which makes them very compact, since brushes
+ * leave most of their bounding rect unchanged.
+ *
+ * The memory used by the journal is bounded; when the limit is exceeded,
+ * the oldest entries are dropped.
+ *
+ * Undoing subtracts the recorded differences and redoing adds them again,
+ * so that changes made by other operations in the same area are preserved
+ * (up to clamping).
+ *
+ * The journal is not thread-safe. It is meant to be used from the game
+ * thread only, which is ensured by applying undo and redo through
+ * ops::JournalUndo and ops::JournalRedo.
+ */
+class WorldJournal
+{
+public:
+    static const std::size_t DEFAULT_MEMORY_LIMIT;
+
+private:
+    struct Delta
+    {
+        TerrainRect rect;
+        std::vector<std::uint8_t> data;
+    };
+
+    struct Entry
+    {
+        Delta terrain;
+        Delta fluid;
+
+        std::size_t memory_usage() const;
+    };
+
+public:
+    explicit WorldJournal(const std::size_t memory_limit = DEFAULT_MEMORY_LIMIT);
+
+private:
+    const std::size_t m_memory_limit;
+    std::size_t m_memory_usage;
+
+    std::deque<Entry> m_undo;
+    std::deque<Entry> m_redo;
+
+private:
+    static void latch_terrain(const Terrain &terrain,
+                              const TerrainRect &rect,
+                              std::vector<float> &dest);
+    static void latch_fluid(FluidBlocks &blocks,
+                            const TerrainRect &rect,
+                            std::vector<float> &dest);
+    static void encode_delta(const std::vector<float> &before,
+                             const std::vector<float> &after,
+                             std::vector<std::uint8_t> &dest);
+    static void decode_delta(const Delta &delta,
+                             std::vector<float> &dest);
+
+    static void apply(const Entry &entry, WorldState &state,
+                      const float sign);
+
+    void trim();
+
+public:
+    /**
+     * Execute a world operation and record it in the journal.
+     *
+     * Operations which do not touch terrain or fluid are executed without
+     * being recorded. Recording an operation discards the redo history.
+     *
+     * @param op Operation to execute.
+     * @param state World state to execute the operation against.
+     * @return The result of the operation.
+     */
+    WorldOperationResult execute(WorldOperation &op, WorldState &state);
+
+    /**
+     * Revert the most recently recorded operation.
+     *
+     * @return false if there is nothing to undo.
+     */
+    bool undo(WorldState &state);
+
+    /**
+     * Re-apply the most recently undone operation.
+     *
+     * @return false if there is nothing to redo.
+     */
+    bool redo(WorldState &state);
+
+    /**
+     * Drop all undo and redo information.
+     */
+    void clear();
+
+    inline std::size_t memory_usage() const
+    {
+        return m_memory_usage;
+    }
+
+    inline std::size_t memory_limit() const
+    {
+        return m_memory_limit;
+    }
+
+    inline std::size_t undo_depth() const
+    {
+        return m_undo.size();
+    }
+
+    inline std::size_t redo_depth() const
+    {
+        return m_redo.size();
+    }
+
+};
+
+
+namespace ops {
+
+/**
+ * Undo the most recent operation recorded in a WorldJournal.
+ *
+ * This goes through the normal operation queue, so that the changes are
+ * delivered with the same notifications and at the same point in the frame
+ * as those of any other operation.
+ */
+class JournalUndo: public WorldOperation
+{
+public:
+    explicit JournalUndo(WorldJournal &journal);
+
+private:
+    WorldJournal &m_journal;
+
+public:
+    WorldOperationResult execute(WorldState &state) override;
+
+};
+
+
+/**
+ * Redo the most recently undone operation of a WorldJournal.
+ *
+ * @see JournalUndo
+ */
+class JournalRedo: public WorldOperation
+{
+public:
+    explicit JournalRedo(WorldJournal &journal);
+
+private:
+    WorldJournal &m_journal;
+
+public:
+    WorldOperationResult execute(WorldState &state) override;
+
+};
+
+}
+
+}
+
+#endif
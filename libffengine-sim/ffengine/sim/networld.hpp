@@ -26,6 +26,11 @@ the AUTHORS file.
 
 #include <sigc++/signal.h>
 
+#include <deque>
+#include <mutex>
+
+#include <sys/uio.h>
+
 #include <google/protobuf/io/zero_copy_stream.h>
 #include <google/protobuf/io/coded_stream.h>
 
@@ -57,7 +62,28 @@ enum NetMessageClass: uint32_t {
     /**
      * A world command maps directly to the corresponding protobuf.
      */
-    MSGCLASS_WORLD_COMMAND
+    MSGCLASS_WORLD_COMMAND,
+
+    /**
+     * Response of the server to a world command which carried a token.
+     */
+    MSGCLASS_WORLD_COMMAND_RESPONSE,
+
+    /**
+     * World state replicated from the server to the client.
+     */
+    MSGCLASS_REPLICATION_UPDATE,
+
+    /**
+     * Feedback of the client on the replicated world state.
+     */
+    MSGCLASS_REPLICATION_FEEDBACK,
+
+    /**
+     * Start of a game frame in a command log (see CommandLogWriter); never
+     * sent over the network.
+     */
+    MSGCLASS_COMMAND_LOG_FRAME
 };
 
 
@@ -71,8 +97,21 @@ enum NetMessageClass: uint32_t {
  *
  * The basic usage is to request a buffer to write to using next_buffer() and
  * confirming that it has been written using written(). During the call to
- * written(), NetMessageParser evaluates the buffer contents (if all required
- * data has been received) and fires events according to what has been found.
+ * written(), NetMessageParser parses all complete messages in the buffer in
+ * place and fires events according to what has been found.
+ *
+ * The buffer returned by next_buffer() is as large as possible, so that
+ * the user can read everything which is available from a socket with a
+ * single call, independent of message boundaries. Incomplete messages are
+ * kept; the buffer is only compacted or grown when the free space at its end
+ * runs low, and never shrinks except on reset().
+ *
+ * Messages are decoded into a per-connection google::protobuf::Arena and
+ * handed out as shared pointers which keep the arena alive. Once all messages
+ * of a previous batch have been released, the arena memory is reused for the
+ * next batch, so that in steady state decoding does not hit the heap. Holding
+ * on to messages (e.g. by borrowing their data in WorldOperations) is safe,
+ * but makes the parser start a new arena eventually.
  *
  * The \a link_control_cb function is called when a
  * NetMessageClass::MSGCLASS_LINK_CONTROL is received; otherwise, the
@@ -93,12 +132,18 @@ public:
     // and a uint32_t which denotes the class.
     static constexpr int64_t HEADER_SIZE = sizeof(NetMessageClass)+sizeof(uint32_t);
 
-    enum ReceptionState {
-        RECV_WAIT_FOR_HEADER,
-        RECV_PAYLOAD
-    };
+    // default size of the receive buffer; it grows up to the size of the
+    // largest message received
+    static constexpr size_t RECV_BUFFER_SIZE = 16384;
+
+    // size of the first block of each message arena
+    static constexpr size_t ARENA_BLOCK_SIZE = 16384;
 
-    using LinkControlCallback = std::function<void(std::unique_ptr<messages::NetWorldControl>&&)>;
+    // an arena which is still referenced by messages is replaced by a fresh
+    // one once it has allocated more than this
+    static constexpr size_t ARENA_RECYCLE_SIZE = 4*ARENA_BLOCK_SIZE;
+
+    using LinkControlCallback = std::function<void(std::shared_ptr<messages::NetWorldControl>&&)>;
     using ErrorCallback = std::function<void()>;
 
 public:
@@ -123,42 +168,88 @@ private:
     LinkControlCallback m_link_control_cb;
     ErrorCallback m_error_cb;
     std::atomic<IMessageHandler*> m_message_handler;
+
+    /**
+     * Receive buffer; m_recv_buffer.size() is its capacity. The bytes in
+     * [m_read_pos, m_write_pos) have been received, but not parsed yet.
+     */
     std::string m_recv_buffer;
-    ReceptionState m_recv_state;
-    uint64_t m_recv_barrier;
-    uint64_t m_written_up_to;
+    size_t m_read_pos;
+    size_t m_write_pos;
+
+    /**
+     * Incremented by reset(), to detect resets from within callbacks.
+     */
+    uint64_t m_reset_counter;
+
+    struct MessageArena;
 
-    NetMessageClass m_curr_class;
+    /**
+     * Arena into which messages are decoded; created lazily.
+     */
+    std::shared_ptr<MessageArena> m_arena;
 
 private:
+    /**
+     * Create a new message on the arena.
+     */
+    template <typename message_t>
+    std::shared_ptr<message_t> create_message();
+
+    /**
+     * Prepare the arena for the next batch of messages.
+     *
+     * If no message of the arena is referenced anymore, the arena is reset
+     * (keeping its memory). Otherwise, it is replaced by a new arena if it has
+     * grown beyond ARENA_RECYCLE_SIZE; the old arena is freed when the last
+     * message referencing it is released.
+     */
+    void recycle_arena();
+
     /**
      * Call reset() and emit the error_cb.
      */
     void fail();
 
     /**
-     * Parse the current buffer contents into the given message \a dest.
+     * Parse a message payload into the given message \a dest.
      *
      * @param dest A protobuf message to parse the buffer into.
+     * @param data Start of the payload.
+     * @param size Size of the payload.
      * @return true if parsing succeeded and false otherwise.
      */
-    bool parse(::google::protobuf::Message &dest);
+    bool parse(::google::protobuf::Message &dest,
+               const char *data,
+               const size_t size);
 
     /**
-     * Process a message header in the buffer.
+     * Read the message header at m_read_pos.
+     *
+     * @return false if the header is invalid.
+     */
+    bool read_header(uint32_t &msgclass, uint32_t &msgsize);
+
+    /**
+     * Dispatch a message payload.
+     *
+     * @return false if the message is invalid or was rejected.
      */
-    void received_header();
+    bool received_payload(const NetMessageClass msgclass,
+                          const char *data,
+                          const size_t size);
 
     /**
-     * Process a message payload in the buffer.
+     * Parse all complete messages in the buffer.
      */
-    void received_payload();
+    void parse_buffer();
 
     /**
-     * Check the current state and call the corresponding function to process
-     * the buffer contents.
+     * Make sure that the buffer has room for the remainder of the current
+     * message, moving the pending bytes to the front or growing the buffer
+     * if necessary.
      */
-    void received_to_barrier();
+    void make_room();
 
 public:
     /**
@@ -177,7 +268,8 @@ public:
      *
      * The function returns a pointer and a size. The size is the maximum
      * number of bytes the user is allowed to write to the memory pointed to
-     * by the pointer.
+     * by the pointer; it is never zero and spans all free space of the
+     * receive buffer.
      *
      * After data has been written, written() must be called to commit it.
      */
@@ -204,6 +296,9 @@ public:
      * returned buffer. The user must not write further data to the buffer
      * after the call to written().
      *
+     * All messages which are complete after the write are parsed and
+     * dispatched before written() returns.
+     *
      * If more data arrives, the user must use next_buffer() to get a new
      * pointer-size-pair.
      *
@@ -216,8 +311,116 @@ public:
 };
 
 
+/**
+ * A NetFrameBuilder serialises outgoing messages into the shim protocol read
+ * by NetMessageParser.
+ *
+ * Messages are serialised directly into a list of reusable segments, without
+ * intermediate copies. Data is handed to the socket by requesting the pending
+ * segments as an iovec array (see pending()), passing that to writev() (or a
+ * similar function) and committing the number of bytes which have actually
+ * been sent using consume(). Thus, all messages produced during a game frame
+ * can be sent with a single system call; if the socket does not accept all
+ * data, the remainder is kept until the socket becomes writable again.
+ *
+ * Segments which have been sent completely are kept for reuse, so that in
+ * steady state, building frames does not allocate.
+ *
+ * The NetFrameBuilder is not thread-safe.
+ */
+class NetFrameBuilder
+{
+public:
+    // default size of a segment; larger messages get a segment of their own
+    static constexpr size_t SEGMENT_SIZE = 16384;
+
+    // number of sent segments which are kept for reuse
+    static constexpr size_t MAX_FREE_SEGMENTS = 4;
+
+public:
+    NetFrameBuilder();
+    NetFrameBuilder(const NetFrameBuilder &ref) = delete;
+    NetFrameBuilder &operator=(const NetFrameBuilder &ref) = delete;
+
+private:
+    struct Segment
+    {
+        std::unique_ptr<char[]> data;
+        size_t capacity;
+        size_t size;
+    };
+
+    /**
+     * Segments with pending data, in sending order.
+     */
+    std::deque<Segment> m_segments;
+
+    /**
+     * Number of bytes of the front segment which have been sent already.
+     */
+    size_t m_send_offset;
+
+    size_t m_pending_bytes;
+
+    std::vector<Segment> m_free_segments;
+
+private:
+    /**
+     * Return a pointer to \a size bytes at the end of the last segment,
+     * starting a new segment if necessary.
+     */
+    char *reserve(const size_t size);
+
+public:
+    /**
+     * Serialise \a msg as a message of class \a msgclass into the pending
+     * data.
+     *
+     * @throws std::length_error if the message exceeds
+     * NetMessageParser::MAX_MESSAGE_SIZE.
+     */
+    void append(const NetMessageClass msgclass,
+                const google::protobuf::Message &msg);
+
+    /**
+     * Discard all pending data.
+     */
+    void clear();
+
+    /**
+     * Mark the first \a bytes bytes of the pending data as sent.
+     *
+     * @param bytes Number of bytes sent; must not be larger than
+     * pending_bytes().
+     */
+    void consume(size_t bytes);
+
+    /**
+     * Fill \a iov with at most \a max_iov buffers describing the pending
+     * data, in sending order.
+     *
+     * @return The number of buffers filled in; zero if no data is pending.
+     */
+    int pending(struct iovec *iov, const int max_iov) const;
+
+    /**
+     * Number of bytes which have been appended, but not consumed yet.
+     */
+    inline size_t pending_bytes() const
+    {
+        return m_pending_bytes;
+    }
+
+};
+
+
 class NetServerClient: public ServerClientBase
 {
+public:
+    // clients with more unsent data than this are disconnected, including
+    // the data buffered by the socket
+    static constexpr size_t MAX_PENDING_BYTES = 8*1024*1024;
+
 public:
     explicit NetServerClient(QTcpSocket &socket, QObject *parent = 0);
     NetServerClient(const NetServerClient &ref) = delete;
@@ -232,13 +435,16 @@ private:
     const uint64_t m_connection_id;
     bool m_terminated;
     QTcpSocket &m_socket;
-    std::string m_send_buffer;
     sigc::signal<void> m_sig_disconnected;
     NetMessageParser m_message_parser;
 
+    /* guarded by m_send_mutex */
+    std::mutex m_send_mutex;
+    NetFrameBuilder m_send_frames;
+
 private:
     void fail();
-    void link_control_received(std::unique_ptr<messages::NetWorldControl> &&msg);
+    void link_control_received(std::shared_ptr<messages::NetWorldControl> &&msg);
 
 protected:
     bool msg_unhandled(AbstractMessagePtr &&msg) override;
@@ -253,6 +459,8 @@ public slots:
     void terminate() override;
 
 public:
+    void send_message(const messages::WorldCommandResponse &msg) override;
+    void send_message(const messages::ReplicationUpdate &msg) override;
     void set_message_handler(IMessageHandler *handler) override;
 
 };
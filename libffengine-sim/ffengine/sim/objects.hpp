@@ -30,7 +30,6 @@ the AUTHORS file.
 #include <list>
 #include <memory>
 #include <ostream>
-#include <unordered_set>
 #include <vector>
 
 
@@ -105,9 +104,17 @@ public:
      */
     virtual ~Object();
 
+    Object(const Object &ref) = delete;
+    Object &operator=(const Object &ref) = delete;
+
 private:
     ID m_object_id;
-    std::unordered_set<abstract_object_ptr*> m_referees;
+
+    /**
+     * Head of the intrusive list of the alive object_ptr instances referring
+     * to this object.
+     */
+    abstract_object_ptr *m_referees;
 
 public:
     /**
@@ -121,56 +128,159 @@ public:
         return m_object_id;
     }
 
-    template <typename T> friend class object_ptr;
+    friend class abstract_object_ptr;
 };
 
 
 /**
  * Implementation detail
+ *
+ * Alive pointers are linked into a doubly-linked list per object, threaded
+ * through the pointers themselves, so that creating, moving and destroying
+ * a pointer takes constant time and does not allocate. A moved-to pointer
+ * takes over the position of its source in the list.
  */
 class abstract_object_ptr
 {
 public:
     explicit abstract_object_ptr(std::nullptr_t = nullptr):
-        m_object(nullptr)
+        m_object(nullptr),
+        m_prev_referee(nullptr),
+        m_next_referee(nullptr)
     {
 
     }
 
     explicit abstract_object_ptr(Object &obj):
-        m_object(&obj)
+        m_object(&obj),
+        m_prev_referee(nullptr),
+        m_next_referee(nullptr)
     {
+        link();
+    }
 
+    abstract_object_ptr(const abstract_object_ptr &ref):
+        m_object(ref.m_object),
+        m_prev_referee(nullptr),
+        m_next_referee(nullptr)
+    {
+        if (m_object) {
+            link();
+        }
     }
 
-    abstract_object_ptr(const abstract_object_ptr &ref) = default;
-    abstract_object_ptr& operator=(const abstract_object_ptr &ref) = default;
+    abstract_object_ptr &operator=(const abstract_object_ptr &ref)
+    {
+        if (m_object == ref.m_object) {
+            return *this;
+        }
+        if (m_object) {
+            unlink();
+        }
+        m_object = ref.m_object;
+        if (m_object) {
+            link();
+        }
+        return *this;
+    }
 
     abstract_object_ptr(abstract_object_ptr &&src):
-        m_object(src.m_object)
+        m_object(src.m_object),
+        m_prev_referee(nullptr),
+        m_next_referee(nullptr)
     {
-        src.m_object = nullptr;
+        if (m_object) {
+            take_over(src);
+        }
     }
 
     abstract_object_ptr &operator=(abstract_object_ptr &&src)
     {
+        if (this == &src) {
+            return *this;
+        }
+        if (m_object) {
+            unlink();
+        }
         m_object = src.m_object;
-        src.m_object = nullptr;
+        if (m_object) {
+            take_over(src);
+        }
         return *this;
     }
 
     abstract_object_ptr &operator=(std::nullptr_t)
     {
-        m_object = nullptr;
+        if (m_object) {
+            unlink();
+            m_object = nullptr;
+        }
         return *this;
     }
 
+    ~abstract_object_ptr()
+    {
+        if (m_object) {
+            unlink();
+        }
+    }
+
 protected:
     Object *m_object;
 
+private:
+    abstract_object_ptr *m_prev_referee;
+    abstract_object_ptr *m_next_referee;
+
+    void link()
+    {
+        m_next_referee = m_object->m_referees;
+        if (m_next_referee) {
+            m_next_referee->m_prev_referee = this;
+        }
+        m_object->m_referees = this;
+    }
+
+    void unlink()
+    {
+        if (m_prev_referee) {
+            m_prev_referee->m_next_referee = m_next_referee;
+        } else {
+            m_object->m_referees = m_next_referee;
+        }
+        if (m_next_referee) {
+            m_next_referee->m_prev_referee = m_prev_referee;
+        }
+        m_prev_referee = nullptr;
+        m_next_referee = nullptr;
+    }
+
+    /**
+     * Replace the alive \a src, which refers to m_object, in the list of
+     * referees and make \a src null.
+     */
+    void take_over(abstract_object_ptr &src)
+    {
+        m_prev_referee = src.m_prev_referee;
+        m_next_referee = src.m_next_referee;
+        if (m_prev_referee) {
+            m_prev_referee->m_next_referee = this;
+        } else {
+            m_object->m_referees = this;
+        }
+        if (m_next_referee) {
+            m_next_referee->m_prev_referee = this;
+        }
+        src.m_object = nullptr;
+        src.m_prev_referee = nullptr;
+        src.m_next_referee = nullptr;
+    }
+
     void kill()
     {
         m_object = nullptr;
+        m_prev_referee = nullptr;
+        m_next_referee = nullptr;
     }
 
     friend class Object;
@@ -227,9 +337,10 @@ protected:
  *
  * Using object_ptr comes with a certain performance penalty, as objects
  * need to be able to notify object_ptr instances of their deletion. Thus,
- * objects keep a set of object_ptr instances referring to them and walk over
- * that set when they are deleted. In addition, copying, creating or deleting
- * an alive object_ptr mutates such a set.
+ * objects keep an intrusive list of the object_ptr instances referring to
+ * them and walk over that list when they are deleted. Copying, creating,
+ * moving or deleting an alive object_ptr links or unlinks it in constant
+ * time, without allocating.
  *
  * @see ObjectManager
  */
@@ -259,9 +370,7 @@ public:
         m_null(src.m_null),
         m_object_id(src.m_object_id)
     {
-        if (m_object) {
-            add(this);
-        }
+
     }
 
     /**
@@ -276,7 +385,7 @@ public:
         m_null(false),
         m_object_id(object.object_id())
     {
-        add(this);
+
     }
 
     /**
@@ -294,9 +403,7 @@ public:
         m_null(src.m_null),
         m_object_id(src.m_object_id)
     {
-        if (m_object) {
-            add(this);
-        }
+
     }
 
     /**
@@ -312,10 +419,6 @@ public:
         m_null(src.m_null),
         m_object_id(src.m_object_id)
     {
-        if (m_object) {
-            remove(&src);
-            add(this);
-        }
         src.m_null = true;
     }
 
@@ -336,10 +439,6 @@ public:
         m_null(src.m_null),
         m_object_id(src.m_object_id)
     {
-        if (m_object) {
-            remove(&src);
-            add(this);
-        }
         src.m_null = true;
     }
 
@@ -348,18 +447,9 @@ public:
      */
     object_ptr &operator=(const object_ptr &src)
     {
-        if (m_object) {
-            remove(this);
-        }
-
         abstract_object_ptr::operator=(src);
         m_object_id = src.m_object_id;
         m_null = src.m_null;
-
-        if (m_object) {
-            add(this);
-        }
-
         return *this;
     }
 
@@ -373,18 +463,9 @@ public:
     template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
     object_ptr &operator=(const object_ptr<U> &src)
     {
-        if (m_object) {
-            remove(this);
-        }
-
         abstract_object_ptr::operator=(src);
         m_object_id = src.m_object_id;
         m_null = src.m_null;
-
-        if (m_object) {
-            add(this);
-        }
-
         return *this;
     }
 
@@ -393,21 +474,13 @@ public:
      */
     object_ptr &operator=(object_ptr &&src)
     {
-        if (m_object) {
-            remove(this);
-        }
-        if (src.m_object) {
-            src.remove(&src);
+        if (&src == this) {
+            return *this;
         }
         abstract_object_ptr::operator=(std::move(src));
         m_object_id = src.m_object_id;
         m_null = src.m_null;
         src.m_null = true;
-
-        if (m_object) {
-            add(this);
-        }
-
         return *this;
     }
 
@@ -421,21 +494,10 @@ public:
     template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
     object_ptr &operator=(object_ptr<U> &&src)
     {
-        if (m_object) {
-            remove(this);
-        }
-        if (src.m_object) {
-            src.remove(&src);
-        }
         abstract_object_ptr::operator=(std::move(src));
         m_object_id = src.m_object_id;
         m_null = src.m_null;
         src.m_null = true;
-
-        if (m_object) {
-            add(this);
-        }
-
         return *this;
     }
 
@@ -444,37 +506,16 @@ public:
      */
     object_ptr &operator=(std::nullptr_t)
     {
-        if (m_object) {
-            remove(this);
-        }
         abstract_object_ptr::operator=(nullptr);
         m_null = true;
         m_object_id = Object::NULL_OBJECT_ID;
         return *this;
     }
 
-    ~object_ptr()
-    {
-        if (m_object) {
-            remove(this);
-        }
-    }
-
 private:
     bool m_null;
     Object::ID m_object_id;
 
-    void add(abstract_object_ptr *ptr)
-    {
-        m_object->m_referees.emplace(ptr);
-    }
-
-    void remove(abstract_object_ptr *ptr)
-    {
-        auto iter = m_object->m_referees.find(ptr);
-        m_object->m_referees.erase(iter);
-    }
-
 public:
     /**
      * Return the object this pointer points to.
@@ -496,9 +537,8 @@ public:
     {
         T* result = get();
         if (result) {
-            remove(this);
+            abstract_object_ptr::operator=(nullptr);
             m_null = true;
-            m_object = nullptr;
         }
         return result;
     }
@@ -575,33 +615,54 @@ static inline object_ptr<U> dynamic_object_cast(object_ptr<T> &&src)
  * The manager also owns the Object instances. All game objects which need to
  * be addressable over the network must be derived from Object.
  *
+ * Objects are stored in a two-level page table: a directory of page
+ * pointers, indexed by the upper bits of the ID, and pages of PAGE_SIZE
+ * object slots, indexed by the lower bits. Pages are allocated when the
+ * first object in their range is created and released when the last one is
+ * killed, and growing the directory only moves the page pointers. Thus,
+ * lookups take constant time and the memory used is proportional to the
+ * number of pages with live objects, plus one pointer per page up to the
+ * highest ID in use. IDs are limited to MAX_OBJECT_ID to bound the size of
+ * the directory.
+ *
  * The ObjectManager is not thread-safe.
  */
 class ObjectManager
 {
+public:
+    /**
+     * Number of object slots in a page.
+     */
+    static constexpr std::size_t PAGE_SIZE = 4096;
+
+    /**
+     * Maximum number of pages, and thus of entries in the directory.
+     */
+    static constexpr std::size_t MAX_PAGES = std::size_t(1) << 20;
+
+    /**
+     * Largest Object::ID which can be used in an ObjectManager.
+     */
+    static constexpr Object::ID MAX_OBJECT_ID = Object::ID(PAGE_SIZE) * MAX_PAGES;
+
 private:
     /**
-     * A chunk of object pointers. Chunks are allocated at once and filled with
-     * objects as needed.
+     * A page of object slots.
      */
-    struct Chunk
+    struct Page
     {
         /**
-         * Number of objects in a single chunk.
+         * Array of objects in this page.
          *
-         * This number is chosen arbitrarily. It should be a power of two, although
-         * this is not a strict requirement. It is probably helpful if the size of
-         * Chunk matches the page size (which it doesn’t, on AMD64, currently).
+         * The array can be indexed using the IDs. The addressing of objects
+         * within pages is implementation-defined by the ObjectManager.
          */
-        static constexpr std::size_t CHUNK_SIZE = 4096;
+        std::array<std::unique_ptr<Object>, PAGE_SIZE> objects;
 
         /**
-         * Array of objects in this chunk.
-         *
-         * The array can be indexed using the IDs. The addressing of objects
-         * within chunks is implementation-defined by the ObjectManager.
+         * Number of non-null entries in objects.
          */
-        std::array<std::unique_ptr<Object>, CHUNK_SIZE> objects;
+        std::size_t live;
     };
 
     /**
@@ -625,31 +686,36 @@ public:
     ObjectManager();
 
 private:
-    std::vector<Chunk> m_chunks;
+    /**
+     * The page directory; null entries are pages without live objects.
+     * Trailing null entries are removed.
+     */
+    std::vector<std::unique_ptr<Page> > m_pages;
+    std::size_t m_allocated_pages;
     std::vector<IDRegion> m_free_list;
 
 private:
     /**
-     * Return a pointer to the ObjectChunk which holds the given Object::ID.
+     * Return a pointer to the Page which holds the given Object::ID.
      *
-     * If the addressed Object::ID is out of the currently reserved range,
-     * nullptr is returned. If the \a object_id is the NULL_OBJECT_ID, nullptr
-     * is returned.
+     * If the page is not allocated or \a object_id is the NULL_OBJECT_ID,
+     * nullptr is returned.
      *
      * @param object_id Object::ID to look up
-     * @return Pointer to the ObjectChunk or nullptr.
+     * @return Pointer to the Page or nullptr.
      */
-    const Chunk *get_object_chunk(Object::ID object_id) const;
-    Chunk *get_object_chunk(Object::ID object_id);
+    const Page *get_page(Object::ID object_id) const;
+    Page *get_page(Object::ID object_id);
 
     /**
      * Return the a pointer to the std::unique_ptr for the object with the
      * given Object::ID.
      *
-     * If the Object::ID \a object_id is NULL_OBJECT_ID, nullptr is returned.
-     * Otherwise, a pointer to a valid std::unique_ptr instance is returned.
-     * That instance may itself be a nullptr, if no object is currently
-     * associated with the given object id.
+     * If the Object::ID \a object_id is NULL_OBJECT_ID or its page is not
+     * allocated, nullptr is returned. Otherwise, a pointer to a valid
+     * std::unique_ptr instance is returned. That instance may itself be a
+     * nullptr, if no object is currently associated with the given object
+     * id.
      *
      * @param object_id Object::ID to look up
      * @return Pointer to an std::unique_ptr object for the object or nullptr.
@@ -658,33 +724,25 @@ private:
     std::unique_ptr<Object> *get_object_ptr(Object::ID object_id);
 
     /**
-     * Return a reference to the ObjectChunk which holds the given Object::ID.
+     * Return a reference to the Page which holds the given Object::ID.
      *
-     * If the addressed Object::ID is out of the currently reserved range,
-     * the range is extended accordingly. If \a object_id is NULL_OBJECT_ID,
-     * std::runtime_error is thrown.
+     * If the page is not allocated yet, it is allocated and the directory is
+     * extended accordingly. If \a object_id is NULL_OBJECT_ID or larger than
+     * MAX_OBJECT_ID, std::runtime_error is thrown.
      *
      * @param object_id Object::ID to look up
-     * @return Pointer to the ObjectChunk or nullptr.
-     * @throws std::runtime_error if \a object_id is NULL_OBJECT_ID.
+     * @return Reference to the Page.
+     * @throws std::runtime_error if \a object_id is out of range.
      */
-    Chunk &require_object_chunk(Object::ID object_id);
+    Page &require_page(Object::ID object_id);
 
     /**
-     * Return the a reference to the std::unique_ptr for the object with the
-     * given Object::ID.
-     *
-     * If the Object::ID is out of the currently reserved range, the range is
-     * extended to cover the Object::ID. This results in a possibly large
-     * reallocation.
-     *
-     * If the Object::ID is the NULL_OBJECT_ID, std::runtime_error is thrown.
+     * Store \a obj in the empty slot of its Object::ID, allocating the page
+     * if necessary.
      *
-     * @param object_id Object::ID to look up
-     * @return Pointer to an std::unique_ptr object for the object or nullptr.
-     * @throws std::runtime_error if the Object::ID is NULL_OBJECT_ID.
+     * @throws std::runtime_error if the Object::ID is out of range.
      */
-    std::unique_ptr<Object> &require_object_ptr(Object::ID object_id);
+    void store_object(std::unique_ptr<Object> &&obj);
 
 protected:
     /**
@@ -702,10 +760,11 @@ protected:
      * Emplace the given object into the ObjectManager.
      *
      * If the object refers to an Object::ID which is already in use in this
-     * ObjectManager, std::runtime_error is thrown.
+     * ObjectManager or is larger than MAX_OBJECT_ID, std::runtime_error is
+     * thrown.
      *
      * @param obj Object to emplace.
-     * @throws std::runtime_error on ID conflict.
+     * @throws std::runtime_error on ID conflict or out-of-range ID.
      */
     void emplace_object(std::unique_ptr<Object> &&obj);
 
@@ -765,9 +824,8 @@ public:
      * constructor of \a T and those exceptions also propagate unchanged.
      *
      * If the ObjectManager runs out of IDs, std::runtime_error is thrown and
-     * you are doomed. IDs are 64 bit integers. You do not simply run out of
-     * 64 bit integers to identify objects. You simply cannot on current
-     * architectures.
+     * you are doomed. There are MAX_OBJECT_ID IDs; you run out of memory for
+     * the objects long before you run out of IDs.
      *
      * @return Reference to the new \a T instance.
      * @throws std::runtime_error If the ObjectManager runs out of IDs.
@@ -799,8 +857,8 @@ public:
      * pulling the Object::ID from the internal pool of unused IDs, the given
      * ID is used.
      *
-     * If the ID is already in use by a different object, std::runtime_error
-     * is thrown.
+     * If the ID is already in use by a different object or larger than
+     * MAX_OBJECT_ID, std::runtime_error is thrown.
      *
      * If the requested ID is equal to Object::NULL_OBJECT_ID, the call
      * behaves like allocate() and sources an unused ID from the allocation
@@ -924,6 +982,22 @@ public:
      */
     std::ostream &dump_free_list(std::ostream &out);
 
+    /**
+     * Number of currently allocated pages.
+     */
+    inline std::size_t allocated_pages() const
+    {
+        return m_allocated_pages;
+    }
+
+    /**
+     * Number of entries in the page directory.
+     */
+    inline std::size_t directory_size() const
+    {
+        return m_pages.size();
+    }
+
     /**@}*/
 };
 
@@ -0,0 +1,344 @@
+/**********************************************************************
+File name: replication.hpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#ifndef SCC_SIM_REPLICATION_H
+#define SCC_SIM_REPLICATION_H
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ffengine/sim/world_view.hpp"
+
+
+namespace sim {
+
+namespace messages {
+
+class ReplicationFeedback;
+class ReplicationUpdate;
+
+}
+
+/**
+ * Quantise a terrain height to 16 bit, covering the range from
+ * Terrain::min_height to Terrain::max_height.
+ */
+std::uint16_t quantize_height(const Terrain::height_t height);
+
+/**
+ * Inverse of quantize_height().
+ */
+Terrain::height_t dequantize_height(const std::uint16_t value);
+
+/**
+ * Encode \a count quantised heights into \a dest.
+ *
+ * Each value is predicted by the corresponding value of \a base, if given,
+ * or by the preceding value otherwise. The residuals (modulo 2^16) are
+ * zigzag-encoded and stored as alternating runs: a varint with the number of
+ * zero residuals, a varint with the number of non-zero residuals, followed by
+ * those residuals as varints. Small, local changes against a base thus
+ * encode to a few bytes, and smooth terrain encodes to about one byte per
+ * cell without a base.
+ *
+ * @param values Values to encode.
+ * @param base Values to encode against, or null.
+ * @param count Number of values in \a values and \a base.
+ * @param dest Receives the encoded data; it is replaced.
+ */
+void encode_height_tile(const std::uint16_t *values,
+                        const std::uint16_t *base,
+                        const std::size_t count,
+                        std::string &dest);
+
+/**
+ * Decode data produced by encode_height_tile().
+ *
+ * @param src Encoded data.
+ * @param base The values the data was encoded against, or null.
+ * @param values Receives \a count decoded values; may be the same as \a base.
+ * @param count Number of values.
+ * @return false if the data is malformed or does not contain exactly
+ * \a count values.
+ */
+bool decode_height_tile(const std::string &src,
+                        const std::uint16_t *base,
+                        std::uint16_t *values,
+                        const std::size_t count);
+
+
+/**
+ * Server side state of the world replication to a single client.
+ *
+ * The session keeps track of the part of the terrain the client is
+ * interested in: the views reported by the client, extended by a margin
+ * so that data is available before it scrolls into view. A client which
+ * has not reported any views is interested in the whole terrain.
+ *
+ * Tiles within the interest which may differ from the data sent to the
+ * client are kept in a dirty set; after a change of the interest, all tiles
+ * in it are dirty, and the owner marks tiles dirty as they change (see
+ * mark_dirty() and InterestGrid). For each frame, build_update() encodes
+ * the dirty tiles which actually differ, delta-encoded against the data the
+ * client has. Tiles overlapping a view are sent first, followed by the
+ * others in order of their distance to the views. Tiles outside the
+ * interest are not sent at all, so that the cost of a session scales with
+ * what the client sees rather than with the activity in the world.
+ *
+ * The amount of data per update and the amount of data sent but not yet
+ * acknowledged by the client are bounded, so that a joining client receives
+ * its surroundings progressively and a slow client does not build up an
+ * ever-growing backlog.
+ *
+ * As updates are delivered in order over a reliable stream, the client
+ * always has the data the server sent last when it decodes a delta; the
+ * acknowledgements are only used for flow control.
+ *
+ * The ReplicationSession is not thread-safe.
+ */
+class ReplicationSession
+{
+public:
+    static constexpr std::size_t DEFAULT_UPDATE_BUDGET = 32*1024;
+    static constexpr std::size_t DEFAULT_WINDOW = 256*1024;
+    static constexpr unsigned int DEFAULT_INTEREST_MARGIN = WorldView::TILE_SIZE;
+    // views beyond this number are ignored
+    static constexpr int MAX_VIEWS = 8;
+
+public:
+    /**
+     * @param update_budget Maximum number of tile and fluid summary bytes
+     * per update; an update contains at least one tile though, if one is
+     * pending and the window permits.
+     * @param window Maximum number of bytes sent, but not acknowledged.
+     * @param interest_margin Number of cells by which the views of the
+     * client are extended to obtain its interest.
+     */
+    explicit ReplicationSession(
+            const std::size_t update_budget = DEFAULT_UPDATE_BUDGET,
+            const std::size_t window = DEFAULT_WINDOW,
+            const unsigned int interest_margin = DEFAULT_INTEREST_MARGIN);
+
+private:
+    struct SentTile
+    {
+        std::shared_ptr<const WorldView::HeightTile> data;
+        std::uint64_t version;
+    };
+
+    const std::size_t m_update_budget;
+    const std::size_t m_window;
+    const unsigned int m_interest_margin;
+
+    unsigned int m_terrain_size;
+    unsigned int m_tiles_per_axis;
+    std::vector<SentTile> m_sent_tiles;
+    std::vector<FluidBlockSummary> m_sent_fluid;
+    /**
+     * Index of the fluid block at which the next update starts looking for
+     * changed blocks.
+     */
+    unsigned int m_fluid_cursor;
+
+    std::vector<TerrainRect> m_views;
+    std::vector<TerrainRect> m_interest;
+    std::uint64_t m_interest_generation;
+
+    /**
+     * Dirty flag per tile, and the indices of the dirty tiles.
+     */
+    std::vector<bool> m_dirty;
+    std::vector<unsigned int> m_dirty_tiles;
+
+    /**
+     * Frame numbers and sizes of the updates which have not been
+     * acknowledged yet, oldest first.
+     */
+    std::deque<std::pair<std::uint64_t, std::size_t> > m_unacked;
+    std::size_t m_bytes_in_flight;
+
+    /* buffers reused between updates */
+    std::vector<std::uint16_t> m_quantized;
+    std::vector<std::uint16_t> m_quantized_base;
+    std::vector<std::pair<std::uint64_t, unsigned int> > m_candidates;
+
+private:
+    bool in_interest(const TerrainRect &rect) const;
+    void reset(const unsigned int terrain_size);
+    std::uint64_t tile_priority(const TerrainRect &rect) const;
+    void update_interest();
+
+public:
+    inline std::size_t bytes_in_flight() const
+    {
+        return m_bytes_in_flight;
+    }
+
+    /**
+     * The views last reported by the client.
+     */
+    inline const std::vector<TerrainRect> &views() const
+    {
+        return m_views;
+    }
+
+    /**
+     * The area of the terrain the client is interested in; empty until the
+     * terrain size is known from the first build_update().
+     */
+    inline const std::vector<TerrainRect> &interest() const
+    {
+        return m_interest;
+    }
+
+    /**
+     * Incremented whenever interest() changes.
+     */
+    inline std::uint64_t interest_generation() const
+    {
+        return m_interest_generation;
+    }
+
+    /**
+     * Process feedback of the client: acknowledged updates and the areas it
+     * looks at.
+     */
+    void feedback(const messages::ReplicationFeedback &msg);
+
+    /**
+     * Mark a tile as possibly changed; this must be called for all tiles
+     * within interest() which change in a frame before build_update() is
+     * called for that frame. Out-of-range tiles are ignored.
+     */
+    void mark_dirty(const unsigned int tx, const unsigned int ty);
+
+    /**
+     * Build the update for the given \a view into \a dest.
+     *
+     * @return true if \a dest contains anything which needs to be sent.
+     */
+    bool build_update(const WorldView &view,
+                      messages::ReplicationUpdate &dest);
+
+};
+
+
+/**
+ * Client side copy of the replicated world state.
+ *
+ * The WorldReplica applies the updates built by a ReplicationSession and
+ * produces the feedback for the server.
+ */
+class WorldReplica
+{
+public:
+    WorldReplica();
+
+private:
+    struct Tile
+    {
+        std::vector<std::uint16_t> values;
+        std::uint64_t version;
+    };
+
+    std::uint64_t m_frame;
+    unsigned int m_terrain_size;
+    unsigned int m_tiles_per_axis;
+    std::vector<Tile> m_tiles;
+    unsigned int m_fluid_blocks_per_axis;
+    std::vector<FluidBlockSummary> m_fluid_blocks;
+
+public:
+    /**
+     * Frame of the most recently applied update.
+     */
+    inline std::uint64_t frame() const
+    {
+        return m_frame;
+    }
+
+    inline unsigned int terrain_size() const
+    {
+        return m_terrain_size;
+    }
+
+    inline unsigned int tiles_per_axis() const
+    {
+        return m_tiles_per_axis;
+    }
+
+    inline unsigned int fluid_blocks_per_axis() const
+    {
+        return m_fluid_blocks_per_axis;
+    }
+
+    inline const std::vector<FluidBlockSummary> &fluid_blocks() const
+    {
+        return m_fluid_blocks;
+    }
+
+    /**
+     * Return true if the tile has been received.
+     */
+    bool has_tile(const unsigned int tx, const unsigned int ty) const;
+
+    /**
+     * Return the version of the tile, or zero if it has not been received.
+     */
+    std::uint64_t tile_version(const unsigned int tx,
+                               const unsigned int ty) const;
+
+    /**
+     * Return the height at the given cell; the tile of the cell must have
+     * been received.
+     */
+    Terrain::height_t height(const unsigned int x, const unsigned int y) const;
+
+    /**
+     * Apply an update.
+     *
+     * @return false if the update is inconsistent with the replica (e.g. a
+     * delta against a version which the replica does not have) or
+     * malformed. The replica may have been partially updated in that case.
+     */
+    bool apply(const messages::ReplicationUpdate &update);
+
+    /**
+     * Fill \a dest with the feedback acknowledging all applied updates and
+     * reporting the areas the client looks at.
+     *
+     * @param views Areas the client looks at; if empty, the previously
+     * reported views stay in effect.
+     * @param dest Message to fill.
+     */
+    void feedback(const std::vector<TerrainRect> &views,
+                  messages::ReplicationFeedback &dest) const;
+
+};
+
+}
+
+#endif
@@ -26,23 +26,44 @@ the AUTHORS file.
 
 #include <sigc++/sigc++.h>
 
+#include <condition_variable>
+#include <functional>
 #include <memory>
 #include <shared_mutex>
+#include <unordered_map>
 
 #include <google/protobuf/message.h>
 
 #include <QObject>
 
+#include "ffengine/common/epoch.hpp"
+#include "ffengine/common/mpsc_queue.hpp"
+
+#include "ffengine/sim/command_log.hpp"
+#include "ffengine/sim/frame_timing.hpp"
+#include "ffengine/sim/interest.hpp"
+#include "ffengine/sim/journal.hpp"
+#include "ffengine/sim/replication.hpp"
 #include "ffengine/sim/world.hpp"
+#include "ffengine/sim/world_view.hpp"
 
 
 namespace sim {
 
-typedef std::unique_ptr<google::protobuf::Message> AbstractMessagePtr;
+/**
+ * Messages are passed around as shared pointers, as they may be allocated on
+ * an arena shared with other messages (see NetMessageParser) and may be
+ * referenced by the objects created from them (see
+ * WorldOperation::from_message()).
+ */
+typedef std::shared_ptr<google::protobuf::Message> AbstractMessagePtr;
 
 namespace messages {
 
+class ReplicationFeedback;
+class ReplicationUpdate;
 class WorldCommand;
+class WorldCommandResponse;
 
 }
 
@@ -78,7 +99,31 @@ public:
      *
      * @param cmd The command message.
      */
-    virtual bool msg_world_command(std::unique_ptr<messages::WorldCommand> &&cmd);
+    virtual bool msg_world_command(std::shared_ptr<messages::WorldCommand> &&cmd);
+
+    /**
+     * Handle a messages::WorldCommandResponse message.
+     *
+     * @param response The response message.
+     */
+    virtual bool msg_world_command_response(
+            std::shared_ptr<messages::WorldCommandResponse> &&response);
+
+    /**
+     * Handle a messages::ReplicationUpdate message.
+     *
+     * @param update The update message.
+     */
+    virtual bool msg_replication_update(
+            std::shared_ptr<messages::ReplicationUpdate> &&update);
+
+    /**
+     * Handle a messages::ReplicationFeedback message.
+     *
+     * @param feedback The feedback message.
+     */
+    virtual bool msg_replication_feedback(
+            std::shared_ptr<messages::ReplicationFeedback> &&feedback);
 
 };
 
@@ -144,6 +189,42 @@ public slots:
     virtual void terminate() = 0;
 
 public:
+    /**
+     * Thread-safely request that flush() is called in the context of the
+     * client.
+     *
+     * The default implementation invokes flush() using
+     * Qt::QueuedConnection.
+     */
+    virtual void request_flush();
+
+    /**
+     * Thread-safely request that terminate() is called in the context of
+     * the client.
+     *
+     * The default implementation invokes terminate() using
+     * Qt::QueuedConnection.
+     */
+    virtual void request_terminate();
+
+    /**
+     * Thread-safely enqueue a response to a world command of the client.
+     *
+     * The message is sent on the next flush().
+     *
+     * @param msg The response to send.
+     */
+    virtual void send_message(const messages::WorldCommandResponse &msg) = 0;
+
+    /**
+     * Thread-safely enqueue a replication update for the client.
+     *
+     * The message is sent on the next flush().
+     *
+     * @param msg The update to send.
+     */
+    virtual void send_message(const messages::ReplicationUpdate &msg) = 0;
+
     /**
      * Set the message handler which receives incoming messages.
      *
@@ -157,13 +238,60 @@ public:
 };
 
 
+/**
+ * Identifies a client registered with Server::add_client().
+ */
+typedef std::uint64_t ServerClientID;
+
+/**
+ * Function called by the game thread with the result of an executed
+ * operation.
+ */
+typedef std::function<void(WorldOperationResult)> WorldOperationCallback;
+
+
 class Server
 {
 public:
     typedef std::shared_lock<std::shared_timed_mutex> SyncSafeLock;
+    typedef ffe::EpochPointer<WorldView>::Ref WorldViewRef;
+
+private:
+    struct QueuedOperation
+    {
+        WorldOperationPtr op;
+        WorldOperationCallback on_done;
+
+        /**
+         * Message representation of the operation, created by enqueue_op()
+         * while a command log is set; null otherwise and for operations
+         * without a message representation.
+         */
+        CommandLogWriter::CommandPtr command;
+    };
+
+    struct ClientEntry
+    {
+        ServerClientBase *client;
+
+        /**
+         * Created when the client sends its first replication feedback.
+         */
+        std::unique_ptr<ReplicationSession> replication;
+
+        /**
+         * ReplicationSession::interest_generation() of the interest which
+         * is registered in Server::m_interest.
+         */
+        std::uint64_t interest_generation;
+    };
 
 public:
-    Server();
+    /**
+     * @param frame_pacing Initial pacing policy; with FramePacing::MANUAL,
+     * no game frame runs before step() is called.
+     */
+    explicit Server(const FramePacing frame_pacing = FramePacing::CATCH_UP);
     ~Server();
 
 private:
@@ -171,18 +299,30 @@ private:
 
     /* guarded by m_clients_mutex */
     std::mutex m_clients_mutex;
-    std::vector<ServerClientBase*> m_client_interfaces;
+    ServerClientID m_next_client_id;
+    std::unordered_map<ServerClientID, ClientEntry> m_client_interfaces;
+    InterestGrid m_interest;
 
-    /* guarded by m_op_queue_mutex */
-    std::mutex m_op_queue_mutex;
-    std::vector<std::unique_ptr<WorldOperation> > m_op_queue;
+    /* filled by any thread, drained by m_game_thread */
+    ffe::MPSCQueue<QueuedOperation> m_op_queue;
 
-    std::atomic_bool m_terminated;
-    std::thread m_game_thread;
-
-    /* owned by m_game_thread */
-    std::vector<std::unique_ptr<WorldOperation> > m_op_buffer;
+    /* used by m_game_thread; must be constructed before the thread starts */
+    WorldJournal m_journal;
     Sandifier m_sandifier;
+    std::vector<QueuedOperation> m_op_buffer;
+    std::vector<QueuedOperation> m_deferred_ops;
+    std::vector<QueuedOperation> m_fused_ops;
+    std::vector<WorldOperationPtr> m_fusion_run;
+    std::unique_ptr<messages::ReplicationUpdate> m_replication_update;
+    std::vector<CommandLogWriter::CommandPtr> m_log_buffer;
+    std::vector<std::uint32_t> m_log_unfused;
+
+    /* guarded by m_command_log_mutex; m_command_logging is set while a log
+     * is set, so that enqueue_op() can skip serialisation otherwise */
+    std::mutex m_command_log_mutex;
+    std::unique_ptr<CommandLogWriter> m_command_log;
+    std::atomic_bool m_command_logging;
+    std::uint64_t m_unlogged_ops;
 
     /**
      * This mutex is used to put the Server into a state which is safe for
@@ -190,9 +330,84 @@ private:
      */
     std::shared_timed_mutex m_interframe_mutex;
 
+    /* published by m_game_thread, read by any thread */
+    ffe::EpochDomain m_view_domain;
+    ffe::EpochPointer<WorldView> m_view;
+
+    /* used by m_game_thread */
+    std::uint64_t m_frame;
+
+    /* terrain changes may be flushed from other threads (e.g. by
+     * Terrain::from_perlin() on a caller's thread), thus guarded by
+     * m_view_changes_mutex */
+    std::mutex m_view_changes_mutex;
+    TerrainRegion m_view_changes;
+    sigc::connection m_view_changes_conn;
+
+    /* written by m_game_thread, read by any thread */
+    FrameTimingBuffer m_frame_timings;
+
+    /* written by any thread, read by m_game_thread */
+    std::atomic<FramePacing> m_frame_pacing;
+    std::atomic_uint m_max_catch_up_frames;
+    std::atomic<std::chrono::milliseconds::rep> m_frame_timing_log_interval;
+
+    /* guarded by m_step_mutex; frames requested by step() while pacing is
+     * FramePacing::MANUAL */
+    std::mutex m_step_mutex;
+    std::condition_variable m_step_cv;
+    std::uint64_t m_steps_requested;
+    std::uint64_t m_steps_done;
+
+    std::atomic_bool m_terminated;
+    std::thread m_game_thread;
+
 protected:
-    void game_frame();
+    void execute_op(QueuedOperation &queued);
+    void flush_clients();
+    void fuse_ops();
+
+    /**
+     * Run one game frame.
+     *
+     * The frame consists of two stages:
+     *
+     * 1. While the fluid step started by the previous frame is still in
+     *    flight, all queued operations which touch neither the terrain nor
+     *    the fluid (see WorldOperation::resources()) are executed, followed
+     *    by the graph reshape. Operations which do touch them are deferred,
+     *    together with all later operations which share a resource with a
+     *    deferred operation, so that operations on the same data keep their
+     *    order.
+     * 2. Once the fluid step has finished, the deferred operations are
+     *    applied, terrain tiles are paged in, the Sandifier runs, terrain
+     *    changes are flushed and the next fluid step is started. Finally, a
+     *    new WorldView is published, replication updates are built for all
+     *    clients which requested replication (only considering the tiles
+     *    which changed within the interest of each client, see InterestGrid)
+     *    and all registered clients are flushed, so that the messages
+     *    produced during the frame are sent in one batch.
+     *
+     * If a command log is set, the operations taken from the queue are
+     * appended to it before they are fused, as one frame.
+     *
+     * The interframe lock is released while waiting for the fluid step.
+     *
+     * @param timing Receives the time spent in the individual stages.
+     */
+    void game_frame(FrameTiming &timing);
     void game_thread();
+    void log_commands();
+    void log_frame_timings();
+
+    /**
+     * Page in the tiles of an attached terrain file below the active fluid
+     * blocks, so that the fluid sim never runs on terrain which has not
+     * been loaded yet. Must be called while the fluid sim is stopped.
+     */
+    void page_in_fluid();
+    void publish_view(std::vector<FluidBlockSummary> &&fluid_blocks);
+    void terrain_changed(const TerrainRegion &region);
 
 public:
     inline WorldState &state()
@@ -212,16 +427,54 @@ public:
      * useful for actual client-server usage, but for local terraforming it
      * is quite handy.
      *
+     * This does not take any lock. If the operation queue is full, the
+     * call waits until the game thread has made room.
+     *
      * @param op Operation to execute in the next game frame.
      */
     void enqueue_op(std::unique_ptr<WorldOperation> &&op);
 
+    /**
+     * Thread-safely enqueue a world operation for the next game frame and
+     * report its result.
+     *
+     * Operations with a callback are not fused with other operations (see
+     * ops::fuse_brush_operations()), as each of them has to report its own
+     * result.
+     *
+     * @param op Operation to execute in the next game frame.
+     * @param on_done Function to call on the game thread once the
+     * operation has been executed.
+     */
+    void enqueue_op(std::unique_ptr<WorldOperation> &&op,
+                    WorldOperationCallback &&on_done);
+
+    /**
+     * Thread-safely enqueue undoing the most recent terrain or fluid
+     * modification for the next game frame.
+     *
+     * Undo and redo are executed as normal world operations.
+     *
+     * @see WorldJournal
+     */
+    void enqueue_undo();
+
+    /**
+     * Thread-safely enqueue redoing the most recently undone modification
+     * for the next game frame.
+     *
+     * @see enqueue_undo
+     */
+    void enqueue_redo();
+
     /**
      * Return a lock object on the WorldState and ensure that simulations are
      * in a state where their front buffers / data can be read safely.
      *
      * This makes sure that the game loop stops until all locks are released
      * and that all simulations are in a state where they are readable.
+     * Readers which only need the data contained in a WorldView should use
+     * view() instead, which never blocks the game loop.
      *
      * @return An opaque, movable object; it cannot be passed between threads.
      * As long as your thread holds such an object, it is safe to access the
@@ -229,6 +482,167 @@ public:
      */
     SyncSafeLock sync_safe_point();
 
+    /**
+     * Thread-safely register a client with the server.
+     *
+     * Registered clients are flushed at the end of each game frame and can
+     * be addressed by send_response().
+     *
+     * @param client The client; it must be removed using remove_client()
+     * before it is destroyed.
+     * @return An ID for the client, unique for the lifetime of the server.
+     */
+    ServerClientID add_client(ServerClientBase &client);
+
+    /**
+     * Thread-safely unregister a client.
+     *
+     * Once this returns, the server does not access the client anymore.
+     */
+    void remove_client(const ServerClientID client);
+
+    /**
+     * Thread-safely enqueue a response for a client.
+     *
+     * The response is sent when the client is flushed at the end of the
+     * current game frame. If the client has been removed in the meantime,
+     * the response is dropped.
+     */
+    void send_response(const ServerClientID client,
+                       const messages::WorldCommandResponse &response);
+
+    /**
+     * Thread-safely process replication feedback of a client.
+     *
+     * The first feedback enables the replication of the world state to the
+     * client: from then on, a messages::ReplicationUpdate is sent at the end
+     * of each game frame in which the client is missing data around the
+     * views it reported and its replication window permits (see
+     * ReplicationSession).
+     */
+    void replication_feedback(const ServerClientID client,
+                              const messages::ReplicationFeedback &feedback);
+
+    /**
+     * Thread-safely return the most recently published WorldView.
+     *
+     * This does not take any lock and does not delay the game loop. The view
+     * stays valid for as long as the returned reference is held; the game
+     * thread keeps publishing new views in the meantime. Holding a
+     * reference for many frames keeps old versions of the changed terrain
+     * tiles alive and eventually makes the game loop wait until it is
+     * released, so references should be dropped once the data has been
+     * read.
+     *
+     * The reference is null until the game thread has published the first
+     * view.
+     */
+    WorldViewRef view() const;
+
+    /**
+     * Thread-safely set the policy used when a game frame overruns its
+     * period.
+     *
+     * The new policy takes effect after the current frame.
+     *
+     * @param policy Pacing policy to use.
+     * @param max_catch_up_frames Number of frames which may be pending with
+     * FramePacing::CATCH_UP before frames are dropped.
+     */
+    void set_frame_pacing(const FramePacing policy,
+                          const unsigned int max_catch_up_frames = 4);
+
+    /**
+     * Run \a frames game frames and wait until they have completed.
+     *
+     * With FramePacing::MANUAL, frames run on request only and back to
+     * back; operations enqueued before the call are executed in the first
+     * of the frames. With other policies, this waits until \a frames frames
+     * have run on their schedule.
+     *
+     * This must not be called from the game thread.
+     */
+    void step(const unsigned int frames = 1);
+
+    /**
+     * Thread-safely set the log to which the operations executed by the
+     * server are appended.
+     *
+     * While a log is set, enqueue_op() converts each operation into its
+     * message representation (see WorldOperation::to_message()), so that
+     * the game thread only has to hand the commands to the log writer.
+     * Operations without a message representation are not logged.
+     *
+     * @param log The log to use, or null to stop logging. The previous log,
+     * if any, is destroyed, which writes its remaining frames.
+     */
+    void set_command_log(std::unique_ptr<CommandLogWriter> &&log);
+
+    /**
+     * Thread-safely set the interval at which a summary of the recent frame
+     * timings is logged.
+     *
+     * @param interval Interval between summaries; a zero interval (the
+     * default) disables logging.
+     */
+    void set_frame_timing_log_interval(const std::chrono::milliseconds interval);
+
+    /**
+     * Thread-safely return the timings of the most recent game frames,
+     * oldest first.
+     */
+    std::vector<FrameTiming> recent_frame_timings() const;
+
+    /**
+     * Thread-safely compute the frame time percentiles over the most recent
+     * game frames.
+     */
+    FrameTimingSummary frame_timing_summary() const;
+
+};
+
+
+/**
+ * Message handler which converts world commands into WorldOperations and
+ * enqueues them on a Server.
+ *
+ * The operations borrow bulk data from the messages (see
+ * WorldOperation::from_message()). Commands which cannot be converted and
+ * commands which carry a role (which only servers may set) are rejected.
+ *
+ * For commands which carry a token, a messages::WorldCommandResponse with the
+ * result of the operation is sent to the client at the end of the game frame
+ * in which the operation has been executed.
+ *
+ * Replication feedback is forwarded to Server::replication_feedback().
+ */
+class ServerCommandHandler: public IMessageHandler
+{
+public:
+    /**
+     * Register \a client with \a server and handle the messages of the
+     * client.
+     *
+     * The handler must be destroyed before the client; it unregisters the
+     * client from the server.
+     */
+    ServerCommandHandler(Server &server, ServerClientBase &client);
+    ServerCommandHandler(const ServerCommandHandler &ref) = delete;
+    ServerCommandHandler &operator=(const ServerCommandHandler &ref) = delete;
+    ~ServerCommandHandler() override;
+
+private:
+    Server &m_server;
+    const ServerClientID m_client_id;
+
+protected:
+    bool msg_unhandled(AbstractMessagePtr &&msg) override;
+
+public:
+    bool msg_world_command(std::shared_ptr<messages::WorldCommand> &&cmd) override;
+    bool msg_replication_feedback(
+            std::shared_ptr<messages::ReplicationFeedback> &&feedback) override;
+
 };
 
 
@@ -27,6 +27,10 @@ the AUTHORS file.
 #include <chrono>
 #include <condition_variable>
 #include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <shared_mutex>
 #include <string>
 #include <thread>
@@ -50,6 +54,86 @@ extern io::Logger &lod_logger;
 
 typedef GenericRect<unsigned int> TerrainRect;
 
+class TerrainFile;
+
+
+/**
+ * A set of disjoint rectangles on the terrain.
+ *
+ * Rectangles added to the region are merged with all rectangles they overlap
+ * with, so that the region always consists of disjoint rectangles. This is
+ * used to collect the changes made to the terrain during a frame and to
+ * deliver them in one batch.
+ */
+class TerrainRegion
+{
+public:
+    typedef std::vector<TerrainRect>::const_iterator const_iterator;
+
+public:
+    TerrainRegion() = default;
+
+    /**
+     * Create a region consisting of a single rectangle.
+     *
+     * This is intentionally not explicit, so that a TerrainRect can be
+     * passed wherever a region is expected.
+     */
+    TerrainRegion(const TerrainRect &rect);
+
+private:
+    std::vector<TerrainRect> m_rects;
+
+public:
+    /**
+     * Add a rectangle to the region.
+     *
+     * Empty rectangles are ignored. The rectangle is merged with all
+     * rectangles of the region it overlaps with, directly or through other
+     * merges.
+     */
+    void add(TerrainRect rect);
+
+    /**
+     * Add all rectangles of another region.
+     */
+    void add(const TerrainRegion &other);
+
+    /**
+     * Return the bounding rectangle of the whole region, or NotARect if the
+     * region is empty.
+     */
+    TerrainRect bounds() const;
+
+    void clear();
+
+    inline bool empty() const
+    {
+        return m_rects.empty();
+    }
+
+    inline const std::vector<TerrainRect> &rects() const
+    {
+        return m_rects;
+    }
+
+    inline const_iterator begin() const
+    {
+        return m_rects.begin();
+    }
+
+    inline const_iterator end() const
+    {
+        return m_rects.end();
+    }
+
+    inline void swap(TerrainRegion &other)
+    {
+        m_rects.swap(other.m_rects);
+    }
+
+};
+
 
 class Terrain
 {
@@ -74,8 +158,22 @@ private:
     mutable std::shared_timed_mutex m_field_mutex;
     Field m_field;
 
-    mutable sigc::signal<void, TerrainRect> m_heightmap_updated;
-    mutable sigc::signal<void, TerrainRect> m_attributes_updated;
+    // guarded by m_field_mutex
+    std::shared_ptr<const TerrainFile> m_file;
+    std::vector<bool> m_tile_loaded;
+    unsigned int m_tiles_pending;
+    unsigned int m_next_pending_tile;
+
+    // guarded by m_pending_mutex
+    mutable std::mutex m_pending_mutex;
+    mutable TerrainRegion m_pending_heightmap;
+    mutable TerrainRegion m_pending_attributes;
+
+    // serialises flushes, so that batches are delivered in order
+    mutable std::mutex m_flush_mutex;
+
+    mutable sigc::signal<void, const TerrainRegion&> m_heightmap_updated;
+    mutable sigc::signal<void, const TerrainRegion&> m_attributes_updated;
 
 public:
     inline unsigned int size() const
@@ -83,25 +181,153 @@ public:
         return m_size;
     }
 
-    inline sigc::signal<void, TerrainRect> &heightmap_updated() const
+    /**
+     * Emitted by flush_notifications() with all parts of the heightmap
+     * which changed since the previous flush.
+     */
+    inline sigc::signal<void, const TerrainRegion&> &heightmap_updated() const
     {
         return m_heightmap_updated;
     }
 
-    inline sigc::signal<void, TerrainRect> &attributes_updated() const
+    /**
+     * Emitted by flush_notifications() with all parts of the terrain whose
+     * attributes changed since the previous flush.
+     */
+    inline sigc::signal<void, const TerrainRegion&> &attributes_updated() const
     {
         return m_attributes_updated;
     }
 
 public:
+    /**
+     * Mark the whole heightmap as changed.
+     *
+     * The change is delivered on the next call to flush_notifications().
+     */
     void notify_heightmap_changed() const;
+
+    /**
+     * Mark a part of the heightmap as changed.
+     *
+     * The change is delivered on the next call to flush_notifications().
+     */
     void notify_heightmap_changed(TerrainRect at) const;
+
+    /**
+     * Mark the attributes of a part of the terrain as changed.
+     *
+     * The change is delivered on the next call to flush_notifications().
+     */
     void notify_attributes_changed(TerrainRect at) const;
+
+    /**
+     * Deliver all changes accumulated since the last flush to the
+     * subscribers of heightmap_updated() and attributes_updated().
+     *
+     * Each signal is emitted at most once per flush, with the merged region
+     * of all changes. Signals are emitted without holding the field lock.
+     */
+    void flush_notifications() const;
+
     std::shared_lock<std::shared_timed_mutex> readonly_field(
             const Field *&heightmap) const;
     std::unique_lock<std::shared_timed_mutex> writable_field(
             Field *&heightmap);
 
+private:
+    /**
+     * Forget about the attached file; m_field_mutex must be held.
+     */
+    void detach_file();
+
+    /**
+     * Decode the given \a tiles and mark them as loaded, then release
+     * \a lock (which must hold m_field_mutex) and notify about the changes.
+     *
+     * If a tile cannot be decoded, the error is logged and the file is
+     * detached.
+     */
+    void page_in_tiles(std::unique_lock<std::shared_timed_mutex> &lock,
+                       const std::vector<unsigned int> &tiles);
+
+    /**
+     * Page in the tiles of the attached file which are read when sampling
+     * at the given positions.
+     */
+    void page_in_samples(const Vector2f *positions, const std::size_t count);
+
+public:
+    /**
+     * Use a terrain file as backing store for the terrain.
+     *
+     * This is cheap: no tile is decoded by this call. Until a tile is paged
+     * in using page_in() or page_in_pending(), the area it covers keeps its
+     * previous contents; readers of the field (readonly_field()) see those,
+     * so they need to page in the area they access first (sample() does so
+     * by itself). Regenerating the terrain with one of the from_*
+     * methods detaches the file.
+     *
+     * @param file File to page in from; must not be null and its size must
+     * match the terrain.
+     * @throws std::invalid_argument if \a file is null or the size does
+     * not match.
+     */
+    void attach(std::shared_ptr<const TerrainFile> file);
+
+    /**
+     * Stop using the attached terrain file, if any.
+     *
+     * Tiles which have not been paged in yet keep their current contents.
+     */
+    void detach();
+
+    /**
+     * Decode all tiles of the attached file which overlap \a rect and have
+     * not been paged in yet.
+     *
+     * Tiles are decoded in parallel on the global thread pool. Paged in
+     * tiles are reported as heightmap and attribute changes. If a tile
+     * cannot be decoded (e.g. because the file is corrupt), the error is
+     * logged and the file is detached; this does not throw.
+     *
+     * Does nothing if no file is attached.
+     */
+    void page_in(const TerrainRect &rect);
+
+    /**
+     * Page in up to \a max_tiles tiles of the attached file which have not
+     * been paged in yet.
+     *
+     * This is meant to be called regularly to fill the terrain in the
+     * background.
+     *
+     * @return The number of tiles paged in.
+     */
+    unsigned int page_in_pending(const unsigned int max_tiles);
+
+    /**
+     * Return the number of tiles of the attached file which have not been
+     * paged in yet.
+     */
+    unsigned int tiles_pending() const;
+
+public:
+    /**
+     * Sample the heightmap at many positions at once, holding the field
+     * lock only once.
+     *
+     * Tiles of an attached terrain file which are covered by the samples
+     * are paged in first, so that the samples reflect the file contents.
+     *
+     * See sample_terrain() for details.
+     */
+    std::size_t sample(const Vector2f *positions,
+                       const std::size_t count,
+                       float *heights,
+                       Vector2f *slopes = nullptr,
+                       Vector3f *normals = nullptr);
+
 public:
     void from_perlin(const PerlinNoiseGenerator &gen);
     void from_noise(const noise::module::Module &gen);
@@ -110,19 +336,51 @@ public:
 };
 
 
+/**
+ * Base class for workers which maintain data derived from the terrain.
+ *
+ * Updates passed to notify_update() are split along a grid of tiles of
+ * tile_size squared cells. Each dirty tile is processed by calling
+ * worker_impl() with the dirty part of the tile, on one of a configurable
+ * number of worker threads. Updates far apart from each other thus only
+ * cause work on the areas which actually changed.
+ *
+ * A tile is never processed by more than one thread at a time, so that
+ * results for a tile are produced in order. Different tiles are processed
+ * concurrently, which worker_impl() implementations must be prepared for.
+ */
 class TerrainWorker
 {
 public:
-    TerrainWorker();
+    static const unsigned int DEFAULT_TILE_SIZE;
+
+public:
+    /**
+     * @param threads Number of worker threads to use.
+     * @param tile_size Edge length of the tiles updates are split into.
+     * @param margin Number of cells by which each update is grown before
+     * it is split, for derived data which depends on neighbouring cells.
+     */
+    explicit TerrainWorker(const unsigned int threads = 1,
+                           const unsigned int tile_size = DEFAULT_TILE_SIZE,
+                           const unsigned int margin = 0);
     virtual ~TerrainWorker();
 
 private:
+    typedef std::pair<unsigned int, unsigned int> TileKey;
+
+    const unsigned int m_thread_count;
+    const unsigned int m_tile_size;
+    const unsigned int m_margin;
+
     std::mutex m_state_mutex;
-    TerrainRect m_updated_rect;
+    std::map<TileKey, TerrainRect> m_dirty_tiles;
+    std::set<TileKey> m_busy_tiles;
     bool m_terminated;
     std::condition_variable m_wakeup;
+    std::condition_variable m_idle;
 
-    std::thread m_worker_thread;
+    std::vector<std::thread> m_worker_threads;
 
 private:
     void worker();
@@ -130,10 +388,27 @@ private:
 protected:
     void start();
     void tear_down();
+
+    /**
+     * Update the derived data for \a updated_rect.
+     *
+     * The rect lies within a single tile. Note that the rect is not clipped
+     * to the size of the terrain, as the worker does not know it.
+     */
     virtual void worker_impl(const TerrainRect &updated_rect) = 0;
 
 public:
-    void notify_update(const TerrainRect &at);
+    inline unsigned int tile_size() const
+    {
+        return m_tile_size;
+    }
+
+    void notify_update(const TerrainRegion &at);
+
+    /**
+     * Block until all updates notified so far have been processed.
+     */
+    void wait_for_idle();
 
 };
 
@@ -141,35 +416,73 @@ public:
 class Fluid;
 struct FluidCell;
 
+/**
+ * Spread sand over the terrain, depending on the fluid and the heightmap.
+ *
+ * The terrain is processed in tiles of TILE_SIZE squared cells, in parallel
+ * on the global thread pool. Each run reads the attributes of all tiles
+ * first and writes the results afterwards, so that every cell sees the
+ * values of its neighbours from the previous run, independent of the order
+ * in which tiles are processed.
+ *
+ * Only tiles near recent changes are processed: tiles whose heightmap
+ * changed, tiles overlapping actively simulated fluid blocks and tiles next
+ * to tiles whose sand changed during the previous run.
+ */
 class Sandifier
 {
 public:
     static const float SAND_FILTER_CONSTANT;
     static const float SAND_FILTER_CUTOFF;
+    static const unsigned int TILE_SIZE;
 
 public:
     Sandifier(Terrain &terrain,
               const Fluid &fluid);
+    ~Sandifier();
 
 private:
     Terrain &m_terrain;
     const Fluid &m_fluid;
 
-    unsigned int m_curr_y;
+    const unsigned int m_tiles_per_axis;
+
+    /* guarded by m_dirty_mutex */
+    std::mutex m_dirty_mutex;
+    std::vector<bool> m_dirty_tiles;
 
-    std::array<std::vector<Vector3f>, 3> m_rows;
+    /* owned by the thread calling run_steps() */
+    std::vector<bool> m_active_tiles;
+    std::vector<std::vector<float> > m_tile_buffers;
 
-    std::vector<float> m_dest_row;
+    sigc::connection m_heightmap_updated_conn;
 
 private:
-    void fetch_fluid_info(const unsigned int x,
-                          std::array<const FluidCell*, 9> &dest);
-    void fetch_row(const unsigned int y,
-                   const Terrain::Field &src,
-                   std::vector<Vector3f> &height_dest);
-    std::tuple<unsigned int, unsigned int> step();
+    TerrainRect tile_rect(const unsigned int tx,
+                          const unsigned int ty) const;
+    void heightmap_updated(const TerrainRegion &region);
+    void mark_tiles(const TerrainRect &rect, std::vector<bool> &dest) const;
+    bool process_tile(const Terrain::Field &field,
+                      const unsigned int tx,
+                      const unsigned int ty,
+                      std::vector<float> &dest) const;
 
 public:
+    /**
+     * Return the number of tiles which will be processed by the next call
+     * to run_steps() even if nothing else changes.
+     */
+    unsigned int tiles_dirty();
+
+    /**
+     * Update the sand attribute of all tiles which may have to change.
+     *
+     * Changed tiles are reported with Terrain::notify_attributes_changed(),
+     * so that they are delivered in one batch with the next
+     * Terrain::flush_notifications().
+     *
+     * The fluid simulation must not run concurrently.
+     */
     void run_steps();
 
 };
@@ -180,6 +493,33 @@ std::pair<bool, float> lookup_height(const Terrain::Field &field,
                    const float x,
                    const float y);
 
+/**
+ * Sample the heightmap with bilinear interpolation at \a count positions.
+ *
+ * Positions outside the terrain are clamped to its edge. The samples are
+ * processed in batches, so that the interpolation is vectorized across
+ * samples. The caller must hold the field lock.
+ *
+ * @param field Field to sample from.
+ * @param terrain_size Size of the terrain.
+ * @param positions Array of \a count positions, in cells.
+ * @param count Number of positions.
+ * @param heights Array of \a count heights which receives the interpolated
+ * heights; may be nullptr.
+ * @param slopes Array of \a count vectors which receives the partial
+ * derivatives of the height along X and Y; may be nullptr.
+ * @param normals Array of \a count vectors which receives the normalized
+ * surface normals; may be nullptr.
+ * @return The number of positions which were outside the terrain.
+ */
+std::size_t sample_terrain(const Terrain::Field &field,
+                           const unsigned int terrain_size,
+                           const Vector2f *positions,
+                           const std::size_t count,
+                           float *heights,
+                           Vector2f *slopes = nullptr,
+                           Vector3f *normals = nullptr);
+
 }
 
 #endif
@@ -0,0 +1,183 @@
+/**********************************************************************
+File name: terrain_file.hpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#ifndef SCC_SIM_TERRAIN_FILE_H
+#define SCC_SIM_TERRAIN_FILE_H
+
+#include <cstdint>
+#include <string>
+
+#include "ffengine/io/stream.hpp"
+
+#include "ffengine/sim/terrain.hpp"
+
+
+namespace sim {
+
+/**
+ * Read-only access to a tiled terrain file.
+ *
+ * The file is memory mapped, so opening it is cheap independent of the size
+ * of the terrain; tiles are only decoded when they are requested via
+ * read_tile().
+ *
+ * File layout (all integers and floats are little endian):
+ *
+ * 1. Header: 8 bytes magic (``FFETERR\0``), u32 version, u32 terrain size,
+ *    u32 tile size, u32 tiles per axis.
+ * 2. Tile data: for each tile, the planes in order (height, then the
+ *    attribute planes). Each plane holds the float values of the tile in
+ *    row-major order, byte-shuffled and run-length encoded (see
+ *    ffe::rle_encode()).
+ * 3. Tile index: one entry per tile in row-major order, consisting of the
+ *    u64 offset of the tile data from the start of the file, one u32
+ *    length per plane and a reserved u32.
+ * 4. Trailer: u64 offset of the tile index from the start of the file.
+ *
+ * The index follows the tile data, so that files can be written tile by
+ * tile to streams which do not support seeking.
+ *
+ * Tiles at the right and bottom edges are cut off at the terrain size.
+ *
+ * @see write_terrain_file
+ */
+class TerrainFile
+{
+public:
+    static const char MAGIC[8];
+    static const std::uint32_t VERSION;
+    static const unsigned int DEFAULT_TILE_SIZE;
+
+    /**
+     * Number of planes stored per tile; one per component of a Terrain
+     * field cell.
+     */
+    static const unsigned int PLANES = 3;
+
+    /**
+     * Sizes of the encoded header, tile index entries and trailer in the
+     * file.
+     */
+    static const std::size_t HEADER_SIZE = 24;
+    static const std::size_t TILE_ENTRY_SIZE = 24;
+    static const std::size_t TRAILER_SIZE = 8;
+
+    struct Header
+    {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t size;
+        std::uint32_t tile_size;
+        std::uint32_t tiles_per_axis;
+    };
+
+    struct TileEntry
+    {
+        std::uint64_t offset;
+        std::uint32_t plane_length[PLANES];
+        std::uint32_t reserved;
+    };
+
+public:
+    /**
+     * Open and map a terrain file.
+     *
+     * @param path Path of the file to open.
+     * @throws std::system_error if the file cannot be opened or mapped.
+     * @throws std::runtime_error if the file is not a valid terrain file.
+     */
+    explicit TerrainFile(const std::string &path);
+    TerrainFile(const TerrainFile &ref) = delete;
+    TerrainFile &operator=(const TerrainFile &ref) = delete;
+    ~TerrainFile();
+
+private:
+    int m_fd;
+    const std::uint8_t *m_data;
+    std::size_t m_data_size;
+
+    Header m_header;
+    const std::uint8_t *m_index;
+
+public:
+    inline unsigned int size() const
+    {
+        return m_header.size;
+    }
+
+    inline unsigned int tile_size() const
+    {
+        return m_header.tile_size;
+    }
+
+    inline unsigned int tiles_per_axis() const
+    {
+        return m_header.tiles_per_axis;
+    }
+
+    /**
+     * Return the part of the terrain covered by the given tile.
+     */
+    TerrainRect tile_rect(const unsigned int tx, const unsigned int ty) const;
+
+    /**
+     * Decode a tile into a terrain field.
+     *
+     * This is thread-safe and may be called for different tiles at the same
+     * time, as long as the threads write to disjoint parts of \a field.
+     *
+     * @param tx X coordinate of the tile.
+     * @param ty Y coordinate of the tile.
+     * @param field Field to write to; it must have size() times size()
+     * cells.
+     * @throws std::runtime_error if the tile data is corrupt.
+     */
+    void read_tile(const unsigned int tx, const unsigned int ty,
+                   Terrain::Field &field) const;
+
+};
+
+
+/**
+ * Write the current contents of \a terrain as tiled terrain file to
+ * \a dest.
+ *
+ * Tiles are copied, encoded and written one at a time, so that only a
+ * single tile is buffered. A shared lock is held on the field of \a terrain
+ * only while a tile is copied; to obtain a consistent snapshot, the caller
+ * has to prevent modifications during the call (e.g. by holding
+ * Server::sync_safe_point()).
+ *
+ * @param terrain Terrain to write.
+ * @param dest Stream to write to.
+ * @param tile_size Edge length of the tiles.
+ *
+ * @see TerrainFile
+ */
+void write_terrain_file(const Terrain &terrain,
+                        io::Stream &dest,
+                        const unsigned int tile_size = TerrainFile::DEFAULT_TILE_SIZE);
+
+}
+
+#endif
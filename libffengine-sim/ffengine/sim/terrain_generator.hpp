@@ -0,0 +1,138 @@
+/**********************************************************************
+File name: terrain_generator.hpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#ifndef SCC_SIM_TERRAIN_GENERATOR_H
+#define SCC_SIM_TERRAIN_GENERATOR_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include "ffengine/common/utils.hpp"
+
+#include "ffengine/sim/terrain.hpp"
+
+
+namespace sim {
+
+/**
+ * Generate the heightmap of a terrain tile by tile in the background.
+ *
+ * In contrast to Terrain::from_perlin() and friends, the field is only
+ * locked while a finished batch of tiles is copied into it, and each tile
+ * is reported as a separate heightmap change. Tiles are generated in order
+ * of their distance to a focus point (such as the position of the camera),
+ * so that the area around it becomes usable first.
+ *
+ * The generator only marks the tiles as changed (see
+ * Terrain::notify_heightmap_changed()); it never calls
+ * Terrain::flush_notifications() itself. The changes are delivered by the
+ * owner of the terrain, on its own thread: the game thread of a Server
+ * flushes once per frame, anything else using a generator has to call
+ * Terrain::flush_notifications() periodically (e.g. from its main loop).
+ *
+ * The attributes of the terrain are not modified.
+ */
+class TerrainGenerator: public ffe::NotifiableWorker
+{
+public:
+    /**
+     * Fill \a dest with the heights of all cells of \a rect, row by row.
+     *
+     * Samplers are called concurrently from the threads of the global
+     * thread pool.
+     */
+    typedef std::function<void(const TerrainRect &rect, float *dest)> Sampler;
+
+    static const unsigned int DEFAULT_TILE_SIZE;
+
+public:
+    /**
+     * Start generating the heightmap of \a terrain using \a sampler.
+     *
+     * Any terrain file attached to \a terrain is detached.
+     *
+     * @param terrain Terrain to generate; must outlive the generator.
+     * @param sampler Sampler for the heights.
+     * @param focus Initial focus point, in terrain cells.
+     * @param tile_size Edge length of the tiles to generate.
+     */
+    TerrainGenerator(Terrain &terrain,
+                     Sampler sampler,
+                     const Vector2f &focus,
+                     const unsigned int tile_size = DEFAULT_TILE_SIZE);
+    ~TerrainGenerator() override;
+
+private:
+    Terrain &m_terrain;
+    const Sampler m_sampler;
+    const unsigned int m_tile_size;
+    const unsigned int m_tiles_per_axis;
+
+    /* guarded by m_state_mutex */
+    mutable std::mutex m_state_mutex;
+    Vector2f m_focus;
+    std::vector<unsigned int> m_pending;
+    mutable std::condition_variable m_finished;
+
+private:
+    TerrainRect tile_rect(const unsigned int tile) const;
+
+protected:
+    bool worker_impl() override;
+
+public:
+    /**
+     * Change the focus point; tiles which have not been generated yet are
+     * generated in order of their distance to the new focus.
+     */
+    void set_focus(const Vector2f &focus);
+
+    /**
+     * Return the number of tiles which have not been generated yet.
+     */
+    unsigned int tiles_pending() const;
+
+    /**
+     * Block until all tiles have been generated.
+     */
+    void wait_for_completion() const;
+
+public:
+    /**
+     * Create a sampler which uses a copy of \a gen.
+     */
+    static Sampler perlin_sampler(const PerlinNoiseGenerator &gen);
+
+    /**
+     * Create a sampler which uses \a gen; \a gen must outlive all
+     * generators using the sampler.
+     */
+    static Sampler noise_sampler(const noise::module::Module &gen);
+
+};
+
+}
+
+#endif
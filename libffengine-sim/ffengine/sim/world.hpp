@@ -25,6 +25,7 @@ the AUTHORS file.
 #define SCC_SIM_WORLD_H
 
 #include <chrono>
+#include <memory>
 
 #include <google/protobuf/io/zero_copy_stream.h>
 
@@ -51,6 +52,27 @@ typedef std::chrono::steady_clock WorldClock;
 typedef uint32_t WorldOperationToken;
 
 
+/**
+ * Parts of the world state which a WorldOperation may access.
+ *
+ * The values are bit flags which are combined into WorldResources. The
+ * server uses them to decide which operations may run concurrently with the
+ * fluid simulation.
+ */
+enum WorldResource
+{
+    RESOURCE_TERRAIN = 1 << 0,
+    RESOURCE_FLUID = 1 << 1,
+    RESOURCE_OBJECTS = 1 << 2,
+    RESOURCE_GRAPH = 1 << 3,
+
+    RESOURCE_ALL = RESOURCE_TERRAIN | RESOURCE_FLUID | RESOURCE_OBJECTS |
+                   RESOURCE_GRAPH
+};
+
+typedef unsigned int WorldResources;
+
+
 /**
  * A class holding the complete world state, including all simulation data.
  *
@@ -161,6 +183,52 @@ public:
      */
     virtual WorldOperationResult execute(WorldState &state) = 0;
 
+    /**
+     * Return the part of the terrain heightmap which execute() may modify.
+     *
+     * This is used by the WorldJournal to record undo information. The
+     * default implementation returns NotARect, which means that the
+     * operation does not modify the heightmap.
+     *
+     * @param state World state the operation will be executed against.
+     */
+    virtual TerrainRect touched_terrain_rect(const WorldState &state) const;
+
+    /**
+     * Return the part of the fluid grid (in cells) which execute() may
+     * modify.
+     *
+     * This is used by the WorldJournal to record undo information. The
+     * default implementation returns NotARect, which means that the
+     * operation does not modify fluid cells directly.
+     *
+     * @param state World state the operation will be executed against.
+     */
+    virtual TerrainRect touched_fluid_rect(const WorldState &state) const;
+
+    /**
+     * Return the parts of the world state which execute() may read or
+     * modify.
+     *
+     * The default implementation returns RESOURCE_ALL, which is always
+     * safe. Operations which report fewer resources may be executed while
+     * other parts of the world (such as the fluid simulation) are busy.
+     */
+    virtual WorldResources resources() const;
+
+    /**
+     * Describe the operation as a world command, such that from_message()
+     * recreates an equivalent operation.
+     *
+     * This is used to record the operations executed by a Server (see
+     * CommandLogWriter). The default implementation returns false, which
+     * means that the operation has no message representation.
+     *
+     * @param dest Message to fill; it is not cleared before.
+     * @return true if \a dest has been filled.
+     */
+    virtual bool to_message(messages::WorldCommand &dest) const;
+
 public:
     /**
      * Use the given \a msg to recover a world command which can be applied
@@ -169,12 +237,33 @@ public:
      * If the message has more than one command payload, which one is chosen
      * is unspecified.
      *
-     * @param msg A valid message containing a world command.
+     * The message is typically received from a remote peer. Messages which
+     * do not contain a supported command or whose parameters are out of
+     * range (e.g. a brush density map which does not match the brush size)
+     * are rejected by returning nullptr.
+     *
+     * Bulk data (such as brush density maps) is copied from the message.
+     *
+     * @param msg A message containing a world command.
      * @return A new WorldOperation instance which executes the world command
-     * described by the given message.
+     * described by the given message, or nullptr.
      */
     static std::unique_ptr<WorldOperation> from_message(
             const sim::messages::WorldCommand &msg);
+
+    /**
+     * Like from_message(const sim::messages::WorldCommand&), but bulk data
+     * is borrowed from the message instead of being copied.
+     *
+     * The operation keeps a reference to \a msg for as long as it needs the
+     * data. This avoids copying density maps of messages which have been
+     * decoded into an arena by the NetMessageParser.
+     *
+     * @param msg A message containing a world command; must not be null.
+     * @return A new WorldOperation instance, or nullptr.
+     */
+    static std::unique_ptr<WorldOperation> from_message(
+            std::shared_ptr<const sim::messages::WorldCommand> msg);
 };
 
 typedef std::unique_ptr<WorldOperation> WorldOperationPtr;
@@ -24,6 +24,8 @@ the AUTHORS file.
 #ifndef SCC_SIM_WORLD_OPS_H
 #define SCC_SIM_WORLD_OPS_H
 
+#include <memory>
+
 #include "ffengine/math/curve.hpp"
 
 #include "ffengine/sim/world.hpp"
@@ -32,21 +34,140 @@ the AUTHORS file.
 namespace sim {
 namespace ops {
 
+/**
+ * Immutable density map of a brush.
+ *
+ * The values are either owned by the map (when constructed from a vector) or
+ * borrowed from another object, typically the network message the brush was
+ * decoded from. In the latter case, the map keeps a reference to that object
+ * so that the values stay valid for the lifetime of the map.
+ */
+class BrushDensityMap
+{
+public:
+    /**
+     * Create a density map owning a copy of \a values.
+     *
+     * This constructor is intentionally implicit, so that brush operations
+     * can be created directly from a vector.
+     */
+    BrushDensityMap(const std::vector<float> &values);
+    BrushDensityMap(std::vector<float> &&values);
+
+    /**
+     * Create a density map borrowing \a size values at \a data.
+     *
+     * @param owner Object which owns the values; it is kept alive as long as
+     * the density map (or any copy of it) exists.
+     * @param data Pointer to the first value.
+     * @param size Number of values.
+     */
+    BrushDensityMap(std::shared_ptr<const void> owner,
+                    const float *data,
+                    const std::size_t size);
+
+private:
+    std::shared_ptr<const void> m_owner;
+    const float *m_data;
+    std::size_t m_size;
+
+public:
+    inline const float *data() const
+    {
+        return m_data;
+    }
+
+    inline std::size_t size() const
+    {
+        return m_size;
+    }
+
+    inline const float &operator[](const std::size_t i) const
+    {
+        return m_data[i];
+    }
+
+    inline const float *begin() const
+    {
+        return m_data;
+    }
+
+    inline const float *end() const
+    {
+        return m_data + m_size;
+    }
+
+};
+
+
 class BrushWorldOperation: public WorldOperation
 {
 public:
     BrushWorldOperation(
             const float xc, const float yc,
             const unsigned int brush_size,
-            const std::vector<float> &density_map,
+            BrushDensityMap density_map,
             const float brush_strength);
 
 protected:
     const float m_xc;
     const float m_yc;
     const unsigned int m_brush_size;
-    const std::vector<float> m_density_map;
+    const BrushDensityMap m_density_map;
     const float m_brush_strength;
+    const bool m_densities_in_unit_range;
+
+public:
+    inline float xc() const
+    {
+        return m_xc;
+    }
+
+    inline float yc() const
+    {
+        return m_yc;
+    }
+
+    inline unsigned int brush_size() const
+    {
+        return m_brush_size;
+    }
+
+    inline const BrushDensityMap &density_map() const
+    {
+        return m_density_map;
+    }
+
+    inline float brush_strength() const
+    {
+        return m_brush_strength;
+    }
+
+    /**
+     * Whether all values of the density map lie in [0, 1] (and are thus
+     * finite). Brush operations are only fused if this holds, see
+     * fuse_brush_operations().
+     */
+    inline bool densities_in_unit_range() const
+    {
+        return m_densities_in_unit_range;
+    }
+
+};
+
+
+/**
+ * Base class for brush operations which modify the terrain heightmap within
+ * the area of the brush.
+ */
+class TerraformBrushOperation: public BrushWorldOperation
+{
+public:
+    using BrushWorldOperation::BrushWorldOperation;
+
+public:
+    TerrainRect touched_terrain_rect(const WorldState &state) const override;
+    WorldResources resources() const override;
 
 };
 
@@ -56,6 +177,9 @@ class ObjectWorldOperation: public WorldOperation
 public:
     explicit ObjectWorldOperation(const Object::ID object_id);
 
+public:
+    WorldResources resources() const override;
+
 protected:
     const Object::ID m_object_id;
 
@@ -77,13 +201,14 @@ protected:
  * @param brush_strength Strength factor for applying the brush, should be
  * in the range [-1.0, 1.0].
  */
-class TerraformRaise: public BrushWorldOperation
+class TerraformRaise: public TerraformBrushOperation
 {
 public:
-    using BrushWorldOperation::BrushWorldOperation;
+    using TerraformBrushOperation::TerraformBrushOperation;
 
 public:
     WorldOperationResult execute(WorldState &state) override;
+    bool to_message(messages::WorldCommand &dest) const override;
 
 };
 
@@ -106,13 +231,13 @@ public:
  * in the range [0.0, 1.0].
  * @param ref_height Reference height to level the terrain to.
  */
-class TerraformLevel: public BrushWorldOperation
+class TerraformLevel: public TerraformBrushOperation
 {
 public:
     TerraformLevel(
             const float xc, const float yc,
             const unsigned int brush_size,
-            const std::vector<float> &density_map,
+            BrushDensityMap density_map,
             const float brush_strength,
             const float reference_height
             );
@@ -120,35 +245,35 @@ public:
 private:
     const float m_reference_height;
 
+public:
+    inline float reference_height() const
+    {
+        return m_reference_height;
+    }
+
 public:
     WorldOperationResult execute(WorldState &state) override;
+    bool to_message(messages::WorldCommand &dest) const override;
 
 };
 
-class TerraformSmooth: public BrushWorldOperation
+class TerraformSmooth: public TerraformBrushOperation
 {
 public:
-    using BrushWorldOperation::BrushWorldOperation;
-
-protected:
-    Terrain::height_t sample_parzen_rect(
-            const Terrain::Field &field,
-            const unsigned int terrain_size,
-            const unsigned int xc, const unsigned int yc,
-            const unsigned int size);
+    using TerraformBrushOperation::TerraformBrushOperation;
 
 public:
     WorldOperationResult execute(WorldState &state) override;
 
 };
 
-class TerraformRamp: public BrushWorldOperation
+class TerraformRamp: public TerraformBrushOperation
 {
 public:
     TerraformRamp(
             const float xc, const float yc,
             const unsigned int brush_size,
-            const std::vector<float> &density_map,
+            BrushDensityMap density_map,
             const float brush_strength,
             const Vector2f source_point,
             const Terrain::height_t source_height,
@@ -174,6 +299,8 @@ public:
 
 public:
     WorldOperationResult execute(WorldState &state) override;
+    TerrainRect touched_fluid_rect(const WorldState &state) const override;
+    WorldResources resources() const override;
 
 };
 
@@ -219,6 +346,7 @@ private:
 
 public:
     WorldOperationResult execute(WorldState &state) override;
+    WorldResources resources() const override;
 
 };
 
@@ -276,6 +404,7 @@ private:
 
 public:
     WorldOperationResult execute(WorldState &state) override;
+    WorldResources resources() const override;
 
 };
 
@@ -284,6 +413,7 @@ class FluidReset: public WorldOperation
 {
 public:
     WorldOperationResult execute(WorldState &state) override;
+    WorldResources resources() const override;
 
 };
 
@@ -307,10 +437,47 @@ private:
 
 public:
     WorldOperationResult execute(WorldState &state) override;
+    WorldResources resources() const override;
 
 };
 
 
+/**
+ * Maximum diameter of a brush created by fuse_brush_operations().
+ *
+ * This bounds the memory used by a fused density map when a brush is dragged
+ * over a long distance within a single frame.
+ */
+static constexpr unsigned int MAX_FUSED_BRUSH_SIZE = 256;
+
+/**
+ * Merge runs of consecutive, compatible brush operations in \a ops into single
+ * operations.
+ *
+ * Two operations are compatible if they use the same tool with parameters for
+ * which applying the accumulated density field once gives the same result as
+ * applying both brushes in sequence, and if their brush areas overlap. The
+ * fused operation uses a square brush covering the union of the areas, with
+ * the density maps (and strengths) accumulated into one field.
+ *
+ * The following operations are fused, provided that all their densities lie
+ * in [0.0, 1.0] (see BrushWorldOperation::densities_in_unit_range()):
+ *
+ * * TerraformRaise with brush strengths of the same sign,
+ * * TerraformLevel with the same reference height and brush strengths in
+ *   [0.0, 1.0],
+ * * FluidRaise with brush strengths of the same sign.
+ *
+ * The relative order of all other operations is preserved; a run is broken by
+ * any operation which cannot be fused into it.
+ *
+ * @param ops Operations to fuse, in execution order; modified in-place.
+ * @return Number of operations which were removed by fusion.
+ */
+std::size_t fuse_brush_operations(
+        std::vector<WorldOperationPtr> &ops);
+
+
 }
 }
 
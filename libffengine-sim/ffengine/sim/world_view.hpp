@@ -0,0 +1,240 @@
+/**********************************************************************
+File name: world_view.hpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#ifndef SCC_SIM_WORLD_VIEW_H
+#define SCC_SIM_WORLD_VIEW_H
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "ffengine/sim/terrain.hpp"
+#include "ffengine/sim/world.hpp"
+
+
+namespace sim {
+
+/**
+ * Summary of the state of a fluid block, as far as it is of interest for
+ * clients which do not run the fluid simulation themselves.
+ *
+ * @see FluidBlockMeta
+ */
+struct FluidBlockSummary
+{
+    bool active;
+    bool flat;
+    float flat_absolute_height;
+    float change;
+
+    bool operator==(const FluidBlockSummary &other) const;
+
+    inline bool operator!=(const FluidBlockSummary &other) const
+    {
+        return !(*this == other);
+    }
+
+};
+
+
+/**
+ * Immutable snapshot of the world state, published by the Server after each
+ * game frame.
+ *
+ * The heightmap is stored in tiles which are shared between consecutive
+ * views; only tiles which changed during a frame are copied. A view can thus
+ * be read without any lock and for as long as needed, while the game thread
+ * continues to modify the world state.
+ *
+ * @see Server::view
+ */
+class WorldView
+{
+public:
+    static constexpr unsigned int TILE_SIZE = 64;
+
+    typedef std::vector<Terrain::height_t> HeightTile;
+
+public:
+    WorldView(const std::uint64_t frame,
+              const WorldClock::time_point timestamp,
+              const unsigned int terrain_size,
+              std::vector<std::shared_ptr<const HeightTile> > &&tiles,
+              const TerrainRegion &changed,
+              const unsigned int fluid_blocks_per_axis = 0,
+              std::vector<FluidBlockSummary> &&fluid_blocks =
+                std::vector<FluidBlockSummary>());
+
+private:
+    const std::uint64_t m_frame;
+    const WorldClock::time_point m_timestamp;
+    const unsigned int m_terrain_size;
+    const unsigned int m_tiles_per_axis;
+    const std::vector<std::shared_ptr<const HeightTile> > m_tiles;
+    const TerrainRegion m_changed;
+    const unsigned int m_fluid_blocks_per_axis;
+    const std::vector<FluidBlockSummary> m_fluid_blocks;
+
+public:
+    /**
+     * Number of the game frame after which the view was taken.
+     */
+    inline std::uint64_t frame() const
+    {
+        return m_frame;
+    }
+
+    inline WorldClock::time_point timestamp() const
+    {
+        return m_timestamp;
+    }
+
+    inline unsigned int terrain_size() const
+    {
+        return m_terrain_size;
+    }
+
+    /**
+     * Parts of the heightmap which changed since the previous view.
+     */
+    inline const TerrainRegion &changed() const
+    {
+        return m_changed;
+    }
+
+    inline unsigned int tiles_per_axis() const
+    {
+        return m_tiles_per_axis;
+    }
+
+    /**
+     * Return the tile with the given tile coordinates, for sharing with the
+     * next view.
+     *
+     * Tiles which did not change between two views are the same object, so
+     * comparing the pointers is a cheap way to detect changes.
+     */
+    inline const std::shared_ptr<const HeightTile> &tile(
+            const unsigned int tx, const unsigned int ty) const
+    {
+        return m_tiles[ty*m_tiles_per_axis + tx];
+    }
+
+    /**
+     * Return the height at the given cell.
+     */
+    Terrain::height_t height(const unsigned int x, const unsigned int y) const;
+
+    /**
+     * Copy the heights within \a rect row by row into \a dest, which must
+     * have room for the area of \a rect. \a rect must lie within the
+     * terrain.
+     */
+    void copy_heights(const TerrainRect &rect, Terrain::height_t *dest) const;
+
+    /**
+     * Number of fluid blocks per axis; zero if the view has been taken
+     * without fluid.
+     */
+    inline unsigned int fluid_blocks_per_axis() const
+    {
+        return m_fluid_blocks_per_axis;
+    }
+
+    /**
+     * Summaries of all fluid blocks, row by row.
+     */
+    inline const std::vector<FluidBlockSummary> &fluid_blocks() const
+    {
+        return m_fluid_blocks;
+    }
+
+private:
+    static std::vector<std::shared_ptr<const HeightTile> > snapshot_tiles(
+            const Terrain &terrain,
+            const WorldView *previous,
+            const TerrainRegion &changed);
+
+public:
+    /**
+     * Return the area covered by the tile \a tx, \a ty of a terrain with
+     * \a terrain_size cells per axis.
+     */
+    static TerrainRect tile_rect(const unsigned int terrain_size,
+                                 const unsigned int tx,
+                                 const unsigned int ty);
+
+    /**
+     * Return the number of tiles per axis of a terrain with \a terrain_size
+     * cells per axis.
+     */
+    static unsigned int tiles_per_axis(const unsigned int terrain_size);
+
+
+    /**
+     * Take a snapshot of \a terrain.
+     *
+     * If \a previous is given and has the same terrain size, all tiles which
+     * do not overlap \a changed are shared with \a previous; otherwise the
+     * whole heightmap is copied.
+     *
+     * @param terrain Terrain to read; a read lock on the field is taken.
+     * @param previous The previously published view, or null.
+     * @param changed Parts of the heightmap changed since \a previous.
+     * @param frame Number of the game frame.
+     */
+    static std::unique_ptr<const WorldView> snapshot(
+            const Terrain &terrain,
+            const WorldView *previous,
+            const TerrainRegion &changed,
+            const std::uint64_t frame);
+
+    /**
+     * Take a snapshot of \a terrain, together with the fluid block
+     * summaries previously taken with summarize_fluid().
+     *
+     * @see snapshot(const Terrain&, const WorldView*, const TerrainRegion&, const std::uint64_t)
+     */
+    static std::unique_ptr<const WorldView> snapshot(
+            const Terrain &terrain,
+            const WorldView *previous,
+            const TerrainRegion &changed,
+            const std::uint64_t frame,
+            const unsigned int fluid_blocks_per_axis,
+            std::vector<FluidBlockSummary> &&fluid_blocks);
+
+    /**
+     * Return the summaries of all blocks of \a fluid, row by row.
+     *
+     * The fluid simulation must not be running while the summaries are
+     * taken.
+     */
+    static std::vector<FluidBlockSummary> summarize_fluid(
+            const FluidBlocks &fluid);
+
+};
+
+
+}
+
+#endif
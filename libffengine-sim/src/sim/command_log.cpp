@@ -0,0 +1,316 @@
+/**********************************************************************
+File name: command_log.cpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#include "ffengine/sim/command_log.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <google/protobuf/io/coded_stream.h>
+
+#include "ffengine/common/utils.hpp"
+#include "ffengine/io/log.hpp"
+
+#include "ffengine/sim/networld.hpp"
+
+#include "command_log.pb.h"
+#include "world_command.pb.h"
+
+
+namespace sim {
+
+static io::Logger &logger = io::logging().get_logger("sim.command_log");
+
+/**
+ * Maximum number of buffers passed to a single writev() call.
+ */
+static constexpr int MAX_WRITE_IOV = 64;
+
+
+/* sim::CommandLogWriter */
+
+constexpr std::size_t CommandLogWriter::MAX_PENDING_COMMANDS;
+
+CommandLogWriter::CommandLogWriter(const std::string &path):
+    m_fd(::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)),
+    m_pending_commands(0),
+    m_frames_appended(0),
+    m_frames_written(0),
+    m_failed(false),
+    m_terminated(false),
+    m_dropped_commands(0),
+    m_send_frames(new NetFrameBuilder()),
+    m_frame_msg(new messages::CommandLogFrame())
+{
+    if (m_fd == -1) {
+        ffe::raise_last_os_error();
+    }
+    m_thread = std::thread(std::bind(&CommandLogWriter::writer_thread, this));
+}
+
+CommandLogWriter::~CommandLogWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_terminated = true;
+    }
+    m_cv.notify_all();
+    m_thread.join();
+    ::close(m_fd);
+
+    if (m_dropped_commands > 0) {
+        logger.logf(io::LOG_WARNING, "%llu commands were not logged",
+                    static_cast<unsigned long long>(m_dropped_commands));
+    }
+}
+
+bool CommandLogWriter::write_pending()
+{
+    for (Frame &frame: m_writing) {
+        m_frame_msg->set_frame(frame.frame);
+        m_frame_msg->clear_unfused();
+        for (const std::uint32_t index: frame.unfused) {
+            m_frame_msg->add_unfused(index);
+        }
+        m_send_frames->append(MSGCLASS_COMMAND_LOG_FRAME, *m_frame_msg);
+        for (const CommandPtr &command: frame.commands) {
+            m_send_frames->append(MSGCLASS_WORLD_COMMAND, *command);
+        }
+    }
+    m_writing.clear();
+
+    struct iovec iov[MAX_WRITE_IOV];
+    while (m_send_frames->pending_bytes() > 0) {
+        const int niov = m_send_frames->pending(iov, MAX_WRITE_IOV);
+        const ssize_t written = ::writev(m_fd, iov, niov);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            logger.logf(io::LOG_ERROR, "failed to write command log: %s",
+                        std::strerror(errno));
+            m_send_frames->clear();
+            return false;
+        }
+        m_send_frames->consume(written);
+    }
+    return true;
+}
+
+void CommandLogWriter::writer_thread()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+        m_cv.wait(lock, [this](){ return m_terminated || !m_pending.empty(); });
+        if (m_pending.empty()) {
+            // terminated and drained
+            return;
+        }
+
+        m_writing.swap(m_pending);
+        m_pending_commands = 0;
+        const std::uint64_t frames = m_frames_appended;
+        lock.unlock();
+
+        const bool success = write_pending();
+
+        lock.lock();
+        if (!success) {
+            m_failed = true;
+        }
+        m_frames_written = frames;
+        m_cv.notify_all();
+    }
+}
+
+void CommandLogWriter::append_frame(const std::uint64_t frame,
+                                    std::vector<CommandPtr> &commands,
+                                    std::vector<std::uint32_t> &unfused)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_failed ||
+                m_pending_commands + commands.size() > MAX_PENDING_COMMANDS)
+        {
+            m_dropped_commands += commands.size();
+            commands.clear();
+            unfused.clear();
+            return;
+        }
+
+        m_pending_commands += commands.size();
+        m_pending.emplace_back(Frame{frame, std::move(commands),
+                                     std::move(unfused)});
+        m_frames_appended += 1;
+    }
+    commands.clear();
+    unfused.clear();
+    m_cv.notify_all();
+}
+
+bool CommandLogWriter::flush()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    const std::uint64_t frames = m_frames_appended;
+    m_cv.wait(lock, [this, frames](){ return m_frames_written >= frames; });
+    return !m_failed;
+}
+
+
+/* sim::CommandLogReader */
+
+CommandLogReader::CommandLogReader(const std::string &path):
+    m_data(nullptr),
+    m_size(0),
+    m_pos(0),
+    m_truncated(false),
+    m_frame_msg(new messages::CommandLogFrame())
+{
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        ffe::raise_last_os_error();
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        const int err = errno;
+        ::close(fd);
+        throw std::system_error(err, std::system_category());
+    }
+    m_size = info.st_size;
+
+    if (m_size > 0) {
+        void *mapped = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            const int err = errno;
+            ::close(fd);
+            throw std::system_error(err, std::system_category());
+        }
+        // the log is read front to back exactly once
+        madvise(mapped, m_size, MADV_SEQUENTIAL);
+        m_data = static_cast<const char*>(mapped);
+    }
+    // the mapping stays valid after closing the descriptor
+    ::close(fd);
+
+    logger.logf(io::LOG_INFO, "mapped command log %s (%zu bytes)",
+                path.c_str(), m_size);
+}
+
+CommandLogReader::~CommandLogReader()
+{
+    if (m_data) {
+        munmap(const_cast<char*>(m_data), m_size);
+    }
+}
+
+bool CommandLogReader::peek_record(std::uint32_t &msgclass,
+                                   std::uint32_t &msgsize) const
+{
+    if (m_size - m_pos < std::size_t(NetMessageParser::HEADER_SIZE)) {
+        return false;
+    }
+
+    const std::uint8_t *header = reinterpret_cast<const std::uint8_t*>(
+                &m_data[m_pos]);
+    google::protobuf::io::CodedInputStream::ReadLittleEndian32FromArray(
+                &header[0], &msgclass);
+    google::protobuf::io::CodedInputStream::ReadLittleEndian32FromArray(
+                &header[sizeof(msgclass)], &msgsize);
+
+    if (msgsize > NetMessageParser::MAX_MESSAGE_SIZE) {
+        throw std::runtime_error("oversized record in command log at offset "+
+                                 std::to_string(m_pos));
+    }
+
+    return m_size - m_pos - NetMessageParser::HEADER_SIZE >= msgsize;
+}
+
+bool CommandLogReader::next_frame(
+        std::uint64_t &frame,
+        std::vector<std::shared_ptr<messages::WorldCommand> > &commands,
+        std::vector<std::uint32_t> &unfused)
+{
+    commands.clear();
+    unfused.clear();
+
+    std::uint32_t msgclass = 0;
+    std::uint32_t msgsize = 0;
+    if (!peek_record(msgclass, msgsize)) {
+        m_truncated = m_pos < m_size;
+        return false;
+    }
+
+    if (msgclass != MSGCLASS_COMMAND_LOG_FRAME) {
+        throw std::runtime_error("command log record at offset "+
+                                 std::to_string(m_pos)+
+                                 " is not a frame marker");
+    }
+    if (!m_frame_msg->ParseFromArray(&m_data[m_pos+NetMessageParser::HEADER_SIZE],
+                                     msgsize))
+    {
+        throw std::runtime_error("malformed frame marker in command log at offset "+
+                                 std::to_string(m_pos));
+    }
+    m_pos += NetMessageParser::HEADER_SIZE + msgsize;
+    frame = m_frame_msg->frame();
+
+    while (peek_record(msgclass, msgsize) &&
+           msgclass == MSGCLASS_WORLD_COMMAND)
+    {
+        auto command = std::make_shared<messages::WorldCommand>();
+        if (!command->ParseFromArray(&m_data[m_pos+NetMessageParser::HEADER_SIZE],
+                                     msgsize))
+        {
+            throw std::runtime_error("malformed command in command log at offset "+
+                                     std::to_string(m_pos));
+        }
+        m_pos += NetMessageParser::HEADER_SIZE + msgsize;
+        commands.emplace_back(std::move(command));
+    }
+
+    unfused.assign(m_frame_msg->unfused().begin(),
+                   m_frame_msg->unfused().end());
+    for (std::size_t i = 0; i < unfused.size(); ++i) {
+        if (unfused[i] >= commands.size() ||
+                (i > 0 && unfused[i] <= unfused[i-1]))
+        {
+            throw std::runtime_error("invalid unfused command index in frame "+
+                                     std::to_string(frame)+
+                                     " of command log");
+        }
+    }
+
+    return true;
+}
+
+}
@@ -0,0 +1,594 @@
+/**********************************************************************
+File name: epoll_server.cpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#define QT_NO_EMIT
+
+#include "ffengine/sim/epoll_server.hpp"
+
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "ffengine/io/log.hpp"
+
+#include "replication.pb.h"
+#include "world_command.pb.h"
+
+
+namespace sim {
+
+static io::Logger &logger = io::logging().get_logger("sim.epoll_server");
+
+/**
+ * Maximum number of events handled per epoll_wait() call.
+ */
+static const int MAX_EVENTS = 256;
+
+/**
+ * Maximum number of buffers passed to a single writev() call.
+ */
+static const int MAX_IOV = 64;
+
+static std::system_error errno_error(const char *what)
+{
+    return std::system_error(errno, std::generic_category(), what);
+}
+
+
+/* sim::EpollServerClient */
+
+constexpr std::size_t EpollServerClient::MAX_PENDING_BYTES;
+
+EpollServerClient::EpollServerClient(EpollNetServer &server,
+                                     const int fd,
+                                     const NetConnectionID id):
+    ServerClientBase(),
+    m_server(server),
+    m_fd(fd),
+    m_id(id),
+    m_failed(false),
+    m_message_parser(std::bind(&EpollServerClient::link_control_received,
+                               this,
+                               std::placeholders::_1),
+                     std::bind(&EpollServerClient::fail,
+                               this),
+                     id),
+    m_send_overflow(false)
+{
+    logger.log(io::LOG_INFO) << "new connection with id " << m_id
+                             << io::submit;
+}
+
+EpollServerClient::~EpollServerClient()
+{
+    ::close(m_fd);
+    logger.log(io::LOG_INFO) << "connection " << m_id
+                             << " destroyed" << io::submit;
+}
+
+void EpollServerClient::fail()
+{
+    m_failed = true;
+}
+
+void EpollServerClient::link_control_received(
+        std::shared_ptr<messages::NetWorldControl> &&msg)
+{
+    if (msg->has_ping()) {
+        messages::NetWorldControl reply;
+        messages::NetWorldPong &pong = *reply.mutable_pong();
+        pong.set_token(msg->ping().token());
+        pong.set_payload(msg->ping().payload());
+        send_message(MSGCLASS_LINK_CONTROL, reply);
+        // we are on the event loop already
+        if (!send_pending()) {
+            m_failed = true;
+        }
+    }
+}
+
+bool EpollServerClient::msg_unhandled(AbstractMessagePtr &&)
+{
+    return false;
+}
+
+bool EpollServerClient::receive()
+{
+    // the socket is edge-triggered, so it has to be drained completely
+    while (!m_failed) {
+        char *dest;
+        std::size_t size;
+        std::tie(dest, size) = m_message_parser.next_buffer();
+        const ssize_t bytes_read = ::recv(m_fd, dest, size, 0);
+        if (bytes_read > 0) {
+            m_message_parser.written(bytes_read);
+        } else if (bytes_read == 0) {
+            logger.log(io::LOG_INFO) << "connection " << m_id
+                                     << " disconnected" << io::submit;
+            return false;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return true;
+        } else if (errno != EINTR) {
+            logger.log(io::LOG_ERROR) << "connection " << m_id
+                                      << " failed to receive: "
+                                      << std::strerror(errno)
+                                      << io::submit;
+            return false;
+        }
+    }
+    return false;
+}
+
+bool EpollServerClient::send_pending()
+{
+    std::lock_guard<std::mutex> lock(m_send_mutex);
+    if (m_send_overflow) {
+        logger.log(io::LOG_WARNING) << "connection " << m_id
+                                    << " does not keep up with the sent data"
+                                    << io::submit;
+        return false;
+    }
+
+    std::array<struct iovec, MAX_IOV> iov;
+    int count;
+    while ((count = m_send_frames.pending(iov.data(), iov.size())) > 0) {
+        msghdr msg{};
+        msg.msg_iov = iov.data();
+        msg.msg_iovlen = count;
+        // sendmsg() is writev() with flags, which we need for MSG_NOSIGNAL
+        const ssize_t bytes_sent = ::sendmsg(m_fd, &msg, MSG_NOSIGNAL);
+        if (bytes_sent >= 0) {
+            m_send_frames.consume(bytes_sent);
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            // the loop is woken up by EPOLLOUT once there is room
+            return true;
+        } else if (errno != EINTR) {
+            logger.log(io::LOG_ERROR) << "connection " << m_id
+                                      << " failed to send: "
+                                      << std::strerror(errno)
+                                      << io::submit;
+            return false;
+        }
+    }
+    return true;
+}
+
+void EpollServerClient::send_message(const NetMessageClass msgclass,
+                                     const google::protobuf::Message &msg)
+{
+    std::lock_guard<std::mutex> lock(m_send_mutex);
+    if (m_send_overflow) {
+        return;
+    }
+    m_send_frames.append(msgclass, msg);
+    if (m_send_frames.pending_bytes() > MAX_PENDING_BYTES) {
+        // the connection is closed on the next flush
+        m_send_overflow = true;
+        m_send_frames.clear();
+    }
+}
+
+std::size_t EpollServerClient::pending_bytes()
+{
+    std::lock_guard<std::mutex> lock(m_send_mutex);
+    return m_send_frames.pending_bytes();
+}
+
+void EpollServerClient::flush()
+{
+    m_server.request_flush(m_id);
+}
+
+void EpollServerClient::terminate()
+{
+    m_message_parser.set_message_handler(nullptr);
+    m_server.request_close(m_id);
+}
+
+void EpollServerClient::request_flush()
+{
+    m_server.request_flush(m_id);
+}
+
+void EpollServerClient::request_terminate()
+{
+    terminate();
+}
+
+void EpollServerClient::send_message(const messages::WorldCommandResponse &msg)
+{
+    send_message(MSGCLASS_WORLD_COMMAND_RESPONSE, msg);
+}
+
+void EpollServerClient::send_message(const messages::ReplicationUpdate &msg)
+{
+    send_message(MSGCLASS_REPLICATION_UPDATE, msg);
+}
+
+void EpollServerClient::set_message_handler(IMessageHandler *handler)
+{
+    m_message_parser.set_message_handler(handler);
+}
+
+
+/* sim::EpollNetServer */
+
+constexpr std::uint64_t EpollNetServer::LISTEN_TOKEN;
+constexpr std::uint64_t EpollNetServer::WAKEUP_TOKEN;
+
+EpollNetServer::EpollNetServer():
+    m_epoll_fd(::epoll_create1(EPOLL_CLOEXEC)),
+    m_wakeup_fd(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+    m_listen_fd(-1),
+    m_reserve_fd(::open("/dev/null", O_RDONLY | O_CLOEXEC)),
+    m_terminated(false),
+    m_client_count(0),
+    m_next_id(0)
+{
+    if (m_epoll_fd < 0 || m_wakeup_fd < 0 || m_reserve_fd < 0) {
+        const std::system_error err = errno_error("failed to create epoll instance");
+        if (m_epoll_fd >= 0) {
+            ::close(m_epoll_fd);
+        }
+        if (m_wakeup_fd >= 0) {
+            ::close(m_wakeup_fd);
+        }
+        if (m_reserve_fd >= 0) {
+            ::close(m_reserve_fd);
+        }
+        throw err;
+    }
+
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.u64 = WAKEUP_TOKEN;
+    if (::epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_wakeup_fd, &ev) != 0) {
+        const std::system_error err = errno_error("failed to register wakeup fd");
+        ::close(m_epoll_fd);
+        ::close(m_wakeup_fd);
+        ::close(m_reserve_fd);
+        throw err;
+    }
+}
+
+EpollNetServer::~EpollNetServer()
+{
+    stop();
+    if (m_listen_fd >= 0) {
+        ::close(m_listen_fd);
+    }
+    if (m_reserve_fd >= 0) {
+        ::close(m_reserve_fd);
+    }
+    ::close(m_wakeup_fd);
+    ::close(m_epoll_fd);
+}
+
+void EpollNetServer::accept_pending()
+{
+    while (true) {
+        const int fd = ::accept4(m_listen_fd, nullptr, nullptr,
+                                 SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            const int accept_errno = errno;
+            if (accept_errno == EINTR || accept_errno == ECONNABORTED) {
+                continue;
+            }
+            if (accept_errno == EAGAIN || accept_errno == EWOULDBLOCK) {
+                return;
+            }
+            if ((accept_errno == EMFILE || accept_errno == ENFILE)
+                    && m_reserve_fd >= 0) {
+                // out of file descriptors: give up the reserve descriptor
+                // to accept the connection and close it right away, so
+                // that it does not stay in the backlog and make the
+                // (level-triggered) listen socket fire continuously
+                logger.log(io::LOG_ERROR) << "out of file descriptors, "
+                                          << "rejecting connection"
+                                          << io::submit;
+                ::close(m_reserve_fd);
+                const int rejected_fd = ::accept4(m_listen_fd, nullptr, nullptr,
+                                                  SOCK_CLOEXEC);
+                if (rejected_fd >= 0) {
+                    ::close(rejected_fd);
+                }
+                m_reserve_fd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+                if (rejected_fd >= 0) {
+                    continue;
+                }
+                return;
+            }
+            logger.log(io::LOG_ERROR) << "failed to accept connection: "
+                                      << std::strerror(accept_errno)
+                                      << io::submit;
+            return;
+        }
+
+        const int nodelay = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+        const NetConnectionID id = m_next_id++;
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.u64 = id;
+        if (::epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            logger.log(io::LOG_ERROR) << "failed to register connection: "
+                                      << std::strerror(errno)
+                                      << io::submit;
+            ::close(fd);
+            continue;
+        }
+
+        auto client = std::make_unique<EpollServerClient>(*this, fd, id);
+        EpollServerClient &client_ref = *client;
+        m_clients.emplace(id, std::move(client));
+        ++m_client_count;
+        m_client_connected.emit(client_ref);
+    }
+}
+
+void EpollNetServer::close_client(const NetConnectionID id,
+                                  const bool emit_disconnected)
+{
+    auto iter = m_clients.find(id);
+    if (iter == m_clients.end()) {
+        return;
+    }
+
+    std::unique_ptr<EpollServerClient> client = std::move(iter->second);
+    m_clients.erase(iter);
+    --m_client_count;
+
+    ::epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, client->fd(), nullptr);
+    if (emit_disconnected) {
+        client->disconnected();
+    }
+    m_client_closed.emit(*client);
+}
+
+void EpollNetServer::loop()
+{
+    std::array<epoll_event, MAX_EVENTS> events;
+    while (!m_terminated) {
+        const int nevents = ::epoll_wait(m_epoll_fd, events.data(),
+                                         events.size(), -1);
+        if (nevents < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            logger.log(io::LOG_EXCEPTION) << "epoll_wait failed: "
+                                          << std::strerror(errno)
+                                          << io::submit;
+            break;
+        }
+
+        for (int i = 0; i < nevents; ++i) {
+            const epoll_event &ev = events[i];
+            if (ev.data.u64 == LISTEN_TOKEN) {
+                accept_pending();
+                continue;
+            }
+            if (ev.data.u64 == WAKEUP_TOKEN) {
+                std::uint64_t counter;
+                while (::read(m_wakeup_fd, &counter, sizeof(counter)) > 0);
+                process_requests();
+                continue;
+            }
+
+            auto iter = m_clients.find(ev.data.u64);
+            if (iter == m_clients.end()) {
+                // closed while handling an earlier event of this batch
+                continue;
+            }
+            EpollServerClient &client = *iter->second;
+
+            bool ok = (ev.events & (EPOLLERR | EPOLLHUP)) == 0 ||
+                    (ev.events & EPOLLIN) != 0;
+            if (ok && (ev.events & EPOLLIN)) {
+                ok = client.receive();
+            }
+            if (ok && (ev.events & EPOLLOUT)) {
+                ok = client.send_pending();
+            }
+            if (!ok) {
+                close_client(client.id(), true);
+            }
+        }
+    }
+
+    while (!m_clients.empty()) {
+        close_client(m_clients.begin()->first, true);
+    }
+}
+
+void EpollNetServer::process_requests()
+{
+    std::vector<NetConnectionID> flush_requests;
+    std::vector<NetConnectionID> close_requests;
+    {
+        std::lock_guard<std::mutex> lock(m_requests_mutex);
+        flush_requests.swap(m_flush_requests);
+        close_requests.swap(m_close_requests);
+    }
+
+    for (const NetConnectionID id: flush_requests) {
+        auto iter = m_clients.find(id);
+        if (iter == m_clients.end()) {
+            continue;
+        }
+        if (!iter->second->send_pending()) {
+            close_client(id, true);
+        }
+    }
+
+    for (const NetConnectionID id: close_requests) {
+        close_client(id, false);
+    }
+}
+
+void EpollNetServer::request_close(const NetConnectionID id)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_requests_mutex);
+        m_close_requests.push_back(id);
+    }
+    wakeup();
+}
+
+void EpollNetServer::request_flush(const NetConnectionID id)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_requests_mutex);
+        m_flush_requests.push_back(id);
+    }
+    wakeup();
+}
+
+void EpollNetServer::wakeup()
+{
+    const std::uint64_t one = 1;
+    // the counter can only overflow if the loop is stuck, in which case
+    // further wakeups are pointless anyways
+    while (::write(m_wakeup_fd, &one, sizeof(one)) < 0 && errno == EINTR);
+}
+
+void EpollNetServer::listen(const std::string &address,
+                            const std::uint16_t port,
+                            const int backlog)
+{
+    if (m_listen_fd >= 0) {
+        throw std::logic_error("EpollNetServer is already listening");
+    }
+
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo *result = nullptr;
+    const std::string service = std::to_string(port);
+    const int gai_err = ::getaddrinfo(address.empty() ? nullptr : address.c_str(),
+                                      service.c_str(), &hints, &result);
+    if (gai_err != 0) {
+        throw std::system_error(std::make_error_code(std::errc::invalid_argument),
+                                std::string("failed to resolve listen address: ")
+                                + ::gai_strerror(gai_err));
+    }
+
+    int fd = -1;
+    int last_errno = 0;
+    for (addrinfo *ai = result; ai; ai = ai->ai_next) {
+        fd = ::socket(ai->ai_family,
+                      ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                      ai->ai_protocol);
+        if (fd < 0) {
+            last_errno = errno;
+            continue;
+        }
+
+        const int reuse = 1;
+        ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (::bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+                ::listen(fd, backlog) == 0)
+        {
+            break;
+        }
+        last_errno = errno;
+        ::close(fd);
+        fd = -1;
+    }
+    ::freeaddrinfo(result);
+
+    if (fd < 0) {
+        errno = last_errno;
+        throw errno_error("failed to bind listening socket");
+    }
+
+    // level-triggered, so that connections which could not be accepted
+    // (e.g. because accept_pending() gave up) are retried on the next
+    // iteration of the loop instead of waiting for another connection
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u64 = LISTEN_TOKEN;
+    if (::epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        const std::system_error err = errno_error("failed to register listening socket");
+        ::close(fd);
+        throw err;
+    }
+    m_listen_fd = fd;
+}
+
+std::uint16_t EpollNetServer::port() const
+{
+    if (m_listen_fd < 0) {
+        return 0;
+    }
+
+    sockaddr_storage addr{};
+    socklen_t addrlen = sizeof(addr);
+    if (::getsockname(m_listen_fd,
+                      reinterpret_cast<sockaddr*>(&addr),
+                      &addrlen) != 0)
+    {
+        throw errno_error("failed to query listening socket");
+    }
+
+    switch (addr.ss_family) {
+    case AF_INET:
+        return ntohs(reinterpret_cast<const sockaddr_in&>(addr).sin_port);
+    case AF_INET6:
+        return ntohs(reinterpret_cast<const sockaddr_in6&>(addr).sin6_port);
+    default:
+        return 0;
+    }
+}
+
+void EpollNetServer::start()
+{
+    if (m_loop_thread.joinable()) {
+        throw std::logic_error("EpollNetServer is already running");
+    }
+    m_terminated = false;
+    m_loop_thread = std::thread(&EpollNetServer::loop, this);
+}
+
+void EpollNetServer::stop()
+{
+    if (!m_loop_thread.joinable()) {
+        return;
+    }
+    m_terminated = true;
+    wakeup();
+    m_loop_thread.join();
+}
+
+}
@@ -168,9 +168,11 @@ TerrainRect Fluid::source_rect(Source *obj) const
     return TerrainRect(x0, y0, x1, y1);
 }
 
-void Fluid::terrain_updated(TerrainRect r)
+void Fluid::terrain_updated(const TerrainRegion &r)
 {
-    m_impl->terrain_update(r);
+    for (const TerrainRect &rect: r) {
+        m_impl->terrain_update(rect);
+    }
 }
 
 void Fluid::start()
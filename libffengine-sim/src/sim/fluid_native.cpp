@@ -136,13 +136,12 @@ void NativeFluidSim::coordinator_impl()
         timelog_clock::time_point t_sync, t_sim;
 #endif
         // sync terrain
-        TerrainRect updated_rect;
+        TerrainRegion updated_region;
         {
             std::lock_guard<std::mutex> lock(m_terrain_update_mutex);
-            updated_rect = m_terrain_update;
-            m_terrain_update = NotARect;
+            updated_region.swap(m_terrain_update);
         }
-        if (!updated_rect.empty()) {
+        for (const TerrainRect &updated_rect: updated_region) {
             logger.logf(io::LOG_INFO, "terrain to sync (%u vertices)",
                         updated_rect.area());
             sync_terrain(updated_rect);
@@ -691,7 +690,7 @@ void NativeFluidSim::start_frame()
 void NativeFluidSim::terrain_update(TerrainRect r)
 {
     std::lock_guard<std::mutex> lock(m_terrain_update_mutex);
-    m_terrain_update = bounds(r, m_terrain_update);
+    m_terrain_update.add(r);
 }
 
 void NativeFluidSim::set_ocean_level(const FluidFloat level)
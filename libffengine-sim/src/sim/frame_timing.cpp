@@ -0,0 +1,175 @@
+/**********************************************************************
+File name: frame_timing.cpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#include "ffengine/sim/frame_timing.hpp"
+
+#include <algorithm>
+
+
+namespace sim {
+
+static FrameDurationStats duration_stats(
+        const std::vector<FrameTiming> &timings,
+        FrameDuration FrameTiming::*member,
+        std::vector<FrameDuration> &buffer)
+{
+    buffer.clear();
+    for (const FrameTiming &timing: timings) {
+        buffer.push_back(timing.*member);
+    }
+    std::sort(buffer.begin(), buffer.end());
+
+    // nearest-rank: the smallest value which is greater than or equal to
+    // p percent of all values
+    const std::size_t n = buffer.size();
+    const auto rank = [n](const std::size_t percent) {
+        return std::max<std::size_t>((percent*n + 99) / 100, 1) - 1;
+    };
+
+    FrameDurationStats result;
+    result.p50 = buffer[rank(50)];
+    result.p99 = buffer[rank(99)];
+    result.max = buffer.back();
+    return result;
+}
+
+
+FrameTimingSummary summarize_frame_timings(
+        const std::vector<FrameTiming> &timings)
+{
+    FrameTimingSummary result{};
+    result.frames = timings.size();
+    if (timings.empty()) {
+        return result;
+    }
+
+    for (const FrameTiming &timing: timings) {
+        result.dropped_frames += timing.dropped_frames;
+    }
+
+    std::vector<FrameDuration> buffer;
+    buffer.reserve(timings.size());
+    result.total = duration_stats(timings, &FrameTiming::total, buffer);
+    result.ops = duration_stats(timings, &FrameTiming::ops, buffer);
+    result.reshape = duration_stats(timings, &FrameTiming::reshape, buffer);
+    result.fluid_wait = duration_stats(timings, &FrameTiming::fluid_wait, buffer);
+    result.sandifier = duration_stats(timings, &FrameTiming::sandifier, buffer);
+    result.fluid_start = duration_stats(timings, &FrameTiming::fluid_start, buffer);
+    result.publish = duration_stats(timings, &FrameTiming::publish, buffer);
+    return result;
+}
+
+
+/* sim::FrameTimingBuffer */
+
+FrameTimingBuffer::FrameTimingBuffer(const std::size_t capacity):
+    m_timings(std::max<std::size_t>(capacity, 1)),
+    m_next(0),
+    m_size(0)
+{
+
+}
+
+void FrameTimingBuffer::clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_next = 0;
+    m_size = 0;
+}
+
+void FrameTimingBuffer::push(const FrameTiming &timing)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_timings[m_next] = timing;
+    m_next = (m_next + 1) % m_timings.size();
+    m_size = std::min(m_size + 1, m_timings.size());
+}
+
+std::vector<FrameTiming> FrameTimingBuffer::recent() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::vector<FrameTiming> result;
+    result.reserve(m_size);
+    const std::size_t first = (m_next + m_timings.size() - m_size)
+            % m_timings.size();
+    for (std::size_t i = 0; i < m_size; ++i) {
+        result.push_back(m_timings[(first + i) % m_timings.size()]);
+    }
+    return result;
+}
+
+FrameTimingSummary FrameTimingBuffer::summary() const
+{
+    return summarize_frame_timings(recent());
+}
+
+
+/* sim::FramePacer */
+
+FramePacer::FramePacer(const FrameDuration period,
+                       const FramePacing policy,
+                       const unsigned int max_catch_up_frames):
+    m_period(period),
+    m_policy(policy),
+    m_max_catch_up_frames(max_catch_up_frames),
+    m_deadline(WorldClock::now())
+{
+
+}
+
+void FramePacer::set_policy(const FramePacing policy,
+                            const unsigned int max_catch_up_frames)
+{
+    m_policy = policy;
+    m_max_catch_up_frames = max_catch_up_frames;
+}
+
+void FramePacer::reset(const WorldClock::time_point now)
+{
+    m_deadline = now;
+}
+
+unsigned int FramePacer::frame_done(const WorldClock::time_point now)
+{
+    m_deadline += m_period;
+    if (m_deadline > now) {
+        return 0;
+    }
+
+    // number of frame slots which are due, including the one at m_deadline
+    const unsigned int due = (now - m_deadline) / m_period + 1;
+    unsigned int keep = 1;
+    if (m_policy == FramePacing::CATCH_UP) {
+        keep = std::max(m_max_catch_up_frames, 1u);
+    }
+    if (due <= keep) {
+        return 0;
+    }
+
+    const unsigned int dropped = due - keep;
+    m_deadline += dropped * m_period;
+    return dropped;
+}
+
+
+}
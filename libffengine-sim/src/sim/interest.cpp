@@ -0,0 +1,104 @@
+/**********************************************************************
+File name: interest.cpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#include "ffengine/sim/interest.hpp"
+
+#include <algorithm>
+
+#include "ffengine/sim/world_view.hpp"
+
+
+namespace sim {
+
+/* sim::InterestGrid */
+
+const unsigned int InterestGrid::cell_size = WorldView::TILE_SIZE;
+
+InterestGrid::InterestGrid(const unsigned int terrain_size):
+    m_terrain_size(0),
+    m_cells_per_axis(0),
+    m_current_mark(0)
+{
+    reset(terrain_size);
+}
+
+std::uint32_t InterestGrid::next_mark() const
+{
+    if (++m_current_mark == 0) {
+        // wrapped around; stale marks could collide with new ones
+        std::fill(m_cell_marks.begin(), m_cell_marks.end(), 0);
+        m_current_mark = 1;
+    }
+    return m_current_mark;
+}
+
+void InterestGrid::unsubscribe_cells(const Subscriber subscriber,
+                                     const std::vector<unsigned int> &cells)
+{
+    for (const unsigned int index: cells) {
+        std::vector<Subscriber> &cell = m_cells[index];
+        auto iter = std::find(cell.begin(), cell.end(), subscriber);
+        if (iter != cell.end()) {
+            *iter = cell.back();
+            cell.pop_back();
+        }
+    }
+}
+
+void InterestGrid::reset(const unsigned int terrain_size)
+{
+    m_terrain_size = terrain_size;
+    m_cells_per_axis = (terrain_size + cell_size - 1) / cell_size;
+    m_cells.clear();
+    m_cells.resize(m_cells_per_axis*m_cells_per_axis);
+    m_cell_marks.clear();
+    m_cell_marks.resize(m_cells.size(), 0);
+    m_current_mark = 0;
+    m_subscriptions.clear();
+}
+
+void InterestGrid::set_interest(const Subscriber subscriber,
+                                const std::vector<TerrainRect> &rects)
+{
+    std::vector<unsigned int> &cells = m_subscriptions[subscriber];
+    unsubscribe_cells(subscriber, cells);
+    cells.clear();
+    for_each_cell(rects, [this, subscriber, &cells](const unsigned int cx,
+                                                   const unsigned int cy){
+        const unsigned int index = cy*m_cells_per_axis + cx;
+        m_cells[index].push_back(subscriber);
+        cells.push_back(index);
+    });
+}
+
+void InterestGrid::remove(const Subscriber subscriber)
+{
+    auto iter = m_subscriptions.find(subscriber);
+    if (iter == m_subscriptions.end()) {
+        return;
+    }
+    unsubscribe_cells(subscriber, iter->second);
+    m_subscriptions.erase(iter);
+}
+
+}
@@ -0,0 +1,299 @@
+/**********************************************************************
+File name: journal.cpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#include "ffengine/sim/journal.hpp"
+
+#include "ffengine/common/rle.hpp"
+
+#include "ffengine/math/algo.hpp"
+
+
+namespace sim {
+
+static io::Logger &logger = io::logging().get_logger("sim.journal");
+
+
+/* sim::WorldJournal::Entry */
+
+std::size_t WorldJournal::Entry::memory_usage() const
+{
+    return sizeof(Entry) + terrain.data.capacity() + fluid.data.capacity();
+}
+
+
+/* sim::WorldJournal */
+
+const std::size_t WorldJournal::DEFAULT_MEMORY_LIMIT = 64*1024*1024;
+
+WorldJournal::WorldJournal(const std::size_t memory_limit):
+    m_memory_limit(memory_limit),
+    m_memory_usage(0)
+{
+
+}
+
+void WorldJournal::latch_terrain(const Terrain &terrain,
+                                 const TerrainRect &rect,
+                                 std::vector<float> &dest)
+{
+    const unsigned int terrain_size = terrain.size();
+    const unsigned int width = rect.x1() - rect.x0();
+    dest.resize(rect.area());
+
+    const Terrain::Field *field = nullptr;
+    auto lock = terrain.readonly_field(field);
+    float *dest_ptr = dest.data();
+    for (unsigned int y = rect.y0(); y < rect.y1(); ++y) {
+        const Vector3f *row = &(*field)[y*terrain_size + rect.x0()];
+        for (unsigned int x = 0; x < width; ++x) {
+            *dest_ptr++ = row[x][Terrain::HEIGHT_ATTR];
+        }
+    }
+}
+
+void WorldJournal::latch_fluid(FluidBlocks &blocks,
+                               const TerrainRect &rect,
+                               std::vector<float> &dest)
+{
+    dest.resize(rect.area());
+
+    float *dest_ptr = dest.data();
+    for (unsigned int y = rect.y0(); y < rect.y1(); ++y) {
+        for (unsigned int x = rect.x0(); x < rect.x1(); ++x) {
+            *dest_ptr++ = blocks.cell_back(x, y)->fluid_height;
+        }
+    }
+}
+
+void WorldJournal::encode_delta(const std::vector<float> &before,
+                                const std::vector<float> &after,
+                                std::vector<std::uint8_t> &dest)
+{
+    const std::size_t count = before.size();
+    std::vector<float> difference(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        difference[i] = after[i] - before[i];
+    }
+
+    std::vector<std::uint8_t> shuffled(count*sizeof(float));
+    ffe::byte_shuffle(difference.data(), count, sizeof(float),
+                      shuffled.data());
+
+    dest.clear();
+    ffe::rle_encode(shuffled.data(), shuffled.size(), dest);
+    dest.shrink_to_fit();
+}
+
+void WorldJournal::decode_delta(const Delta &delta,
+                                std::vector<float> &dest)
+{
+    const std::size_t count = delta.rect.area();
+    std::vector<std::uint8_t> shuffled(count*sizeof(float));
+    ffe::rle_decode(delta.data.data(), delta.data.size(),
+                    shuffled.data(), shuffled.size());
+
+    dest.resize(count);
+    ffe::byte_unshuffle(shuffled.data(), count, sizeof(float), dest.data());
+}
+
+void WorldJournal::apply(const Entry &entry, WorldState &state,
+                         const float sign)
+{
+    std::vector<float> difference;
+
+    if (entry.terrain.rect) {
+        const TerrainRect &rect = entry.terrain.rect;
+        decode_delta(entry.terrain, difference);
+
+        const unsigned int terrain_size = state.terrain().size();
+        const unsigned int width = rect.x1() - rect.x0();
+        {
+            Terrain::Field *field = nullptr;
+            auto lock = state.terrain().writable_field(field);
+            const float *src = difference.data();
+            for (unsigned int y = rect.y0(); y < rect.y1(); ++y) {
+                Vector3f *row = &(*field)[y*terrain_size + rect.x0()];
+                for (unsigned int x = 0; x < width; ++x) {
+                    Terrain::height_t &h = row[x][Terrain::HEIGHT_ATTR];
+                    h = clamp(h + sign*(*src++),
+                              Terrain::min_height,
+                              Terrain::max_height);
+                }
+            }
+        }
+        state.terrain().notify_heightmap_changed(rect);
+    }
+
+    if (entry.fluid.rect) {
+        const TerrainRect &rect = entry.fluid.rect;
+        decode_delta(entry.fluid, difference);
+
+        FluidBlocks &blocks = state.fluid().blocks();
+        const float *src = difference.data();
+        for (unsigned int y = rect.y0(); y < rect.y1(); ++y) {
+            for (unsigned int x = rect.x0(); x < rect.x1(); ++x) {
+                FluidCell &cell = *blocks.cell_back(x, y);
+                cell.fluid_height = std::max(
+                            FluidFloat(0),
+                            cell.fluid_height + sign*(*src++));
+                blocks.block_for_cell(x, y)->set_active(true);
+            }
+        }
+    }
+}
+
+void WorldJournal::trim()
+{
+    while (m_memory_usage > m_memory_limit && !m_undo.empty()) {
+        m_memory_usage -= m_undo.front().memory_usage();
+        m_undo.pop_front();
+    }
+    while (m_memory_usage > m_memory_limit && !m_redo.empty()) {
+        m_memory_usage -= m_redo.front().memory_usage();
+        m_redo.pop_front();
+    }
+}
+
+WorldOperationResult WorldJournal::execute(WorldOperation &op,
+                                           WorldState &state)
+{
+    const TerrainRect terrain_rect = op.touched_terrain_rect(state);
+    const TerrainRect fluid_rect = op.touched_fluid_rect(state);
+    if (!terrain_rect && !fluid_rect) {
+        return op.execute(state);
+    }
+
+    std::vector<float> terrain_before;
+    std::vector<float> fluid_before;
+    if (terrain_rect) {
+        latch_terrain(state.terrain(), terrain_rect, terrain_before);
+    }
+    if (fluid_rect) {
+        latch_fluid(state.fluid().blocks(), fluid_rect, fluid_before);
+    }
+
+    const WorldOperationResult result = op.execute(state);
+    if (result != NO_ERROR) {
+        return result;
+    }
+
+    Entry entry;
+    std::vector<float> after;
+    if (terrain_rect) {
+        latch_terrain(state.terrain(), terrain_rect, after);
+        entry.terrain.rect = terrain_rect;
+        encode_delta(terrain_before, after, entry.terrain.data);
+    }
+    if (fluid_rect) {
+        latch_fluid(state.fluid().blocks(), fluid_rect, after);
+        entry.fluid.rect = fluid_rect;
+        encode_delta(fluid_before, after, entry.fluid.data);
+    }
+
+    for (const Entry &dropped: m_redo) {
+        m_memory_usage -= dropped.memory_usage();
+    }
+    m_redo.clear();
+
+    m_memory_usage += entry.memory_usage();
+    m_undo.emplace_back(std::move(entry));
+    trim();
+
+    logger.logf(io::LOG_DEBUG, "recorded operation, %zu entries using %zu bytes",
+                m_undo.size(), m_memory_usage);
+
+    return result;
+}
+
+bool WorldJournal::undo(WorldState &state)
+{
+    if (m_undo.empty()) {
+        return false;
+    }
+
+    Entry entry = std::move(m_undo.back());
+    m_undo.pop_back();
+    apply(entry, state, -1.f);
+    m_redo.emplace_back(std::move(entry));
+    return true;
+}
+
+bool WorldJournal::redo(WorldState &state)
+{
+    if (m_redo.empty()) {
+        return false;
+    }
+
+    Entry entry = std::move(m_redo.back());
+    m_redo.pop_back();
+    apply(entry, state, 1.f);
+    m_undo.emplace_back(std::move(entry));
+    return true;
+}
+
+void WorldJournal::clear()
+{
+    m_undo.clear();
+    m_redo.clear();
+    m_memory_usage = 0;
+}
+
+
+namespace ops {
+
+/* sim::ops::JournalUndo */
+
+JournalUndo::JournalUndo(WorldJournal &journal):
+    m_journal(journal)
+{
+
+}
+
+WorldOperationResult JournalUndo::execute(WorldState &state)
+{
+    if (!m_journal.undo(state)) {
+        return INVALID_ARGUMENT;
+    }
+    return NO_ERROR;
+}
+
+
+/* sim::ops::JournalRedo */
+
+JournalRedo::JournalRedo(WorldJournal &journal):
+    m_journal(journal)
+{
+
+}
+
+WorldOperationResult JournalRedo::execute(WorldState &state)
+{
+    if (!m_journal.redo(state)) {
+        return INVALID_ARGUMENT;
+    }
+    return NO_ERROR;
+}
+
+}
+
+}
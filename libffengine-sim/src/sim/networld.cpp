@@ -23,13 +23,18 @@ the AUTHORS file.
 **********************************************************************/
 #define QT_NO_EMIT
 
+#include <google/protobuf/arena.h>
 #include <google/protobuf/message.h>
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 
 #include "ffengine/sim/networld.hpp"
 
+#include "replication.pb.h"
 #include "world_command.pb.h"
 
+#include <array>
+#include <atomic>
+#include <cstring>
 #include <iostream>
 
 
@@ -41,6 +46,32 @@ static RejectingMessageHandler default_message_handler;
 
 /* sim::NetMessageParser */
 
+constexpr size_t NetMessageParser::RECV_BUFFER_SIZE;
+constexpr size_t NetMessageParser::ARENA_BLOCK_SIZE;
+constexpr size_t NetMessageParser::ARENA_RECYCLE_SIZE;
+
+struct NetMessageParser::MessageArena
+{
+    MessageArena():
+        initial_block(new char[ARENA_BLOCK_SIZE]),
+        arena(options(initial_block.get()))
+    {
+
+    }
+
+    std::unique_ptr<char[]> initial_block;
+    google::protobuf::Arena arena;
+
+    static google::protobuf::ArenaOptions options(char *initial_block)
+    {
+        google::protobuf::ArenaOptions result;
+        result.initial_block = initial_block;
+        result.initial_block_size = ARENA_BLOCK_SIZE;
+        result.start_block_size = ARENA_BLOCK_SIZE;
+        return result;
+    }
+};
+
 NetMessageParser::NetMessageParser(LinkControlCallback &&link_control_cb,
                                    ErrorCallback &&error_cb,
                                    const NetConnectionID &id):
@@ -48,11 +79,11 @@ NetMessageParser::NetMessageParser(LinkControlCallback &&link_control_cb,
     m_link_control_cb(std::move(link_control_cb)),
     m_error_cb(std::move(error_cb)),
     m_message_handler(&default_message_handler),
-    m_recv_state(RECV_WAIT_FOR_HEADER),
-    m_recv_barrier(HEADER_SIZE),
-    m_written_up_to(0)
+    m_read_pos(0),
+    m_write_pos(0),
+    m_reset_counter(0)
 {
-    m_recv_buffer.resize(m_recv_barrier);
+
 }
 
 void NetMessageParser::fail()
@@ -61,17 +92,49 @@ void NetMessageParser::fail()
     m_error_cb();
 }
 
-bool NetMessageParser::parse(google::protobuf::Message &dest)
+bool NetMessageParser::parse(google::protobuf::Message &dest,
+                             const char *data,
+                             const size_t size)
+{
+    return dest.ParseFromArray(data, size);
+}
+
+template <typename message_t>
+std::shared_ptr<message_t> NetMessageParser::create_message()
+{
+    if (!m_arena) {
+        m_arena = std::make_shared<MessageArena>();
+    }
+    // the aliasing constructor makes the message keep the arena alive
+    return std::shared_ptr<message_t>(
+                m_arena,
+                google::protobuf::Arena::CreateMessage<message_t>(
+                    &m_arena->arena));
+}
+
+void NetMessageParser::recycle_arena()
 {
-    return dest.ParseFromArray(m_recv_buffer.data(), m_recv_buffer.size());
+    if (!m_arena) {
+        return;
+    }
+    if (m_arena.use_count() == 1) {
+        // nobody else references the arena and only we could create new
+        // references. use_count() is only a relaxed load though: the fence
+        // makes sure that the accesses of other threads to their (now
+        // released) messages happen before the arena is reset, pairing with
+        // the release ordering of the reference count decrement.
+        std::atomic_thread_fence(std::memory_order_acquire);
+        m_arena->arena.Reset();
+    } else if (m_arena->arena.SpaceAllocated() > ARENA_RECYCLE_SIZE) {
+        m_arena.reset();
+    }
 }
 
-void NetMessageParser::received_header()
+bool NetMessageParser::read_header(uint32_t &msgclass, uint32_t &msgsize)
 {
-    const uint8_t *buffer = reinterpret_cast<const uint8_t*>(m_recv_buffer.data());
+    const uint8_t *buffer = reinterpret_cast<const uint8_t*>(
+                &m_recv_buffer[m_read_pos]);
 
-    uint32_t msgclass = 0;
-    uint32_t msgsize = 0;
     bool success = true;
     success = success && google::protobuf::io::CodedInputStream::ReadLittleEndian32FromArray(
                 &buffer[0], &msgclass);
@@ -82,8 +145,7 @@ void NetMessageParser::received_header()
         logger.log(io::LOG_ERROR) << "connection " << m_id
                                   << " failed to receive header"
                                   << io::submit;
-        fail();
-        return;
+        return false;
     }
 
     if (msgsize > MAX_MESSAGE_SIZE) {
@@ -93,84 +155,150 @@ void NetMessageParser::received_header()
                                     << MAX_MESSAGE_SIZE << "). "
                                     << "protocol violation, killing."
                                     << io::submit;
-        fail();
-        return;
+        return false;
     }
 
-    m_recv_barrier = msgsize;
-    m_recv_state = RECV_PAYLOAD;
-    m_curr_class = NetMessageClass(msgclass);
+    return true;
 }
 
-void NetMessageParser::received_payload()
+bool NetMessageParser::received_payload(const NetMessageClass msgclass,
+                                        const char *data,
+                                        const size_t size)
 {
-    bool pass = false;
-    switch (m_curr_class)
+    switch (msgclass)
     {
     case MSGCLASS_LINK_CONTROL:
     {
-        auto protobuf = std::make_unique<messages::NetWorldControl>();
-        if (!parse(*protobuf)) {
-            fail();
-            return;
+        auto protobuf = create_message<messages::NetWorldControl>();
+        if (!parse(*protobuf, data, size)) {
+            return false;
         }
         m_link_control_cb(std::move(protobuf));
-        pass = true;
-        break;
+        return true;
     }
     case MSGCLASS_WORLD_COMMAND:
     {
-        auto protobuf = std::make_unique<messages::WorldCommand>();
-        if (!parse(*protobuf)) {
-            fail();
-            return;
+        auto protobuf = create_message<messages::WorldCommand>();
+        if (!parse(*protobuf, data, size)) {
+            return false;
         }
-        pass = (*m_message_handler).msg_world_command(std::move(protobuf));
-        break;
+        return (*m_message_handler).msg_world_command(std::move(protobuf));
+    }
+    case MSGCLASS_WORLD_COMMAND_RESPONSE:
+    {
+        auto protobuf = create_message<messages::WorldCommandResponse>();
+        if (!parse(*protobuf, data, size)) {
+            return false;
+        }
+        return (*m_message_handler).msg_world_command_response(
+                    std::move(protobuf));
+    }
+    case MSGCLASS_REPLICATION_UPDATE:
+    {
+        auto protobuf = create_message<messages::ReplicationUpdate>();
+        if (!parse(*protobuf, data, size)) {
+            return false;
+        }
+        return (*m_message_handler).msg_replication_update(
+                    std::move(protobuf));
+    }
+    case MSGCLASS_REPLICATION_FEEDBACK:
+    {
+        auto protobuf = create_message<messages::ReplicationFeedback>();
+        if (!parse(*protobuf, data, size)) {
+            return false;
+        }
+        return (*m_message_handler).msg_replication_feedback(
+                    std::move(protobuf));
+    }
+    case MSGCLASS_COMMAND_LOG_FRAME:
+    {
+        // only valid in command log files
+        return false;
     }
     }
 
-    if (!pass) {
-        fail();
-        return;
+    return false;
+}
+
+void NetMessageParser::parse_buffer()
+{
+    const uint64_t reset_counter = m_reset_counter;
+    while (m_write_pos - m_read_pos >= HEADER_SIZE) {
+        uint32_t msgclass = 0;
+        uint32_t msgsize = 0;
+        if (!read_header(msgclass, msgsize)) {
+            fail();
+            return;
+        }
+
+        if (m_write_pos - m_read_pos < size_t(HEADER_SIZE) + msgsize) {
+            break;
+        }
+
+        const char *payload = &m_recv_buffer[m_read_pos + HEADER_SIZE];
+        m_read_pos += HEADER_SIZE + msgsize;
+        const bool pass = received_payload(NetMessageClass(msgclass),
+                                           payload, msgsize);
+        if (m_reset_counter != reset_counter) {
+            // a callback has reset the parser, the buffer is gone
+            return;
+        }
+        if (!pass) {
+            fail();
+            return;
+        }
     }
 
-    m_recv_state = RECV_WAIT_FOR_HEADER;
-    m_recv_barrier = HEADER_SIZE;
+    if (m_read_pos == m_write_pos) {
+        m_read_pos = 0;
+        m_write_pos = 0;
+    }
 }
 
-void NetMessageParser::received_to_barrier()
+void NetMessageParser::make_room()
 {
-    switch (m_recv_state)
-    {
-    case RECV_WAIT_FOR_HEADER:
-    {
-        received_header();
-        break;
+    const size_t pending = m_write_pos - m_read_pos;
+    size_t frame_size = HEADER_SIZE;
+    if (pending >= HEADER_SIZE) {
+        uint32_t msgclass = 0;
+        uint32_t msgsize = 0;
+        // the header has been validated by parse_buffer() already
+        read_header(msgclass, msgsize);
+        frame_size += msgsize;
     }
-    case RECV_PAYLOAD:
+
+    const size_t capacity = std::max(frame_size, RECV_BUFFER_SIZE);
+    const size_t free_space = m_recv_buffer.size() - m_write_pos;
+    if (m_read_pos > 0 &&
+            (free_space < frame_size - pending ||
+             free_space < m_recv_buffer.size() / 4))
     {
-        received_payload();
-        break;
+        std::memmove(&m_recv_buffer[0], &m_recv_buffer[m_read_pos], pending);
+        m_read_pos = 0;
+        m_write_pos = pending;
     }
+
+    if (m_recv_buffer.size() < capacity) {
+        m_recv_buffer.resize(capacity);
     }
-    m_written_up_to = 0;
-    m_recv_buffer.resize(m_recv_barrier);
 }
 
 void NetMessageParser::reset()
 {
+    m_arena.reset();
     m_recv_buffer.clear();
     m_recv_buffer.shrink_to_fit();
-    m_recv_state = RECV_WAIT_FOR_HEADER;
-    m_recv_barrier = HEADER_SIZE;
-    m_written_up_to = 0;
+    m_read_pos = 0;
+    m_write_pos = 0;
+    ++m_reset_counter;
 }
 
 std::pair<char *, size_t> NetMessageParser::next_buffer()
 {
-    size_t to_recv = m_recv_barrier - m_written_up_to;
-    return std::make_pair(&m_recv_buffer[m_written_up_to], to_recv);
+    make_room();
+    return std::make_pair(&m_recv_buffer[m_write_pos],
+                          m_recv_buffer.size() - m_write_pos);
 }
 
 void NetMessageParser::set_message_handler(IMessageHandler *handler)
@@ -184,19 +312,123 @@ void NetMessageParser::set_message_handler(IMessageHandler *handler)
 
 void NetMessageParser::written(size_t bytes)
 {
-    m_written_up_to += bytes;
-    if (m_written_up_to > m_recv_barrier) {
+    if (bytes > m_recv_buffer.size() - m_write_pos) {
         throw std::logic_error("NetMessageParser user wrote more bytes than allowed");
     }
 
-    if (m_written_up_to == m_recv_barrier) {
-        received_to_barrier();
+    m_write_pos += bytes;
+    recycle_arena();
+    parse_buffer();
+}
+
+
+/* sim::NetFrameBuilder */
+
+constexpr size_t NetFrameBuilder::SEGMENT_SIZE;
+constexpr size_t NetFrameBuilder::MAX_FREE_SEGMENTS;
+
+NetFrameBuilder::NetFrameBuilder():
+    m_send_offset(0),
+    m_pending_bytes(0)
+{
+
+}
+
+char *NetFrameBuilder::reserve(const size_t size)
+{
+    if (!m_segments.empty()) {
+        Segment &last = m_segments.back();
+        if (last.capacity - last.size >= size) {
+            char *result = &last.data[last.size];
+            last.size += size;
+            return result;
+        }
+    }
+
+    Segment segment;
+    if (size <= SEGMENT_SIZE && !m_free_segments.empty()) {
+        segment = std::move(m_free_segments.back());
+        m_free_segments.pop_back();
+    } else {
+        segment.capacity = std::max(size, SEGMENT_SIZE);
+        segment.data.reset(new char[segment.capacity]);
+    }
+    segment.size = size;
+    m_segments.emplace_back(std::move(segment));
+    return &m_segments.back().data[0];
+}
+
+void NetFrameBuilder::append(const NetMessageClass msgclass,
+                             const google::protobuf::Message &msg)
+{
+    const size_t payload_size = msg.ByteSizeLong();
+    if (payload_size > NetMessageParser::MAX_MESSAGE_SIZE) {
+        throw std::length_error("message exceeds maximum message size");
+    }
+
+    const size_t frame_size = NetMessageParser::HEADER_SIZE + payload_size;
+    uint8_t *dest = reinterpret_cast<uint8_t*>(reserve(frame_size));
+    dest = google::protobuf::io::CodedOutputStream::WriteLittleEndian32ToArray(
+                msgclass, dest);
+    dest = google::protobuf::io::CodedOutputStream::WriteLittleEndian32ToArray(
+                payload_size, dest);
+    msg.SerializeWithCachedSizesToArray(dest);
+    m_pending_bytes += frame_size;
+}
+
+void NetFrameBuilder::clear()
+{
+    consume(m_pending_bytes);
+}
+
+void NetFrameBuilder::consume(size_t bytes)
+{
+    if (bytes > m_pending_bytes) {
+        throw std::logic_error("NetFrameBuilder user consumed more bytes than pending");
+    }
+
+    m_pending_bytes -= bytes;
+    while (bytes > 0) {
+        Segment &front = m_segments.front();
+        const size_t available = front.size - m_send_offset;
+        if (bytes < available) {
+            m_send_offset += bytes;
+            return;
+        }
+        bytes -= available;
+        m_send_offset = 0;
+
+        if (front.capacity == SEGMENT_SIZE &&
+                m_free_segments.size() < MAX_FREE_SEGMENTS)
+        {
+            front.size = 0;
+            m_free_segments.emplace_back(std::move(front));
+        }
+        m_segments.pop_front();
     }
 }
 
+int NetFrameBuilder::pending(struct iovec *iov, const int max_iov) const
+{
+    int count = 0;
+    size_t offset = m_send_offset;
+    for (auto iter = m_segments.begin();
+         iter != m_segments.end() && count < max_iov;
+         ++iter)
+    {
+        iov[count].iov_base = &iter->data[offset];
+        iov[count].iov_len = iter->size - offset;
+        offset = 0;
+        ++count;
+    }
+    return count;
+}
+
 
 /* sim::TCPServerClient */
 
+constexpr size_t NetServerClient::MAX_PENDING_BYTES;
+
 std::atomic<uint64_t> NetServerClient::m_connection_id_ctr(0);
 
 NetServerClient::NetServerClient(QTcpSocket &socket, QObject *parent):
@@ -258,7 +490,7 @@ void NetServerClient::fail()
     m_sig_disconnected.emit();
 }
 
-void NetServerClient::link_control_received(std::unique_ptr<messages::NetWorldControl>&&)
+void NetServerClient::link_control_received(std::shared_ptr<messages::NetWorldControl>&&)
 {
 
 }
@@ -268,13 +500,14 @@ void NetServerClient::on_data_received()
     char *dest;
     size_t size;
     while (m_socket.bytesAvailable() > 0) {
+        // the parser hands out all of its free space, so that everything
+        // which is available is read at once
         std::tie(dest, size) = m_message_parser.next_buffer();
-        if (size > 0) {
-            int64_t bytes_read = m_socket.read(dest, size);
-            m_message_parser.written(bytes_read);
-        } else {
-            m_message_parser.written(0);
+        int64_t bytes_read = m_socket.read(dest, size);
+        if (bytes_read < 0) {
+            break;
         }
+        m_message_parser.written(bytes_read);
     }
 }
 
@@ -310,6 +543,37 @@ void NetServerClient::flush()
                 << io::submit;
         return;
     }
+    bool overflow;
+    {
+        std::lock_guard<std::mutex> lock(m_send_mutex);
+        // QTcpSocket buffers internally without bound, so what it has not
+        // written yet counts against the limit, too
+        const size_t unsent = std::max<qint64>(m_socket.bytesToWrite(), 0)
+                + m_send_frames.pending_bytes();
+        overflow = unsent > MAX_PENDING_BYTES;
+    }
+    if (overflow) {
+        logger.log(io::LOG_WARNING) << "connection " << m_connection_id
+                                    << " does not keep up with the sent data"
+                                    << io::submit;
+        fail();
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_send_mutex);
+        // everything is handed over to the socket at once
+        std::array<struct iovec, 16> iov;
+        int count;
+        while ((count = m_send_frames.pending(iov.data(), iov.size())) > 0) {
+            size_t written = 0;
+            for (int i = 0; i < count; ++i) {
+                m_socket.write(static_cast<const char*>(iov[i].iov_base),
+                               iov[i].iov_len);
+                written += iov[i].iov_len;
+            }
+            m_send_frames.consume(written);
+        }
+    }
     m_socket.flush();
 }
 
@@ -324,13 +588,27 @@ void NetServerClient::terminate()
         return;
     }
 
-    m_send_buffer.clear();
-    m_send_buffer.shrink_to_fit();
+    {
+        std::lock_guard<std::mutex> lock(m_send_mutex);
+        m_send_frames.clear();
+    }
     m_message_parser.reset();
     m_socket.close();
     m_terminated = true;
 }
 
+void NetServerClient::send_message(const messages::WorldCommandResponse &msg)
+{
+    std::lock_guard<std::mutex> lock(m_send_mutex);
+    m_send_frames.append(MSGCLASS_WORLD_COMMAND_RESPONSE, msg);
+}
+
+void NetServerClient::send_message(const messages::ReplicationUpdate &msg)
+{
+    std::lock_guard<std::mutex> lock(m_send_mutex);
+    m_send_frames.append(MSGCLASS_REPLICATION_UPDATE, msg);
+}
+
 void NetServerClient::set_message_handler(IMessageHandler *handler)
 {
     m_message_parser.set_message_handler(handler);
@@ -26,7 +26,7 @@ the AUTHORS file.
 #include <algorithm>
 #include <cassert>
 #include <iomanip>
-#include <limits>
+#include <string>
 
 
 namespace sim {
@@ -37,31 +37,39 @@ constexpr Object::ID NULL_OBJECT_ID = 0;
 /* sim::Object */
 
 Object::Object(const ID object_id):
-    m_object_id(object_id)
+    m_object_id(object_id),
+    m_referees(nullptr)
 {
 
 }
 
 Object::~Object()
 {
-    for (auto &referee: m_referees)
-    {
+    abstract_object_ptr *referee = m_referees;
+    while (referee) {
+        abstract_object_ptr *next = referee->m_next_referee;
         referee->kill();
+        referee = next;
     }
-    m_referees.clear();
+    m_referees = nullptr;
 }
 
 
 /* sim::ObjectManager */
 
-ObjectManager::ObjectManager()
+constexpr std::size_t ObjectManager::PAGE_SIZE;
+constexpr std::size_t ObjectManager::MAX_PAGES;
+constexpr Object::ID ObjectManager::MAX_OBJECT_ID;
+
+ObjectManager::ObjectManager():
+    m_allocated_pages(0)
 {
     m_free_list.emplace_back(
-                IDRegion{1, std::numeric_limits<Object::ID>::max()-1}
+                IDRegion{1, MAX_OBJECT_ID}
                 );
 }
 
-inline const ObjectManager::Chunk *ObjectManager::get_object_chunk(
+inline const ObjectManager::Page *ObjectManager::get_page(
         Object::ID object_id) const
 {
     if (object_id == NULL_OBJECT_ID) {
@@ -71,85 +79,81 @@ inline const ObjectManager::Chunk *ObjectManager::get_object_chunk(
     // offset by one, we don’t waste space here
     --object_id;
 
-    const std::vector<Chunk>::size_type chunk_index =
-            object_id / Chunk::CHUNK_SIZE;
-
-    if (chunk_index >= m_chunks.size()) {
+    const Object::ID page_index = object_id / PAGE_SIZE;
+    if (page_index >= m_pages.size()) {
         return nullptr;
     }
 
-    return &m_chunks[chunk_index];
+    return m_pages[page_index].get();
 }
 
-inline ObjectManager::Chunk *ObjectManager::get_object_chunk(
+inline ObjectManager::Page *ObjectManager::get_page(
         Object::ID object_id)
 {
-    if (object_id == NULL_OBJECT_ID) {
-        return nullptr;
-    }
-
-    // offset by one, we don’t waste space here
-    --object_id;
-
-    const std::vector<Chunk>::size_type chunk_index =
-            object_id / Chunk::CHUNK_SIZE;
-
-    if (chunk_index >= m_chunks.size()) {
-        return nullptr;
-    }
-
-    return &m_chunks[chunk_index];
+    return const_cast<Page*>(
+                static_cast<const ObjectManager&>(*this).get_page(object_id));
 }
 
 inline const std::unique_ptr<Object> *ObjectManager::get_object_ptr(Object::ID object_id) const
 {
-    const Chunk *chunk = get_object_chunk(object_id);
-    if (!chunk) {
+    const Page *page = get_page(object_id);
+    if (!page) {
         return nullptr;
     }
-    return &(chunk->objects[(object_id-1) % Chunk::CHUNK_SIZE]);
+    return &(page->objects[(object_id-1) % PAGE_SIZE]);
 }
 
 std::unique_ptr<Object> *ObjectManager::get_object_ptr(Object::ID object_id)
 {
-    Chunk *chunk = get_object_chunk(object_id);
-    if (!chunk) {
+    Page *page = get_page(object_id);
+    if (!page) {
         return nullptr;
     }
-    return &(chunk->objects[(object_id-1) % Chunk::CHUNK_SIZE]);
+    return &(page->objects[(object_id-1) % PAGE_SIZE]);
 }
 
-inline ObjectManager::Chunk &ObjectManager::require_object_chunk(Object::ID object_id)
+inline ObjectManager::Page &ObjectManager::require_page(Object::ID object_id)
 {
     if (object_id == NULL_OBJECT_ID) {
         throw std::runtime_error("NULL_OBJECT require");
     }
+    if (object_id > MAX_OBJECT_ID) {
+        throw std::runtime_error("object id out of range");
+    }
 
     // offset by one, we don’t waste space here
     --object_id;
 
-    const std::vector<Chunk>::size_type chunk_index =
-            object_id / Chunk::CHUNK_SIZE;
-
-    if (chunk_index >= m_chunks.size()) {
-        m_chunks.resize(chunk_index+1);
+    const std::size_t page_index = object_id / PAGE_SIZE;
+    if (page_index >= m_pages.size()) {
+        m_pages.resize(page_index+1);
     }
 
-    return m_chunks[chunk_index];
+    std::unique_ptr<Page> &page = m_pages[page_index];
+    if (!page) {
+        page = std::make_unique<Page>();
+        page->live = 0;
+        ++m_allocated_pages;
+    }
+    return *page;
 }
 
-inline std::unique_ptr<Object> &ObjectManager::require_object_ptr(Object::ID object_id)
+void ObjectManager::store_object(std::unique_ptr<Object> &&obj)
 {
-    return require_object_chunk(object_id).objects[(object_id-1) % Chunk::CHUNK_SIZE];
+    const Object::ID object_id = obj->object_id();
+    Page &page = require_page(object_id);
+    std::unique_ptr<Object> &slot = page.objects[(object_id-1) % PAGE_SIZE];
+    assert(!slot);
+    slot = std::move(obj);
+    ++page.live;
 }
 
 Object::ID ObjectManager::allocate_object_id()
 {
     if (m_free_list.empty()) {
-        throw std::runtime_error("Out of ObjectIDs. What kind of machine are "
-                                 "you using?? These are 64bit integers! You "
-                                 "cannot simply exhaust the 64bit integer "
-                                 "space without running out of memory first!");
+        throw std::runtime_error("out of object IDs: all " +
+                                 std::to_string(MAX_OBJECT_ID) +
+                                 " IDs (ObjectManager::MAX_OBJECT_ID) are in use");
     }
     IDRegion &first = m_free_list.front();
     const Object::ID result = first.first++;
@@ -164,6 +168,9 @@ Object::ID ObjectManager::allocate_object_id()
 void ObjectManager::emplace_object(std::unique_ptr<Object> &&obj)
 {
     const Object::ID object_id = obj->object_id();
+    if (object_id > MAX_OBJECT_ID) {
+        throw std::runtime_error("emplace_object id out of range");
+    }
 
     auto match = std::lower_bound(
                 m_free_list.begin(),
@@ -191,7 +198,7 @@ void ObjectManager::emplace_object(std::unique_ptr<Object> &&obj)
         throw std::runtime_error("emplace_object id not in free list");
     }
 
-    require_object_ptr(object_id) = std::move(obj);
+    store_object(std::move(obj));
 
     // first the easy cases:
     if (region.first == object_id) {
@@ -265,7 +272,9 @@ void ObjectManager::release_object_id(Object::ID object_id)
         } else if (region.first + region.count == object_id) {
             region.count++;
             // check if the next region is now adjacent to the current
-            if (match->first == region.first + region.count) {
+            if (match != m_free_list.end() &&
+                    match->first == region.first + region.count)
+            {
                 // merge with next
                 region.count += match->count;
                 m_free_list.erase(match);
@@ -279,7 +288,7 @@ void ObjectManager::release_object_id(Object::ID object_id)
 
 void ObjectManager::set_object(std::unique_ptr<Object> &&obj)
 {
-    require_object_ptr(obj->object_id()) = std::move(obj);
+    store_object(std::move(obj));
 }
 
 void ObjectManager::kill(Object::ID object_id)
@@ -288,15 +297,30 @@ void ObjectManager::kill(Object::ID object_id)
         return;
     }
 
-    std::unique_ptr<Object> *object_ptr = get_object_ptr(object_id);
-    if (!object_ptr) {
+    const std::size_t page_index = (object_id-1) / PAGE_SIZE;
+    Page *page = get_page(object_id);
+    if (!page) {
         return;
     }
-    if (!(*object_ptr)) {
+    std::unique_ptr<Object> &slot = page->objects[(object_id-1) % PAGE_SIZE];
+    if (!slot) {
         return;
     }
 
-    *object_ptr = nullptr;
+    // the object is deleted last, so that the bookkeeping is consistent if
+    // its destructor uses the ObjectManager
+    std::unique_ptr<Object> object(std::move(slot));
+    --page->live;
+    if (page->live == 0) {
+        m_pages[page_index] = nullptr;
+        --m_allocated_pages;
+        while (!m_pages.empty() && !m_pages.back()) {
+            m_pages.pop_back();
+        }
+        if (m_pages.size() < m_pages.capacity() / 4) {
+            m_pages.shrink_to_fit();
+        }
+    }
     release_object_id(object_id);
 }
 
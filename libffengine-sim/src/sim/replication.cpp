@@ -0,0 +1,590 @@
+/**********************************************************************
+File name: replication.cpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#include "ffengine/sim/replication.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "ffengine/math/algo.hpp"
+
+#include "ffengine/sim/fluid_base.hpp"
+
+#include "replication.pb.h"
+
+
+namespace sim {
+
+static const float HEIGHT_SCALE = 65535.f / (Terrain::max_height -
+                                             Terrain::min_height);
+
+std::uint16_t quantize_height(const Terrain::height_t height)
+{
+    const float scaled = (clamp(height, Terrain::min_height,
+                                Terrain::max_height)
+                          - Terrain::min_height) * HEIGHT_SCALE;
+    return std::uint16_t(std::lround(scaled));
+}
+
+Terrain::height_t dequantize_height(const std::uint16_t value)
+{
+    return Terrain::min_height + float(value) / HEIGHT_SCALE;
+}
+
+static inline void put_varint(std::string &dest, std::uint32_t value)
+{
+    while (value >= 0x80) {
+        dest.push_back(char((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    dest.push_back(char(value));
+}
+
+static inline bool get_varint(const std::string &src,
+                              std::size_t &pos,
+                              std::uint32_t &value)
+{
+    value = 0;
+    // residuals fit into three bytes, counts into five
+    for (unsigned int shift = 0; shift < 35; shift += 7) {
+        if (pos >= src.size()) {
+            return false;
+        }
+        const std::uint8_t byte = std::uint8_t(src[pos++]);
+        value |= std::uint32_t(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline std::uint16_t zigzag(const std::uint16_t residual)
+{
+    const std::int16_t value = std::int16_t(residual);
+    return std::uint16_t((std::uint16_t(value) << 1) ^
+                         std::uint16_t(value >> 15));
+}
+
+static inline std::uint16_t unzigzag(const std::uint16_t value)
+{
+    return std::uint16_t((value >> 1) ^ -(value & 1));
+}
+
+void encode_height_tile(const std::uint16_t *values,
+                        const std::uint16_t *base,
+                        const std::size_t count,
+                        std::string &dest)
+{
+    dest.clear();
+    std::uint16_t previous = 0;
+    std::size_t i = 0;
+    while (i < count) {
+        // run of zero residuals
+        const std::size_t zeros_start = i;
+        while (i < count) {
+            const std::uint16_t prediction = base ? base[i] : previous;
+            if (values[i] != prediction) {
+                break;
+            }
+            previous = values[i];
+            ++i;
+        }
+        put_varint(dest, i - zeros_start);
+
+        // run of non-zero residuals; measured first, as the count precedes
+        // the values
+        std::size_t literals_end = i;
+        std::uint16_t lookahead_previous = previous;
+        while (literals_end < count) {
+            const std::uint16_t prediction =
+                    base ? base[literals_end] : lookahead_previous;
+            if (values[literals_end] == prediction) {
+                break;
+            }
+            lookahead_previous = values[literals_end];
+            ++literals_end;
+        }
+        put_varint(dest, literals_end - i);
+        for (; i < literals_end; ++i) {
+            const std::uint16_t prediction = base ? base[i] : previous;
+            put_varint(dest, zigzag(std::uint16_t(values[i] - prediction)));
+            previous = values[i];
+        }
+    }
+}
+
+bool decode_height_tile(const std::string &src,
+                        const std::uint16_t *base,
+                        std::uint16_t *values,
+                        const std::size_t count)
+{
+    std::size_t pos = 0;
+    std::size_t i = 0;
+    std::uint16_t previous = 0;
+    while (i < count) {
+        std::uint32_t zeros, literals;
+        if (!get_varint(src, pos, zeros) || zeros > count - i) {
+            return false;
+        }
+        for (const std::size_t end = i + zeros; i < end; ++i) {
+            values[i] = base ? base[i] : previous;
+            previous = values[i];
+        }
+
+        if (!get_varint(src, pos, literals) || literals > count - i) {
+            return false;
+        }
+        for (const std::size_t end = i + literals; i < end; ++i) {
+            std::uint32_t residual;
+            if (!get_varint(src, pos, residual) || residual > 0xffff) {
+                return false;
+            }
+            const std::uint16_t prediction = base ? base[i] : previous;
+            values[i] = std::uint16_t(prediction + unzigzag(residual));
+            previous = values[i];
+        }
+    }
+    return pos == src.size();
+}
+
+static void quantize_tile(const WorldView::HeightTile &tile,
+                          std::vector<std::uint16_t> &dest)
+{
+    dest.resize(tile.size());
+    std::transform(tile.begin(), tile.end(), dest.begin(), quantize_height);
+}
+
+
+/* sim::ReplicationSession */
+
+constexpr std::size_t ReplicationSession::DEFAULT_UPDATE_BUDGET;
+constexpr std::size_t ReplicationSession::DEFAULT_WINDOW;
+constexpr unsigned int ReplicationSession::DEFAULT_INTEREST_MARGIN;
+constexpr int ReplicationSession::MAX_VIEWS;
+
+ReplicationSession::ReplicationSession(const std::size_t update_budget,
+                                       const std::size_t window,
+                                       const unsigned int interest_margin):
+    m_update_budget(update_budget),
+    m_window(window),
+    m_interest_margin(interest_margin),
+    m_terrain_size(0),
+    m_tiles_per_axis(0),
+    m_fluid_cursor(0),
+    m_interest_generation(1),
+    m_bytes_in_flight(0)
+{
+
+}
+
+bool ReplicationSession::in_interest(const TerrainRect &rect) const
+{
+    for (const TerrainRect &interest: m_interest) {
+        if (interest.overlaps(rect)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void ReplicationSession::reset(const unsigned int terrain_size)
+{
+    m_terrain_size = terrain_size;
+    m_tiles_per_axis = WorldView::tiles_per_axis(terrain_size);
+    const unsigned int ntiles = m_tiles_per_axis*m_tiles_per_axis;
+    m_sent_tiles.clear();
+    m_sent_tiles.resize(ntiles, SentTile{nullptr, 0});
+    m_sent_fluid.clear();
+    m_fluid_cursor = 0;
+    m_dirty.assign(ntiles, false);
+    m_dirty_tiles.clear();
+    update_interest();
+}
+
+std::uint64_t ReplicationSession::tile_priority(const TerrainRect &rect) const
+{
+    // lower is more important; without views, the centre of the terrain is
+    // used
+    const unsigned int centre = m_terrain_size / 2;
+    const TerrainRect default_view(centre, centre, centre+1, centre+1);
+    const TerrainRect *views = &default_view;
+    std::size_t nviews = 1;
+    if (!m_views.empty()) {
+        views = m_views.data();
+        nviews = m_views.size();
+    }
+
+    std::uint64_t best = std::numeric_limits<std::uint64_t>::max();
+    for (std::size_t i = 0; i < nviews; ++i) {
+        const TerrainRect &view = views[i];
+        if (view.overlaps(rect)) {
+            return 0;
+        }
+        const std::int64_t dx = (std::int64_t(rect.x0()) + rect.x1())
+                - (std::int64_t(view.x0()) + view.x1());
+        const std::int64_t dy = (std::int64_t(rect.y0()) + rect.y1())
+                - (std::int64_t(view.y0()) + view.y1());
+        best = std::min(best, std::uint64_t(dx*dx + dy*dy) + 1);
+    }
+    return best;
+}
+
+void ReplicationSession::update_interest()
+{
+    m_interest.clear();
+    if (m_terrain_size > 0) {
+        if (m_views.empty()) {
+            m_interest.emplace_back(0, 0, m_terrain_size, m_terrain_size);
+        }
+        const unsigned int margin = m_interest_margin;
+        const unsigned int size = m_terrain_size;
+        auto extend_down = [margin](const unsigned int v) {
+            return v - std::min(v, margin);
+        };
+        auto extend_up = [margin, size](const unsigned int v) {
+            return (v >= size || size - v <= margin) ? size : v + margin;
+        };
+        for (const TerrainRect &view: m_views) {
+            const TerrainRect rect(extend_down(view.x0()),
+                                   extend_down(view.y0()),
+                                   extend_up(view.x1()),
+                                   extend_up(view.y1()));
+            if (!rect.empty()) {
+                m_interest.push_back(rect);
+            }
+        }
+
+        // tiles which enter the interest may be out of date at the client;
+        // those which did not change are skipped by build_update()
+        for (unsigned int ty = 0; ty < m_tiles_per_axis; ++ty) {
+            for (unsigned int tx = 0; tx < m_tiles_per_axis; ++tx) {
+                if (in_interest(WorldView::tile_rect(m_terrain_size, tx, ty))) {
+                    mark_dirty(tx, ty);
+                }
+            }
+        }
+    }
+    ++m_interest_generation;
+}
+
+void ReplicationSession::feedback(const messages::ReplicationFeedback &msg)
+{
+    if (msg.has_ack_frame()) {
+        while (!m_unacked.empty() &&
+               m_unacked.front().first <= msg.ack_frame())
+        {
+            m_bytes_in_flight -= m_unacked.front().second;
+            m_unacked.pop_front();
+        }
+    }
+
+    if (msg.views_size() > 0) {
+        m_views.clear();
+        for (const messages::ReplicationViewRect &view: msg.views()) {
+            if (m_views.size() >= std::size_t(MAX_VIEWS)) {
+                break;
+            }
+            if (view.x0() < view.x1() && view.y0() < view.y1()) {
+                m_views.emplace_back(view.x0(), view.y0(),
+                                     view.x1(), view.y1());
+            }
+        }
+        update_interest();
+    }
+}
+
+void ReplicationSession::mark_dirty(const unsigned int tx,
+                                    const unsigned int ty)
+{
+    if (tx >= m_tiles_per_axis || ty >= m_tiles_per_axis) {
+        return;
+    }
+    const unsigned int index = ty*m_tiles_per_axis + tx;
+    if (!m_dirty[index]) {
+        m_dirty[index] = true;
+        m_dirty_tiles.push_back(index);
+    }
+}
+
+bool ReplicationSession::build_update(const WorldView &view,
+                                      messages::ReplicationUpdate &dest)
+{
+    dest.Clear();
+    if (view.terrain_size() != m_terrain_size) {
+        reset(view.terrain_size());
+    }
+
+    if (m_bytes_in_flight >= m_window) {
+        return false;
+    }
+    std::size_t budget = std::min(m_update_budget,
+                                  m_window - m_bytes_in_flight);
+
+    dest.set_frame(view.frame());
+    dest.set_terrain_size(m_terrain_size);
+
+    // fluid summaries are small and sent whenever they change within the
+    // interest; they may use up to half of the budget, the remaining changed
+    // blocks are sent with later updates, continuing where this one stopped
+    if (!view.fluid_blocks().empty()) {
+        const std::vector<FluidBlockSummary> &blocks = view.fluid_blocks();
+        const unsigned int nblocks = view.fluid_blocks_per_axis();
+        if (m_sent_fluid.size() != blocks.size()) {
+            m_sent_fluid.assign(blocks.size(),
+                                FluidBlockSummary{false, false, -1.f, -1.f});
+            m_fluid_cursor = 0;
+        }
+        dest.set_fluid_blocks_per_axis(nblocks);
+
+        const std::size_t fluid_budget = budget / 2;
+        std::size_t fluid_size = 0;
+        const unsigned int count = blocks.size();
+        for (unsigned int n = 0; n < count; ++n) {
+            const unsigned int i = (m_fluid_cursor + n) % count;
+            const FluidBlockSummary &block = blocks[i];
+            if (block == m_sent_fluid[i]) {
+                continue;
+            }
+            const unsigned int x0 = (i % nblocks) * IFluidSim::block_size;
+            const unsigned int y0 = (i / nblocks) * IFluidSim::block_size;
+            if (!in_interest(TerrainRect(x0, y0,
+                                         x0 + IFluidSim::block_size,
+                                         y0 + IFluidSim::block_size)))
+            {
+                continue;
+            }
+            if (fluid_size >= fluid_budget) {
+                m_fluid_cursor = i;
+                break;
+            }
+            messages::FluidBlockSummary &msg = *dest.add_fluid_blocks();
+            msg.set_index(i);
+            msg.set_active(block.active);
+            if (block.flat) {
+                msg.set_flat_absolute_height(block.flat_absolute_height);
+            }
+            msg.set_change(block.change);
+            // plus the tag and the length of the embedded message
+            fluid_size += msg.ByteSizeLong() + 2;
+            m_sent_fluid[i] = block;
+        }
+        budget -= std::min(budget, fluid_size);
+    }
+
+    const unsigned int ntiles = m_tiles_per_axis;
+    m_candidates.clear();
+    for (const unsigned int index: m_dirty_tiles) {
+        const unsigned int tx = index % ntiles;
+        const unsigned int ty = index / ntiles;
+        if (m_sent_tiles[index].data == view.tile(tx, ty) ||
+                !in_interest(WorldView::tile_rect(m_terrain_size, tx, ty)))
+        {
+            // tiles which left the interest are marked again when they
+            // re-enter it
+            m_dirty[index] = false;
+            continue;
+        }
+        m_candidates.emplace_back(
+                    tile_priority(WorldView::tile_rect(m_terrain_size, tx, ty)),
+                    index);
+    }
+    m_dirty_tiles.clear();
+    std::sort(m_candidates.begin(), m_candidates.end());
+
+    std::size_t done = 0;
+    for (; done < m_candidates.size() && budget > 0; ++done) {
+        const unsigned int index = m_candidates[done].second;
+        const unsigned int tx = index % ntiles;
+        const unsigned int ty = index / ntiles;
+        SentTile &sent = m_sent_tiles[index];
+        const std::shared_ptr<const WorldView::HeightTile> &tile =
+                view.tile(tx, ty);
+
+        quantize_tile(*tile, m_quantized);
+        const std::uint16_t *base = nullptr;
+        if (sent.data) {
+            quantize_tile(*sent.data, m_quantized_base);
+            if (m_quantized_base == m_quantized) {
+                // changes below the quantisation step are not worth sending
+                sent.data = tile;
+                m_dirty[index] = false;
+                continue;
+            }
+            base = m_quantized_base.data();
+        }
+
+        messages::TerrainTileUpdate &msg = *dest.add_tiles();
+        encode_height_tile(m_quantized.data(), base, m_quantized.size(),
+                           *msg.mutable_data());
+        const std::size_t size = msg.data().size();
+        if (size > budget && dest.tiles_size() > 1) {
+            dest.mutable_tiles()->RemoveLast();
+            break;
+        }
+
+        msg.set_tx(tx);
+        msg.set_ty(ty);
+        msg.set_version(view.frame());
+        if (base) {
+            msg.set_base_version(sent.version);
+        }
+        sent.data = tile;
+        sent.version = view.frame();
+        m_dirty[index] = false;
+        budget -= std::min(budget, size);
+    }
+    // whatever did not fit stays dirty
+    for (; done < m_candidates.size(); ++done) {
+        m_dirty_tiles.push_back(m_candidates[done].second);
+    }
+
+    if (dest.tiles_size() == 0 && dest.fluid_blocks_size() == 0) {
+        return false;
+    }
+
+    const std::size_t size = dest.ByteSizeLong();
+    m_unacked.emplace_back(view.frame(), size);
+    m_bytes_in_flight += size;
+    return true;
+}
+
+
+/* sim::WorldReplica */
+
+WorldReplica::WorldReplica():
+    m_frame(0),
+    m_terrain_size(0),
+    m_tiles_per_axis(0),
+    m_fluid_blocks_per_axis(0)
+{
+
+}
+
+bool WorldReplica::has_tile(const unsigned int tx,
+                            const unsigned int ty) const
+{
+    if (tx >= m_tiles_per_axis || ty >= m_tiles_per_axis) {
+        return false;
+    }
+    return !m_tiles[ty*m_tiles_per_axis + tx].values.empty();
+}
+
+std::uint64_t WorldReplica::tile_version(const unsigned int tx,
+                                         const unsigned int ty) const
+{
+    if (!has_tile(tx, ty)) {
+        return 0;
+    }
+    return m_tiles[ty*m_tiles_per_axis + tx].version;
+}
+
+Terrain::height_t WorldReplica::height(const unsigned int x,
+                                       const unsigned int y) const
+{
+    const unsigned int tx = x / WorldView::TILE_SIZE;
+    const unsigned int ty = y / WorldView::TILE_SIZE;
+    const TerrainRect rect = WorldView::tile_rect(m_terrain_size, tx, ty);
+    const unsigned int width = rect.x1() - rect.x0();
+    return dequantize_height(m_tiles[ty*m_tiles_per_axis + tx].values[
+                             (y - rect.y0())*width + (x - rect.x0())]);
+}
+
+bool WorldReplica::apply(const messages::ReplicationUpdate &update)
+{
+    if (update.terrain_size() != m_terrain_size) {
+        m_terrain_size = update.terrain_size();
+        m_tiles_per_axis = WorldView::tiles_per_axis(m_terrain_size);
+        m_tiles.clear();
+        m_tiles.resize(m_tiles_per_axis*m_tiles_per_axis, Tile{{}, 0});
+    }
+
+    for (const messages::TerrainTileUpdate &msg: update.tiles()) {
+        if (msg.tx() >= m_tiles_per_axis || msg.ty() >= m_tiles_per_axis) {
+            return false;
+        }
+        Tile &tile = m_tiles[msg.ty()*m_tiles_per_axis + msg.tx()];
+        const std::size_t count = WorldView::tile_rect(
+                    m_terrain_size, msg.tx(), msg.ty()).area();
+        if (msg.has_base_version()) {
+            if (tile.values.empty() || tile.version != msg.base_version()) {
+                return false;
+            }
+        } else {
+            tile.values.resize(count);
+        }
+
+        if (!decode_height_tile(msg.data(),
+                                msg.has_base_version() ? tile.values.data() : nullptr,
+                                tile.values.data(),
+                                count))
+        {
+            tile.values.clear();
+            tile.version = 0;
+            return false;
+        }
+        tile.version = msg.version();
+    }
+
+    if (update.has_fluid_blocks_per_axis()) {
+        const unsigned int nblocks = update.fluid_blocks_per_axis();
+        if (nblocks != m_fluid_blocks_per_axis) {
+            m_fluid_blocks_per_axis = nblocks;
+            m_fluid_blocks.assign(nblocks*nblocks,
+                                  FluidBlockSummary{false, false, 0.f, 0.f});
+        }
+        for (const messages::FluidBlockSummary &msg: update.fluid_blocks()) {
+            if (msg.index() >= m_fluid_blocks.size()) {
+                return false;
+            }
+            m_fluid_blocks[msg.index()] = FluidBlockSummary{
+                    msg.active(),
+                    msg.has_flat_absolute_height(),
+                    msg.flat_absolute_height(),
+                    msg.change()};
+        }
+    }
+
+    m_frame = update.frame();
+    return true;
+}
+
+void WorldReplica::feedback(const std::vector<TerrainRect> &views,
+                            messages::ReplicationFeedback &dest) const
+{
+    dest.Clear();
+    if (m_terrain_size > 0) {
+        // nothing to acknowledge before the first update
+        dest.set_ack_frame(m_frame);
+    }
+    for (const TerrainRect &view: views) {
+        messages::ReplicationViewRect &msg = *dest.add_views();
+        msg.set_x0(view.x0());
+        msg.set_y0(view.y0());
+        msg.set_x1(view.x1());
+        msg.set_y1(view.y1());
+    }
+}
+
+}
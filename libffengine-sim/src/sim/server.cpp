@@ -23,11 +23,18 @@ the AUTHORS file.
 **********************************************************************/
 #include "server.moc"
 
+#include "replication.pb.h"
 #include "world_command.pb.h"
 
+#include "ffengine/io/log.hpp"
+
+#include "ffengine/sim/world_ops.hpp"
+
 
 namespace sim {
 
+static io::Logger &logger = io::logging().get_logger("sim.server");
+
 
 /* sim::IMessageHandler */
 
@@ -36,11 +43,29 @@ IMessageHandler::~IMessageHandler()
 
 }
 
-bool IMessageHandler::msg_world_command(std::unique_ptr<messages::WorldCommand> &&cmd)
+bool IMessageHandler::msg_world_command(std::shared_ptr<messages::WorldCommand> &&cmd)
 {
     return msg_unhandled(std::move(cmd));
 }
 
+bool IMessageHandler::msg_world_command_response(
+        std::shared_ptr<messages::WorldCommandResponse> &&response)
+{
+    return msg_unhandled(std::move(response));
+}
+
+bool IMessageHandler::msg_replication_update(
+        std::shared_ptr<messages::ReplicationUpdate> &&update)
+{
+    return msg_unhandled(std::move(update));
+}
+
+bool IMessageHandler::msg_replication_feedback(
+        std::shared_ptr<messages::ReplicationFeedback> &&feedback)
+{
+    return msg_unhandled(std::move(feedback));
+}
+
 
 /* sim::RejectingMessageHandler */
 
@@ -57,78 +82,479 @@ ServerClientBase::~ServerClientBase()
 
 }
 
+void ServerClientBase::request_flush()
+{
+    QMetaObject::invokeMethod(this, "flush", Qt::QueuedConnection);
+}
+
+void ServerClientBase::request_terminate()
+{
+    QMetaObject::invokeMethod(this, "terminate", Qt::QueuedConnection);
+}
+
 
 /* sim::Server */
 
-Server::Server():
+/**
+ * Number of tiles of an attached terrain file which are paged in per game
+ * frame in the background.
+ */
+static const unsigned int TERRAIN_TILES_PER_FRAME = 32;
+
+/**
+ * Number of operations which can be queued for the game thread before
+ * enqueue_op() has to wait.
+ */
+static const std::size_t OP_QUEUE_CAPACITY = 4096;
+
+/**
+ * Number of threads which can hold a WorldView at the same time without
+ * waiting for each other.
+ */
+static const std::size_t VIEW_READER_SLOTS = 64;
+
+/**
+ * Number of replaced WorldViews which are expected to be kept alive for
+ * readers still holding them. Readers holding views for longer do not stall
+ * the game thread; the old views are kept until they are released.
+ */
+static const std::size_t VIEW_MAX_RETIRED = 8;
+
+/**
+ * Nominal duration of a game frame.
+ */
+static const FrameDuration GAME_FRAME_DURATION = std::chrono::microseconds(16000);
+
+/**
+ * Time before a frame deadline at which the game thread stops sleeping and
+ * starts spinning, to compensate for the coarse sleep granularity.
+ */
+static const FrameDuration FRAME_BUSYWAIT = std::chrono::microseconds(100);
+
+static float to_ms(const FrameDuration d)
+{
+    return std::chrono::duration_cast<std::chrono::duration<float, std::milli> >(d).count();
+}
+
+Server::Server(const FramePacing frame_pacing):
     m_state(),
+    m_next_client_id(0),
+    m_op_queue(OP_QUEUE_CAPACITY),
+    m_sandifier(m_state.terrain(), m_state.fluid()),
+    m_replication_update(std::make_unique<messages::ReplicationUpdate>()),
+    m_command_logging(false),
+    m_unlogged_ops(0),
+    m_view_domain(VIEW_READER_SLOTS, VIEW_MAX_RETIRED),
+    m_view(m_view_domain),
+    m_frame(0),
+    m_view_changes_conn(m_state.terrain().heightmap_updated().connect(
+                            sigc::mem_fun(*this, &Server::terrain_changed))),
+    m_frame_pacing(frame_pacing),
+    m_max_catch_up_frames(4),
+    m_frame_timing_log_interval(0),
+    m_steps_requested(0),
+    m_steps_done(0),
     m_terminated(false),
-    m_game_thread(std::bind(&Server::game_thread, this)),
-    m_sandifier(m_state.terrain(), m_state.fluid())
+    m_game_thread(std::bind(&Server::game_thread, this))
 {
 
 }
 
 Server::~Server()
 {
-    m_terminated = true;
+    {
+        std::lock_guard<std::mutex> lock(m_step_mutex);
+        m_terminated = true;
+    }
+    m_step_cv.notify_all();
     m_game_thread.join();
+    m_view_changes_conn.disconnect();
 }
 
-void Server::game_frame()
+void Server::execute_op(QueuedOperation &queued)
 {
-    m_state.fluid().wait_for();
+    const WorldOperationResult result = m_journal.execute(*queued.op, m_state);
+    if (queued.on_done) {
+        queued.on_done(result);
+    }
+}
+
+void Server::flush_clients()
+{
+    std::lock_guard<std::mutex> lock(m_clients_mutex);
+    const WorldView &view = *m_view.current();
+    if (m_interest.terrain_size() != view.terrain_size()) {
+        // the sessions reset themselves and are registered again below
+        m_interest.reset(view.terrain_size());
+        for (auto &item: m_client_interfaces) {
+            item.second.interest_generation = 0;
+        }
+    } else {
+        m_interest.for_each_subscriber(
+                    view.changed(),
+                    [this](const InterestGrid::Subscriber client,
+                           const unsigned int tx, const unsigned int ty){
+                        auto iter = m_client_interfaces.find(client);
+                        if (iter != m_client_interfaces.end() &&
+                                iter->second.replication)
+                        {
+                            iter->second.replication->mark_dirty(tx, ty);
+                        }
+                    });
+    }
+
+    for (auto &item: m_client_interfaces) {
+        ClientEntry &entry = item.second;
+        ReplicationSession *session = entry.replication.get();
+        if (session) {
+            try {
+                if (session->build_update(view, *m_replication_update)) {
+                    entry.client->send_message(*m_replication_update);
+                }
+            } catch (const std::exception &exc) {
+                // only this client is affected; it does not receive any
+                // updates until it is removed
+                logger.log(io::LOG_ERROR)
+                        << "failed to send replication update to client "
+                        << item.first << ": " << exc.what()
+                        << "; terminating it"
+                        << io::submit;
+                entry.replication = nullptr;
+                m_interest.remove(item.first);
+                entry.client->request_terminate();
+                continue;
+            }
+            if (session->interest_generation() != entry.interest_generation) {
+                m_interest.set_interest(item.first, session->interest());
+                entry.interest_generation = session->interest_generation();
+            }
+        }
+        entry.client->request_flush();
+    }
+}
+
+void Server::fuse_ops()
+{
+    // operations with a callback have to report their own result, thus
+    // they break the runs of fused operations
+    m_fused_ops.clear();
+    auto fuse_run = [this](){
+        ops::fuse_brush_operations(m_fusion_run);
+        for (auto &op: m_fusion_run) {
+            m_fused_ops.emplace_back(QueuedOperation{std::move(op), nullptr, nullptr});
+        }
+        m_fusion_run.clear();
+    };
+
+    for (auto &queued: m_op_buffer) {
+        if (queued.on_done) {
+            fuse_run();
+            m_fused_ops.emplace_back(std::move(queued));
+        } else {
+            m_fusion_run.emplace_back(std::move(queued.op));
+        }
+    }
+    fuse_run();
+    m_op_buffer.swap(m_fused_ops);
+    m_fused_ops.clear();
+}
+
+void Server::game_frame(FrameTiming &timing)
+{
+    // resources which must not be used while the fluid step is in flight
+    static const WorldResources fluid_step_resources =
+            RESOURCE_TERRAIN | RESOURCE_FLUID;
+
+    bool reshape_deferred = false;
+    {
+        std::lock_guard<std::shared_timed_mutex> lock(m_interframe_mutex);
+        const WorldClock::time_point t0 = WorldClock::now();
+        // take at most one queue worth of operations, so that a steady
+        // stream of operations cannot stall the frame
+        QueuedOperation queued;
+        for (std::size_t i = 0;
+             i < OP_QUEUE_CAPACITY && m_op_queue.try_pop(queued);
+             ++i)
+        {
+            m_op_buffer.emplace_back(std::move(queued));
+        }
+
+        if (m_command_logging) {
+            log_commands();
+        }
+
+        // consecutive brush strokes are merged, so that each touched area
+        // is painted (and journalled) once per frame
+        fuse_ops();
+
+        WorldResources deferred_resources = 0;
+        for (auto &queued: m_op_buffer)
+        {
+            const WorldResources resources = queued.op->resources();
+            if ((resources & (fluid_step_resources | deferred_resources)) != 0) {
+                deferred_resources |= resources;
+                m_deferred_ops.emplace_back(std::move(queued));
+                continue;
+            }
+            execute_op(queued);
+        }
+        m_op_buffer.clear();
+        const WorldClock::time_point t_ops = WorldClock::now();
+
+        reshape_deferred = (deferred_resources & RESOURCE_GRAPH) != 0;
+        if (!reshape_deferred) {
+            m_state.graph().reshape();
+        }
+        timing.ops = t_ops - t0;
+        timing.reshape = WorldClock::now() - t_ops;
+    }
 
     // wait for the fluid sim to finish _without_ holding the lock!
     // this allows the UI to render even while the fluid sim is stuck
+    const WorldClock::time_point t_wait = WorldClock::now();
+    m_state.fluid().wait_for();
+    timing.fluid_wait = WorldClock::now() - t_wait;
+
     std::lock_guard<std::shared_timed_mutex> lock(m_interframe_mutex);
+    const WorldClock::time_point t1 = WorldClock::now();
+    for (auto &queued: m_deferred_ops)
     {
-        std::lock_guard<std::mutex> lock(m_op_queue_mutex);
-        m_op_queue.swap(m_op_buffer);
+        // operations must see (and must not be overwritten by) the data of
+        // an attached terrain file
+        m_state.terrain().page_in(queued.op->touched_terrain_rect(m_state));
+        execute_op(queued);
     }
-
-    for (auto &op: m_op_buffer)
-    {
-        op->execute(m_state);
+    m_deferred_ops.clear();
+    const WorldClock::time_point t_deferred = WorldClock::now();
+    timing.ops += t_deferred - t1;
+    if (reshape_deferred) {
+        m_state.graph().reshape();
     }
-    m_state.graph().reshape();
+    const WorldClock::time_point t_reshape = WorldClock::now();
+    timing.reshape += t_reshape - t_deferred;
+
+    m_state.terrain().page_in_pending(TERRAIN_TILES_PER_FRAME);
+    page_in_fluid();
     m_sandifier.run_steps();
+    const WorldClock::time_point t_sandifier = WorldClock::now();
+    timing.sandifier = t_sandifier - t_reshape;
+
+    // deliver all terrain changes of this frame in one batch, before the
+    // fluid sim picks them up
+    m_state.terrain().flush_notifications();
 
-    m_op_buffer.clear();
+    // the fluid blocks are swapped by the fluid sim, thus they have to be
+    // summarized before it is started again
+    std::vector<FluidBlockSummary> fluid_blocks(
+                WorldView::summarize_fluid(m_state.fluid().blocks()));
 
     m_state.fluid().start();
+    const WorldClock::time_point t_start = WorldClock::now();
+    timing.fluid_start = t_start - t_sandifier;
+
+    publish_view(std::move(fluid_blocks));
+    flush_clients();
+    timing.publish = WorldClock::now() - t_start;
 }
 
 void Server::game_thread()
 {
-    static const std::chrono::microseconds game_frame_duration(16000);
-    static const std::chrono::microseconds busywait(100);
-
+    FramePacer pacer(GAME_FRAME_DURATION,
+                     m_frame_pacing,
+                     m_max_catch_up_frames);
+
+    page_in_fluid();
+    m_state.terrain().flush_notifications();
+    std::vector<FluidBlockSummary> fluid_blocks(
+                WorldView::summarize_fluid(m_state.fluid().blocks()));
     m_state.fluid().start();
-    // tnext_frame is always in the future when we are on time
-    WorldClock::time_point tnext_frame = WorldClock::now();
+    publish_view(std::move(fluid_blocks));
+    // the deadline is always in the future when we are on time
+    pacer.reset(WorldClock::now());
+    WorldClock::time_point tlast_log = WorldClock::now();
     while (!m_terminated)
     {
         WorldClock::time_point tnow = WorldClock::now();
-        if (tnext_frame > tnow)
-        {
-            std::chrono::nanoseconds time_to_sleep = tnext_frame - tnow;
-            if (time_to_sleep > busywait) {
-                std::this_thread::sleep_for(time_to_sleep - busywait);
+        const bool manual = m_frame_pacing == FramePacing::MANUAL;
+        if (manual) {
+            std::unique_lock<std::mutex> lock(m_step_mutex);
+            m_step_cv.wait(lock, [this](){
+                return m_terminated ||
+                        m_frame_pacing != FramePacing::MANUAL ||
+                        m_steps_requested > m_steps_done;
+            });
+            if (m_steps_requested <= m_steps_done) {
+                // terminated or switched to a scheduled policy, which
+                // starts from now
+                pacer.reset(WorldClock::now());
+                continue;
+            }
+            tnow = WorldClock::now();
+        } else if (pacer.deadline() > tnow) {
+            FrameDuration time_to_sleep = pacer.deadline() - tnow;
+            if (time_to_sleep > FRAME_BUSYWAIT) {
+                std::this_thread::sleep_for(time_to_sleep - FRAME_BUSYWAIT);
             }
             continue;
         }
 
-        game_frame();
+        FrameTiming timing{};
+        timing.start = tnow;
+        game_frame(timing);
+
+        tnow = WorldClock::now();
+        timing.total = tnow - timing.start;
+        if (manual) {
+            pacer.reset(tnow);
+        } else {
+            pacer.set_policy(m_frame_pacing, m_max_catch_up_frames);
+            timing.dropped_frames = pacer.frame_done(tnow);
+        }
+        m_frame_timings.push(timing);
+
+        {
+            std::lock_guard<std::mutex> lock(m_step_mutex);
+            m_steps_done += 1;
+        }
+        m_step_cv.notify_all();
+
+        const std::chrono::milliseconds log_interval(m_frame_timing_log_interval);
+        if (log_interval.count() > 0 && tnow - tlast_log >= log_interval) {
+            log_frame_timings();
+            tlast_log = tnow;
+        }
+    }
+}
+
+void Server::log_commands()
+{
+    std::lock_guard<std::mutex> lock(m_command_log_mutex);
+    if (!m_command_log) {
+        return;
+    }
+
+    for (auto &queued: m_op_buffer) {
+        if (queued.command) {
+            // operations with a callback are not fused (see fuse_ops()); a
+            // replay needs to know that to execute the same operations
+            if (queued.on_done) {
+                m_log_unfused.emplace_back(m_log_buffer.size());
+            }
+            m_log_buffer.emplace_back(std::move(queued.command));
+        } else {
+            m_unlogged_ops += 1;
+        }
+    }
+
+    if (!m_log_buffer.empty()) {
+        m_command_log->append_frame(m_frame, m_log_buffer, m_log_unfused);
+    }
+}
+
+void Server::log_frame_timings()
+{
+    const FrameTimingSummary summary = m_frame_timings.summary();
+    if (summary.frames == 0) {
+        return;
+    }
+
+    logger.logf(io::LOG_INFO,
+                "%zu frames: p50 %.2f ms, p99 %.2f ms, max %.2f ms, "
+                "%u dropped",
+                summary.frames,
+                to_ms(summary.total.p50),
+                to_ms(summary.total.p99),
+                to_ms(summary.total.max),
+                summary.dropped_frames);
+    logger.logf(io::LOG_DEBUG,
+                "p50/p99: ops %.2f/%.2f ms, reshape %.2f/%.2f ms, "
+                "fluid wait %.2f/%.2f ms, sandifier %.2f/%.2f ms, "
+                "fluid start %.2f/%.2f ms, publish %.2f/%.2f ms",
+                to_ms(summary.ops.p50), to_ms(summary.ops.p99),
+                to_ms(summary.reshape.p50), to_ms(summary.reshape.p99),
+                to_ms(summary.fluid_wait.p50), to_ms(summary.fluid_wait.p99),
+                to_ms(summary.sandifier.p50), to_ms(summary.sandifier.p99),
+                to_ms(summary.fluid_start.p50), to_ms(summary.fluid_start.p99),
+                to_ms(summary.publish.p50), to_ms(summary.publish.p99));
+}
+
+void Server::page_in_fluid()
+{
+    Terrain &terrain = m_state.terrain();
+    if (terrain.tiles_pending() == 0) {
+        return;
+    }
+
+    // the fluid cells at the edges of a block also read the terrain of the
+    // neighbouring cells
+    FluidBlocks &blocks = m_state.fluid().blocks();
+    const unsigned int block_size = IFluidSim::block_size;
+    for (unsigned int by = 0; by < blocks.blocks_per_axis(); ++by) {
+        for (unsigned int bx = 0; bx < blocks.blocks_per_axis(); ++bx) {
+            FluidBlock &block = *blocks.block(bx, by);
+            if (!block.front_meta().active && !block.back_meta().active) {
+                continue;
+            }
+            const unsigned int x0 = bx*block_size;
+            const unsigned int y0 = by*block_size;
+            terrain.page_in(TerrainRect(x0 > 0 ? x0 - 1 : 0,
+                                        y0 > 0 ? y0 - 1 : 0,
+                                        x0 + block_size + 1,
+                                        y0 + block_size + 1));
+        }
+    }
+}
 
-        tnext_frame += game_frame_duration;
+void Server::publish_view(std::vector<FluidBlockSummary> &&fluid_blocks)
+{
+    TerrainRegion changes;
+    {
+        std::lock_guard<std::mutex> lock(m_view_changes_mutex);
+        changes.swap(m_view_changes);
     }
+    // changes which are notified after this point are picked up by the next
+    // view; the snapshot itself always sees the current heightmap
+    m_view.publish(WorldView::snapshot(
+                       m_state.terrain(), m_view.current(),
+                       changes, m_frame++,
+                       m_state.fluid().blocks().blocks_per_axis(),
+                       std::move(fluid_blocks)));
+}
+
+void Server::terrain_changed(const TerrainRegion &region)
+{
+    std::lock_guard<std::mutex> lock(m_view_changes_mutex);
+    m_view_changes.add(region);
 }
 
 void Server::enqueue_op(std::unique_ptr<WorldOperation> &&op)
 {
-    std::unique_lock<std::mutex> lock(m_op_queue_mutex);
-    m_op_queue.emplace_back(std::move(op));
+    enqueue_op(std::move(op), nullptr);
+}
+
+void Server::enqueue_op(std::unique_ptr<WorldOperation> &&op,
+                        WorldOperationCallback &&on_done)
+{
+    QueuedOperation queued{std::move(op), std::move(on_done), nullptr};
+    if (m_command_logging) {
+        queued.command = std::make_unique<messages::WorldCommand>();
+        if (!queued.op->to_message(*queued.command)) {
+            queued.command = nullptr;
+        }
+    }
+    while (!m_op_queue.try_push(std::move(queued))) {
+        std::this_thread::yield();
+    }
+}
+
+void Server::enqueue_undo()
+{
+    enqueue_op(std::make_unique<ops::JournalUndo>(m_journal));
+}
+
+void Server::enqueue_redo()
+{
+    enqueue_op(std::make_unique<ops::JournalRedo>(m_journal));
 }
 
 Server::SyncSafeLock Server::sync_safe_point()
@@ -141,5 +567,177 @@ Server::SyncSafeLock Server::sync_safe_point()
     return lock;
 }
 
+ServerClientID Server::add_client(ServerClientBase &client)
+{
+    std::lock_guard<std::mutex> lock(m_clients_mutex);
+    const ServerClientID id = m_next_client_id++;
+    m_client_interfaces.emplace(id, ClientEntry{&client, nullptr, 0});
+    return id;
+}
+
+void Server::remove_client(const ServerClientID client)
+{
+    std::lock_guard<std::mutex> lock(m_clients_mutex);
+    m_client_interfaces.erase(client);
+    m_interest.remove(client);
+}
+
+void Server::send_response(const ServerClientID client,
+                           const messages::WorldCommandResponse &response)
+{
+    std::lock_guard<std::mutex> lock(m_clients_mutex);
+    auto iter = m_client_interfaces.find(client);
+    if (iter == m_client_interfaces.end()) {
+        return;
+    }
+    iter->second.client->send_message(response);
+}
+
+void Server::replication_feedback(const ServerClientID client,
+                                  const messages::ReplicationFeedback &feedback)
+{
+    std::lock_guard<std::mutex> lock(m_clients_mutex);
+    auto iter = m_client_interfaces.find(client);
+    if (iter == m_client_interfaces.end()) {
+        return;
+    }
+    std::unique_ptr<ReplicationSession> &session = iter->second.replication;
+    if (!session) {
+        session = std::make_unique<ReplicationSession>();
+    }
+    session->feedback(feedback);
+}
+
+Server::WorldViewRef Server::view() const
+{
+    return m_view.load();
+}
+
+void Server::set_frame_pacing(const FramePacing policy,
+                              const unsigned int max_catch_up_frames)
+{
+    m_max_catch_up_frames = max_catch_up_frames;
+    {
+        // the game thread may be waiting for steps with FramePacing::MANUAL
+        std::lock_guard<std::mutex> lock(m_step_mutex);
+        m_frame_pacing = policy;
+    }
+    m_step_cv.notify_all();
+}
+
+void Server::step(const unsigned int frames)
+{
+    std::unique_lock<std::mutex> lock(m_step_mutex);
+    m_steps_requested = std::max(m_steps_requested, m_steps_done) + frames;
+    const std::uint64_t target = m_steps_requested;
+    m_step_cv.notify_all();
+    m_step_cv.wait(lock, [this, target](){
+        return m_terminated || m_steps_done >= target;
+    });
+}
+
+void Server::set_command_log(std::unique_ptr<CommandLogWriter> &&log)
+{
+    std::unique_ptr<CommandLogWriter> old_log;
+    {
+        std::lock_guard<std::mutex> lock(m_command_log_mutex);
+        old_log = std::move(m_command_log);
+        m_command_log = std::move(log);
+        m_command_logging = bool(m_command_log);
+        if (old_log && m_unlogged_ops > 0) {
+            logger.logf(io::LOG_WARNING,
+                        "%llu operations without message representation "
+                        "were not logged",
+                        static_cast<unsigned long long>(m_unlogged_ops));
+        }
+        m_unlogged_ops = 0;
+    }
+    // the old log is destroyed outside the lock, as it writes all pending
+    // frames first
+}
+
+void Server::set_frame_timing_log_interval(
+        const std::chrono::milliseconds interval)
+{
+    m_frame_timing_log_interval = interval.count();
+}
+
+std::vector<FrameTiming> Server::recent_frame_timings() const
+{
+    return m_frame_timings.recent();
+}
+
+FrameTimingSummary Server::frame_timing_summary() const
+{
+    return m_frame_timings.summary();
+}
+
+
+/* sim::ServerCommandHandler */
+
+ServerCommandHandler::ServerCommandHandler(Server &server,
+                                           ServerClientBase &client):
+    m_server(server),
+    m_client_id(server.add_client(client))
+{
+
+}
+
+ServerCommandHandler::~ServerCommandHandler()
+{
+    m_server.remove_client(m_client_id);
+}
+
+bool ServerCommandHandler::msg_unhandled(AbstractMessagePtr &&)
+{
+    return false;
+}
+
+bool ServerCommandHandler::msg_world_command(
+        std::shared_ptr<messages::WorldCommand> &&cmd)
+{
+    if (cmd->has_role()) {
+        logger.log(io::LOG_WARNING) << "client attempted to set the role of a "
+                                    << "world command"
+                                    << io::submit;
+        return false;
+    }
+
+    const bool respond = cmd->has_token();
+    const WorldOperationToken token = cmd->token();
+    WorldOperationPtr op = WorldOperation::from_message(
+                std::shared_ptr<const messages::WorldCommand>(std::move(cmd)));
+    if (!op) {
+        logger.log(io::LOG_WARNING) << "received invalid or unsupported world "
+                                    << "command"
+                                    << io::submit;
+        return false;
+    }
+
+    if (!respond) {
+        m_server.enqueue_op(std::move(op));
+        return true;
+    }
+
+    Server &server = m_server;
+    const ServerClientID client_id = m_client_id;
+    m_server.enqueue_op(
+                std::move(op),
+                [&server, client_id, token](WorldOperationResult result){
+                    messages::WorldCommandResponse response;
+                    response.set_token(token);
+                    response.set_result(result);
+                    server.send_response(client_id, response);
+                });
+    return true;
+}
+
+bool ServerCommandHandler::msg_replication_feedback(
+        std::shared_ptr<messages::ReplicationFeedback> &&feedback)
+{
+    m_server.replication_feedback(m_client_id, *feedback);
+    return true;
+}
+
 
 }
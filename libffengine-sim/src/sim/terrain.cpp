@@ -23,8 +23,11 @@ the AUTHORS file.
 **********************************************************************/
 #include "ffengine/sim/terrain.hpp"
 
+#include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <cstring>
+#include <exception>
 #include <iostream>
 
 #include "ffengine/common/utils.hpp"
@@ -34,14 +37,72 @@ the AUTHORS file.
 #include "ffengine/math/algo.hpp"
 
 #include "ffengine/sim/fluid.hpp"
+#include "ffengine/sim/terrain_file.hpp"
 
 
 namespace sim {
 
 io::Logger &lod_logger = io::logging().get_logger("sim.terrain.lod");
 static io::Logger &tw_logger = io::logging().get_logger("sim.terrain.worker");
+static io::Logger &file_logger = io::logging().get_logger("sim.terrain.file");
 
 
+/* sim::TerrainRegion */
+
+TerrainRegion::TerrainRegion(const TerrainRect &rect)
+{
+    add(rect);
+}
+
+void TerrainRegion::add(TerrainRect rect)
+{
+    if (!rect) {
+        return;
+    }
+
+    // merging may make the grown rect overlap with rects we already passed,
+    // so we start over until nothing overlaps anymore
+    bool merged = true;
+    while (merged) {
+        merged = false;
+        for (auto iter = m_rects.begin(); iter != m_rects.end(); ++iter) {
+            if (iter->overlaps(rect)) {
+                rect = ::bounds(rect, *iter);
+                *iter = m_rects.back();
+                m_rects.pop_back();
+                merged = true;
+                break;
+            }
+        }
+    }
+
+    m_rects.emplace_back(rect);
+}
+
+void TerrainRegion::add(const TerrainRegion &other)
+{
+    for (const TerrainRect &rect: other.m_rects) {
+        add(rect);
+    }
+}
+
+TerrainRect TerrainRegion::bounds() const
+{
+    TerrainRect result(NotARect);
+    for (const TerrainRect &rect: m_rects) {
+        result = ::bounds(result, rect);
+    }
+    return result;
+}
+
+void TerrainRegion::clear()
+{
+    m_rects.clear();
+}
+
+
+/* sim::Terrain */
+
 const Terrain::height_t Terrain::default_height = 20.f;
 const Terrain::height_t Terrain::min_height = 0.f;
 const Terrain::height_t Terrain::max_height = 500.f;
@@ -51,7 +112,9 @@ const vector_component_y_t Terrain::SAND_ATTR = eY;
 
 Terrain::Terrain(const unsigned int size):
     m_size(size),
-    m_field(m_size*m_size, Vector3f(default_height, 0, 0))
+    m_field(m_size*m_size, Vector3f(default_height, 0, 0)),
+    m_tiles_pending(0),
+    m_next_pending_tile(0)
 {
 
 }
@@ -63,17 +126,39 @@ Terrain::~Terrain()
 
 void Terrain::notify_heightmap_changed() const
 {
-    m_heightmap_updated.emit(TerrainRect(0, 0, m_size, m_size));
+    notify_heightmap_changed(TerrainRect(0, 0, m_size, m_size));
 }
 
 void Terrain::notify_heightmap_changed(TerrainRect at) const
 {
-    m_heightmap_updated.emit(at);
+    std::lock_guard<std::mutex> lock(m_pending_mutex);
+    m_pending_heightmap.add(at);
 }
 
 void Terrain::notify_attributes_changed(TerrainRect at) const
 {
-    m_attributes_updated.emit(at);
+    std::lock_guard<std::mutex> lock(m_pending_mutex);
+    m_pending_attributes.add(at);
+}
+
+void Terrain::flush_notifications() const
+{
+    std::lock_guard<std::mutex> flush_lock(m_flush_mutex);
+
+    TerrainRegion heightmap_changes;
+    TerrainRegion attribute_changes;
+    {
+        std::lock_guard<std::mutex> lock(m_pending_mutex);
+        heightmap_changes.swap(m_pending_heightmap);
+        attribute_changes.swap(m_pending_attributes);
+    }
+
+    if (!heightmap_changes.empty()) {
+        m_heightmap_updated.emit(heightmap_changes);
+    }
+    if (!attribute_changes.empty()) {
+        m_attributes_updated.emit(attribute_changes);
+    }
 }
 
 std::shared_lock<std::shared_timed_mutex> Terrain::readonly_field(
@@ -90,16 +175,233 @@ std::unique_lock<std::shared_timed_mutex> Terrain::writable_field(
     return std::unique_lock<std::shared_timed_mutex>(m_field_mutex);
 }
 
+void Terrain::detach_file()
+{
+    m_file = nullptr;
+    m_tile_loaded.clear();
+    m_tiles_pending = 0;
+    m_next_pending_tile = 0;
+}
+
+void Terrain::attach(std::shared_ptr<const TerrainFile> file)
+{
+    if (!file) {
+        throw std::invalid_argument("null terrain file");
+    }
+    if (file->size() != m_size) {
+        throw std::invalid_argument("terrain file size does not match terrain");
+    }
+
+    std::unique_lock<std::shared_timed_mutex> lock(m_field_mutex);
+    const unsigned int tiles = file->tiles_per_axis()*file->tiles_per_axis();
+    m_file = std::move(file);
+    m_tile_loaded.assign(tiles, false);
+    m_tiles_pending = tiles;
+    m_next_pending_tile = 0;
+}
+
+/**
+ * Decode the given tiles from \a file into \a field, in parallel if there
+ * is more than one.
+ *
+ * If decoding fails, the first error is rethrown once all tasks have
+ * finished, so that none of them writes into \a field afterwards.
+ */
+static void read_tiles(const TerrainFile &file,
+                       const std::vector<unsigned int> &tiles,
+                       Terrain::Field &field)
+{
+    const unsigned int tiles_per_axis = file.tiles_per_axis();
+    if (tiles.size() == 1) {
+        file.read_tile(tiles[0] % tiles_per_axis, tiles[0] / tiles_per_axis,
+                       field);
+        return;
+    }
+
+    ffe::ThreadPool &pool = ffe::ThreadPool::global();
+    std::vector<std::future<void>> tasks;
+    tasks.reserve(tiles.size());
+    for (const unsigned int tile: tiles) {
+        tasks.emplace_back(pool.submit_task(std::packaged_task<void()>([&file, &field, tile, tiles_per_axis](){
+            file.read_tile(tile % tiles_per_axis, tile / tiles_per_axis, field);
+        })));
+    }
+
+    std::exception_ptr error;
+    for (auto &fut: tasks) {
+        try {
+            fut.get();
+        } catch (...) {
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+void Terrain::page_in_tiles(std::unique_lock<std::shared_timed_mutex> &lock,
+                            const std::vector<unsigned int> &tiles)
+{
+    if (tiles.empty()) {
+        return;
+    }
+
+    std::shared_ptr<const TerrainFile> file = m_file;
+    try {
+        read_tiles(*file, tiles, m_field);
+        for (const unsigned int tile: tiles) {
+            m_tile_loaded[tile] = true;
+        }
+        m_tiles_pending -= tiles.size();
+    } catch (const std::exception &err) {
+        // the tiles may have been written partially; they are reported as
+        // changed below, like successfully paged in tiles
+        file_logger.logf(io::LOG_ERROR,
+                         "failed to page in terrain tiles, detaching "
+                         "terrain file: %s", err.what());
+        detach_file();
+    }
+    lock.unlock();
+
+    const unsigned int tiles_per_axis = file->tiles_per_axis();
+    for (const unsigned int tile: tiles) {
+        const TerrainRect tile_rect = file->tile_rect(tile % tiles_per_axis,
+                                                      tile / tiles_per_axis);
+        notify_heightmap_changed(tile_rect);
+        notify_attributes_changed(tile_rect);
+    }
+}
+
+void Terrain::detach()
+{
+    std::unique_lock<std::shared_timed_mutex> lock(m_field_mutex);
+    detach_file();
+}
+
+void Terrain::page_in(const TerrainRect &rect)
+{
+    std::unique_lock<std::shared_timed_mutex> lock(m_field_mutex);
+    if (!m_file || m_tiles_pending == 0 || !rect) {
+        return;
+    }
+
+    const unsigned int tile_size = m_file->tile_size();
+    const unsigned int tiles_per_axis = m_file->tiles_per_axis();
+    const unsigned int tx1 = std::min((rect.x1() + tile_size - 1) / tile_size,
+                                      tiles_per_axis);
+    const unsigned int ty1 = std::min((rect.y1() + tile_size - 1) / tile_size,
+                                      tiles_per_axis);
+
+    std::vector<unsigned int> tiles;
+    for (unsigned int ty = rect.y0() / tile_size; ty < ty1; ++ty) {
+        for (unsigned int tx = rect.x0() / tile_size; tx < tx1; ++tx) {
+            const unsigned int tile = ty*tiles_per_axis+tx;
+            if (!m_tile_loaded[tile]) {
+                tiles.push_back(tile);
+            }
+        }
+    }
+
+    page_in_tiles(lock, tiles);
+}
+
+void Terrain::page_in_samples(const Vector2f *positions,
+                              const std::size_t count)
+{
+    std::unique_lock<std::shared_timed_mutex> lock(m_field_mutex);
+    if (!m_file || m_tiles_pending == 0) {
+        return;
+    }
+
+    const unsigned int tile_size = m_file->tile_size();
+    const unsigned int tiles_per_axis = m_file->tiles_per_axis();
+    const float last = m_size - 1;
+    std::vector<unsigned int> tiles;
+    for (std::size_t i = 0; i < count; ++i) {
+        const Vector2f &p = positions[i];
+        if (std::isnan(p[eX]) || std::isnan(p[eY])) {
+            continue;
+        }
+        // positions outside the terrain are clamped to its edge, and the
+        // bilinear interpolation also reads the next cell on each axis
+        const unsigned int x0 = std::floor(clamp(p[eX], 0.f, last));
+        const unsigned int y0 = std::floor(clamp(p[eY], 0.f, last));
+        const unsigned int x1 = std::min(x0 + 1, m_size - 1);
+        const unsigned int y1 = std::min(y0 + 1, m_size - 1);
+        for (const unsigned int y: {y0, y1}) {
+            for (const unsigned int x: {x0, x1}) {
+                const unsigned int tile = (y / tile_size)*tiles_per_axis
+                        + x / tile_size;
+                if (!m_tile_loaded[tile]) {
+                    tiles.push_back(tile);
+                }
+            }
+        }
+    }
+    std::sort(tiles.begin(), tiles.end());
+    tiles.erase(std::unique(tiles.begin(), tiles.end()), tiles.end());
+
+    page_in_tiles(lock, tiles);
+}
+
+unsigned int Terrain::page_in_pending(const unsigned int max_tiles)
+{
+    std::unique_lock<std::shared_timed_mutex> lock(m_field_mutex);
+    if (!m_file || m_tiles_pending == 0) {
+        return 0;
+    }
+
+    // tiles before m_next_pending_tile are all loaded, so we continue the
+    // scan from there
+    std::vector<unsigned int> tiles;
+    const unsigned int tile_count = m_tile_loaded.size();
+    while (m_next_pending_tile < tile_count && tiles.size() < max_tiles) {
+        if (!m_tile_loaded[m_next_pending_tile]) {
+            tiles.push_back(m_next_pending_tile);
+        }
+        ++m_next_pending_tile;
+    }
+
+    page_in_tiles(lock, tiles);
+    return tiles.size();
+}
+
+unsigned int Terrain::tiles_pending() const
+{
+    std::shared_lock<std::shared_timed_mutex> lock(m_field_mutex);
+    return m_tiles_pending;
+}
+
+std::size_t Terrain::sample(const Vector2f *positions,
+                            const std::size_t count,
+                            float *heights,
+                            Vector2f *slopes,
+                            Vector3f *normals)
+{
+    if (tiles_pending() > 0) {
+        page_in_samples(positions, count);
+    }
+
+    std::shared_lock<std::shared_timed_mutex> lock(m_field_mutex);
+    return sample_terrain(m_field, m_size, positions, count,
+                          heights, slopes, normals);
+}
+
 void sample_from_perlin(const PerlinNoiseGenerator &gen,
                         const std::size_t size,
                         const unsigned int x0, const unsigned int x1,
                         const unsigned int y0, const unsigned int y1,
                         Terrain::Field &buf)
 {
+    std::vector<VectorFloat> row(x1 - x0);
     for (unsigned int y = y0; y < y1; ++y) {
-        auto *out = &buf[y * size];
-        for (unsigned int x = x0; x < x1; ++x) {
-            (*out++)[Terrain::HEIGHT_ATTR] = gen.get(Vector2(x, y));
+        gen.get_row(x0, y, row.size(), row.data());
+        auto *out = &buf[y * size + x0];
+        for (const VectorFloat value: row) {
+            (*out++)[Terrain::HEIGHT_ATTR] = value;
         }
     }
 }
@@ -123,6 +425,7 @@ void Terrain::from_perlin(const PerlinNoiseGenerator &gen)
     ffe::ThreadPool &pool = ffe::ThreadPool::global();
 
     std::unique_lock<std::shared_timed_mutex> lock(m_field_mutex);
+    detach_file();
 
     const unsigned int step = std::max(16U, pool.workers());
     std::vector<std::future<void>> tasks;
@@ -143,6 +446,7 @@ void Terrain::from_perlin(const PerlinNoiseGenerator &gen)
 
     lock.unlock();
     notify_heightmap_changed();
+    flush_notifications();
 }
 
 void Terrain::from_noise(const noise::module::Module &gen)
@@ -150,6 +454,7 @@ void Terrain::from_noise(const noise::module::Module &gen)
     ffe::ThreadPool &pool = ffe::ThreadPool::global();
 
     std::unique_lock<std::shared_timed_mutex> lock(m_field_mutex);
+    detach_file();
 
     const unsigned int step = std::max(16U, pool.workers());
     std::vector<std::future<void>> tasks;
@@ -170,12 +475,14 @@ void Terrain::from_noise(const noise::module::Module &gen)
 
     lock.unlock();
     notify_heightmap_changed();
+    flush_notifications();
 }
 
 void Terrain::from_sincos(const Vector3f scale)
 {
     const float offset = scale[eZ];
     std::unique_lock<std::shared_timed_mutex> lock(m_field_mutex);
+    detach_file();
     for (unsigned int y = 0; y < m_size; y++) {
         for (unsigned int x = 0; x < m_size; x++) {
             m_field[y*m_size+x][HEIGHT_ATTR] = (sin(x*scale[eX]) + cos(y*scale[eY])) * scale[eZ] + offset;
@@ -183,11 +490,18 @@ void Terrain::from_sincos(const Vector3f scale)
     }
     lock.unlock();
     notify_heightmap_changed();
+    flush_notifications();
 }
 
 
-TerrainWorker::TerrainWorker():
-    m_updated_rect(NotARect),
+const unsigned int TerrainWorker::DEFAULT_TILE_SIZE = 128;
+
+TerrainWorker::TerrainWorker(const unsigned int threads,
+                             const unsigned int tile_size,
+                             const unsigned int margin):
+    m_thread_count(std::max(1U, threads)),
+    m_tile_size(tile_size),
+    m_margin(margin),
     m_terminated(false)
 {
 
@@ -202,67 +516,114 @@ void TerrainWorker::worker()
 {
     std::unique_lock<std::mutex> lock(m_state_mutex);
     while (!m_terminated) {
-        while (!m_updated_rect.is_a_rect()) {
-            m_wakeup.wait(lock);
-            if (m_terminated) {
-                return;
+        // pick any dirty tile which is not being processed by another thread
+        auto iter = m_dirty_tiles.begin();
+        while (iter != m_dirty_tiles.end() &&
+               m_busy_tiles.count(iter->first) > 0)
+        {
+            ++iter;
+        }
+
+        if (iter == m_dirty_tiles.end()) {
+            if (m_busy_tiles.empty()) {
+                m_idle.notify_all();
             }
+            m_wakeup.wait(lock);
+            continue;
         }
-        TerrainRect updated_rect = m_updated_rect;
-        m_updated_rect = NotARect;
+
+        const TileKey tile = iter->first;
+        const TerrainRect updated_rect = iter->second;
+        m_dirty_tiles.erase(iter);
+        m_busy_tiles.insert(tile);
         lock.unlock();
 
-        tw_logger.log(io::LOG_DEBUG) << "woke worker "
-                                     << m_worker_thread.get_id()
-                                     << " with rect "
+        tw_logger.log(io::LOG_DEBUG) << "worker "
+                                     << std::this_thread::get_id()
+                                     << " processing rect "
                                      << updated_rect
                                      << io::submit;
 
         worker_impl(updated_rect);
 
         lock.lock();
+        m_busy_tiles.erase(tile);
     }
 }
 
 void TerrainWorker::start()
 {
-    if (m_worker_thread.joinable()) {
+    if (!m_worker_threads.empty()) {
         throw std::logic_error("Worker already running!");
     }
-    m_worker_thread = std::thread(std::bind(&TerrainWorker::worker,
-                                            this));
-    tw_logger.log(io::LOG_INFO) << "new worker: "
-                                << m_worker_thread.get_id()
-                                << io::submit;
+    for (unsigned int i = 0; i < m_thread_count; ++i) {
+        m_worker_threads.emplace_back(std::bind(&TerrainWorker::worker, this));
+    }
+    tw_logger.logf(io::LOG_INFO, "new worker %p with %u threads",
+                   this, m_thread_count);
 }
 
 void TerrainWorker::tear_down()
 {
-    if (m_worker_thread.joinable()) {
-        {
-            std::unique_lock<std::mutex> lock(m_state_mutex);
-            m_terminated = true;
-        }
-        m_wakeup.notify_all();
-        tw_logger.log(io::LOG_INFO) << "tearing down worker "
-                                    << m_worker_thread.get_id()
-                                    << io::submit;
-        m_worker_thread.join();
+    if (m_worker_threads.empty()) {
+        return;
     }
+
+    {
+        std::unique_lock<std::mutex> lock(m_state_mutex);
+        m_terminated = true;
+    }
+    m_wakeup.notify_all();
+    tw_logger.logf(io::LOG_INFO, "tearing down worker %p", this);
+    for (auto &thread: m_worker_threads) {
+        thread.join();
+    }
+    m_worker_threads.clear();
 }
 
-void TerrainWorker::notify_update(const TerrainRect &at)
+void TerrainWorker::notify_update(const TerrainRegion &at)
 {
     {
         std::unique_lock<std::mutex> lock(m_state_mutex);
-        m_updated_rect = bounds(m_updated_rect, at);
+        for (const TerrainRect &rect: at) {
+            const unsigned int x0 = (rect.x0() > m_margin ? rect.x0() - m_margin : 0);
+            const unsigned int y0 = (rect.y0() > m_margin ? rect.y0() - m_margin : 0);
+            const unsigned int x1 = rect.x1() + m_margin;
+            const unsigned int y1 = rect.y1() + m_margin;
+            if (x1 <= x0 || y1 <= y0) {
+                continue;
+            }
+
+            for (unsigned int ty = y0 / m_tile_size; ty*m_tile_size < y1; ++ty) {
+                for (unsigned int tx = x0 / m_tile_size; tx*m_tile_size < x1; ++tx) {
+                    const TerrainRect part(
+                                std::max(x0, tx*m_tile_size),
+                                std::max(y0, ty*m_tile_size),
+                                std::min(x1, (tx+1)*m_tile_size),
+                                std::min(y1, (ty+1)*m_tile_size));
+
+                    auto iter = m_dirty_tiles.find(TileKey(tx, ty));
+                    if (iter == m_dirty_tiles.end()) {
+                        m_dirty_tiles.emplace(TileKey(tx, ty), part);
+                    } else {
+                        iter->second = bounds(iter->second, part);
+                    }
+                }
+            }
+        }
     }
-    tw_logger.log(io::LOG_DEBUG) << "notifying worker "
-                                 << m_worker_thread.get_id()
-                                 << io::submit;
+    tw_logger.logf(io::LOG_DEBUG, "notifying worker %p", this);
     m_wakeup.notify_all();
 }
 
+void TerrainWorker::wait_for_idle()
+{
+    std::unique_lock<std::mutex> lock(m_state_mutex);
+    while (!m_dirty_tiles.empty() || !m_busy_tiles.empty()) {
+        m_idle.wait(lock);
+    }
+}
+
 
 std::pair<bool, float> lookup_height(
         const Terrain::Field &field,
@@ -282,187 +643,356 @@ std::pair<bool, float> lookup_height(
     return std::make_pair(true, field[terrainy*terrain_size+terrainx][Terrain::HEIGHT_ATTR]);
 }
 
+std::size_t sample_terrain(const Terrain::Field &field,
+                           const unsigned int terrain_size,
+                           const Vector2f *positions,
+                           const std::size_t count,
+                           float *heights,
+                           Vector2f *slopes,
+                           Vector3f *normals)
+{
+    static const std::size_t BATCH_SIZE = 256;
+
+    const float max_coord = terrain_size - 1;
+    const unsigned int max_cell = terrain_size - 2;
+
+    std::size_t outside = 0;
+
+    unsigned int index[BATCH_SIZE];
+    float frac_x[BATCH_SIZE];
+    float frac_y[BATCH_SIZE];
+    float h00[BATCH_SIZE], h10[BATCH_SIZE], h01[BATCH_SIZE], h11[BATCH_SIZE];
+    float h[BATCH_SIZE], dx[BATCH_SIZE], dy[BATCH_SIZE];
+
+    for (std::size_t batch0 = 0; batch0 < count; batch0 += BATCH_SIZE)
+    {
+        const std::size_t batch_size = std::min(count - batch0, BATCH_SIZE);
+        const Vector2f *const pos = &positions[batch0];
+
+        for (std::size_t i = 0; i < batch_size; ++i) {
+            const float x = pos[i][eX];
+            const float y = pos[i][eY];
+            if (!(x >= 0.f && x <= max_coord && y >= 0.f && y <= max_coord)) {
+                outside += 1;
+            }
+
+            const float xc = std::max(0.f, std::min(x, max_coord));
+            const float yc = std::max(0.f, std::min(y, max_coord));
+            const unsigned int cell_x = std::min((unsigned int)xc, max_cell);
+            const unsigned int cell_y = std::min((unsigned int)yc, max_cell);
+            index[i] = cell_y*terrain_size + cell_x;
+            frac_x[i] = xc - cell_x;
+            frac_y[i] = yc - cell_y;
+        }
+
+        // gather the corners; this is the only part which cannot be
+        // vectorized
+        for (std::size_t i = 0; i < batch_size; ++i) {
+            const Vector3f *const cell = &field[index[i]];
+            h00[i] = cell[0][Terrain::HEIGHT_ATTR];
+            h10[i] = cell[1][Terrain::HEIGHT_ATTR];
+            h01[i] = cell[terrain_size][Terrain::HEIGHT_ATTR];
+            h11[i] = cell[terrain_size+1][Terrain::HEIGHT_ATTR];
+        }
+
+        for (std::size_t i = 0; i < batch_size; ++i) {
+            const float fx = frac_x[i];
+            const float fy = frac_y[i];
+            const float top = h00[i] + (h10[i] - h00[i]) * fx;
+            const float bottom = h01[i] + (h11[i] - h01[i]) * fx;
+            h[i] = top + (bottom - top) * fy;
+            dx[i] = (h10[i] - h00[i]) * (1.f - fy) + (h11[i] - h01[i]) * fy;
+            dy[i] = bottom - top;
+        }
+
+        if (heights) {
+            float *const dest = &heights[batch0];
+            for (std::size_t i = 0; i < batch_size; ++i) {
+                dest[i] = h[i];
+            }
+        }
+
+        if (slopes) {
+            Vector2f *const dest = &slopes[batch0];
+            for (std::size_t i = 0; i < batch_size; ++i) {
+                dest[i].as_array[eX] = dx[i];
+                dest[i].as_array[eY] = dy[i];
+            }
+        }
+
+        if (normals) {
+            Vector3f *const dest = &normals[batch0];
+            for (std::size_t i = 0; i < batch_size; ++i) {
+                const float inv_length = 1.f / std::sqrt(dx[i]*dx[i] + dy[i]*dy[i] + 1.f);
+                dest[i].as_array[eX] = -dx[i] * inv_length;
+                dest[i].as_array[eY] = -dy[i] * inv_length;
+                dest[i].as_array[eZ] = inv_length;
+            }
+        }
+    }
+
+    return outside;
+}
+
+
+/* sim::Sandifier */
 
 const float Sandifier::SAND_FILTER_CONSTANT = 0.4f;
 const float Sandifier::SAND_FILTER_CUTOFF = 1e-2;
+const unsigned int Sandifier::TILE_SIZE = 64;
 
 
 Sandifier::Sandifier(Terrain &terrain, const Fluid &fluid):
     m_terrain(terrain),
     m_fluid(fluid),
-    m_curr_y(0),
-    m_dest_row(m_terrain.size())
+    m_tiles_per_axis((terrain.size() + TILE_SIZE - 1) / TILE_SIZE),
+    m_dirty_tiles(m_tiles_per_axis*m_tiles_per_axis, true),
+    m_active_tiles(m_dirty_tiles.size(), false),
+    m_heightmap_updated_conn(terrain.heightmap_updated().connect(
+                                 sigc::mem_fun(*this, &Sandifier::heightmap_updated)))
 {
-    m_rows[0].resize(m_terrain.size()+2);
-    m_rows[1].resize(m_rows[0].size());
-    m_rows[2].resize(m_rows[0].size());
+
 }
 
-void Sandifier::fetch_fluid_info(const unsigned int x,
-                                 std::array<const FluidCell*, 9> &dest)
+Sandifier::~Sandifier()
 {
-    const int xc = x;
-    const int yc = m_curr_y;
-
-    dest[0] = m_fluid.blocks().clamped_cell_front(xc-1, yc-1);
-    dest[1] = m_fluid.blocks().clamped_cell_front(xc, yc-1);
-    dest[2] = m_fluid.blocks().clamped_cell_front(xc+1, yc-1);
-
-    dest[3] = m_fluid.blocks().clamped_cell_front(xc-1, yc);
-    dest[4] = m_fluid.blocks().clamped_cell_front(xc, yc);
-    dest[5] = m_fluid.blocks().clamped_cell_front(xc+1, yc);
+    m_heightmap_updated_conn.disconnect();
+}
 
-    dest[6] = m_fluid.blocks().clamped_cell_front(xc-1, yc+1);
-    dest[7] = m_fluid.blocks().clamped_cell_front(xc, yc+1);
-    dest[8] = m_fluid.blocks().clamped_cell_front(xc+1, yc+1);
+TerrainRect Sandifier::tile_rect(const unsigned int tx,
+                                 const unsigned int ty) const
+{
+    const unsigned int x0 = tx*TILE_SIZE;
+    const unsigned int y0 = ty*TILE_SIZE;
+    return TerrainRect(x0, y0,
+                       std::min(x0+TILE_SIZE, m_terrain.size()),
+                       std::min(y0+TILE_SIZE, m_terrain.size()));
 }
 
-void Sandifier::fetch_row(const unsigned int y,
-                          const Terrain::Field &src,
-                          std::vector<Vector3f> &dest)
+void Sandifier::heightmap_updated(const TerrainRegion &region)
 {
-    memcpy(&dest[1], &src[y*m_terrain.size()],
-            sizeof(Terrain::Field::value_type)*m_terrain.size());
-    dest[0] = dest[1];
-    dest[m_terrain.size()] = dest[m_terrain.size()-1];
+    std::lock_guard<std::mutex> lock(m_dirty_mutex);
+    for (const TerrainRect &rect: region) {
+        mark_tiles(rect, m_dirty_tiles);
+    }
 }
 
-std::tuple<unsigned int, unsigned int> Sandifier::step()
+void Sandifier::mark_tiles(const TerrainRect &rect,
+                           std::vector<bool> &dest) const
 {
-    {
-        const Terrain::Field *field;
-        auto lock = m_terrain.readonly_field(field);
-        if (m_curr_y == 0) {
-            // load first row and copy it in the prev buffer
-            fetch_row(m_curr_y, *field, m_rows[1]);
-            m_rows[0] = m_rows[1];
-        } else {
-            //m_rows[0].swap(m_rows[1]);  // move 1st to 0th
-            //m_rows[1].swap(m_rows[2]);  // move 2nd to 1st
-            m_rows[0] = std::move(m_rows[1]);
-            m_rows[1] = std::move(m_rows[2]);
-            m_rows[2].resize(m_rows[0].size());
+    if (!rect.is_a_rect() || rect.x1() <= rect.x0() || rect.y1() <= rect.y0()) {
+        return;
+    }
+
+    // cells depend on their direct neighbours, so the rect is grown by one
+    // cell in each direction
+    const unsigned int tx0 = (rect.x0() > 0 ? rect.x0() - 1 : 0) / TILE_SIZE;
+    const unsigned int ty0 = (rect.y0() > 0 ? rect.y0() - 1 : 0) / TILE_SIZE;
+    const unsigned int tx1 = std::min(rect.x1() / TILE_SIZE + 1,
+                                      m_tiles_per_axis);
+    const unsigned int ty1 = std::min(rect.y1() / TILE_SIZE + 1,
+                                      m_tiles_per_axis);
+
+    for (unsigned int ty = ty0; ty < ty1; ++ty) {
+        for (unsigned int tx = tx0; tx < tx1; ++tx) {
+            dest[ty*m_tiles_per_axis+tx] = true;
         }
-        if (m_curr_y < m_terrain.size()-1) {
-            fetch_row(m_curr_y+1, *field, m_rows[2]);  // load next row
-        } else {
-            // copy last row
-            m_rows[2] = m_rows[1];
+    }
+}
+
+bool Sandifier::process_tile(const Terrain::Field &field,
+                             const unsigned int tx,
+                             const unsigned int ty,
+                             std::vector<float> &dest) const
+{
+    const unsigned int size = m_terrain.size();
+    const TerrainRect rect = tile_rect(tx, ty);
+    const unsigned int width = rect.x1() - rect.x0();
+    const unsigned int height = rect.y1() - rect.y0();
+    const unsigned int latch_width = width + 2;
+
+    // latch heights and sand of the tile plus a border of one cell into
+    // separate planes; cells outside the terrain are clamped to the edge
+    std::vector<float> heights(latch_width*(height+2));
+    std::vector<float> sand(heights.size());
+    for (unsigned int ly = 0; ly < height+2; ++ly) {
+        const int y = std::max(0, std::min(int(rect.y0()+ly)-1, int(size)-1));
+        const Vector3f *src_row = &field[y*size];
+        for (unsigned int lx = 0; lx < latch_width; ++lx) {
+            const int x = std::max(0, std::min(int(rect.x0()+lx)-1, int(size)-1));
+            heights[ly*latch_width+lx] = src_row[x][Terrain::HEIGHT_ATTR];
+            sand[ly*latch_width+lx] = src_row[x][Terrain::SAND_ATTR];
         }
     }
 
-    unsigned int min_changed_x = m_terrain.size();
-    unsigned int max_changed_x = 0;
     bool changed = false;
+    for (unsigned int y = 0; y < height; ++y) {
+        for (unsigned int x = 0; x < width; ++x) {
+            const unsigned int center = (y+1)*latch_width+(x+1);
+            const FluidCell &center_cell = *m_fluid.blocks().clamped_cell_front(
+                        rect.x0()+x, rect.y0()+y);
+
+            const float prev_sandiness = sand[center];
+            const float local_height = heights[center];
+            float &dest_value = dest[y*width+x];
+            dest_value = prev_sandiness;
+
+            float new_value = 0.f;
+
+            if (center_cell.fluid_height >= 0.01) {
+                // clamp wet cells to 1
+                new_value = 1.f;
+            } else {
+                float accum = 0;
+                float min_value = std::numeric_limits<float>::infinity();
+                float max_value = 0;
+
+                for (int yo = -1; yo <= 1; ++yo) {
+                    for (int xo = -1; xo <= 1; ++xo) {
+                        if (xo == 0 && yo == 0) {
+                            continue;
+                        }
 
-    for (unsigned int xc = 0; xc < m_terrain.size(); ++xc) {
-        const FluidCell &center_cell = *m_fluid.blocks().clamped_cell_front(xc, m_curr_y);
-
-        /*std::array<const FluidCell*, 9> neighbourhood;
-        fetch_fluid_info(x, neighbourhood);*/
-
-
-        std::vector<Vector3f> *row = &m_rows[0];
-        //const FluidCell **cells = &neighbourhood[0];
-
-        const float prev_sandiness = m_rows[1][xc+1][Terrain::SAND_ATTR];
-        const float local_height = m_rows[1][xc+1][Terrain::HEIGHT_ATTR];
-        m_dest_row[xc] = prev_sandiness;
+                        const unsigned int neighbour = center + yo*int(latch_width) + xo;
+                        const float value = std::max(0.f, sand[neighbour] - std::fabs(heights[neighbour] - local_height) / 1000.f);
 
-        float new_value = 0.f;
+                        if (value >= prev_sandiness) {
+                            if (value > 0) {
+                                min_value = std::min(min_value, value);
+                            }
+                            accum += value;
+                        }
+                        max_value = std::max(value, max_value);
+                    }
+                }
 
-        if (center_cell.fluid_height >= 0.01) {
-            // clamp wet cells to 1
-            new_value = 1.f;
-        } else {
-            float accum = 0;
-            float min_value = std::numeric_limits<float>::infinity();
-            float max_value = 0;
+                min_value = std::max(prev_sandiness, min_value);
 
-            for (int yo = -1; yo <= 1; ++yo) {
-                for (int xo = -1; xo <= 1; ++xo) {
-                    if (xo == 0 && yo == 0) {
-                        continue;
-                    }
+                // sand sources
+                new_value = std::min(min_value, accum / 5.f);
 
-                    const float sandiness = (*row)[xc+1+xo][Terrain::SAND_ATTR];
-                    const float value = std::max(0.f, sandiness- std::fabs((*row)[xc+1+xo][Terrain::HEIGHT_ATTR] - local_height) / 1000.f);
+                if (new_value == max_value) {
+                    new_value = 0.f; // filtering will prevent oscillation
+                }
+            }
 
-                    if (value >= prev_sandiness) {
-                        if (value > 0) {
-                            min_value = std::min(min_value, value);
-                        }
-                        accum += value;
-                    }
-                    max_value = std::max(value, max_value);
+            if (prev_sandiness != new_value) {
+                changed = true;
+                if (std::fabs(prev_sandiness - new_value) < SAND_FILTER_CUTOFF) {
+                    dest_value = new_value;
+                } else {
+                    dest_value = SAND_FILTER_CONSTANT * new_value + prev_sandiness * (1-SAND_FILTER_CONSTANT);
                 }
-                row++;
             }
+        }
+    }
 
-            min_value = std::max(prev_sandiness, min_value);
+    return changed;
+}
 
-            // sand sources
-            new_value = std::min(min_value, accum / 5.f);
+unsigned int Sandifier::tiles_dirty()
+{
+    std::lock_guard<std::mutex> lock(m_dirty_mutex);
+    return std::count(m_dirty_tiles.begin(), m_dirty_tiles.end(), true);
+}
 
-            if (new_value == max_value) {
-                //new_value *= 0.95;
-                new_value = 0.f; // filtering will prevent oscillation
-            }
-        }
+void Sandifier::run_steps()
+{
+    const FluidBlocks &blocks = m_fluid.blocks();
+    auto fluid_lock = blocks.read_frontbuffer();
 
-        if (prev_sandiness != new_value) {
-            min_changed_x = std::min(min_changed_x, xc);
-            max_changed_x = std::max(max_changed_x, xc);
-            /*if (!center_cell.wet()) {
-                std::cout << prev_sandiness << " " << new_value << std::endl;
-            }*/
-            if (std::fabs(prev_sandiness - new_value) < SAND_FILTER_CUTOFF) {
-                m_dest_row[xc] = new_value;
-            } else {
-                m_dest_row[xc] = SAND_FILTER_CONSTANT * new_value + prev_sandiness * (1-SAND_FILTER_CONSTANT);
+    {
+        std::lock_guard<std::mutex> lock(m_dirty_mutex);
+        m_active_tiles.swap(m_dirty_tiles);
+        std::fill(m_dirty_tiles.begin(), m_dirty_tiles.end(), false);
+    }
+
+    for (unsigned int by = 0; by < blocks.blocks_per_axis(); ++by) {
+        for (unsigned int bx = 0; bx < blocks.blocks_per_axis(); ++bx) {
+            if (blocks.block(bx, by)->front_meta().active) {
+                const unsigned int x0 = bx*IFluidSim::block_size;
+                const unsigned int y0 = by*IFluidSim::block_size;
+                mark_tiles(TerrainRect(x0, y0,
+                                       x0+IFluidSim::block_size,
+                                       y0+IFluidSim::block_size),
+                           m_active_tiles);
             }
         }
     }
 
-    if (min_changed_x <= max_changed_x) {
-        Terrain::Field *field;
-        auto lock = m_terrain.writable_field(field);
-        for (unsigned int x = min_changed_x; x <= max_changed_x; ++x) {
-            (*field)[m_curr_y*m_terrain.size() + x][Terrain::SAND_ATTR] = m_dest_row[x];
+    std::vector<unsigned int> tiles;
+    for (unsigned int i = 0; i < m_active_tiles.size(); ++i) {
+        if (m_active_tiles[i]) {
+            tiles.push_back(i);
         }
     }
+    if (tiles.empty()) {
+        return;
+    }
 
-    m_curr_y += 1;
-    if (m_curr_y == m_terrain.size()) {
-        m_curr_y = 0;
+    if (m_tile_buffers.size() < tiles.size()) {
+        m_tile_buffers.resize(tiles.size());
     }
 
-    return std::make_tuple(min_changed_x, max_changed_x);
-}
+    // phase one: compute the new values of all tiles from a consistent
+    // snapshot of the field
+    std::vector<std::future<void>> tasks;
+    std::vector<char> tile_changed(tiles.size(), false);
+    {
+        const Terrain::Field *field = nullptr;
+        auto lock = m_terrain.readonly_field(field);
 
-void Sandifier::run_steps()
-{
-    unsigned int start_y = m_curr_y;
-    unsigned int min_changed_x = m_terrain.size(), max_changed_x = 0;
+        ffe::ThreadPool &pool = ffe::ThreadPool::global();
+        tasks.reserve(tiles.size());
+        for (unsigned int i = 0; i < tiles.size(); ++i) {
+            const unsigned int tx = tiles[i] % m_tiles_per_axis;
+            const unsigned int ty = tiles[i] / m_tiles_per_axis;
+            std::vector<float> &dest = m_tile_buffers[i];
+            dest.resize(TILE_SIZE*TILE_SIZE);
+            char &changed = tile_changed[i];
+
+            tasks.emplace_back(pool.submit_task(std::packaged_task<void()>([this, field, tx, ty, &dest, &changed](){
+                changed = process_tile(*field, tx, ty, dest);
+            })));
+        }
+
+        for (auto &task: tasks) {
+            task.get();
+        }
+    }
 
-    const unsigned int rows = (start_y == m_terrain.size()-5 ? 5 : 4);
+    // phase two: write back the changed tiles
+    std::vector<bool> next_dirty(m_active_tiles.size(), false);
+    {
+        Terrain::Field *field = nullptr;
+        auto lock = m_terrain.writable_field(field);
+        for (unsigned int i = 0; i < tiles.size(); ++i) {
+            if (!tile_changed[i]) {
+                continue;
+            }
 
-    for (unsigned int i = 0; i < rows; ++i) {
-        unsigned int this_min_changed_x, this_max_changed_x;
-        std::tie(this_min_changed_x, this_max_changed_x) = step();
+            const TerrainRect rect = tile_rect(tiles[i] % m_tiles_per_axis,
+                                               tiles[i] / m_tiles_per_axis);
+            const float *src = m_tile_buffers[i].data();
+            for (unsigned int y = rect.y0(); y < rect.y1(); ++y) {
+                Vector3f *dest_row = &(*field)[y*m_terrain.size()];
+                for (unsigned int x = rect.x0(); x < rect.x1(); ++x) {
+                    dest_row[x][Terrain::SAND_ATTR] = *src++;
+                }
+            }
 
-        if (this_min_changed_x <= this_max_changed_x) {
-            min_changed_x = std::min(min_changed_x, this_min_changed_x);
-            max_changed_x = std::max(max_changed_x, this_max_changed_x);
+            // the tile and its neighbours may change further in the next run
+            mark_tiles(rect, next_dirty);
+            m_terrain.notify_attributes_changed(rect);
         }
     }
 
-    if (min_changed_x <= max_changed_x) {
-        const TerrainRect changed_rect(min_changed_x, start_y, max_changed_x + 1, start_y+rows);
-        std::cout << changed_rect << std::endl;
-        m_terrain.notify_attributes_changed(changed_rect);
+    std::lock_guard<std::mutex> lock(m_dirty_mutex);
+    for (unsigned int i = 0; i < next_dirty.size(); ++i) {
+        if (next_dirty[i]) {
+            m_dirty_tiles[i] = true;
+        }
     }
 }
 
-
 }
@@ -0,0 +1,344 @@
+/**********************************************************************
+File name: terrain_file.cpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#include "ffengine/sim/terrain_file.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <google/protobuf/io/coded_stream.h>
+
+#include "ffengine/common/rle.hpp"
+#include "ffengine/common/utils.hpp"
+
+
+namespace sim {
+
+static io::Logger &logger = io::logging().get_logger("sim.terrain_file");
+
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::io::CodedOutputStream;
+
+
+static void encode_header(const TerrainFile::Header &header,
+                          std::uint8_t *dest)
+{
+    std::memcpy(dest, header.magic, sizeof(header.magic));
+    dest += sizeof(header.magic);
+    dest = CodedOutputStream::WriteLittleEndian32ToArray(header.version, dest);
+    dest = CodedOutputStream::WriteLittleEndian32ToArray(header.size, dest);
+    dest = CodedOutputStream::WriteLittleEndian32ToArray(header.tile_size, dest);
+    CodedOutputStream::WriteLittleEndian32ToArray(header.tiles_per_axis, dest);
+}
+
+static TerrainFile::Header decode_header(const std::uint8_t *src)
+{
+    TerrainFile::Header header;
+    std::memcpy(header.magic, src, sizeof(header.magic));
+    src += sizeof(header.magic);
+    src = CodedInputStream::ReadLittleEndian32FromArray(src, &header.version);
+    src = CodedInputStream::ReadLittleEndian32FromArray(src, &header.size);
+    src = CodedInputStream::ReadLittleEndian32FromArray(src, &header.tile_size);
+    CodedInputStream::ReadLittleEndian32FromArray(src, &header.tiles_per_axis);
+    return header;
+}
+
+static void encode_tile_entry(const TerrainFile::TileEntry &entry,
+                              std::uint8_t *dest)
+{
+    dest = CodedOutputStream::WriteLittleEndian64ToArray(entry.offset, dest);
+    for (unsigned int plane = 0; plane < TerrainFile::PLANES; ++plane) {
+        dest = CodedOutputStream::WriteLittleEndian32ToArray(
+                    entry.plane_length[plane], dest);
+    }
+    CodedOutputStream::WriteLittleEndian32ToArray(entry.reserved, dest);
+}
+
+static TerrainFile::TileEntry decode_tile_entry(const std::uint8_t *src)
+{
+    TerrainFile::TileEntry entry;
+    src = CodedInputStream::ReadLittleEndian64FromArray(src, &entry.offset);
+    for (unsigned int plane = 0; plane < TerrainFile::PLANES; ++plane) {
+        src = CodedInputStream::ReadLittleEndian32FromArray(
+                    src, &entry.plane_length[plane]);
+    }
+    CodedInputStream::ReadLittleEndian32FromArray(src, &entry.reserved);
+    return entry;
+}
+
+
+/* sim::TerrainFile */
+
+const char TerrainFile::MAGIC[8] = {'F', 'F', 'E', 'T', 'E', 'R', 'R', '\0'};
+const std::uint32_t TerrainFile::VERSION = 2;
+const unsigned int TerrainFile::DEFAULT_TILE_SIZE = 64;
+const std::size_t TerrainFile::HEADER_SIZE;
+const std::size_t TerrainFile::TILE_ENTRY_SIZE;
+const std::size_t TerrainFile::TRAILER_SIZE;
+
+TerrainFile::TerrainFile(const std::string &path):
+    m_fd(-1),
+    m_data(nullptr),
+    m_data_size(0),
+    m_header(),
+    m_index(nullptr)
+{
+    m_fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (m_fd == -1) {
+        ffe::raise_last_os_error();
+    }
+
+    struct stat info;
+    if (fstat(m_fd, &info) != 0) {
+        const int err = errno;
+        ::close(m_fd);
+        throw std::system_error(err, std::system_category());
+    }
+    m_data_size = info.st_size;
+
+    if (m_data_size < HEADER_SIZE + TRAILER_SIZE) {
+        ::close(m_fd);
+        throw std::runtime_error("terrain file too short: "+path);
+    }
+
+    void *mapped = mmap(nullptr, m_data_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+    if (mapped == MAP_FAILED) {
+        const int err = errno;
+        ::close(m_fd);
+        throw std::system_error(err, std::system_category());
+    }
+    // tiles are requested in no particular order
+    madvise(mapped, m_data_size, MADV_RANDOM);
+    m_data = static_cast<const std::uint8_t*>(mapped);
+    m_header = decode_header(m_data);
+
+    try {
+        if (std::memcmp(m_header.magic, MAGIC, sizeof(MAGIC)) != 0) {
+            throw std::runtime_error("not a terrain file: "+path);
+        }
+        if (m_header.version != VERSION) {
+            throw std::runtime_error("unsupported terrain file version: "+
+                                     std::to_string(m_header.version));
+        }
+        if (m_header.tile_size == 0 ||
+                m_header.tiles_per_axis !=
+                (std::uint64_t(m_header.size) + m_header.tile_size - 1)
+                / m_header.tile_size)
+        {
+            throw std::runtime_error("inconsistent tiling in terrain file: "+path);
+        }
+
+        // the index is written after the tiles, so that the writer does not
+        // need to seek; the trailer points to it
+        const std::size_t tiles = std::size_t(m_header.tiles_per_axis)
+                * m_header.tiles_per_axis;
+        std::uint64_t index_offset = 0;
+        CodedInputStream::ReadLittleEndian64FromArray(
+                    m_data + m_data_size - TRAILER_SIZE, &index_offset);
+        if (index_offset < HEADER_SIZE ||
+                index_offset > m_data_size - TRAILER_SIZE ||
+                m_data_size - TRAILER_SIZE - index_offset
+                != tiles*TILE_ENTRY_SIZE)
+        {
+            throw std::runtime_error("truncated tile index in terrain file: "+path);
+        }
+        m_index = m_data + index_offset;
+    } catch (...) {
+        munmap(const_cast<std::uint8_t*>(m_data), m_data_size);
+        ::close(m_fd);
+        throw;
+    }
+
+    logger.logf(io::LOG_INFO, "mapped terrain file %s (size %u, %u tiles per axis)",
+                path.c_str(), size(), tiles_per_axis());
+}
+
+TerrainFile::~TerrainFile()
+{
+    munmap(const_cast<std::uint8_t*>(m_data), m_data_size);
+    ::close(m_fd);
+}
+
+TerrainRect TerrainFile::tile_rect(const unsigned int tx,
+                                   const unsigned int ty) const
+{
+    const unsigned int x0 = tx * tile_size();
+    const unsigned int y0 = ty * tile_size();
+    return TerrainRect(x0, y0,
+                       std::min(x0 + tile_size(), size()),
+                       std::min(y0 + tile_size(), size()));
+}
+
+void TerrainFile::read_tile(const unsigned int tx, const unsigned int ty,
+                            Terrain::Field &field) const
+{
+    if (tx >= tiles_per_axis() || ty >= tiles_per_axis()) {
+        throw std::out_of_range("tile coordinates out of range");
+    }
+
+    const TileEntry entry = decode_tile_entry(
+                m_index + std::size_t(ty*tiles_per_axis()+tx)*TILE_ENTRY_SIZE);
+    const TerrainRect rect = tile_rect(tx, ty);
+    const unsigned int width = rect.x1() - rect.x0();
+    const std::size_t count = rect.area();
+
+    std::uint64_t offset = entry.offset;
+    std::vector<std::uint8_t> shuffled(count*sizeof(float));
+    std::vector<std::uint8_t> values(count*sizeof(float));
+    for (unsigned int plane = 0; plane < PLANES; ++plane) {
+        const std::size_t length = entry.plane_length[plane];
+        if (offset > m_data_size || length > m_data_size - offset) {
+            throw std::runtime_error("tile data out of bounds in terrain file");
+        }
+
+        ffe::rle_decode(m_data + offset, length,
+                        shuffled.data(), shuffled.size());
+        ffe::byte_unshuffle(shuffled.data(), count, sizeof(float),
+                            values.data());
+        offset += length;
+
+        const std::uint8_t *src = values.data();
+        for (unsigned int y = rect.y0(); y < rect.y1(); ++y) {
+            Vector3f *row = &field[y*size() + rect.x0()];
+            for (unsigned int x = 0; x < width; ++x) {
+                std::uint32_t bits;
+                src = CodedInputStream::ReadLittleEndian32FromArray(src, &bits);
+                std::memcpy(&row[x].as_array[plane], &bits, sizeof(bits));
+            }
+        }
+    }
+}
+
+
+static void write_all(io::Stream &dest, const void *data, std::size_t length)
+{
+    const std::uint8_t *ptr = static_cast<const std::uint8_t*>(data);
+    while (length > 0) {
+        const std::size_t written = dest.write(ptr, length);
+        if (written == 0) {
+            throw std::runtime_error("failed to write terrain file");
+        }
+        ptr += written;
+        length -= written;
+    }
+}
+
+void write_terrain_file(const Terrain &terrain,
+                        io::Stream &dest,
+                        const unsigned int tile_size)
+{
+    if (tile_size == 0) {
+        throw std::invalid_argument("tile size must be positive");
+    }
+
+    const unsigned int size = terrain.size();
+    const unsigned int tiles_per_axis = (size + tile_size - 1) / tile_size;
+
+    TerrainFile::Header header;
+    std::memcpy(header.magic, TerrainFile::MAGIC, sizeof(header.magic));
+    header.version = TerrainFile::VERSION;
+    header.size = size;
+    header.tile_size = tile_size;
+    header.tiles_per_axis = tiles_per_axis;
+
+    std::uint8_t encoded_header[TerrainFile::HEADER_SIZE];
+    encode_header(header, encoded_header);
+    write_all(dest, encoded_header, sizeof(encoded_header));
+
+    /* each tile is copied, encoded and written on its own, so that only a
+     * tile worth of data is buffered and the lock on the field is only held
+     * for short copies, which does not stall writers (such as the game
+     * loop) */
+    std::vector<std::uint8_t> encoded_index(
+                std::size_t(tiles_per_axis)*tiles_per_axis
+                * TerrainFile::TILE_ENTRY_SIZE
+                + TerrainFile::TRAILER_SIZE);
+    std::vector<Vector3f> cells;
+    std::vector<std::uint8_t> values;
+    std::vector<std::uint8_t> shuffled;
+    std::vector<std::uint8_t> data;
+    std::uint64_t offset = TerrainFile::HEADER_SIZE;
+    for (unsigned int ty = 0; ty < tiles_per_axis; ++ty) {
+        for (unsigned int tx = 0; tx < tiles_per_axis; ++tx) {
+            const unsigned int x0 = tx*tile_size;
+            const unsigned int y0 = ty*tile_size;
+            const unsigned int x1 = std::min(x0 + tile_size, size);
+            const unsigned int y1 = std::min(y0 + tile_size, size);
+            const unsigned int width = x1 - x0;
+            const std::size_t count = std::size_t(width) * (y1 - y0);
+
+            cells.resize(count);
+            {
+                const Terrain::Field *field = nullptr;
+                auto lock = terrain.readonly_field(field);
+                for (unsigned int y = y0; y < y1; ++y) {
+                    std::copy(&(*field)[y*size + x0],
+                              &(*field)[y*size + x1],
+                              &cells[(y - y0)*width]);
+                }
+            }
+
+            TerrainFile::TileEntry entry;
+            entry.offset = offset;
+            entry.reserved = 0;
+
+            data.clear();
+            values.resize(count*sizeof(float));
+            shuffled.resize(count*sizeof(float));
+            for (unsigned int plane = 0; plane < TerrainFile::PLANES; ++plane) {
+                std::uint8_t *dest_value = values.data();
+                for (const Vector3f &cell: cells) {
+                    std::uint32_t bits;
+                    std::memcpy(&bits, &cell.as_array[plane], sizeof(bits));
+                    dest_value = CodedOutputStream::WriteLittleEndian32ToArray(
+                                bits, dest_value);
+                }
+
+                ffe::byte_shuffle(values.data(), count, sizeof(float),
+                                  shuffled.data());
+                const std::size_t start = data.size();
+                ffe::rle_encode(shuffled.data(), shuffled.size(), data);
+                entry.plane_length[plane] = data.size() - start;
+            }
+            write_all(dest, data.data(), data.size());
+            offset += data.size();
+
+            encode_tile_entry(entry, &encoded_index[
+                                  std::size_t(ty*tiles_per_axis+tx)
+                                  * TerrainFile::TILE_ENTRY_SIZE]);
+        }
+    }
+
+    CodedOutputStream::WriteLittleEndian64ToArray(
+                offset,
+                &encoded_index[encoded_index.size()-TerrainFile::TRAILER_SIZE]);
+    write_all(dest, encoded_index.data(), encoded_index.size());
+}
+
+}
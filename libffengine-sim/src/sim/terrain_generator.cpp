@@ -0,0 +1,203 @@
+/**********************************************************************
+File name: terrain_generator.cpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#include "ffengine/sim/terrain_generator.hpp"
+
+#include <algorithm>
+
+
+namespace sim {
+
+static io::Logger &logger = io::logging().get_logger("sim.terrain_generator");
+
+
+/* sim::TerrainGenerator */
+
+const unsigned int TerrainGenerator::DEFAULT_TILE_SIZE = 64;
+
+TerrainGenerator::TerrainGenerator(Terrain &terrain,
+                                   Sampler sampler,
+                                   const Vector2f &focus,
+                                   const unsigned int tile_size):
+    m_terrain(terrain),
+    m_sampler(std::move(sampler)),
+    m_tile_size(tile_size),
+    m_tiles_per_axis((terrain.size() + tile_size - 1) / tile_size),
+    m_focus(focus),
+    m_pending(m_tiles_per_axis*m_tiles_per_axis)
+{
+    for (unsigned int i = 0; i < m_pending.size(); ++i) {
+        m_pending[i] = i;
+    }
+    m_terrain.detach();
+
+    logger.logf(io::LOG_DEBUG, "generating %u tiles of size %u",
+                (unsigned int)m_pending.size(), m_tile_size);
+
+    start();
+    notify();
+}
+
+TerrainGenerator::~TerrainGenerator()
+{
+    tear_down();
+}
+
+TerrainRect TerrainGenerator::tile_rect(const unsigned int tile) const
+{
+    const unsigned int x0 = (tile % m_tiles_per_axis) * m_tile_size;
+    const unsigned int y0 = (tile / m_tiles_per_axis) * m_tile_size;
+    return TerrainRect(x0, y0,
+                       std::min(x0 + m_tile_size, m_terrain.size()),
+                       std::min(y0 + m_tile_size, m_terrain.size()));
+}
+
+bool TerrainGenerator::worker_impl()
+{
+    ffe::ThreadPool &pool = ffe::ThreadPool::global();
+
+    std::vector<unsigned int> batch;
+    {
+        std::lock_guard<std::mutex> lock(m_state_mutex);
+        if (m_pending.empty()) {
+            return false;
+        }
+
+        // move the tiles closest to the focus to the end of the pending
+        // list and take them from there
+        const Vector2f focus = m_focus;
+        const float half_tile = m_tile_size / 2.f;
+        const unsigned int tiles_per_axis = m_tiles_per_axis;
+        const unsigned int tile_size = m_tile_size;
+        auto distance = [=](const unsigned int tile) {
+            const Vector2f center((tile % tiles_per_axis) * tile_size + half_tile,
+                                  (tile / tiles_per_axis) * tile_size + half_tile);
+            const Vector2f offset(center - focus);
+            return offset * offset;
+        };
+
+        const std::size_t batch_size = std::min<std::size_t>(
+                    std::max(1U, pool.workers()), m_pending.size());
+        const auto split = m_pending.end() - batch_size;
+        std::nth_element(m_pending.begin(), split, m_pending.end(),
+                         [&distance](const unsigned int a, const unsigned int b){
+            return distance(a) > distance(b);
+        });
+        batch.assign(split, m_pending.end());
+        m_pending.erase(split, m_pending.end());
+    }
+
+    std::vector<TerrainRect> rects(batch.size());
+    std::vector<std::vector<float> > heights(batch.size());
+    std::vector<std::future<void> > tasks;
+    tasks.reserve(batch.size());
+    for (unsigned int i = 0; i < batch.size(); ++i) {
+        const TerrainRect &rect = rects[i] = tile_rect(batch[i]);
+        std::vector<float> &dest = heights[i];
+        dest.resize((rect.x1() - rect.x0()) * (rect.y1() - rect.y0()));
+        tasks.emplace_back(pool.submit_task(std::packaged_task<void()>([this, &rect, &dest](){
+            m_sampler(rect, dest.data());
+        })));
+    }
+
+    for (auto &task: tasks) {
+        task.get();
+    }
+
+    {
+        Terrain::Field *field = nullptr;
+        auto lock = m_terrain.writable_field(field);
+        for (unsigned int i = 0; i < batch.size(); ++i) {
+            const TerrainRect &rect = rects[i];
+            const float *src = heights[i].data();
+            for (unsigned int y = rect.y0(); y < rect.y1(); ++y) {
+                Vector3f *dest = &(*field)[y*m_terrain.size()];
+                for (unsigned int x = rect.x0(); x < rect.x1(); ++x) {
+                    dest[x][Terrain::HEIGHT_ATTR] = *src++;
+                }
+            }
+        }
+    }
+
+    // the owner of the terrain delivers the changes with its next
+    // flush_notifications(), like all other changes
+    for (const TerrainRect &rect: rects) {
+        m_terrain.notify_heightmap_changed(rect);
+    }
+
+    std::lock_guard<std::mutex> lock(m_state_mutex);
+    if (m_pending.empty()) {
+        logger.log(io::LOG_DEBUG, "generation finished");
+        m_finished.notify_all();
+        return false;
+    }
+    return true;
+}
+
+void TerrainGenerator::set_focus(const Vector2f &focus)
+{
+    std::lock_guard<std::mutex> lock(m_state_mutex);
+    m_focus = focus;
+}
+
+unsigned int TerrainGenerator::tiles_pending() const
+{
+    std::lock_guard<std::mutex> lock(m_state_mutex);
+    return m_pending.size();
+}
+
+void TerrainGenerator::wait_for_completion() const
+{
+    std::unique_lock<std::mutex> lock(m_state_mutex);
+    while (!m_pending.empty()) {
+        m_finished.wait(lock);
+    }
+}
+
+TerrainGenerator::Sampler TerrainGenerator::perlin_sampler(
+        const PerlinNoiseGenerator &gen)
+{
+    return [gen](const TerrainRect &rect, float *dest) {
+        std::vector<VectorFloat> row(rect.x1() - rect.x0());
+        for (unsigned int y = rect.y0(); y < rect.y1(); ++y) {
+            gen.get_row(rect.x0(), y, row.size(), row.data());
+            for (const VectorFloat value: row) {
+                *dest++ = value;
+            }
+        }
+    };
+}
+
+TerrainGenerator::Sampler TerrainGenerator::noise_sampler(
+        const noise::module::Module &gen)
+{
+    return [&gen](const TerrainRect &rect, float *dest) {
+        for (unsigned int y = rect.y0(); y < rect.y1(); ++y) {
+            for (unsigned int x = rect.x0(); x < rect.x1(); ++x) {
+                *dest++ = gen.GetValue(x, y, 0.f);
+            }
+        }
+    };
+}
+
+}
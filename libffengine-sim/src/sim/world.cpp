@@ -23,6 +23,10 @@ the AUTHORS file.
 **********************************************************************/
 #include "ffengine/sim/world.hpp"
 
+#include <cmath>
+
+#include "ffengine/sim/world_ops.hpp"
+
 #include "world_command.pb.h"
 
 namespace sim {
@@ -45,6 +49,119 @@ WorldOperation::~WorldOperation()
 
 }
 
+TerrainRect WorldOperation::touched_terrain_rect(const WorldState&) const
+{
+    return NotARect;
+}
+
+TerrainRect WorldOperation::touched_fluid_rect(const WorldState&) const
+{
+    return NotARect;
+}
+
+WorldResources WorldOperation::resources() const
+{
+    return RESOURCE_ALL;
+}
+
+bool WorldOperation::to_message(messages::WorldCommand &) const
+{
+    return false;
+}
+
+namespace {
+
+/**
+ * Check the fields of a brush command received from a client.
+ *
+ * Besides the size of the density map, this also requires all densities to
+ * lie in [0, 1]; brush operations with other densities would never be fused
+ * (see ops::fuse_brush_operations()) and are not produced by the clients.
+ */
+template <typename brush_msg_t>
+bool valid_brush_message(const brush_msg_t &msg)
+{
+    const uint64_t brush_size = msg.brush_size();
+    if (brush_size == 0 ||
+            uint64_t(msg.density_map_size()) != brush_size*brush_size ||
+            !std::isfinite(msg.xc()) || !std::isfinite(msg.yc()) ||
+            !std::isfinite(msg.brush_strength()))
+    {
+        return false;
+    }
+    for (const float density: msg.density_map()) {
+        // also rejects NaN
+        if (!(density >= 0.f && density <= 1.f)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Return the density map of \a msg, borrowed from it if \a owner is set and
+ * copied otherwise.
+ */
+template <typename brush_msg_t>
+ops::BrushDensityMap density_map_from_message(
+        const brush_msg_t &msg,
+        const std::shared_ptr<const void> &owner)
+{
+    if (owner) {
+        return ops::BrushDensityMap(owner,
+                                    msg.density_map().data(),
+                                    msg.density_map_size());
+    }
+    return std::vector<float>(msg.density_map().begin(),
+                              msg.density_map().end());
+}
+
+std::unique_ptr<WorldOperation> operation_from_message(
+        const messages::WorldCommand &msg,
+        const std::shared_ptr<const void> &owner)
+{
+    if (msg.has_tf_raise()) {
+        const messages::TerraformRaise &cmd = msg.tf_raise();
+        if (!valid_brush_message(cmd)) {
+            return nullptr;
+        }
+        return std::make_unique<ops::TerraformRaise>(
+                    cmd.xc(), cmd.yc(),
+                    cmd.brush_size(),
+                    density_map_from_message(cmd, owner),
+                    cmd.brush_strength());
+    } else if (msg.has_tf_level()) {
+        const messages::TerraformLevel &cmd = msg.tf_level();
+        if (!valid_brush_message(cmd) ||
+                !std::isfinite(cmd.reference_height()))
+        {
+            return nullptr;
+        }
+        return std::make_unique<ops::TerraformLevel>(
+                    cmd.xc(), cmd.yc(),
+                    cmd.brush_size(),
+                    density_map_from_message(cmd, owner),
+                    cmd.brush_strength(),
+                    cmd.reference_height());
+    }
+    return nullptr;
+}
+
+}
+
+std::unique_ptr<WorldOperation> WorldOperation::from_message(
+        const messages::WorldCommand &msg)
+{
+    return operation_from_message(msg, nullptr);
+}
+
+std::unique_ptr<WorldOperation> WorldOperation::from_message(
+        std::shared_ptr<const messages::WorldCommand> msg)
+{
+    const messages::WorldCommand &ref = *msg;
+    return operation_from_message(ref, msg);
+}
+
 
 /* sim::AbstractClient */
 
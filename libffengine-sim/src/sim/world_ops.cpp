@@ -23,16 +23,94 @@ the AUTHORS file.
 **********************************************************************/
 #include "ffengine/sim/world_ops.hpp"
 
+#include <array>
+#include <typeinfo>
+
 #include "ffengine/math/algo.hpp"
 
+#include "world_command.pb.h"
+
 
 namespace sim {
 namespace ops {
 
 
+/**
+ * Grid coordinate of the first brush cell along one axis, for a brush of
+ * diameter \a brush_size centered at \a c.
+ */
+static inline int brush_origin(const unsigned int brush_size, const float c)
+{
+    return std::round(c - brush_size / 2.f);
+}
+
+/**
+ * Part of a brush which lies within a grid of a given size.
+ *
+ * The window is computed once per brush application, so that the inner loops
+ * do not need to check against the grid edges.
+ */
+struct BrushWindow
+{
+    /**
+     * Clip a brush of diameter \a brush_size centered at \a xc, \a yc
+     * against a grid of \a grid_size times \a grid_size cells.
+     */
+    BrushWindow(const unsigned int brush_size,
+                const float xc, const float yc,
+                const unsigned int grid_size)
+    {
+        const int size = brush_size;
+        const int xbase = brush_origin(brush_size, xc);
+        const int ybase = brush_origin(brush_size, yc);
+
+        brush_x0 = std::max(0, -xbase);
+        brush_y0 = std::max(0, -ybase);
+        const int brush_x1 = std::min(size, (int)grid_size - xbase);
+        const int brush_y1 = std::min(size, (int)grid_size - ybase);
+
+        width = std::max(0, brush_x1 - brush_x0);
+        height = std::max(0, brush_y1 - brush_y0);
+        x0 = xbase + brush_x0;
+        y0 = ybase + brush_y0;
+    }
+
+    /**
+     * First cell of the window in the brush density map.
+     */
+    int brush_x0, brush_y0;
+
+    /**
+     * First cell of the window in the grid.
+     */
+    int x0, y0;
+
+    /**
+     * Size of the window; zero if the brush lies outside of the grid.
+     */
+    int width, height;
+
+    inline bool empty() const
+    {
+        return width == 0 || height == 0;
+    }
+
+    inline TerrainRect rect() const
+    {
+        if (empty()) {
+            return NotARect;
+        }
+        return TerrainRect(x0, y0, x0 + width, y0 + height);
+    }
+};
+
 /**
  * Apply a terrain tool using a brush mask.
  *
+ * The heights of each row of the brush are copied into a contiguous buffer,
+ * on which the tool operates. This allows the tools to be implemented as
+ * simple loops over float arrays, which are vectorized by the compiler.
+ *
  * @param field The heightfield to work on
  * @param brush_size Diameter of the brush
  * @param sampled Density map of the brush
@@ -43,46 +121,45 @@ namespace ops {
  * @param y0 Y center for painting
  * @param impl Tool implementation
  *
- * @see flatten_tool, raise_tool
+ * @see flatten_tool, raise_tool, ramp_tool
  */
 template <typename impl_t>
 void apply_brush_masked_tool(sim::Terrain::Field &field,
                              const unsigned int brush_size,
-                             const std::vector<float> &sampled,
+                             const BrushDensityMap &sampled,
                              const float brush_strength,
                              const unsigned int terrain_size,
                              const float x0,
                              const float y0,
                              const impl_t &impl)
 {
-    const int size = brush_size;
-    const float radius = size / 2.f;
-    const int terrain_xbase = std::round(x0 - radius);
-    const int terrain_ybase = std::round(y0 - radius);
+    const BrushWindow window(brush_size, x0, y0, terrain_size);
+    if (window.empty()) {
+        return;
+    }
 
-    for (int y = 0; y < size; y++) {
-        const int yterrain = y + terrain_ybase;
-        if (yterrain < 0) {
-            continue;
-        }
-        if (yterrain >= (int)terrain_size) {
-            break;
+    const std::size_t width = window.width;
+    std::vector<float> heights(width);
+    std::vector<float> density(width);
+
+    for (int y = 0; y < window.height; ++y) {
+        const int yterrain = window.y0 + y;
+        Vector3f *row = &field[yterrain*terrain_size + window.x0];
+        const float *sampled_row = &sampled[(window.brush_y0 + y)*brush_size
+                                            + window.brush_x0];
+
+        for (std::size_t x = 0; x < width; ++x) {
+            heights[x] = row[x][Terrain::HEIGHT_ATTR];
+            density[x] = brush_strength*sampled_row[x];
         }
-        for (int x = 0; x < size; x++) {
-            const int xterrain = x + terrain_xbase;
-            if (xterrain < 0) {
-                continue;
-            }
-            if (xterrain >= (int)terrain_size) {
-                break;
-            }
 
-            sim::Terrain::height_t &h = field[yterrain*terrain_size+xterrain][Terrain::HEIGHT_ATTR];
-            h = std::max(sim::Terrain::min_height,
-                         std::min(sim::Terrain::max_height,
-                                  impl.paint(
-                                      h, brush_strength*sampled[y*size+x],
-                                      xterrain, yterrain)));
+        impl.paint_row(heights.data(), density.data(), width,
+                       window.x0, yterrain);
+
+        for (std::size_t x = 0; x < width; ++x) {
+            row[x][Terrain::HEIGHT_ATTR] = clamp(heights[x],
+                                                 Terrain::min_height,
+                                                 Terrain::max_height);
         }
     }
 }
@@ -105,37 +182,22 @@ void apply_brush_masked_tool(sim::Terrain::Field &field,
 template <typename impl_t>
 void apply_brush_masked_tool(FluidBlocks &field,
                              const unsigned int brush_size,
-                             const std::vector<float> &sampled,
+                             const BrushDensityMap &sampled,
                              const float brush_strength,
                              const float x0,
                              const float y0,
                              const impl_t &impl)
 {
-    const int fluid_size = field.cells_per_axis();
-    const int size = brush_size;
-    const float radius = size / 2.f;
-    const int fluid_xbase = std::round(x0 - radius);
-    const int fluid_ybase = std::round(y0 - radius);
-
-    for (int y = 0; y < size; y++) {
-        const int yfluid = y + fluid_ybase;
-        if (yfluid < 0) {
-            continue;
-        }
-        if (yfluid >= (int)fluid_size) {
-            break;
-        }
-        for (int x = 0; x < size; x++) {
-            const int xfluid = x + fluid_xbase;
-            if (xfluid < 0) {
-                continue;
-            }
-            if (xfluid >= (int)fluid_size) {
-                break;
-            }
-
+    const BrushWindow window(brush_size, x0, y0, field.cells_per_axis());
+
+    for (int y = 0; y < window.height; ++y) {
+        const int yfluid = window.y0 + y;
+        const float *sampled_row = &sampled[(window.brush_y0 + y)*brush_size
+                                            + window.brush_x0];
+        for (int x = 0; x < window.width; ++x) {
+            const int xfluid = window.x0 + x;
             impl.apply(*field.cell_back(xfluid, yfluid),
-                       brush_strength*sampled[y*size+x]);
+                       brush_strength*sampled_row[x]);
             field.block_for_cell(xfluid, yfluid)->set_active(true);
         }
     }
@@ -148,11 +210,14 @@ void apply_brush_masked_tool(FluidBlocks &field,
  */
 struct raise_tool
 {
-    sim::Terrain::height_t paint(sim::Terrain::height_t h,
-                                 float brush_density,
-                                 int, int) const
+    void paint_row(float *h,
+                   const float *brush_density,
+                   const std::size_t width,
+                   int, int) const
     {
-        return h + brush_density;
+        for (std::size_t x = 0; x < width; ++x) {
+            h[x] += brush_density[x];
+        }
     }
 };
 
@@ -171,17 +236,24 @@ struct flatten_tool
 
     sim::Terrain::height_t new_value;
 
-    sim::Terrain::height_t paint(sim::Terrain::height_t h,
-                                 float brush_density,
-                                 int, int) const
+    void paint_row(float *h,
+                   const float *brush_density,
+                   const std::size_t width,
+                   int, int) const
     {
-        return interp_linear(h, new_value, brush_density);
+        for (std::size_t x = 0; x < width; ++x) {
+            const float t = brush_density[x];
+            h[x] = (1.f-t)*h[x] + t*new_value;
+        }
     }
 };
 
 /**
  * Tool implementation for creating a ramp on the terrain
  *
+ * The ramp parameter is linear along a row, so it is computed incrementally
+ * instead of projecting each point separately.
+ *
  * For use with apply_brush_masked_tool().
  */
 struct ramp_tool
@@ -204,14 +276,23 @@ struct ramp_tool
     float length;
     Terrain::height_t source_height, destination_height;
 
-    sim::Terrain::height_t paint(sim::Terrain::height_t h,
-                                 float brush_density,
-                                 int x, int y) const
+    void paint_row(float *h,
+                   const float *brush_density,
+                   const std::size_t width,
+                   int x0, int y) const
     {
-        Vector2f p_in_origin_space = Vector2f(x, y) - origin;
-        const float interp = clamp((p_in_origin_space * direction) / length,
-                                   0.f, 1.f);
-        return interp_linear(h, interp_linear(source_height, destination_height, interp), brush_density);
+        const Vector2f p0_in_origin_space = Vector2f(x0, y) - origin;
+        const float interp0 = (p0_in_origin_space * direction) / length;
+        const float interp_step = direction[eX] / length;
+        const float height_delta = destination_height - source_height;
+
+        for (std::size_t x = 0; x < width; ++x) {
+            const float interp = clamp(interp0 + interp_step*float(x),
+                                       0.f, 1.f);
+            const float target = source_height + height_delta*interp;
+            const float t = brush_density[x];
+            h[x] = (1.f-t)*h[x] + t*target;
+        }
     }
 };
 
@@ -250,20 +331,72 @@ void notify_update_terrain_rect(const Terrain &terrain,
 }
 
 
+/* sim::ops::BrushDensityMap */
+
+BrushDensityMap::BrushDensityMap(const std::vector<float> &values):
+    BrushDensityMap(std::vector<float>(values))
+{
+
+}
+
+BrushDensityMap::BrushDensityMap(std::vector<float> &&values)
+{
+    auto owned = std::make_shared<const std::vector<float> >(std::move(values));
+    m_data = owned->data();
+    m_size = owned->size();
+    m_owner = std::move(owned);
+}
+
+BrushDensityMap::BrushDensityMap(std::shared_ptr<const void> owner,
+                                 const float *data,
+                                 const std::size_t size):
+    m_owner(std::move(owner)),
+    m_data(data),
+    m_size(size)
+{
+
+}
+
+
 /* sim::ops::BrushWorldOperation */
 
+static bool in_unit_range(const BrushDensityMap &density_map)
+{
+    for (const float density: density_map) {
+        // also false for NaN
+        if (!(density >= 0.f && density <= 1.f)) {
+            return false;
+        }
+    }
+    return true;
+}
+
 BrushWorldOperation::BrushWorldOperation(
         const float xc, const float yc,
         const unsigned int brush_size,
-        const std::vector<float> &density_map,
+        BrushDensityMap density_map,
         const float brush_strength):
     m_xc(xc),
     m_yc(yc),
     m_brush_size(brush_size),
-    m_density_map(density_map),
-    m_brush_strength(brush_strength)
+    m_density_map(std::move(density_map)),
+    m_brush_strength(brush_strength),
+    m_densities_in_unit_range(in_unit_range(m_density_map))
+{
+
+}
+
+/* sim::ops::TerraformBrushOperation */
+
+TerrainRect TerraformBrushOperation::touched_terrain_rect(
+        const WorldState &state) const
 {
+    return BrushWindow(m_brush_size, m_xc, m_yc, state.terrain().size()).rect();
+}
 
+WorldResources TerraformBrushOperation::resources() const
+{
+    return RESOURCE_TERRAIN;
 }
 
 /* sim::ops::ObjectWorldOperation */
@@ -274,6 +407,11 @@ ObjectWorldOperation::ObjectWorldOperation(const Object::ID object_id):
 
 }
 
+WorldResources ObjectWorldOperation::resources() const
+{
+    return RESOURCE_OBJECTS | RESOURCE_FLUID;
+}
+
 /* sim::ops::TerraformRaise */
 
 WorldOperationResult TerraformRaise::execute(WorldState &state)
@@ -291,16 +429,28 @@ WorldOperationResult TerraformRaise::execute(WorldState &state)
     return NO_ERROR;
 }
 
+bool TerraformRaise::to_message(messages::WorldCommand &dest) const
+{
+    messages::TerraformRaise &cmd = *dest.mutable_tf_raise();
+    cmd.set_xc(m_xc);
+    cmd.set_yc(m_yc);
+    cmd.set_brush_size(m_brush_size);
+    cmd.mutable_density_map()->Add(m_density_map.begin(), m_density_map.end());
+    cmd.set_brush_strength(m_brush_strength);
+    return true;
+}
+
 
 /* sim::ops::TerraformLevel */
 
 TerraformLevel::TerraformLevel(
         const float xc, const float yc,
         const unsigned int brush_size,
-        const std::vector<float> &density_map,
+        BrushDensityMap density_map,
         const float brush_strength,
         const float reference_height):
-    BrushWorldOperation(xc, yc, brush_size, density_map, brush_strength),
+    TerraformBrushOperation(xc, yc, brush_size, std::move(density_map),
+                            brush_strength),
     m_reference_height(reference_height)
 {
 
@@ -321,101 +471,124 @@ WorldOperationResult TerraformLevel::execute(WorldState &state)
     return NO_ERROR;
 }
 
-
-/* sim::ops::TerraformSmooth */
-
-Terrain::height_t TerraformSmooth::sample_parzen_rect(
-        const Terrain::Field &field,
-        const unsigned int terrain_size,
-        const unsigned int xc, const unsigned int yc,
-        const unsigned int size)
+bool TerraformLevel::to_message(messages::WorldCommand &dest) const
 {
-    TerrainRect r(0, 0, xc+size, yc+size);
-    if (xc < size) {
-        r.set_x0(0);
-    } else {
-        r.set_x0(xc-size);
-    }
-    if (yc < size) {
-        r.set_y0(0);
-    } else {
-        r.set_y0(yc-size);
-    }
+    messages::TerraformLevel &cmd = *dest.mutable_tf_level();
+    cmd.set_xc(m_xc);
+    cmd.set_yc(m_yc);
+    cmd.set_brush_size(m_brush_size);
+    cmd.mutable_density_map()->Add(m_density_map.begin(), m_density_map.end());
+    cmd.set_brush_strength(m_brush_strength);
+    cmd.set_reference_height(m_reference_height);
+    return true;
+}
 
-    if (r.x1() > terrain_size) {
-        r.set_x1(terrain_size);
-    }
-    if (r.y1() > terrain_size) {
-        r.set_y1(terrain_size);
-    }
 
+/* sim::ops::TerraformSmooth */
+
+/**
+ * Radius of the parzen window used for smoothing, in cells.
+ *
+ * The window vanishes at this distance, so only cells closer than this
+ * contribute.
+ */
+static const int SMOOTH_WINDOW_SIZE = 3;
+static const int SMOOTH_KERNEL_RADIUS = SMOOTH_WINDOW_SIZE - 1;
+static const int SMOOTH_KERNEL_SIZE = 2*SMOOTH_KERNEL_RADIUS + 1;
 
-    float total_weight = 0;
-    float total_weighted_height = 0;
-    for (unsigned int y = r.y0(); y < r.y1(); ++y) {
-        for (unsigned int x = r.x0(); x < r.x1(); ++x) {
+static std::array<float, SMOOTH_KERNEL_SIZE*SMOOTH_KERNEL_SIZE> make_smooth_kernel()
+{
+    std::array<float, SMOOTH_KERNEL_SIZE*SMOOTH_KERNEL_SIZE> result;
+    for (int y = 0; y < SMOOTH_KERNEL_SIZE; ++y) {
+        for (int x = 0; x < SMOOTH_KERNEL_SIZE; ++x) {
             const float d = std::sqrt(
-                        sqr((float)x-(float)xc)+sqr((float)y-(float)yc)) / size;
-            const float weight = parzen(d);
-            total_weight += weight;
-            Terrain::height_t height = field[y*terrain_size+x][Terrain::HEIGHT_ATTR];
-            total_weighted_height += height*weight;
+                        sqr((float)(x - SMOOTH_KERNEL_RADIUS))
+                        + sqr((float)(y - SMOOTH_KERNEL_RADIUS)))
+                    / SMOOTH_WINDOW_SIZE;
+            result[y*SMOOTH_KERNEL_SIZE+x] = parzen(d);
         }
     }
-
-    if (total_weight == 0) {
-        return NAN;
-    }
-
-    return total_weighted_height / total_weight;
+    return result;
 }
 
 WorldOperationResult TerraformSmooth::execute(WorldState &state)
 {
+    static const std::array<float, SMOOTH_KERNEL_SIZE*SMOOTH_KERNEL_SIZE> kernel =
+            make_smooth_kernel();
+
     {
         sim::Terrain::Field *field = nullptr;
         auto lock = state.terrain().writable_field(field);
 
-        // we cannot use apply_brush_masked_tool here, because we need
-        // information about our surroundings
-        const int size = m_brush_size;
-        const float radius = size / 2.f;
-        const int terrain_xbase = std::round(m_xc - radius);
-        const int terrain_ybase = std::round(m_yc - radius);
         const unsigned int terrain_size = state.terrain().size();
+        const BrushWindow window(m_brush_size, m_xc, m_yc, terrain_size);
+        if (window.empty()) {
+            return NO_ERROR;
+        }
 
-        for (int y = 0; y < size; y++) {
-            const int yterrain = y + terrain_ybase;
-            if (yterrain < 0) {
-                continue;
+        // latch the heights around the brush, so that all cells are smoothed
+        // based on the original heights; cells outside of the terrain get a
+        // zero weight in the validity plane
+        const int pad = SMOOTH_KERNEL_RADIUS;
+        const std::size_t width = window.width;
+        const std::size_t latch_width = window.width + 2*pad;
+        const std::size_t latch_height = window.height + 2*pad;
+        std::vector<float> heights(latch_width*latch_height, 0.f);
+        std::vector<float> valid(latch_width*latch_height, 0.f);
+
+        const int latch_x0 = window.x0 - pad;
+        const int latch_y0 = window.y0 - pad;
+        const int src_x0 = std::max(0, latch_x0);
+        const int src_x1 = std::min((int)terrain_size,
+                                    latch_x0 + (int)latch_width);
+        const int src_y0 = std::max(0, latch_y0);
+        const int src_y1 = std::min((int)terrain_size,
+                                    latch_y0 + (int)latch_height);
+        for (int y = src_y0; y < src_y1; ++y) {
+            const Vector3f *src = &(*field)[y*terrain_size];
+            const std::size_t offset = (y - latch_y0)*latch_width - latch_x0;
+            for (int x = src_x0; x < src_x1; ++x) {
+                heights[offset+x] = src[x][Terrain::HEIGHT_ATTR];
+                valid[offset+x] = 1.f;
             }
-            if (yterrain >= (int)terrain_size) {
-                break;
-            }
-            for (int x = 0; x < size; x++) {
-                const int xterrain = x + terrain_xbase;
-                if (xterrain < 0) {
-                    continue;
-                }
-                if (xterrain >= (int)terrain_size) {
-                    break;
-                }
-
-                Terrain::height_t &h = (*field)[yterrain*terrain_size+xterrain][Terrain::HEIGHT_ATTR];
+        }
 
-                Terrain::height_t new_h = sample_parzen_rect(
-                            *field, terrain_size, xterrain, yterrain, 3);
-                if (std::isnan(new_h)) {
-                    continue;
+        std::vector<float> weighted_heights(width);
+        std::vector<float> weights(width);
+        for (int y = 0; y < window.height; ++y) {
+            std::fill(weighted_heights.begin(), weighted_heights.end(), 0.f);
+            std::fill(weights.begin(), weights.end(), 0.f);
+
+            for (int ky = 0; ky < SMOOTH_KERNEL_SIZE; ++ky) {
+                for (int kx = 0; kx < SMOOTH_KERNEL_SIZE; ++kx) {
+                    const float k = kernel[ky*SMOOTH_KERNEL_SIZE+kx];
+                    if (k == 0.f) {
+                        continue;
+                    }
+
+                    const std::size_t offset = (y+ky)*latch_width + kx;
+                    const float *height_row = &heights[offset];
+                    const float *valid_row = &valid[offset];
+                    for (std::size_t x = 0; x < width; ++x) {
+                        weighted_heights[x] += k*height_row[x];
+                        weights[x] += k*valid_row[x];
+                    }
                 }
+            }
 
-                h = std::max(
-                            sim::Terrain::min_height,
-                            std::min(
-                                sim::Terrain::max_height,
-                                interp_linear(
-                                    h, new_h,
-                                    m_brush_strength*m_density_map[y*size+x])));
+            const float *original_row = &heights[(y+pad)*latch_width + pad];
+            const float *sampled_row = &m_density_map[
+                    (window.brush_y0 + y)*m_brush_size + window.brush_x0];
+            Vector3f *dest = &(*field)[(window.y0 + y)*terrain_size
+                                       + window.x0];
+            for (std::size_t x = 0; x < width; ++x) {
+                // the center always has a non-zero weight
+                const float smoothed = weighted_heights[x] / weights[x];
+                const float t = m_brush_strength*sampled_row[x];
+                const float h = (1.f-t)*original_row[x] + t*smoothed;
+                dest[x][Terrain::HEIGHT_ATTR] = clamp(h,
+                                                      Terrain::min_height,
+                                                      Terrain::max_height);
             }
         }
     }
@@ -428,13 +601,14 @@ WorldOperationResult TerraformSmooth::execute(WorldState &state)
 
 TerraformRamp::TerraformRamp(const float xc, const float yc,
                              const unsigned int brush_size,
-                             const std::vector<float> &density_map,
+                             BrushDensityMap density_map,
                              const float brush_strength,
                              const Vector2f source_point,
                              const Terrain::height_t source_height,
                              const Vector2f destination_point,
                              const Terrain::height_t destination_height):
-    BrushWorldOperation(xc, yc, brush_size, density_map, brush_strength),
+    TerraformBrushOperation(xc, yc, brush_size, std::move(density_map),
+                            brush_strength),
     m_source_point(source_point),
     m_source_height(source_height),
     m_destination_point(destination_point),
@@ -475,6 +649,17 @@ WorldOperationResult FluidRaise::execute(WorldState &state)
     return NO_ERROR;
 }
 
+TerrainRect FluidRaise::touched_fluid_rect(const WorldState &state) const
+{
+    return BrushWindow(m_brush_size, m_xc, m_yc,
+                       state.fluid().blocks().cells_per_axis()).rect();
+}
+
+WorldResources FluidRaise::resources() const
+{
+    return RESOURCE_FLUID;
+}
+
 
 /* sim::ops::FluidSourceCreate */
 
@@ -526,18 +711,16 @@ sim::WorldOperationResult sim::ops::FluidSourceMove::execute(
         return NO_SUCH_OBJECT;
     }
 
-    float old_terrain_height;
-    float new_terrain_height;
-    {
-        const sim::Terrain::Field *field;
-        auto lock = state.terrain().readonly_field(field);
-        bool valid;
-        std::tie(valid, old_terrain_height) = lookup_height(*field, state.terrain().size(), obj->m_pos[eX], obj->m_pos[eY]);
-        std::tie(valid, new_terrain_height) = lookup_height(*field, state.terrain().size(), m_new_x, m_new_y);
-        if (!valid) {
-            return INVALID_ARGUMENT;
-        }
+    const Vector2f positions[2] = {
+        obj->m_pos,
+        Vector2f(m_new_x, m_new_y)
+    };
+    float terrain_heights[2];
+    if (state.terrain().sample(positions, 2, terrain_heights) > 0) {
+        return INVALID_ARGUMENT;
     }
+    const float old_terrain_height = terrain_heights[0];
+    const float new_terrain_height = terrain_heights[1];
 
     state.fluid().unmap_source(obj);
     obj->m_pos = Vector2f(m_new_x, m_new_y);
@@ -546,6 +729,12 @@ sim::WorldOperationResult sim::ops::FluidSourceMove::execute(
     return NO_ERROR;
 }
 
+WorldResources FluidSourceMove::resources() const
+{
+    // the height of the source is adjusted to the terrain
+    return RESOURCE_OBJECTS | RESOURCE_FLUID | RESOURCE_TERRAIN;
+}
+
 
 /* sim::ops::FluidSourceSetHeight */
 
@@ -638,6 +827,11 @@ WorldOperationResult FluidOceanLevelSetHeight::execute(WorldState &state)
     return NO_ERROR;
 }
 
+WorldResources FluidOceanLevelSetHeight::resources() const
+{
+    return RESOURCE_FLUID;
+}
+
 
 /* sim::ops::FluidReset */
 
@@ -648,6 +842,11 @@ WorldOperationResult FluidReset::execute(WorldState &state)
     return NO_ERROR;
 }
 
+WorldResources FluidReset::resources() const
+{
+    return RESOURCE_FLUID;
+}
+
 /* sim::ops::ConstructNewCurve */
 
 ConstructNewCurve::ConstructNewCurve(
@@ -675,6 +874,240 @@ WorldOperationResult ConstructNewCurve::execute(WorldState &state)
     return NO_ERROR;
 }
 
+WorldResources ConstructNewCurve::resources() const
+{
+    return RESOURCE_OBJECTS | RESOURCE_GRAPH;
+}
+
+
+/* sim::ops::fuse_brush_operations */
+
+namespace {
+
+enum class FusionKind
+{
+    NONE,
+    RAISE,
+    LEVEL,
+    FLUID_RAISE
+};
+
+/**
+ * Unclipped area of a brush in grid coordinates; x1 and y1 are exclusive.
+ */
+struct BrushArea
+{
+    int x0, y0, x1, y1;
+
+    BrushArea():
+        x0(0), y0(0), x1(0), y1(0)
+    {
+
+    }
+
+    explicit BrushArea(const BrushWorldOperation &op):
+        x0(brush_origin(op.brush_size(), op.xc())),
+        y0(brush_origin(op.brush_size(), op.yc())),
+        x1(x0 + (int)op.brush_size()),
+        y1(y0 + (int)op.brush_size())
+    {
+
+    }
+
+    inline bool overlaps(const BrushArea &other) const
+    {
+        return x0 < other.x1 && other.x0 < x1 &&
+                y0 < other.y1 && other.y0 < y1;
+    }
+
+    inline void unite(const BrushArea &other)
+    {
+        x0 = std::min(x0, other.x0);
+        y0 = std::min(y0, other.y0);
+        x1 = std::max(x1, other.x1);
+        y1 = std::max(y1, other.y1);
+    }
+
+    inline unsigned int size() const
+    {
+        return std::max(x1 - x0, y1 - y0);
+    }
+};
+
+FusionKind fusion_kind(const WorldOperation &op)
+{
+    // exact type matches only, subclasses may change the semantics
+    if (typeid(op) == typeid(TerraformRaise)) {
+        return FusionKind::RAISE;
+    } else if (typeid(op) == typeid(TerraformLevel)) {
+        return FusionKind::LEVEL;
+    } else if (typeid(op) == typeid(FluidRaise)) {
+        return FusionKind::FLUID_RAISE;
+    }
+    return FusionKind::NONE;
+}
+
+/**
+ * Check whether applying the accumulated density of \a a and \a b once has
+ * the same effect as applying both in sequence, including the clamping of
+ * the result.
+ */
+bool fusion_compatible(const FusionKind kind,
+                       const BrushWorldOperation &a,
+                       const BrushWorldOperation &b)
+{
+    // a negative density inverts the direction of a raise and a density
+    // above one makes a level overshoot the reference height, either of
+    // which breaks the assumptions below
+    if (!a.densities_in_unit_range() || !b.densities_in_unit_range()) {
+        return false;
+    }
+
+    switch (kind) {
+    case FusionKind::RAISE:
+    case FusionKind::FLUID_RAISE:
+    {
+        // clamping commutes with the sum only if all summands pull into the
+        // same direction
+        return (a.brush_strength() >= 0.f) == (b.brush_strength() >= 0.f);
+    }
+    case FusionKind::LEVEL:
+    {
+        const float ref = static_cast<const TerraformLevel&>(a).reference_height();
+        return ref == static_cast<const TerraformLevel&>(b).reference_height() &&
+                ref >= Terrain::min_height && ref <= Terrain::max_height &&
+                a.brush_strength() >= 0.f && a.brush_strength() <= 1.f &&
+                b.brush_strength() >= 0.f && b.brush_strength() <= 1.f;
+    }
+    case FusionKind::NONE:
+    {
+        break;
+    }
+    }
+    return false;
+}
+
+WorldOperationPtr fuse_run(const FusionKind kind,
+                           const BrushArea &area,
+                           std::vector<WorldOperationPtr>::iterator begin,
+                           std::vector<WorldOperationPtr>::iterator end)
+{
+    const unsigned int size = area.size();
+    // with an integral origin, the centre lies exactly half a brush away, so
+    // that brush_origin() reproduces the origin of the area
+    const float xc = area.x0 + size / 2.f;
+    const float yc = area.y0 + size / 2.f;
+
+    // for levelling, the fraction of the original height which is kept is
+    // accumulated instead of the density
+    const bool multiplicative = kind == FusionKind::LEVEL;
+    std::vector<float> density(size*size, multiplicative ? 1.f : 0.f);
+
+    for (auto iter = begin; iter != end; ++iter) {
+        const BrushWorldOperation &op =
+                static_cast<const BrushWorldOperation&>(**iter);
+        const BrushArea op_area(op);
+        const std::size_t width = op.brush_size();
+        const float strength = op.brush_strength();
+        const std::size_t xoffset = op_area.x0 - area.x0;
+        const std::size_t yoffset = op_area.y0 - area.y0;
+        for (std::size_t y = 0; y < width; ++y) {
+            float *dest = &density[(yoffset + y)*size + xoffset];
+            const float *src = &op.density_map()[y*width];
+            if (multiplicative) {
+                for (std::size_t x = 0; x < width; ++x) {
+                    dest[x] *= 1.f - strength*src[x];
+                }
+            } else {
+                for (std::size_t x = 0; x < width; ++x) {
+                    dest[x] += strength*src[x];
+                }
+            }
+        }
+    }
+
+    switch (kind) {
+    case FusionKind::RAISE:
+    {
+        return std::make_unique<TerraformRaise>(xc, yc, size,
+                                                std::move(density), 1.f);
+    }
+    case FusionKind::LEVEL:
+    {
+        for (float &value: density) {
+            value = 1.f - value;
+        }
+        const TerraformLevel &first = static_cast<const TerraformLevel&>(**begin);
+        return std::make_unique<TerraformLevel>(xc, yc, size,
+                                                std::move(density), 1.f,
+                                                first.reference_height());
+    }
+    case FusionKind::FLUID_RAISE:
+    {
+        return std::make_unique<FluidRaise>(xc, yc, size,
+                                            std::move(density), 1.f);
+    }
+    case FusionKind::NONE:
+    {
+        break;
+    }
+    }
+    return nullptr;
+}
+
+}
+
+std::size_t fuse_brush_operations(std::vector<WorldOperationPtr> &ops)
+{
+    std::vector<WorldOperationPtr> result;
+    result.reserve(ops.size());
+
+    std::size_t removed = 0;
+    auto begin = ops.begin();
+    while (begin != ops.end()) {
+        const FusionKind kind = fusion_kind(**begin);
+        auto end = begin + 1;
+        BrushArea area;
+        if (kind != FusionKind::NONE) {
+            const BrushWorldOperation &first =
+                    static_cast<const BrushWorldOperation&>(**begin);
+            area = BrushArea(first);
+            BrushArea prev_area(first);
+            for (; end != ops.end() && fusion_kind(**end) == kind; ++end) {
+                const BrushWorldOperation &next =
+                        static_cast<const BrushWorldOperation&>(**end);
+                // the compatibility checks are transitive, so checking
+                // against the first operation of the run is sufficient
+                if (!fusion_compatible(kind, first, next)) {
+                    break;
+                }
+                const BrushArea next_area(next);
+                if (!prev_area.overlaps(next_area)) {
+                    break;
+                }
+                BrushArea new_area(area);
+                new_area.unite(next_area);
+                if (new_area.size() > MAX_FUSED_BRUSH_SIZE) {
+                    break;
+                }
+                area = new_area;
+                prev_area = next_area;
+            }
+        }
+
+        if (end - begin > 1) {
+            result.emplace_back(fuse_run(kind, area, begin, end));
+            removed += (end - begin) - 1;
+        } else {
+            result.emplace_back(std::move(*begin));
+        }
+        begin = end;
+    }
+
+    ops = std::move(result);
+    return removed;
+}
+
 
 }
 }
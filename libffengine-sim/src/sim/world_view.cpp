@@ -0,0 +1,209 @@
+/**********************************************************************
+File name: world_view.cpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#include "ffengine/sim/world_view.hpp"
+
+#include <algorithm>
+
+
+namespace sim {
+
+/* sim::FluidBlockSummary */
+
+bool FluidBlockSummary::operator==(const FluidBlockSummary &other) const
+{
+    return active == other.active &&
+            flat == other.flat &&
+            flat_absolute_height == other.flat_absolute_height &&
+            change == other.change;
+}
+
+
+/* sim::WorldView */
+
+constexpr unsigned int WorldView::TILE_SIZE;
+
+WorldView::WorldView(const std::uint64_t frame,
+                     const WorldClock::time_point timestamp,
+                     const unsigned int terrain_size,
+                     std::vector<std::shared_ptr<const HeightTile> > &&tiles,
+                     const TerrainRegion &changed,
+                     const unsigned int fluid_blocks_per_axis,
+                     std::vector<FluidBlockSummary> &&fluid_blocks):
+    m_frame(frame),
+    m_timestamp(timestamp),
+    m_terrain_size(terrain_size),
+    m_tiles_per_axis(tiles_per_axis(terrain_size)),
+    m_tiles(std::move(tiles)),
+    m_changed(changed),
+    m_fluid_blocks_per_axis(fluid_blocks_per_axis),
+    m_fluid_blocks(std::move(fluid_blocks))
+{
+
+}
+
+Terrain::height_t WorldView::height(const unsigned int x,
+                                    const unsigned int y) const
+{
+    const unsigned int tx = x / TILE_SIZE;
+    const unsigned int ty = y / TILE_SIZE;
+    const unsigned int width = tile_rect(m_terrain_size, tx, ty).x1() - tx*TILE_SIZE;
+    return (*tile(tx, ty))[(y - ty*TILE_SIZE)*width + (x - tx*TILE_SIZE)];
+}
+
+void WorldView::copy_heights(const TerrainRect &rect,
+                             Terrain::height_t *dest) const
+{
+    const unsigned int dest_width = rect.x1() - rect.x0();
+    for (unsigned int ty = rect.y0() / TILE_SIZE;
+         ty*TILE_SIZE < rect.y1();
+         ++ty)
+    {
+        for (unsigned int tx = rect.x0() / TILE_SIZE;
+             tx*TILE_SIZE < rect.x1();
+             ++tx)
+        {
+            const TerrainRect trect = tile_rect(m_terrain_size, tx, ty);
+            const unsigned int tile_width = trect.x1() - trect.x0();
+            const TerrainRect part = trect & rect;
+            const HeightTile &src = *tile(tx, ty);
+            const std::size_t width = part.x1() - part.x0();
+            for (unsigned int y = part.y0(); y < part.y1(); ++y) {
+                std::copy_n(&src[(y - trect.y0())*tile_width + (part.x0() - trect.x0())],
+                            width,
+                            &dest[(y - rect.y0())*dest_width + (part.x0() - rect.x0())]);
+            }
+        }
+    }
+}
+
+TerrainRect WorldView::tile_rect(const unsigned int terrain_size,
+                                 const unsigned int tx,
+                                 const unsigned int ty)
+{
+    const unsigned int x0 = tx*TILE_SIZE;
+    const unsigned int y0 = ty*TILE_SIZE;
+    return TerrainRect(x0, y0,
+                       std::min(x0 + TILE_SIZE, terrain_size),
+                       std::min(y0 + TILE_SIZE, terrain_size));
+}
+
+unsigned int WorldView::tiles_per_axis(const unsigned int terrain_size)
+{
+    return (terrain_size + TILE_SIZE - 1) / TILE_SIZE;
+}
+
+std::vector<std::shared_ptr<const WorldView::HeightTile> >
+WorldView::snapshot_tiles(const Terrain &terrain,
+                          const WorldView *previous,
+                          const TerrainRegion &changed)
+{
+    const unsigned int size = terrain.size();
+    const unsigned int ntiles = tiles_per_axis(size);
+    if (previous && previous->terrain_size() != size) {
+        previous = nullptr;
+    }
+
+    std::vector<std::shared_ptr<const HeightTile> > tiles;
+    tiles.reserve(ntiles*ntiles);
+    {
+        const Terrain::Field *field = nullptr;
+        auto lock = terrain.readonly_field(field);
+
+        for (unsigned int ty = 0; ty < ntiles; ++ty) {
+            for (unsigned int tx = 0; tx < ntiles; ++tx) {
+                const TerrainRect rect = tile_rect(size, tx, ty);
+                if (previous) {
+                    const bool dirty = std::any_of(
+                                changed.begin(), changed.end(),
+                                [&rect](const TerrainRect &r){ return rect.overlaps(r); });
+                    if (!dirty) {
+                        tiles.emplace_back(previous->tile(tx, ty));
+                        continue;
+                    }
+                }
+
+                auto tile = std::make_shared<HeightTile>();
+                tile->reserve(rect.area());
+                for (unsigned int y = rect.y0(); y < rect.y1(); ++y) {
+                    const Vector3f *row = &(*field)[y*size];
+                    for (unsigned int x = rect.x0(); x < rect.x1(); ++x) {
+                        tile->push_back(row[x][Terrain::HEIGHT_ATTR]);
+                    }
+                }
+                tiles.emplace_back(std::move(tile));
+            }
+        }
+    }
+
+    return tiles;
+}
+
+std::unique_ptr<const WorldView> WorldView::snapshot(
+        const Terrain &terrain,
+        const WorldView *previous,
+        const TerrainRegion &changed,
+        const std::uint64_t frame)
+{
+    return std::make_unique<WorldView>(frame, WorldClock::now(),
+                                       terrain.size(),
+                                       snapshot_tiles(terrain, previous, changed),
+                                       changed);
+}
+
+std::unique_ptr<const WorldView> WorldView::snapshot(
+        const Terrain &terrain,
+        const WorldView *previous,
+        const TerrainRegion &changed,
+        const std::uint64_t frame,
+        const unsigned int fluid_blocks_per_axis,
+        std::vector<FluidBlockSummary> &&fluid_blocks)
+{
+    return std::make_unique<WorldView>(frame, WorldClock::now(),
+                                       terrain.size(),
+                                       snapshot_tiles(terrain, previous, changed),
+                                       changed,
+                                       fluid_blocks_per_axis,
+                                       std::move(fluid_blocks));
+}
+
+std::vector<FluidBlockSummary> WorldView::summarize_fluid(
+        const FluidBlocks &fluid)
+{
+    const unsigned int nblocks = fluid.blocks_per_axis();
+    std::vector<FluidBlockSummary> result;
+    result.reserve(nblocks*nblocks);
+    for (unsigned int by = 0; by < nblocks; ++by) {
+        for (unsigned int bx = 0; bx < nblocks; ++bx) {
+            const FluidBlockMeta &meta = fluid.block(bx, by)->front_meta();
+            result.emplace_back(FluidBlockSummary{
+                                    meta.active,
+                                    meta.flat,
+                                    meta.flat ? meta.flat_absolute_height : 0.f,
+                                    meta.change});
+        }
+    }
+    return result;
+}
+
+}
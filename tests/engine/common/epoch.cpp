@@ -0,0 +1,238 @@
+/**********************************************************************
+File name: epoch.cpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#include <catch.hpp>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "ffengine/common/epoch.hpp"
+
+
+using namespace ffe;
+
+
+struct Tracked
+{
+    Tracked(int value, std::atomic_int &alive):
+        value(value),
+        alive(alive)
+    {
+        ++alive;
+    }
+
+    ~Tracked()
+    {
+        value = -1;
+        --alive;
+    }
+
+    int value;
+    std::atomic_int &alive;
+};
+
+
+TEST_CASE("common/EpochDomain/retire_unpinned")
+{
+    EpochDomain domain(4, 4);
+    int freed = 0;
+    domain.retire([&freed](){ ++freed; });
+    CHECK(domain.collect() == 1);
+    CHECK(freed == 1);
+    CHECK(domain.retired_count() == 0);
+}
+
+TEST_CASE("common/EpochDomain/pinned_reader_delays_retirement")
+{
+    EpochDomain domain(4, 4);
+    int freed = 0;
+
+    EpochDomain::Guard guard = domain.pin();
+    REQUIRE(guard);
+    domain.retire([&freed](){ ++freed; });
+    CHECK(domain.collect() == 0);
+    CHECK(freed == 0);
+
+    // readers pinning after the retirement cannot see the retired data
+    {
+        EpochDomain::Guard later = domain.pin();
+        domain.retire([&freed](){ ++freed; });
+        CHECK(domain.collect() == 0);
+    }
+
+    guard.release();
+    CHECK_FALSE(guard);
+    CHECK(domain.collect() == 2);
+    CHECK(freed == 2);
+}
+
+TEST_CASE("common/EpochDomain/pinned_reader_does_not_block_retire")
+{
+    EpochDomain domain(4, 4);
+    int freed = 0;
+
+    EpochDomain::Guard guard = domain.pin();
+    for (std::size_t i = 0; i < 3*domain.max_retired(); ++i) {
+        domain.retire([&freed](){ ++freed; });
+    }
+    CHECK(domain.retired_count() == 3*domain.max_retired());
+    CHECK(domain.saturated());
+    CHECK(freed == 0);
+
+    guard.release();
+    CHECK(domain.collect() == 3*domain.max_retired());
+    CHECK(freed == 3*(int)domain.max_retired());
+    CHECK_FALSE(domain.saturated());
+}
+
+TEST_CASE("common/EpochDomain/destructor_frees")
+{
+    int freed = 0;
+    {
+        EpochDomain domain(4, 4);
+        {
+            EpochDomain::Guard guard = domain.pin();
+            domain.retire([&freed](){ ++freed; });
+        }
+        CHECK(freed == 0);
+    }
+    CHECK(freed == 1);
+}
+
+TEST_CASE("common/EpochPointer/publish")
+{
+    std::atomic_int alive(0);
+    {
+        EpochDomain domain(4, 2);
+        EpochPointer<Tracked> ptr(domain);
+        CHECK_FALSE(ptr.load());
+
+        ptr.publish(std::make_unique<Tracked>(1, alive));
+        EpochPointer<Tracked>::Ref ref = ptr.load();
+        REQUIRE(ref);
+        CHECK(ref->value == 1);
+
+        ptr.publish(std::make_unique<Tracked>(2, alive));
+        CHECK(ptr.current()->value == 2);
+        // still pinned
+        CHECK(ref->value == 1);
+        CHECK(alive == 2);
+
+        ref = EpochPointer<Tracked>::Ref();
+        ptr.publish(std::make_unique<Tracked>(3, alive));
+        domain.collect();
+        CHECK(alive == 1);
+        CHECK(ptr.load()->value == 3);
+    }
+    CHECK(alive == 0);
+}
+
+TEST_CASE("common/EpochPointer/reader_pinned_across_publishes")
+{
+    std::atomic_int alive(0);
+    {
+        EpochDomain domain(4, 2);
+        EpochPointer<Tracked> ptr(domain,
+                                  std::make_unique<Tracked>(0, alive));
+
+        std::atomic_bool pinned(false);
+        std::atomic_bool release(false);
+        std::atomic_int seen(-1);
+        std::thread reader([&](){
+            EpochPointer<Tracked>::Ref ref = ptr.load();
+            pinned = true;
+            while (!release) {
+                std::this_thread::yield();
+            }
+            seen = ref->value;
+        });
+        while (!pinned) {
+            std::this_thread::yield();
+        }
+
+        const int versions = 5*domain.max_retired();
+        for (int i = 1; i <= versions; ++i) {
+            ptr.publish(std::make_unique<Tracked>(i, alive));
+        }
+        CHECK(domain.saturated());
+        CHECK(alive == versions + 1);
+
+        release = true;
+        reader.join();
+        CHECK(seen == 0);
+
+        // the next publish collects all versions the reader held back
+        ptr.publish(std::make_unique<Tracked>(versions + 1, alive));
+        CHECK_FALSE(domain.saturated());
+        CHECK(alive == 1);
+    }
+    CHECK(alive == 0);
+}
+
+TEST_CASE("common/EpochPointer/concurrent_readers")
+{
+    static const int versions = 20000;
+    static const int nreaders = 4;
+
+    std::atomic_int alive(0);
+    {
+        EpochDomain domain(8, 4);
+        EpochPointer<Tracked> ptr(domain,
+                                  std::make_unique<Tracked>(0, alive));
+        std::atomic_bool done(false);
+        std::atomic_bool valid(true);
+
+        std::vector<std::thread> readers;
+        for (int i = 0; i < nreaders; ++i) {
+            readers.emplace_back([&](){
+                int last = 0;
+                while (!done) {
+                    EpochPointer<Tracked>::Ref ref = ptr.load();
+                    const int value = ref->value;
+                    // versions are published in increasing order and must
+                    // never be observed after destruction
+                    if (value < last) {
+                        valid = false;
+                    }
+                    last = value;
+                }
+            });
+        }
+
+        for (int i = 1; i <= versions; ++i) {
+            ptr.publish(std::make_unique<Tracked>(i, alive));
+        }
+        done = true;
+        for (auto &reader: readers) {
+            reader.join();
+        }
+
+        CHECK(valid);
+        domain.collect();
+        CHECK(domain.retired_count() == 0);
+        CHECK_FALSE(domain.saturated());
+        CHECK(ptr.load()->value == versions);
+    }
+    CHECK(alive == 0);
+}
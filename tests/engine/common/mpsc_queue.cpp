@@ -0,0 +1,126 @@
+/**********************************************************************
+File name: mpsc_queue.cpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#include <catch.hpp>
+
+#include <thread>
+#include <vector>
+
+#include "ffengine/common/mpsc_queue.hpp"
+
+
+using namespace ffe;
+
+
+TEST_CASE("common/MPSCQueue/capacity")
+{
+    CHECK(MPSCQueue<int>(1).capacity() == 2);
+    CHECK(MPSCQueue<int>(16).capacity() == 16);
+    CHECK(MPSCQueue<int>(100).capacity() == 128);
+}
+
+TEST_CASE("common/MPSCQueue/fifo")
+{
+    MPSCQueue<int> queue(4);
+    int value = 0;
+
+    CHECK_FALSE(queue.try_pop(value));
+
+    for (int lap = 0; lap < 3; ++lap) {
+        for (int i = 0; i < 4; ++i) {
+            CHECK(queue.try_push(lap*10+i));
+        }
+        CHECK_FALSE(queue.try_push(100));
+
+        for (int i = 0; i < 4; ++i) {
+            REQUIRE(queue.try_pop(value));
+            CHECK(value == lap*10+i);
+        }
+        CHECK_FALSE(queue.try_pop(value));
+    }
+}
+
+TEST_CASE("common/MPSCQueue/full_push_keeps_value")
+{
+    MPSCQueue<std::unique_ptr<int> > queue(2);
+    CHECK(queue.try_push(std::make_unique<int>(1)));
+    CHECK(queue.try_push(std::make_unique<int>(2)));
+
+    std::unique_ptr<int> value = std::make_unique<int>(3);
+    CHECK_FALSE(queue.try_push(std::move(value)));
+    REQUIRE(value);
+    CHECK(*value == 3);
+
+    std::unique_ptr<int> popped;
+    REQUIRE(queue.try_pop(popped));
+    CHECK(*popped == 1);
+    CHECK(queue.try_push(std::move(value)));
+    CHECK_FALSE(value);
+}
+
+TEST_CASE("common/MPSCQueue/multiple_producers")
+{
+    static const unsigned int producers = 4;
+    static const unsigned int items_per_producer = 20000;
+
+    MPSCQueue<unsigned int> queue(64);
+
+    std::vector<std::thread> threads;
+    for (unsigned int producer = 0; producer < producers; ++producer) {
+        threads.emplace_back([&queue, producer](){
+            for (unsigned int i = 0; i < items_per_producer; ++i) {
+                const unsigned int item = producer*items_per_producer + i;
+                while (!queue.try_push(item)) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+
+    std::vector<unsigned int> next(producers, 0);
+    bool in_order = true;
+    unsigned int received = 0;
+    while (received < producers*items_per_producer) {
+        unsigned int item;
+        if (!queue.try_pop(item)) {
+            std::this_thread::yield();
+            continue;
+        }
+        const unsigned int producer = item / items_per_producer;
+        in_order = in_order && (item % items_per_producer == next[producer]);
+        next[producer] += 1;
+        received += 1;
+    }
+
+    for (auto &thread: threads) {
+        thread.join();
+    }
+
+    CHECK(in_order);
+    for (unsigned int producer = 0; producer < producers; ++producer) {
+        CHECK(next[producer] == items_per_producer);
+    }
+
+    unsigned int item;
+    CHECK_FALSE(queue.try_pop(item));
+}
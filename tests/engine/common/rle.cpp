@@ -0,0 +1,134 @@
+/**********************************************************************
+File name: rle.cpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#include <catch.hpp>
+
+#include "ffengine/common/rle.hpp"
+
+
+using namespace ffe;
+
+
+static std::vector<std::uint8_t> roundtrip(const std::vector<std::uint8_t> &src)
+{
+    std::vector<std::uint8_t> encoded;
+    rle_encode(src.data(), src.size(), encoded);
+    std::vector<std::uint8_t> decoded(src.size());
+    rle_decode(encoded.data(), encoded.size(), decoded.data(), decoded.size());
+    return decoded;
+}
+
+
+TEST_CASE("common/rle/encode/runs")
+{
+    std::vector<std::uint8_t> src(300, 0x42);
+    std::vector<std::uint8_t> encoded;
+    rle_encode(src.data(), src.size(), encoded);
+
+    // 128 + 128 + 44
+    CHECK(encoded == std::vector<std::uint8_t>({129, 0x42, 129, 0x42, 213, 0x42}));
+}
+
+TEST_CASE("common/rle/encode/literals")
+{
+    std::vector<std::uint8_t> src({1, 2, 3, 3, 4});
+    std::vector<std::uint8_t> encoded;
+    rle_encode(src.data(), src.size(), encoded);
+
+    CHECK(encoded == std::vector<std::uint8_t>({4, 1, 2, 3, 3, 4}));
+}
+
+TEST_CASE("common/rle/roundtrip")
+{
+    SECTION("empty")
+    {
+        std::vector<std::uint8_t> src;
+        CHECK(roundtrip(src) == src);
+    }
+
+    SECTION("mixed")
+    {
+        std::vector<std::uint8_t> src;
+        for (unsigned int i = 0; i < 1000; ++i) {
+            if ((i / 50) % 2 == 0) {
+                src.push_back(0);
+            } else {
+                src.push_back(i * 7);
+            }
+        }
+        CHECK(roundtrip(src) == src);
+    }
+
+    SECTION("long literal")
+    {
+        std::vector<std::uint8_t> src;
+        for (unsigned int i = 0; i < 1000; ++i) {
+            src.push_back(i);
+        }
+        CHECK(roundtrip(src) == src);
+    }
+}
+
+TEST_CASE("common/rle/decode/malformed")
+{
+    std::vector<std::uint8_t> dest(4);
+
+    SECTION("truncated literal")
+    {
+        std::vector<std::uint8_t> src({3, 1, 2});
+        CHECK_THROWS_AS(rle_decode(src.data(), src.size(), dest.data(), dest.size()),
+                        std::runtime_error);
+    }
+
+    SECTION("overflow")
+    {
+        std::vector<std::uint8_t> src({250, 1});
+        CHECK_THROWS_AS(rle_decode(src.data(), src.size(), dest.data(), dest.size()),
+                        std::runtime_error);
+    }
+
+    SECTION("too short")
+    {
+        std::vector<std::uint8_t> src({0, 1});
+        CHECK_THROWS_AS(rle_decode(src.data(), src.size(), dest.data(), dest.size()),
+                        std::runtime_error);
+    }
+}
+
+TEST_CASE("common/rle/byte_shuffle")
+{
+    const std::vector<std::uint32_t> src({0x11223344, 0x55667788});
+    std::vector<std::uint8_t> shuffled(src.size()*sizeof(std::uint32_t));
+    byte_shuffle(src.data(), src.size(), sizeof(std::uint32_t), shuffled.data());
+
+    const std::uint8_t *bytes = reinterpret_cast<const std::uint8_t*>(src.data());
+    CHECK(shuffled[0] == bytes[0]);
+    CHECK(shuffled[1] == bytes[4]);
+    CHECK(shuffled[2] == bytes[1]);
+    CHECK(shuffled[7] == bytes[7]);
+
+    std::vector<std::uint32_t> unshuffled(src.size());
+    byte_unshuffle(shuffled.data(), src.size(), sizeof(std::uint32_t),
+                   unshuffled.data());
+    CHECK(unshuffled == src);
+}
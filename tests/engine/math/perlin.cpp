@@ -0,0 +1,73 @@
+/**********************************************************************
+File name: perlin.cpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#include <catch.hpp>
+
+#include "ffengine/math/perlin.hpp"
+
+
+static void check_row(const PerlinNoiseGenerator &gen,
+                      const VectorFloat x0, const VectorFloat y,
+                      const unsigned int count)
+{
+    std::vector<VectorFloat> row(count);
+    gen.get_row(x0, y, count, row.data());
+
+    for (unsigned int i = 0; i < count; ++i) {
+        CHECK(row[i] == gen.get(Vector2(x0+i, y)));
+    }
+}
+
+
+TEST_CASE("math/PerlinNoiseGenerator/get_row/matches_get")
+{
+    PerlinNoiseGenerator gen(Vector3(1.5, 2.25, 20.),
+                             Vector3(1., 1., 10.),
+                             0.6, 5, 128.);
+
+    SECTION("single batch")
+    {
+        check_row(gen, 0, 0, 100);
+        check_row(gen, 0, 37, 100);
+    }
+
+    SECTION("multiple batches")
+    {
+        check_row(gen, 3, 513, 1000);
+    }
+
+    SECTION("negative coordinates")
+    {
+        check_row(gen, -300, -17, 600);
+    }
+}
+
+TEST_CASE("math/PerlinNoiseGenerator/get_row/scaled")
+{
+    PerlinNoiseGenerator gen(Vector3(-40., 13., 0.),
+                             Vector3(0.3, 2.7, 1.),
+                             0.45, 8, 16.);
+
+    check_row(gen, 0, 5, 300);
+    check_row(gen, 17, 1023, 300);
+}
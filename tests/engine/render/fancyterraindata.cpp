@@ -25,5 +25,186 @@ the AUTHORS file.
 
 #include "ffengine/render/fancyterraindata.hpp"
 
+#include <cmath>
+#include <mutex>
+
 using namespace ffe;
 using namespace sim;
+
+
+/**
+ * Compute the normal/tangent map of \a terrain per sample, by summing the
+ * normals of the faces adjacent to each sample. This is how NTMapGenerator
+ * used to compute the map and serves as reference.
+ */
+static NTMapGenerator::NTField reference_ntmap(const Terrain &terrain)
+{
+    const unsigned int size = terrain.size();
+    const Terrain::Field *field = nullptr;
+    auto lock = terrain.readonly_field(field);
+    auto height = [field, size](const unsigned int x, const unsigned int y)
+    {
+        return (*field)[y*size+x][Terrain::HEIGHT_ATTR];
+    };
+
+    NTMapGenerator::NTField result(size*size);
+    for (unsigned int y = 0; y < size; ++y) {
+        const bool has_ym = y > 0;
+        const bool has_yp = y < size - 1;
+        for (unsigned int x = 0; x < size; ++x) {
+            const bool has_xm = x > 0;
+            const bool has_xp = x < size - 1;
+            const float y0x0 = height(x, y);
+
+            Vector3f tangent_x1, tangent_x2, tangent_y1, tangent_y2;
+            float tangent_eZ = 0;
+            if (has_ym) {
+                tangent_y1 = Vector3f(0, 1, y0x0 - height(x, y-1));
+            }
+            if (has_yp) {
+                tangent_y2 = Vector3f(0, 1, height(x, y+1) - y0x0);
+            }
+            if (has_xm) {
+                const float z = y0x0 - height(x-1, y);
+                tangent_x1 = Vector3f(1, 0, z);
+                tangent_eZ += z;
+            }
+            if (has_xp) {
+                const float z = height(x+1, y) - y0x0;
+                tangent_x2 = Vector3f(1, 0, z);
+                tangent_eZ += z;
+            }
+            if (!has_xm || !has_xp) {
+                tangent_eZ *= 2;
+            }
+
+            Vector3f normal(0, 0, 0);
+            if (has_xm && has_ym) {
+                normal += tangent_x1 % tangent_y1;
+            }
+            if (has_xp && has_ym) {
+                normal += tangent_x2 % tangent_y1;
+            }
+            if (has_xm && has_yp) {
+                normal += tangent_x1 % tangent_y2;
+            }
+            if (has_xp && has_yp) {
+                normal += tangent_x2 % tangent_y2;
+            }
+            normal.normalize();
+
+            result[y*size+x] = Vector4f(normal, tangent_eZ / 2.f);
+        }
+    }
+    return result;
+}
+
+template <typename height_func_t>
+static void fill_heights(Terrain &terrain,
+                         const TerrainRect &rect,
+                         height_func_t &&height_func)
+{
+    Terrain::Field *field = nullptr;
+    auto lock = terrain.writable_field(field);
+    for (unsigned int y = rect.y0(); y < rect.y1(); ++y) {
+        for (unsigned int x = rect.x0(); x < rect.x1(); ++x) {
+            (*field)[y*terrain.size()+x][Terrain::HEIGHT_ATTR] = height_func(x, y);
+        }
+    }
+}
+
+static float sloped(const unsigned int x, const unsigned int y)
+{
+    return 3.f + 0.5f*x - 0.25f*y;
+}
+
+static float wavy(const unsigned int x, const unsigned int y)
+{
+    return 20.f + 5.f*std::sin(0.7f*x) + 3.f*std::cos(0.4f*y);
+}
+
+static void check_ntmap(const NTMapGenerator &generator,
+                        const Terrain &terrain)
+{
+    const NTMapGenerator::NTField expected = reference_ntmap(terrain);
+    const NTMapGenerator::NTField *actual = nullptr;
+    auto lock = generator.readonly_field(actual);
+    REQUIRE(actual->size() == expected.size());
+
+    const unsigned int size = terrain.size();
+    for (unsigned int y = 0; y < size; ++y) {
+        for (unsigned int x = 0; x < size; ++x) {
+            INFO("x = " << x << "; y = " << y);
+            CHECK(((*actual)[y*size+x] - expected[y*size+x]).abssum() <= 1e-5f);
+        }
+    }
+}
+
+
+TEST_CASE("render/fancyterraindata/NTMapGenerator/reference")
+{
+    // 257 samples yield tiles of 128, 128 and a single sample per axis
+    Terrain terrain(257);
+    const TerrainRect full(0, 0, terrain.size(), terrain.size());
+
+    std::mutex emitted_mutex;
+    std::vector<TerrainRect> emitted;
+
+    NTMapGenerator generator(terrain, 2);
+    generator.field_updated().connect(
+                [&emitted_mutex, &emitted](const TerrainRect &rect)
+    {
+        std::lock_guard<std::mutex> lock(emitted_mutex);
+        emitted.push_back(rect);
+    });
+
+    SECTION("sloped")
+    {
+        fill_heights(terrain, full, sloped);
+    }
+
+    SECTION("wavy")
+    {
+        fill_heights(terrain, full, wavy);
+    }
+
+    generator.notify_update(full);
+    generator.wait_for_idle();
+    check_ntmap(generator, terrain);
+
+    // each tile is emitted on its own and the tiles cover the terrain
+    unsigned int area = 0;
+    for (const TerrainRect &rect: emitted) {
+        CHECK(rect.x1() - rect.x0() <= TerrainWorker::DEFAULT_TILE_SIZE);
+        CHECK(rect.y1() - rect.y0() <= TerrainWorker::DEFAULT_TILE_SIZE);
+        area += (rect.x1() - rect.x0()) * (rect.y1() - rect.y0());
+    }
+    CHECK(emitted.size() == 9);
+    CHECK(area == terrain.size()*terrain.size());
+}
+
+TEST_CASE("render/fancyterraindata/NTMapGenerator/partial_update")
+{
+    Terrain terrain(257);
+    fill_heights(terrain, TerrainRect(0, 0, terrain.size(), terrain.size()),
+                 sloped);
+
+    NTMapGenerator generator(terrain, 2);
+    generator.notify_update(TerrainRect(0, 0, terrain.size(), terrain.size()));
+    generator.wait_for_idle();
+
+    // a tile corner in the interior, the right edge and the top left corner;
+    // the normals around the changed rects must be updated, too
+    const TerrainRect changed[3] = {TerrainRect(120, 120, 136, 136),
+                                    TerrainRect(250, 60, 257, 70),
+                                    TerrainRect(0, 0, 3, 2)};
+    TerrainRegion region;
+    for (const TerrainRect &rect: changed) {
+        fill_heights(terrain, rect, wavy);
+        region.add(rect);
+    }
+
+    generator.notify_update(region);
+    generator.wait_for_idle();
+    check_ntmap(generator, terrain);
+}
@@ -0,0 +1,242 @@
+/**********************************************************************
+File name: command_log.cpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#include <catch.hpp>
+
+#include "ffengine/io/filestream.hpp"
+
+#include "ffengine/sim/command_log.hpp"
+#include "ffengine/sim/server.hpp"
+#include "ffengine/sim/world_ops.hpp"
+
+#include "world_command.pb.h"
+
+#include "testutils.hpp"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+using namespace sim;
+
+
+static CommandLogWriter::CommandPtr raise_command(const float xc,
+                                                  const float yc)
+{
+    CommandLogWriter::CommandPtr result(new messages::WorldCommand());
+    ops::TerraformRaise(xc, yc, 2, std::vector<float>{1, 0.5, 0.5, 0.25}, 0.5f)
+            .to_message(*result);
+    return result;
+}
+
+static std::vector<float> heights(Server &server)
+{
+    auto sync_lock = server.sync_safe_point();
+    return heights(server.state());
+}
+
+
+TEST_CASE("sim/command_log/round_trip")
+{
+    TemporaryPath tmp("command-log");
+    {
+        CommandLogWriter writer(tmp.m_path);
+        std::vector<CommandLogWriter::CommandPtr> commands;
+        std::vector<std::uint32_t> unfused;
+        commands.emplace_back(raise_command(10, 20));
+        commands.emplace_back(raise_command(30, 40));
+        unfused.push_back(1);
+        writer.append_frame(3, commands, unfused);
+        CHECK(commands.empty());
+        CHECK(unfused.empty());
+
+        commands.emplace_back(raise_command(50, 60));
+        writer.append_frame(7, commands, unfused);
+        CHECK(writer.flush());
+        CHECK(writer.dropped_commands() == 0);
+    }
+
+    CommandLogReader reader(tmp.m_path);
+    std::uint64_t frame = 0;
+    std::vector<std::shared_ptr<messages::WorldCommand> > commands;
+    std::vector<std::uint32_t> unfused;
+
+    REQUIRE(reader.next_frame(frame, commands, unfused));
+    CHECK(frame == 3);
+    REQUIRE(commands.size() == 2);
+    CHECK(commands[0]->tf_raise().xc() == 10);
+    CHECK(commands[1]->tf_raise().yc() == 40);
+    CHECK(unfused == std::vector<std::uint32_t>({1}));
+
+    REQUIRE(reader.next_frame(frame, commands, unfused));
+    CHECK(frame == 7);
+    REQUIRE(commands.size() == 1);
+    CHECK(commands[0]->tf_raise().xc() == 50);
+    CHECK(unfused.empty());
+
+    CHECK_FALSE(reader.next_frame(frame, commands, unfused));
+    CHECK(commands.empty());
+    CHECK_FALSE(reader.truncated());
+}
+
+TEST_CASE("sim/command_log/appends_to_existing_log")
+{
+    TemporaryPath tmp("command-log");
+    for (std::uint64_t frame = 1; frame <= 2; ++frame) {
+        CommandLogWriter writer(tmp.m_path);
+        std::vector<CommandLogWriter::CommandPtr> commands;
+        std::vector<std::uint32_t> unfused;
+        commands.emplace_back(raise_command(frame, frame));
+        writer.append_frame(frame, commands, unfused);
+    }
+
+    CommandLogReader reader(tmp.m_path);
+    std::uint64_t frame = 0;
+    std::vector<std::shared_ptr<messages::WorldCommand> > commands;
+    std::vector<std::uint32_t> unfused;
+    REQUIRE(reader.next_frame(frame, commands, unfused));
+    CHECK(frame == 1);
+    REQUIRE(reader.next_frame(frame, commands, unfused));
+    CHECK(frame == 2);
+    CHECK_FALSE(reader.next_frame(frame, commands, unfused));
+}
+
+TEST_CASE("sim/command_log/truncated_tail")
+{
+    TemporaryPath tmp("command-log");
+    {
+        CommandLogWriter writer(tmp.m_path);
+        std::vector<CommandLogWriter::CommandPtr> commands;
+        std::vector<std::uint32_t> unfused;
+        commands.emplace_back(raise_command(10, 20));
+        writer.append_frame(1, commands, unfused);
+        commands.emplace_back(raise_command(30, 40));
+        writer.append_frame(2, commands, unfused);
+    }
+
+    // cut into the last command, as an interrupted writer would
+    off_t size = 0;
+    {
+        const int fd = io::check_fd(open(tmp.m_path.c_str(), O_RDWR));
+        size = lseek(fd, 0, SEEK_END);
+        REQUIRE(ftruncate(fd, size - 3) == 0);
+        close(fd);
+    }
+
+    CommandLogReader reader(tmp.m_path);
+    std::uint64_t frame = 0;
+    std::vector<std::shared_ptr<messages::WorldCommand> > commands;
+    std::vector<std::uint32_t> unfused;
+    REQUIRE(reader.next_frame(frame, commands, unfused));
+    CHECK(frame == 1);
+    CHECK(commands.size() == 1);
+    // the marker of the second frame is complete, its command is not
+    REQUIRE(reader.next_frame(frame, commands, unfused));
+    CHECK(frame == 2);
+    CHECK(commands.empty());
+    CHECK_FALSE(reader.next_frame(frame, commands, unfused));
+    CHECK(reader.truncated());
+}
+
+TEST_CASE("sim/command_log/rejects_commands_without_frame")
+{
+    TemporaryPath tmp("command-log");
+    {
+        const int fd = io::check_fd(open(tmp.m_path.c_str(), O_WRONLY));
+        // header of an empty MSGCLASS_WORLD_COMMAND record
+        const std::uint8_t record[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+        REQUIRE(write(fd, record, sizeof(record)) == sizeof(record));
+        close(fd);
+    }
+
+    CommandLogReader reader(tmp.m_path);
+    std::uint64_t frame = 0;
+    std::vector<std::shared_ptr<messages::WorldCommand> > commands;
+    std::vector<std::uint32_t> unfused;
+    CHECK_THROWS_AS(reader.next_frame(frame, commands, unfused), std::runtime_error);
+}
+
+TEST_CASE("sim/command_log/server_replay")
+{
+    TemporaryPath tmp("command-log");
+    std::vector<float> expected;
+    {
+        Server server(FramePacing::MANUAL);
+        server.set_command_log(std::make_unique<CommandLogWriter>(tmp.m_path));
+        server.step(2);
+        server.enqueue_op(std::make_unique<ops::TerraformRaise>(
+                              100, 100, 2, std::vector<float>{1, 1, 1, 1}, 1.f));
+        server.enqueue_op(std::make_unique<ops::TerraformLevel>(
+                              101, 100, 2, std::vector<float>{1, 1, 1, 1}, 1.f, 5.f));
+        // overlapping raises which are only fused if the callback of the
+        // middle one is replayed as a fusion barrier
+        server.enqueue_op(std::make_unique<ops::TerraformRaise>(
+                              150, 150, 4, std::vector<float>(16, 0.3f), 0.7f));
+        server.enqueue_op(std::make_unique<ops::TerraformRaise>(
+                              151, 150, 4, std::vector<float>(16, 0.9f), 0.9f),
+                          [](WorldOperationResult){});
+        server.enqueue_op(std::make_unique<ops::TerraformRaise>(
+                              152, 151, 4, std::vector<float>(16, 0.6f), 0.3f));
+        // not representable as message
+        server.enqueue_op(std::make_unique<ops::FluidReset>());
+        server.step();
+        server.step(3);
+        server.enqueue_op(std::make_unique<ops::TerraformRaise>(
+                              200, 300, 2, std::vector<float>{1, 1, 1, 1}, -1.f));
+        server.step();
+        expected = heights(server);
+        server.set_command_log(nullptr);
+    }
+
+    CommandLogReader reader(tmp.m_path);
+    Server server(FramePacing::MANUAL);
+    // the first game frame is frame 1; frame 0 is the initial view
+    std::uint64_t next_frame = 1;
+    std::uint64_t frame = 0;
+    std::vector<std::shared_ptr<messages::WorldCommand> > commands;
+    std::vector<std::uint32_t> unfused;
+    std::vector<std::uint64_t> frames;
+    std::vector<std::uint32_t> all_unfused;
+    while (reader.next_frame(frame, commands, unfused)) {
+        frames.push_back(frame);
+        all_unfused.insert(all_unfused.end(), unfused.begin(), unfused.end());
+        REQUIRE(frame >= next_frame);
+        server.step(frame - next_frame);
+        for (std::uint32_t i = 0; i < commands.size(); ++i) {
+            WorldOperationPtr op = WorldOperation::from_message(commands[i]);
+            REQUIRE(op);
+            if (std::find(unfused.begin(), unfused.end(), i) != unfused.end()) {
+                server.enqueue_op(std::move(op), [](WorldOperationResult){});
+            } else {
+                server.enqueue_op(std::move(op));
+            }
+        }
+        server.step();
+        next_frame = frame + 1;
+    }
+
+    CHECK(frames == std::vector<std::uint64_t>({3, 7}));
+    CHECK(all_unfused == std::vector<std::uint32_t>({3}));
+    CHECK(heights(server) == expected);
+}
@@ -0,0 +1,234 @@
+/**********************************************************************
+File name: epoll_server.cpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#include <catch.hpp>
+
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "ffengine/sim/epoll_server.hpp"
+
+#include "world_command.pb.h"
+
+using namespace sim;
+
+
+static int connect_to(const std::uint16_t port)
+{
+    const int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    REQUIRE(fd >= 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    REQUIRE(::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+    return fd;
+}
+
+static void send_all(const int fd, const std::string &data)
+{
+    std::size_t offset = 0;
+    while (offset < data.size()) {
+        const ssize_t sent = ::send(fd, &data[offset], data.size() - offset, 0);
+        REQUIRE(sent > 0);
+        offset += sent;
+    }
+}
+
+static std::string recv_exactly(const int fd, const std::size_t size)
+{
+    std::string result(size, '\0');
+    std::size_t offset = 0;
+    while (offset < size) {
+        const ssize_t received = ::recv(fd, &result[offset], size - offset, 0);
+        REQUIRE(received > 0);
+        offset += received;
+    }
+    return result;
+}
+
+static std::string frame(const NetMessageClass msgclass,
+                         const google::protobuf::Message &msg)
+{
+    const std::string payload = msg.SerializeAsString();
+    std::string result(NetMessageParser::HEADER_SIZE, '\0');
+    std::uint8_t *dest = reinterpret_cast<std::uint8_t*>(&result[0]);
+    dest = google::protobuf::io::CodedOutputStream::WriteLittleEndian32ToArray(
+                msgclass, dest);
+    google::protobuf::io::CodedOutputStream::WriteLittleEndian32ToArray(
+                payload.size(), dest);
+    return result + payload;
+}
+
+template <typename predicate_t>
+static bool wait_until(predicate_t predicate)
+{
+    for (int i = 0; i < 1000; ++i) {
+        if (predicate()) {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return predicate();
+}
+
+
+TEST_CASE("sim/EpollNetServer/ping")
+{
+    EpollNetServer server;
+    server.listen("127.0.0.1", 0);
+    REQUIRE(server.port() != 0);
+
+    std::atomic_int connected(0);
+    server.client_connected().connect([&connected](ServerClientBase&){
+        ++connected;
+    });
+    server.start();
+
+    const int fd = connect_to(server.port());
+    CHECK(wait_until([&](){ return connected == 1; }));
+    CHECK(server.client_count() == 1);
+
+    messages::NetWorldControl msg;
+    msg.mutable_ping()->set_token(0x1234);
+    msg.mutable_ping()->set_payload(0x5678);
+    // send the frame in two parts, to cover partial reception
+    const std::string data = frame(MSGCLASS_LINK_CONTROL, msg);
+    send_all(fd, data.substr(0, 3));
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    send_all(fd, data.substr(3));
+
+    const std::string header = recv_exactly(fd, NetMessageParser::HEADER_SIZE);
+    std::uint32_t msgclass = 0;
+    std::uint32_t msgsize = 0;
+    const std::uint8_t *src = reinterpret_cast<const std::uint8_t*>(header.data());
+    google::protobuf::io::CodedInputStream::ReadLittleEndian32FromArray(
+                &src[0], &msgclass);
+    google::protobuf::io::CodedInputStream::ReadLittleEndian32FromArray(
+                &src[4], &msgsize);
+    CHECK(msgclass == MSGCLASS_LINK_CONTROL);
+
+    messages::NetWorldControl reply;
+    REQUIRE(reply.ParseFromString(recv_exactly(fd, msgsize)));
+    REQUIRE(reply.has_pong());
+    CHECK(reply.pong().token() == 0x1234);
+    CHECK(reply.pong().payload() == 0x5678);
+
+    ::close(fd);
+    CHECK(wait_until([&](){ return server.client_count() == 0; }));
+    server.stop();
+}
+
+TEST_CASE("sim/EpollNetServer/protocol_violation_disconnects")
+{
+    EpollNetServer server;
+    server.listen("127.0.0.1", 0);
+    server.start();
+
+    const int fd = connect_to(server.port());
+    CHECK(wait_until([&](){ return server.client_count() == 1; }));
+
+    // unknown message class
+    send_all(fd, std::string("\xff\x00\x00\x00\x00\x00\x00\x00", 8));
+    CHECK(wait_until([&](){ return server.client_count() == 0; }));
+
+    char buf;
+    CHECK(::recv(fd, &buf, 1, 0) == 0);
+    ::close(fd);
+}
+
+TEST_CASE("sim/EpollNetServer/stop_closes_clients")
+{
+    EpollNetServer server;
+    server.listen("127.0.0.1", 0);
+    server.start();
+
+    const int fd1 = connect_to(server.port());
+    const int fd2 = connect_to(server.port());
+    CHECK(wait_until([&](){ return server.client_count() == 2; }));
+
+    server.stop();
+    CHECK(server.client_count() == 0);
+
+    char buf;
+    CHECK(::recv(fd1, &buf, 1, 0) == 0);
+    CHECK(::recv(fd2, &buf, 1, 0) == 0);
+    ::close(fd1);
+    ::close(fd2);
+}
+
+TEST_CASE("sim/EpollNetServer/send_responses")
+{
+    EpollNetServer server;
+    server.listen("127.0.0.1", 0);
+
+    std::atomic<ServerClientBase*> client(nullptr);
+    std::atomic_int closed(0);
+    server.client_connected().connect([&client](ServerClientBase &ref){
+        client = &ref;
+    });
+    server.client_closed().connect([&closed](ServerClientBase&){
+        ++closed;
+    });
+    server.start();
+
+    const int fd = connect_to(server.port());
+    REQUIRE(wait_until([&](){ return client != nullptr; }));
+
+    // all responses of a frame are sent on a single flush
+    static const unsigned int count = 1000;
+    for (unsigned int i = 0; i < count; ++i) {
+        messages::WorldCommandResponse response;
+        response.set_token(i);
+        response.set_result(i % 2 == 0 ? NO_ERROR : INVALID_ARGUMENT);
+        client.load()->send_message(response);
+    }
+    client.load()->request_flush();
+
+    for (unsigned int i = 0; i < count; ++i) {
+        const std::string header = recv_exactly(fd, NetMessageParser::HEADER_SIZE);
+        std::uint32_t msgclass = 0;
+        std::uint32_t msgsize = 0;
+        const std::uint8_t *src = reinterpret_cast<const std::uint8_t*>(header.data());
+        google::protobuf::io::CodedInputStream::ReadLittleEndian32FromArray(
+                    &src[0], &msgclass);
+        google::protobuf::io::CodedInputStream::ReadLittleEndian32FromArray(
+                    &src[4], &msgsize);
+        REQUIRE(msgclass == MSGCLASS_WORLD_COMMAND_RESPONSE);
+
+        messages::WorldCommandResponse response;
+        REQUIRE(response.ParseFromString(recv_exactly(fd, msgsize)));
+        CHECK(response.token() == i);
+        CHECK(response.result() == (i % 2 == 0 ? NO_ERROR : INVALID_ARGUMENT));
+    }
+
+    ::close(fd);
+    CHECK(wait_until([&](){ return closed == 1; }));
+    server.stop();
+}
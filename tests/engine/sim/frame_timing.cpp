@@ -0,0 +1,131 @@
+/**********************************************************************
+File name: frame_timing.cpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#include <catch.hpp>
+
+#include "ffengine/sim/frame_timing.hpp"
+
+
+using namespace sim;
+using std::chrono::milliseconds;
+
+
+static FrameTiming frame(const unsigned int total_ms)
+{
+    FrameTiming result{};
+    result.total = milliseconds(total_ms);
+    result.ops = milliseconds(total_ms / 2);
+    return result;
+}
+
+
+TEST_CASE("sim/FrameTimingBuffer/ring")
+{
+    FrameTimingBuffer buffer(4);
+    CHECK(buffer.capacity() == 4);
+    CHECK(buffer.recent().empty());
+    CHECK(buffer.summary().frames == 0);
+
+    for (unsigned int i = 1; i <= 6; ++i) {
+        buffer.push(frame(i));
+    }
+
+    const std::vector<FrameTiming> recent = buffer.recent();
+    REQUIRE(recent.size() == 4);
+    CHECK(recent[0].total == milliseconds(3));
+    CHECK(recent[1].total == milliseconds(4));
+    CHECK(recent[2].total == milliseconds(5));
+    CHECK(recent[3].total == milliseconds(6));
+
+    buffer.clear();
+    CHECK(buffer.recent().empty());
+}
+
+TEST_CASE("sim/FrameTimingBuffer/percentiles")
+{
+    FrameTimingBuffer buffer(200);
+    // push out of order, so that the summary has to sort
+    for (unsigned int i = 100; i >= 1; --i) {
+        FrameTiming timing = frame(i);
+        timing.dropped_frames = (i % 10 == 0 ? 1 : 0);
+        buffer.push(timing);
+    }
+
+    const FrameTimingSummary summary = buffer.summary();
+    CHECK(summary.frames == 100);
+    CHECK(summary.dropped_frames == 10);
+    CHECK(summary.total.p50 == milliseconds(50));
+    CHECK(summary.total.p99 == milliseconds(99));
+    CHECK(summary.total.max == milliseconds(100));
+    CHECK(summary.ops.p50 == milliseconds(25));
+    CHECK(summary.ops.max == milliseconds(50));
+    CHECK(summary.sandifier.max == milliseconds(0));
+}
+
+TEST_CASE("sim/FrameTimingBuffer/single_frame")
+{
+    const FrameTimingSummary summary = summarize_frame_timings({frame(7)});
+    CHECK(summary.frames == 1);
+    CHECK(summary.total.p50 == milliseconds(7));
+    CHECK(summary.total.p99 == milliseconds(7));
+}
+
+TEST_CASE("sim/FramePacer/on_time")
+{
+    const WorldClock::time_point t0 = WorldClock::now();
+    FramePacer pacer(milliseconds(16));
+    pacer.reset(t0);
+    CHECK(pacer.deadline() == t0);
+
+    CHECK(pacer.frame_done(t0 + milliseconds(5)) == 0);
+    CHECK(pacer.deadline() == t0 + milliseconds(16));
+}
+
+TEST_CASE("sim/FramePacer/catch_up")
+{
+    const WorldClock::time_point t0 = WorldClock::now();
+    FramePacer pacer(milliseconds(16), FramePacing::CATCH_UP, 4);
+    pacer.reset(t0);
+
+    // overrun by two slots: both are caught up
+    CHECK(pacer.frame_done(t0 + milliseconds(40)) == 0);
+    CHECK(pacer.deadline() == t0 + milliseconds(16));
+
+    // overrun by far: only four frames are kept pending
+    pacer.reset(t0);
+    CHECK(pacer.frame_done(t0 + milliseconds(16*10 + 1)) == 6);
+    CHECK(pacer.deadline() == t0 + milliseconds(16*7));
+}
+
+TEST_CASE("sim/FramePacer/drop")
+{
+    const WorldClock::time_point t0 = WorldClock::now();
+    FramePacer pacer(milliseconds(16), FramePacing::DROP);
+    pacer.reset(t0);
+
+    CHECK(pacer.frame_done(t0 + milliseconds(40)) == 1);
+    CHECK(pacer.deadline() == t0 + milliseconds(32));
+
+    CHECK(pacer.frame_done(t0 + milliseconds(45)) == 0);
+    CHECK(pacer.deadline() == t0 + milliseconds(48));
+}
@@ -0,0 +1,112 @@
+/**********************************************************************
+File name: interest.cpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#include <catch.hpp>
+
+#include <algorithm>
+#include <tuple>
+
+#include "ffengine/sim/interest.hpp"
+#include "ffengine/sim/world_view.hpp"
+
+
+using namespace sim;
+
+typedef std::tuple<InterestGrid::Subscriber, unsigned int, unsigned int> Hit;
+
+
+static std::vector<Hit> collect(const InterestGrid &grid,
+                                const TerrainRegion &region)
+{
+    std::vector<Hit> result;
+    grid.for_each_subscriber(
+                region,
+                [&result](InterestGrid::Subscriber subscriber,
+                          const unsigned int cx, const unsigned int cy){
+                    result.emplace_back(subscriber, cx, cy);
+                });
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+
+TEST_CASE("sim/InterestGrid/set_interest")
+{
+    // the edge cells are clipped
+    InterestGrid grid(WorldView::TILE_SIZE*3 + 5);
+    CHECK(grid.cells_per_axis() == 4);
+
+    // two overlapping rects; cells are registered once
+    grid.set_interest(1, {TerrainRect(10, 10, 70, 20),
+                          TerrainRect(60, 15, 65, 16)});
+    // clipped to the terrain
+    grid.set_interest(2, {TerrainRect(190, 190, 1000, 1000)});
+    CHECK(grid.size() == 2);
+
+    CHECK(grid.subscribers(0, 0) == std::vector<InterestGrid::Subscriber>{1});
+    CHECK(grid.subscribers(1, 0) == std::vector<InterestGrid::Subscriber>{1});
+    CHECK(grid.subscribers(2, 0).empty());
+    CHECK(grid.subscribers(0, 1).empty());
+    CHECK(grid.subscribers(2, 2) == std::vector<InterestGrid::Subscriber>{2});
+    CHECK(grid.subscribers(3, 3) == std::vector<InterestGrid::Subscriber>{2});
+
+    // replacing the interest unregisters the old cells
+    grid.set_interest(1, {TerrainRect(130, 0, 140, 10)});
+    CHECK(grid.subscribers(0, 0).empty());
+    CHECK(grid.subscribers(1, 0).empty());
+    CHECK(grid.subscribers(2, 0) == std::vector<InterestGrid::Subscriber>{1});
+
+    grid.remove(2);
+    grid.remove(3);
+    CHECK(grid.size() == 1);
+    CHECK(grid.subscribers(2, 2).empty());
+    CHECK(grid.subscribers(3, 3).empty());
+
+    grid.reset(WorldView::TILE_SIZE);
+    CHECK(grid.size() == 0);
+    CHECK(grid.cells_per_axis() == 1);
+    CHECK(grid.subscribers(0, 0).empty());
+}
+
+TEST_CASE("sim/InterestGrid/for_each_subscriber")
+{
+    InterestGrid grid(WorldView::TILE_SIZE*4);
+    grid.set_interest(1, {TerrainRect(0, 0, 128, 128)});
+    grid.set_interest(2, {TerrainRect(64, 64, 256, 256)});
+    grid.set_interest(3, {TerrainRect(250, 0, 256, 10)});
+
+    // each subscriber is reported once per cell, even if several rectangles
+    // of the region touch the cell
+    TerrainRegion region;
+    region.add(TerrainRect(70, 70, 72, 72));
+    region.add(TerrainRect(100, 100, 101, 101));
+    CHECK(collect(grid, region) == (std::vector<Hit>{
+              Hit(1, 1, 1), Hit(2, 1, 1)}));
+
+    CHECK(collect(grid, TerrainRect(0, 0, 256, 1)) == (std::vector<Hit>{
+              Hit(1, 0, 0), Hit(1, 1, 0), Hit(3, 3, 0)}));
+
+    CHECK(collect(grid, TerrainRect(200, 200, 210, 210)) ==
+          std::vector<Hit>{Hit(2, 3, 3)});
+    CHECK(collect(grid, TerrainRegion()).empty());
+}
@@ -0,0 +1,102 @@
+/**********************************************************************
+File name: journal.cpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#include <catch.hpp>
+
+#include "ffengine/sim/journal.hpp"
+#include "ffengine/sim/world_ops.hpp"
+
+#include "testutils.hpp"
+
+
+using namespace sim;
+
+
+TEST_CASE("sim/WorldJournal/undo_redo")
+{
+    WorldState state;
+    WorldJournal journal;
+
+    const std::vector<float> original = heights(state);
+
+    ops::TerraformRaise raise(100.f, 100.f, 4,
+                              std::vector<float>(16, 1.f), 2.f);
+    REQUIRE(journal.execute(raise, state) == NO_ERROR);
+    const std::vector<float> raised = heights(state);
+    CHECK(raised != original);
+    CHECK(journal.undo_depth() == 1);
+
+    CHECK(journal.undo(state));
+    CHECK(heights(state) == original);
+    CHECK(journal.undo_depth() == 0);
+    CHECK(journal.redo_depth() == 1);
+    CHECK_FALSE(journal.undo(state));
+
+    CHECK(journal.redo(state));
+    CHECK(heights(state) == raised);
+    CHECK(journal.redo_depth() == 0);
+    CHECK_FALSE(journal.redo(state));
+}
+
+TEST_CASE("sim/WorldJournal/new_operation_drops_redo")
+{
+    WorldState state;
+    WorldJournal journal;
+
+    ops::TerraformRaise raise(100.f, 100.f, 4,
+                              std::vector<float>(16, 1.f), 2.f);
+    journal.execute(raise, state);
+    journal.undo(state);
+    REQUIRE(journal.redo_depth() == 1);
+
+    journal.execute(raise, state);
+    CHECK(journal.redo_depth() == 0);
+    CHECK(journal.undo_depth() == 1);
+}
+
+TEST_CASE("sim/WorldJournal/unrecorded_operation")
+{
+    WorldState state;
+    WorldJournal journal;
+
+    ops::FluidOceanLevelSetHeight op(10.f);
+    CHECK(journal.execute(op, state) == NO_ERROR);
+    CHECK(journal.undo_depth() == 0);
+    CHECK(journal.memory_usage() == 0);
+}
+
+TEST_CASE("sim/WorldJournal/memory_limit")
+{
+    WorldState state;
+    WorldJournal journal(1024);
+
+    for (unsigned int i = 0; i < 100; ++i) {
+        ops::TerraformRaise raise(10.f*i, 100.f, 4,
+                                  std::vector<float>(16, 1.f), 1.f);
+        journal.execute(raise, state);
+    }
+
+    CHECK(journal.memory_usage() <= 1024);
+    CHECK(journal.undo_depth() > 0);
+    CHECK(journal.undo_depth() < 100);
+}
@@ -27,6 +27,9 @@ the AUTHORS file.
 
 #include "world_command.pb.h"
 
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+
+#include <array>
 #include <iostream>
 
 using namespace sim;
@@ -53,7 +56,7 @@ struct NetMessageParserTest: public IMessageHandler
     std::vector<sim::AbstractMessagePtr> m_found;
 
 private:
-    void on_link_control(std::unique_ptr<sim::messages::NetWorldControl> &&msg)
+    void on_link_control(std::shared_ptr<sim::messages::NetWorldControl> &&msg)
     {
         m_found.emplace_back(std::move(msg));
     }
@@ -94,7 +97,6 @@ TEST_CASE("sim/networld/NetMessageParser/barriers_and_emission")
 
     NetMessageParserTest test;
     std::tie(dest, size) = test.m_parser.next_buffer();
-    CHECK(size == HEADER_SIZE);
     REQUIRE(size >= HEADER_SIZE);
 
     google::protobuf::io::CodedOutputStream::WriteLittleEndian32ToArray(
@@ -106,7 +108,6 @@ TEST_CASE("sim/networld/NetMessageParser/barriers_and_emission")
     test.m_parser.written(8);
 
     std::tie(dest, size) = test.m_parser.next_buffer();
-    CHECK(size == src.size());
     REQUIRE(size >= src.size());
 
     memcpy(dest, src.data(), src.size());
@@ -134,7 +135,6 @@ TEST_CASE("sim/networld/NetMessageParser/enforce_maximum_payload_size")
 
     NetMessageParserTest test;
     std::tie(dest, size) = test.m_parser.next_buffer();
-    CHECK(size == HEADER_SIZE);
     REQUIRE(size >= HEADER_SIZE);
 
     google::protobuf::io::CodedOutputStream::WriteLittleEndian32ToArray(
@@ -155,7 +155,6 @@ TEST_CASE("sim/networld/NetMessageParser/allow_maximum_payload_size")
 
     NetMessageParserTest test;
     std::tie(dest, size) = test.m_parser.next_buffer();
-    CHECK(size == HEADER_SIZE);
     REQUIRE(size >= HEADER_SIZE);
 
     google::protobuf::io::CodedOutputStream::WriteLittleEndian32ToArray(
@@ -185,7 +184,6 @@ TEST_CASE("sim/networld/NetMessageParser/fail_at_unknown")
     test.m_pass_unhandled = false;
 
     std::tie(dest, size) = test.m_parser.next_buffer();
-    CHECK(size == HEADER_SIZE);
     REQUIRE(size >= HEADER_SIZE);
 
     google::protobuf::io::CodedOutputStream::WriteLittleEndian32ToArray(
@@ -197,7 +195,6 @@ TEST_CASE("sim/networld/NetMessageParser/fail_at_unknown")
     test.m_parser.written(8);
 
     std::tie(dest, size) = test.m_parser.next_buffer();
-    CHECK(size == src.size());
     REQUIRE(size >= src.size());
 
     memcpy(dest, src.data(), src.size());
@@ -222,7 +219,6 @@ TEST_CASE("sim/networld/NetMessageParser/fail_at_false_result_from_handler")
     test.m_pass_unhandled = false;
 
     std::tie(dest, size) = test.m_parser.next_buffer();
-    CHECK(size == HEADER_SIZE);
     REQUIRE(size >= HEADER_SIZE);
 
     google::protobuf::io::CodedOutputStream::WriteLittleEndian32ToArray(
@@ -234,7 +230,6 @@ TEST_CASE("sim/networld/NetMessageParser/fail_at_false_result_from_handler")
     test.m_parser.written(8);
 
     std::tie(dest, size) = test.m_parser.next_buffer();
-    CHECK(size == src.size());
     REQUIRE(size >= src.size());
 
     memcpy(dest, src.data(), src.size());
@@ -262,7 +257,6 @@ TEST_CASE("sim/networld/NetMessageParser/pass_at_true_result_from_handler")
     test.m_pass_unhandled = true;
 
     std::tie(dest, size) = test.m_parser.next_buffer();
-    CHECK(size == HEADER_SIZE);
     REQUIRE(size >= HEADER_SIZE);
 
     google::protobuf::io::CodedOutputStream::WriteLittleEndian32ToArray(
@@ -274,7 +268,6 @@ TEST_CASE("sim/networld/NetMessageParser/pass_at_true_result_from_handler")
     test.m_parser.written(8);
 
     std::tie(dest, size) = test.m_parser.next_buffer();
-    CHECK(size == src.size());
     REQUIRE(size >= src.size());
 
     memcpy(dest, src.data(), src.size());
@@ -302,7 +295,6 @@ TEST_CASE("sim/networld/NetMessageParser/set_message_handler(nullptr)")
     test.m_parser.set_message_handler(nullptr);
 
     std::tie(dest, size) = test.m_parser.next_buffer();
-    CHECK(size == HEADER_SIZE);
     REQUIRE(size >= HEADER_SIZE);
 
     google::protobuf::io::CodedOutputStream::WriteLittleEndian32ToArray(
@@ -314,7 +306,6 @@ TEST_CASE("sim/networld/NetMessageParser/set_message_handler(nullptr)")
     test.m_parser.written(8);
 
     std::tie(dest, size) = test.m_parser.next_buffer();
-    CHECK(size == src.size());
     REQUIRE(size >= src.size());
 
     memcpy(dest, src.data(), src.size());
@@ -323,3 +314,230 @@ TEST_CASE("sim/networld/NetMessageParser/set_message_handler(nullptr)")
     CHECK(test.m_found.size() == 0);
     CHECK(test.m_had_error);
 }
+
+static std::string ping_frames(const unsigned int count)
+{
+    std::string result;
+    for (unsigned int i = 0; i < count; ++i) {
+        messages::NetWorldControl msg;
+        msg.mutable_ping()->set_token(i);
+        const std::string payload = msg.SerializeAsString();
+
+        const size_t offset = result.size();
+        result.resize(offset + HEADER_SIZE);
+        uint8_t *dest = reinterpret_cast<uint8_t*>(&result[offset]);
+        google::protobuf::io::CodedOutputStream::WriteLittleEndian32ToArray(
+                    MSGCLASS_LINK_CONTROL, &dest[0]);
+        google::protobuf::io::CodedOutputStream::WriteLittleEndian32ToArray(
+                    payload.size(), &dest[4]);
+        result += payload;
+    }
+    return result;
+}
+
+static void feed(NetMessageParser &parser,
+                 const std::string &data,
+                 const size_t chunk_size)
+{
+    size_t offset = 0;
+    while (offset < data.size()) {
+        char *dest;
+        size_t size;
+        std::tie(dest, size) = parser.next_buffer();
+        REQUIRE(size > 0);
+        size = std::min(std::min(size, chunk_size), data.size() - offset);
+        memcpy(dest, &data[offset], size);
+        parser.written(size);
+        offset += size;
+    }
+}
+
+static void check_ping_tokens(const NetMessageParserTest &test,
+                              const unsigned int count)
+{
+    REQUIRE(test.m_found.size() == count);
+    for (unsigned int i = 0; i < count; ++i) {
+        const messages::NetWorldControl *msg =
+                dynamic_cast<const messages::NetWorldControl*>(test.m_found[i].get());
+        REQUIRE(msg);
+        CHECK(msg->ping().token() == i);
+    }
+}
+
+TEST_CASE("sim/networld/NetMessageParser/many_frames_in_one_write")
+{
+    const std::string data = ping_frames(200);
+
+    NetMessageParserTest test;
+    char *dest;
+    size_t size;
+    std::tie(dest, size) = test.m_parser.next_buffer();
+    REQUIRE(size >= data.size());
+    memcpy(dest, data.data(), data.size());
+    test.m_parser.written(data.size());
+
+    CHECK_FALSE(test.m_had_error);
+    check_ping_tokens(test, 200);
+}
+
+TEST_CASE("sim/networld/NetMessageParser/frames_split_across_writes")
+{
+    const std::string data = ping_frames(5000);
+
+    for (size_t chunk_size: {1u, 3u, 7u, 4096u, 65536u}) {
+        NetMessageParserTest test;
+        feed(test.m_parser, data, chunk_size);
+        CHECK_FALSE(test.m_had_error);
+        check_ping_tokens(test, 5000);
+    }
+}
+
+TEST_CASE("sim/networld/NetMessageParser/grows_for_large_messages")
+{
+    messages::NetWorldControl msg;
+    msg.mutable_ping()->set_token(1);
+    const std::string small = ping_frames(3);
+
+    // a link control message padded with an unknown field to the maximum size
+    std::string payload = msg.SerializeAsString();
+    const size_t padding = NetMessageParser::MAX_MESSAGE_SIZE - payload.size() - 6;
+    std::string field;
+    {
+        google::protobuf::io::StringOutputStream raw(&field);
+        google::protobuf::io::CodedOutputStream out(&raw);
+        out.WriteTag((1000 << 3) | 2);
+        out.WriteVarint32(padding);
+        out.WriteString(std::string(padding, 'x'));
+    }
+    payload += field;
+    REQUIRE(payload.size() <= NetMessageParser::MAX_MESSAGE_SIZE);
+
+    std::string large(HEADER_SIZE, '\0');
+    google::protobuf::io::CodedOutputStream::WriteLittleEndian32ToArray(
+                MSGCLASS_LINK_CONTROL, reinterpret_cast<uint8_t*>(&large[0]));
+    google::protobuf::io::CodedOutputStream::WriteLittleEndian32ToArray(
+                payload.size(), reinterpret_cast<uint8_t*>(&large[4]));
+    large += payload;
+
+    NetMessageParserTest test;
+    feed(test.m_parser, small + large + small, 10000);
+    CHECK_FALSE(test.m_had_error);
+    CHECK(test.m_found.size() == 7);
+}
+
+TEST_CASE("sim/networld/NetMessageParser/messages_outlive_arena_reuse")
+{
+    const std::string data = ping_frames(2000);
+
+    NetMessageParserTest test;
+    feed(test.m_parser, data, 4096);
+    check_ping_tokens(test, 2000);
+
+    // keep the messages of the first batch alive while the parser continues
+    // to decode into (possibly new) arenas
+    std::vector<sim::AbstractMessagePtr> retained;
+    retained.swap(test.m_found);
+    feed(test.m_parser, data, 7);
+    check_ping_tokens(test, 2000);
+
+    test.m_found.swap(retained);
+    check_ping_tokens(test, 2000);
+
+    // and once all are released, the arena is reused
+    retained.clear();
+    test.m_found.clear();
+    feed(test.m_parser, data, 65536);
+    CHECK_FALSE(test.m_had_error);
+    check_ping_tokens(test, 2000);
+}
+
+
+static std::string drain(NetFrameBuilder &builder, const size_t max_bytes)
+{
+    std::string result;
+    std::array<struct iovec, 4> iov;
+    int count;
+    while ((count = builder.pending(iov.data(), iov.size())) > 0) {
+        // simulate a socket which accepts at most max_bytes per call
+        size_t sent = 0;
+        for (int i = 0; i < count && sent < max_bytes; ++i) {
+            const size_t size = std::min(iov[i].iov_len, max_bytes - sent);
+            result.append(static_cast<const char*>(iov[i].iov_base), size);
+            sent += size;
+        }
+        builder.consume(sent);
+    }
+    return result;
+}
+
+TEST_CASE("sim/networld/NetFrameBuilder/round_trip")
+{
+    NetFrameBuilder builder;
+    CHECK(builder.pending_bytes() == 0);
+
+    for (unsigned int i = 0; i < 5000; ++i) {
+        messages::NetWorldControl msg;
+        msg.mutable_ping()->set_token(i);
+        builder.append(MSGCLASS_LINK_CONTROL, msg);
+    }
+    const std::string expected = ping_frames(5000);
+    CHECK(builder.pending_bytes() == expected.size());
+
+    SECTION("in one go")
+    {
+        CHECK(drain(builder, expected.size()) == expected);
+    }
+    SECTION("in small parts")
+    {
+        CHECK(drain(builder, 1001) == expected);
+    }
+    CHECK(builder.pending_bytes() == 0);
+
+    struct iovec iov;
+    CHECK(builder.pending(&iov, 1) == 0);
+
+    // segments are reused and the builder keeps working
+    const std::string again = ping_frames(10);
+    for (unsigned int i = 0; i < 10; ++i) {
+        messages::NetWorldControl msg;
+        msg.mutable_ping()->set_token(i);
+        builder.append(MSGCLASS_LINK_CONTROL, msg);
+    }
+    NetMessageParserTest test;
+    feed(test.m_parser, drain(builder, 3), 4096);
+    CHECK_FALSE(test.m_had_error);
+    check_ping_tokens(test, 10);
+}
+
+TEST_CASE("sim/networld/NetFrameBuilder/large_messages")
+{
+    messages::WorldCommand msg;
+    messages::TerraformRaise &cmd = *msg.mutable_tf_raise();
+    cmd.set_xc(1.f);
+    cmd.set_yc(2.f);
+    cmd.set_brush_size(128);
+    cmd.set_brush_strength(1.f);
+    for (unsigned int i = 0; i < 128*128; ++i) {
+        cmd.add_density_map(float(i));
+    }
+    REQUIRE(msg.ByteSizeLong() > NetFrameBuilder::SEGMENT_SIZE);
+
+    NetFrameBuilder builder;
+    messages::NetWorldControl ping;
+    ping.mutable_ping()->set_token(0);
+    builder.append(MSGCLASS_LINK_CONTROL, ping);
+    builder.append(MSGCLASS_WORLD_COMMAND, msg);
+    builder.append(MSGCLASS_LINK_CONTROL, ping);
+    CHECK(builder.pending_bytes() ==
+          3*HEADER_SIZE + 2*ping.ByteSizeLong() + msg.ByteSizeLong());
+
+    NetMessageParserTest test;
+    feed(test.m_parser, drain(builder, 65536), 65536);
+    CHECK_FALSE(test.m_had_error);
+    REQUIRE(test.m_found.size() == 3);
+    const messages::WorldCommand *received =
+            dynamic_cast<const messages::WorldCommand*>(test.m_found[1].get());
+    REQUIRE(received);
+    CHECK(received->tf_raise().density_map_size() == 128*128);
+    CHECK(received->tf_raise().density_map(128*128-1) == float(128*128-1));
+}
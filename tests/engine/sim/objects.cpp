@@ -273,6 +273,78 @@ TEST_CASE("sim/ObjectManager/share")
 }
 
 
+TEST_CASE("sim/ObjectManager/pages/allocated_lazily")
+{
+    sim::ObjectManager om;
+    CHECK(om.allocated_pages() == 0);
+    CHECK(om.directory_size() == 0);
+
+    const sim::Object::ID far_id = 100*sim::ObjectManager::PAGE_SIZE + 1;
+    MyObject &far = om.emplace<MyObject>(far_id, 10);
+    CHECK(om.allocated_pages() == 1);
+    CHECK(om.directory_size() == 101);
+    CHECK(om.get_safe<MyObject>(far_id) == &far);
+    CHECK(om.get_safe<MyObject>(far_id - 1) == nullptr);
+    CHECK(om.get_safe<MyObject>(1) == nullptr);
+
+    MyObject &near = om.allocate<MyObject>(20);
+    CHECK(near.object_id() == 1);
+    CHECK(om.allocated_pages() == 2);
+}
+
+TEST_CASE("sim/ObjectManager/pages/released_when_empty")
+{
+    sim::ObjectManager om;
+    const sim::Object::ID count = 3*sim::ObjectManager::PAGE_SIZE;
+    for (sim::Object::ID i = 1; i <= count; ++i) {
+        om.allocate<MyObject>(i);
+    }
+    CHECK(om.allocated_pages() == 3);
+
+    // empty the middle page
+    for (sim::Object::ID i = sim::ObjectManager::PAGE_SIZE + 1;
+         i <= 2*sim::ObjectManager::PAGE_SIZE;
+         ++i)
+    {
+        om.kill(i);
+    }
+    CHECK(om.allocated_pages() == 2);
+    CHECK(om.directory_size() == 3);
+    CHECK(om.get_safe<MyObject>(sim::ObjectManager::PAGE_SIZE + 1) == nullptr);
+    REQUIRE(om.get_safe<MyObject>(count));
+    CHECK(om.get_safe<MyObject>(count)->m_value == count);
+
+    // trailing empty pages are removed from the directory
+    for (sim::Object::ID i = 2*sim::ObjectManager::PAGE_SIZE + 1;
+         i <= count;
+         ++i)
+    {
+        om.kill(i);
+    }
+    CHECK(om.allocated_pages() == 1);
+    CHECK(om.directory_size() == 1);
+
+    // IDs are reused from the free list, pages are allocated again
+    CHECK(om.allocate<MyObject>().object_id() ==
+          sim::ObjectManager::PAGE_SIZE + 1);
+    CHECK(om.allocated_pages() == 2);
+}
+
+TEST_CASE("sim/ObjectManager/pages/id_range")
+{
+    sim::ObjectManager om;
+    MyObject &last = om.emplace<MyObject>(sim::ObjectManager::MAX_OBJECT_ID);
+    CHECK(om.get_safe<MyObject>(sim::ObjectManager::MAX_OBJECT_ID) == &last);
+    CHECK(om.allocated_pages() == 1);
+    CHECK_THROWS_AS(om.emplace<MyObject>(sim::ObjectManager::MAX_OBJECT_ID + 1),
+                    std::runtime_error);
+    CHECK(om.get_safe<MyObject>(sim::ObjectManager::MAX_OBJECT_ID + 1) == nullptr);
+
+    om.kill(last);
+    CHECK(om.allocated_pages() == 0);
+    CHECK(om.directory_size() == 0);
+}
+
 TEST_CASE("sim/object_ptr/default_constructor")
 {
     sim::object_ptr<MyObject> ptr;
@@ -402,3 +474,51 @@ TEST_CASE("sim/object_ptr/dynamic_downcast_failure")
     CHECK_FALSE(ptr2.was_valid());
 }
 
+
+TEST_CASE("sim/object_ptr/all_referees_die_with_object")
+{
+    sim::ObjectManager om;
+    MyObject &obj = om.allocate<MyObject>();
+    MyObject &other = om.allocate<MyObject>();
+
+    std::vector<sim::object_ptr<MyObject> > ptrs;
+    for (unsigned int i = 0; i < 16; ++i) {
+        // growing the vector moves all pointers around
+        ptrs.emplace_back(om.share(obj));
+    }
+    sim::object_ptr<sim::Object> upcast(ptrs[3]);
+    sim::object_ptr<MyObject> moved(std::move(ptrs[5]));
+    sim::object_ptr<MyObject> reassigned(om.share(other));
+    reassigned = ptrs[7];
+    ptrs.erase(ptrs.begin() + 10);
+    sim::object_ptr<MyObject> other_ptr(om.share(other));
+    {
+        sim::object_ptr<MyObject> temporary(ptrs[0]);
+        ptrs[1] = nullptr;
+    }
+
+    om.kill(obj);
+    for (auto &ptr: ptrs) {
+        CHECK_FALSE(ptr);
+    }
+    CHECK_FALSE(upcast);
+    CHECK(upcast.was_valid());
+    CHECK_FALSE(moved);
+    CHECK_FALSE(reassigned);
+    CHECK(other_ptr.get() == &other);
+
+    om.kill(other);
+    CHECK_FALSE(other_ptr);
+}
+
+TEST_CASE("sim/object_ptr/self_assignment")
+{
+    MyObject obj(123);
+    sim::object_ptr<MyObject> ptr(obj);
+    sim::object_ptr<MyObject> &alias = ptr;
+    ptr = alias;
+    CHECK(ptr.get() == &obj);
+    ptr = std::move(alias);
+    CHECK(ptr.get() == &obj);
+    CHECK(ptr.was_valid());
+}
@@ -0,0 +1,463 @@
+/**********************************************************************
+File name: replication.cpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#include <catch.hpp>
+
+#include "ffengine/sim/fluid_base.hpp"
+#include "ffengine/sim/interest.hpp"
+#include "ffengine/sim/replication.hpp"
+#include "ffengine/sim/server.hpp"
+
+#include "replication.pb.h"
+
+#include <atomic>
+#include <stdexcept>
+
+
+using namespace sim;
+
+
+static const float HEIGHT_EPSILON = (Terrain::max_height - Terrain::min_height)
+        / 65535.f;
+
+
+static void set_height(Terrain &terrain,
+                       const unsigned int x, const unsigned int y,
+                       const float height)
+{
+    Terrain::Field *field = nullptr;
+    auto lock = terrain.writable_field(field);
+    (*field)[y*terrain.size() + x][Terrain::HEIGHT_ATTR] = height;
+}
+
+/**
+ * Mark the tiles changed in \a view within the interest of \a session dirty,
+ * like the Server does.
+ */
+static void mark_changed(ReplicationSession &session, const WorldView &view)
+{
+    InterestGrid grid(view.terrain_size());
+    grid.set_interest(0, session.interest());
+    grid.for_each_subscriber(
+                view.changed(),
+                [&session](InterestGrid::Subscriber,
+                           const unsigned int tx, const unsigned int ty){
+                    session.mark_dirty(tx, ty);
+                });
+}
+
+/**
+ * Run one round trip from \a session to \a replica, returning false if there
+ * was nothing to send.
+ */
+static bool replicate(ReplicationSession &session,
+                      const WorldView &view,
+                      WorldReplica &replica,
+                      messages::ReplicationUpdate &update,
+                      const bool ack = true)
+{
+    if (!session.build_update(view, update)) {
+        return false;
+    }
+    REQUIRE(replica.apply(update));
+    if (ack) {
+        messages::ReplicationFeedback feedback;
+        replica.feedback({}, feedback);
+        session.feedback(feedback);
+    }
+    return true;
+}
+
+
+TEST_CASE("sim/replication/height_tile_codec")
+{
+    const std::size_t count = 300;
+    std::vector<std::uint16_t> values(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        values[i] = std::uint16_t(1000 + (i % 17)*(i % 5)*300);
+    }
+    std::vector<std::uint16_t> base(values);
+    base[10] = 0;
+    base[11] = 65535;
+    base[200] += 3;
+
+    std::string encoded;
+    std::vector<std::uint16_t> decoded(count);
+
+    SECTION("without base")
+    {
+        encode_height_tile(values.data(), nullptr, count, encoded);
+        CHECK(decode_height_tile(encoded, nullptr, decoded.data(), count));
+        CHECK(decoded == values);
+    }
+
+    SECTION("with base")
+    {
+        encode_height_tile(values.data(), base.data(), count, encoded);
+        // only three values differ from the base
+        CHECK(encoded.size() < 16);
+        decoded = base;
+        CHECK(decode_height_tile(encoded, decoded.data(), decoded.data(),
+                                 count));
+        CHECK(decoded == values);
+    }
+
+    SECTION("constant data is compact")
+    {
+        std::vector<std::uint16_t> flat(count, 1234);
+        encode_height_tile(flat.data(), nullptr, count, encoded);
+        CHECK(encoded.size() < 8);
+        CHECK(decode_height_tile(encoded, nullptr, decoded.data(), count));
+        CHECK(decoded == flat);
+    }
+
+    SECTION("rejects malformed data")
+    {
+        encode_height_tile(values.data(), nullptr, count, encoded);
+        CHECK_FALSE(decode_height_tile(encoded, nullptr, decoded.data(),
+                                       count + 1));
+        CHECK_FALSE(decode_height_tile(encoded.substr(0, encoded.size() - 1),
+                                       nullptr, decoded.data(), count));
+        CHECK_FALSE(decode_height_tile(encoded + '\0',
+                                       nullptr, decoded.data(), count));
+        CHECK_FALSE(decode_height_tile(std::string("\xff\xff\xff\xff\xff\xff"),
+                                       nullptr, decoded.data(), count));
+    }
+}
+
+TEST_CASE("sim/replication/ReplicationSession/converges_progressively")
+{
+    Terrain terrain(WorldView::TILE_SIZE*3 + 5);
+    const unsigned int size = terrain.size();
+    set_height(terrain, 0, 0, 10.f);
+    set_height(terrain, size-1, size-1, 123.4f);
+    set_height(terrain, 70, 130, 499.f);
+    auto view = WorldView::snapshot(terrain, nullptr, TerrainRegion(), 1);
+
+    // a budget of one byte sends a single tile per update
+    ReplicationSession session(1);
+    WorldReplica replica;
+    messages::ReplicationUpdate update;
+
+    unsigned int updates = 0;
+    while (replicate(session, *view, replica, update)) {
+        CHECK(update.tiles_size() == 1);
+        ++updates;
+        REQUIRE(updates <= view->tiles_per_axis()*view->tiles_per_axis());
+    }
+    CHECK(updates == view->tiles_per_axis()*view->tiles_per_axis());
+    CHECK(session.bytes_in_flight() == 0);
+
+    CHECK(replica.terrain_size() == size);
+    CHECK(replica.frame() == 1);
+    for (unsigned int ty = 0; ty < replica.tiles_per_axis(); ++ty) {
+        for (unsigned int tx = 0; tx < replica.tiles_per_axis(); ++tx) {
+            CHECK(replica.has_tile(tx, ty));
+        }
+    }
+    CHECK(replica.height(0, 0) == Approx(10.f).margin(HEIGHT_EPSILON));
+    CHECK(replica.height(size-1, size-1) ==
+          Approx(123.4f).margin(HEIGHT_EPSILON));
+    CHECK(replica.height(70, 130) == Approx(499.f).margin(HEIGHT_EPSILON));
+    CHECK(replica.height(1, 1) ==
+          Approx(Terrain::default_height).margin(HEIGHT_EPSILON));
+}
+
+TEST_CASE("sim/replication/ReplicationSession/prioritises_viewport")
+{
+    Terrain terrain(WorldView::TILE_SIZE*4);
+    auto view = WorldView::snapshot(terrain, nullptr, TerrainRegion(), 0);
+
+    ReplicationSession session(1);
+    messages::ReplicationFeedback feedback;
+    WorldReplica().feedback({TerrainRect(200, 140, 210, 150)}, feedback);
+    CHECK_FALSE(feedback.has_ack_frame());
+    session.feedback(feedback);
+
+    messages::ReplicationUpdate update;
+    REQUIRE(session.build_update(*view, update));
+    REQUIRE(update.tiles_size() == 1);
+    CHECK(update.tiles(0).tx() == 3);
+    CHECK(update.tiles(0).ty() == 2);
+
+    // the neighbours come next
+    REQUIRE(session.build_update(*view, update));
+    REQUIRE(update.tiles_size() == 1);
+    CHECK((update.tiles(0).tx() == 2 || update.tiles(0).tx() == 3));
+    CHECK((update.tiles(0).ty() >= 1 && update.tiles(0).ty() <= 3));
+}
+
+TEST_CASE("sim/replication/ReplicationSession/sends_deltas")
+{
+    Terrain terrain(WorldView::TILE_SIZE*2);
+    auto first = WorldView::snapshot(terrain, nullptr, TerrainRegion(), 0);
+
+    ReplicationSession session;
+    WorldReplica replica;
+    messages::ReplicationUpdate update;
+    REQUIRE(replicate(session, *first, replica, update));
+    CHECK(update.tiles_size() == 4);
+    CHECK_FALSE(replicate(session, *first, replica, update));
+
+    set_height(terrain, 100, 20, 42.f);
+    const TerrainRegion changed(TerrainRect(100, 20, 101, 21));
+    auto second = WorldView::snapshot(terrain, first.get(), changed, 1);
+
+    const std::uint64_t old_version = replica.tile_version(1, 0);
+    mark_changed(session, *second);
+    REQUIRE(replicate(session, *second, replica, update));
+    REQUIRE(update.tiles_size() == 1);
+    const messages::TerrainTileUpdate &tile = update.tiles(0);
+    CHECK(tile.tx() == 1);
+    CHECK(tile.ty() == 0);
+    CHECK(tile.has_base_version());
+    CHECK(tile.base_version() == old_version);
+    CHECK(tile.data().size() < 16);
+    CHECK(replica.tile_version(1, 0) != old_version);
+    CHECK(replica.height(100, 20) == Approx(42.f).margin(HEIGHT_EPSILON));
+
+    // a delta against a version the replica does not have is rejected
+    WorldReplica other;
+    CHECK_FALSE(other.apply(update));
+}
+
+TEST_CASE("sim/replication/ReplicationSession/filters_by_interest")
+{
+    Terrain terrain(WorldView::TILE_SIZE*4);
+    auto first = WorldView::snapshot(terrain, nullptr, TerrainRegion(), 0);
+
+    ReplicationSession session;
+    WorldReplica replica;
+    messages::ReplicationFeedback feedback;
+    replica.feedback({TerrainRect(0, 0, 10, 10)}, feedback);
+    session.feedback(feedback);
+
+    // the view plus the margin covers the top-left 2×2 tiles
+    messages::ReplicationUpdate update;
+    REQUIRE(replicate(session, *first, replica, update));
+    CHECK(update.tiles_size() == 4);
+    CHECK_FALSE(replicate(session, *first, replica, update));
+    CHECK(replica.has_tile(1, 1));
+    CHECK_FALSE(replica.has_tile(2, 0));
+    CHECK_FALSE(replica.has_tile(3, 3));
+
+    // changes outside the interest are not sent
+    set_height(terrain, 200, 200, 77.f);
+    auto second = WorldView::snapshot(terrain, first.get(),
+                                      TerrainRect(200, 200, 201, 201), 1);
+    mark_changed(session, *second);
+    CHECK_FALSE(replicate(session, *second, replica, update));
+
+    set_height(terrain, 5, 5, 33.f);
+    auto third = WorldView::snapshot(terrain, second.get(),
+                                     TerrainRect(5, 5, 6, 6), 2);
+    mark_changed(session, *third);
+    REQUIRE(replicate(session, *third, replica, update));
+    REQUIRE(update.tiles_size() == 1);
+    CHECK(update.tiles(0).tx() == 0);
+    CHECK(update.tiles(0).ty() == 0);
+    CHECK(replica.height(5, 5) == Approx(33.f).margin(HEIGHT_EPSILON));
+
+    // moving the view brings the current data of the new surroundings
+    replica.feedback({TerrainRect(200, 200, 210, 210)}, feedback);
+    session.feedback(feedback);
+    REQUIRE(replicate(session, *third, replica, update));
+    CHECK(update.tiles_size() == 4);
+    CHECK(replica.has_tile(3, 3));
+    CHECK(replica.height(200, 200) == Approx(77.f).margin(HEIGHT_EPSILON));
+}
+
+TEST_CASE("sim/replication/ReplicationSession/respects_window")
+{
+    Terrain terrain(WorldView::TILE_SIZE*2);
+    auto view = WorldView::snapshot(terrain, nullptr, TerrainRegion(), 5);
+
+    ReplicationSession session(1, 1);
+    WorldReplica replica;
+    messages::ReplicationUpdate update;
+    REQUIRE(replicate(session, *view, replica, update, false));
+    CHECK(session.bytes_in_flight() > 0);
+    CHECK_FALSE(session.build_update(*view, update));
+
+    messages::ReplicationFeedback feedback;
+    replica.feedback({}, feedback);
+    CHECK(feedback.ack_frame() == 5);
+    session.feedback(feedback);
+    CHECK(session.bytes_in_flight() == 0);
+    CHECK(session.build_update(*view, update));
+}
+
+TEST_CASE("sim/replication/ReplicationSession/fluid_blocks")
+{
+    Terrain terrain(WorldView::TILE_SIZE);
+    std::vector<FluidBlockSummary> blocks{
+        FluidBlockSummary{true, false, 0.f, 0.5f},
+        FluidBlockSummary{false, true, 12.f, 0.f},
+        FluidBlockSummary{false, false, 0.f, 0.f},
+        FluidBlockSummary{true, true, 20.f, 0.25f},
+    };
+    auto first = WorldView::snapshot(terrain, nullptr, TerrainRegion(), 0,
+                                     2, std::vector<FluidBlockSummary>(blocks));
+
+    ReplicationSession session;
+    WorldReplica replica;
+    messages::ReplicationUpdate update;
+    REQUIRE(replicate(session, *first, replica, update));
+    CHECK(update.fluid_blocks_size() == 4);
+    CHECK(replica.fluid_blocks_per_axis() == 2);
+    CHECK(replica.fluid_blocks() == blocks);
+
+    blocks[2].active = true;
+    blocks[2].change = 1.f;
+    auto second = WorldView::snapshot(terrain, first.get(), TerrainRegion(), 1,
+                                      2, std::vector<FluidBlockSummary>(blocks));
+    REQUIRE(replicate(session, *second, replica, update));
+    CHECK(update.tiles_size() == 0);
+    REQUIRE(update.fluid_blocks_size() == 1);
+    CHECK(update.fluid_blocks(0).index() == 2);
+    CHECK(replica.fluid_blocks() == blocks);
+}
+
+TEST_CASE("sim/replication/ReplicationSession/fluid_blocks_within_budget")
+{
+    const unsigned int nblocks = 4;
+    Terrain terrain(nblocks*IFluidSim::block_size);
+    std::vector<FluidBlockSummary> blocks;
+    for (unsigned int i = 0; i < nblocks*nblocks; ++i) {
+        blocks.push_back(FluidBlockSummary{true, true, 10.f + i, 0.5f});
+    }
+    auto view = WorldView::snapshot(terrain, nullptr, TerrainRegion(), 0,
+                                    nblocks,
+                                    std::vector<FluidBlockSummary>(blocks));
+
+    const std::size_t budget = 128;
+    ReplicationSession session(budget);
+    WorldReplica replica;
+    messages::ReplicationUpdate update;
+    unsigned int updates = 0;
+    unsigned int fluid_updates = 0;
+    while (replicate(session, *view, replica, update)) {
+        ++updates;
+        REQUIRE(updates < 100);
+        if (update.fluid_blocks_size() == 0) {
+            continue;
+        }
+        ++fluid_updates;
+        std::size_t fluid_size = 0;
+        for (const messages::FluidBlockSummary &msg: update.fluid_blocks()) {
+            fluid_size += msg.ByteSizeLong() + 2;
+        }
+        // the last summary may exceed the half of the budget reserved for
+        // fluid summaries
+        CHECK(fluid_size - (update.fluid_blocks(0).ByteSizeLong() + 2)
+              < budget / 2);
+    }
+
+    CHECK(fluid_updates > 1);
+    CHECK(replica.fluid_blocks() == blocks);
+}
+
+
+/**
+ * Client which fails to enqueue replication updates, like a client whose
+ * updates exceed the maximum message size.
+ */
+class FailingClient: public ServerClientBase
+{
+public:
+    std::atomic_int m_updates{0};
+    std::atomic_int m_terminate_requests{0};
+    bool m_fail = false;
+
+public:
+    void flush() override
+    {
+
+    }
+
+    void terminate() override
+    {
+
+    }
+
+    void request_flush() override
+    {
+
+    }
+
+    void request_terminate() override
+    {
+        ++m_terminate_requests;
+    }
+
+    void send_message(const messages::WorldCommandResponse &) override
+    {
+
+    }
+
+    void send_message(const messages::ReplicationUpdate &) override
+    {
+        if (m_fail) {
+            throw std::length_error("message exceeds maximum message size");
+        }
+        ++m_updates;
+    }
+
+    void set_message_handler(IMessageHandler *) override
+    {
+
+    }
+
+    bool msg_unhandled(AbstractMessagePtr &&) override
+    {
+        return false;
+    }
+
+};
+
+TEST_CASE("sim/replication/Server/terminates_failing_client")
+{
+    Server server(FramePacing::MANUAL);
+    FailingClient failing;
+    failing.m_fail = true;
+    FailingClient healthy;
+    const ServerClientID failing_id = server.add_client(failing);
+    const ServerClientID healthy_id = server.add_client(healthy);
+
+    messages::ReplicationFeedback feedback;
+    server.replication_feedback(failing_id, feedback);
+    server.replication_feedback(healthy_id, feedback);
+
+    server.step();
+    CHECK(failing.m_terminate_requests == 1);
+    CHECK(healthy.m_terminate_requests == 0);
+    CHECK(healthy.m_updates == 1);
+
+    // the terminated client is not replicated to anymore
+    server.step(3);
+    CHECK(failing.m_terminate_requests == 1);
+    CHECK(healthy.m_updates > 1);
+
+    server.remove_client(failing_id);
+    server.remove_client(healthy_id);
+}
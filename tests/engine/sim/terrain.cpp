@@ -0,0 +1,290 @@
+/**********************************************************************
+File name: terrain.cpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#include <catch.hpp>
+
+#include <algorithm>
+
+#include "ffengine/sim/fluid.hpp"
+#include "ffengine/sim/terrain.hpp"
+
+
+using namespace sim;
+
+
+TEST_CASE("sim/TerrainRegion/add_disjoint")
+{
+    TerrainRegion region;
+    region.add(TerrainRect(0, 0, 10, 10));
+    region.add(TerrainRect(20, 20, 30, 30));
+
+    CHECK(region.rects().size() == 2);
+    CHECK(region.bounds() == TerrainRect(0, 0, 30, 30));
+}
+
+TEST_CASE("sim/TerrainRegion/add_overlapping")
+{
+    TerrainRegion region;
+    region.add(TerrainRect(0, 0, 10, 10));
+    region.add(TerrainRect(5, 5, 15, 15));
+
+    REQUIRE(region.rects().size() == 1);
+    CHECK(region.rects()[0] == TerrainRect(0, 0, 15, 15));
+}
+
+TEST_CASE("sim/TerrainRegion/add_chained_merge")
+{
+    TerrainRegion region;
+    region.add(TerrainRect(0, 0, 10, 10));
+    region.add(TerrainRect(20, 0, 30, 10));
+    region.add(TerrainRect(40, 40, 50, 50));
+    CHECK(region.rects().size() == 3);
+
+    // overlaps the first two rects
+    region.add(TerrainRect(5, 5, 25, 45));
+    CHECK(region.rects().size() == 2);
+
+    // only overlaps the merged rect, which then grows into the last one
+    region.add(TerrainRect(28, 30, 41, 35));
+
+    REQUIRE(region.rects().size() == 1);
+    CHECK(region.rects()[0] == TerrainRect(0, 0, 50, 50));
+}
+
+TEST_CASE("sim/TerrainRegion/add_empty")
+{
+    TerrainRegion region;
+    region.add(TerrainRect(NotARect));
+    region.add(TerrainRect(10, 10, 10, 20));
+
+    CHECK(region.empty());
+    CHECK(region.bounds() == NotARect);
+}
+
+TEST_CASE("sim/Terrain/flush_notifications")
+{
+    Terrain terrain(17);
+
+    std::vector<TerrainRegion> heightmap_batches;
+    std::vector<TerrainRegion> attribute_batches;
+    terrain.heightmap_updated().connect([&heightmap_batches](const TerrainRegion &region){
+        heightmap_batches.emplace_back(region);
+    });
+    terrain.attributes_updated().connect([&attribute_batches](const TerrainRegion &region){
+        attribute_batches.emplace_back(region);
+    });
+
+    terrain.notify_heightmap_changed(TerrainRect(0, 0, 4, 4));
+    terrain.notify_heightmap_changed(TerrainRect(2, 2, 6, 6));
+    terrain.notify_heightmap_changed(TerrainRect(10, 10, 12, 12));
+    terrain.notify_attributes_changed(TerrainRect(1, 1, 2, 2));
+
+    CHECK(heightmap_batches.empty());
+    CHECK(attribute_batches.empty());
+
+    terrain.flush_notifications();
+
+    REQUIRE(heightmap_batches.size() == 1);
+    CHECK(heightmap_batches[0].rects().size() == 2);
+    CHECK(heightmap_batches[0].bounds() == TerrainRect(0, 0, 12, 12));
+    REQUIRE(attribute_batches.size() == 1);
+    CHECK(attribute_batches[0].bounds() == TerrainRect(1, 1, 2, 2));
+
+    SECTION("nothing pending")
+    {
+        terrain.flush_notifications();
+        CHECK(heightmap_batches.size() == 1);
+        CHECK(attribute_batches.size() == 1);
+    }
+}
+
+TEST_CASE("sim/Sandifier/spread")
+{
+    Terrain terrain(181);
+    Fluid fluid(terrain);
+    Sandifier sandifier(terrain, fluid);
+
+    {
+        Terrain::Field *field = nullptr;
+        auto lock = terrain.writable_field(field);
+        (*field)[100*181+100][Terrain::SAND_ATTR] = 1.f;
+    }
+
+    std::vector<TerrainRegion> updates;
+    terrain.attributes_updated().connect([&updates](const TerrainRegion &r){
+        updates.push_back(r);
+    });
+
+    sandifier.run_steps();
+    CHECK(updates.empty());
+    terrain.flush_notifications();
+    REQUIRE(updates.size() == 1);
+    CHECK(updates[0].bounds().overlaps(TerrainRect(100, 100, 101, 101)));
+
+    const Terrain::Field *field = nullptr;
+    auto lock = terrain.readonly_field(field);
+    CHECK((*field)[100*181+100][Terrain::SAND_ATTR] < 1.f);
+    CHECK((*field)[100*181+101][Terrain::SAND_ATTR] > 0.f);
+    CHECK((*field)[99*181+99][Terrain::SAND_ATTR] > 0.f);
+    CHECK((*field)[100*181+102][Terrain::SAND_ATTR] == 0.f);
+    CHECK((*field)[10*181+10][Terrain::SAND_ATTR] == 0.f);
+}
+
+TEST_CASE("sim/Sandifier/heightmap_marks_tiles")
+{
+    Terrain terrain(181);
+    Fluid fluid(terrain);
+    Sandifier sandifier(terrain, fluid);
+
+    // initially, all tiles need to be processed
+    CHECK(sandifier.tiles_dirty() == 9);
+    sandifier.run_steps();
+    CHECK(sandifier.tiles_dirty() == 0);
+
+    terrain.notify_heightmap_changed(TerrainRect(10, 10, 20, 20));
+    terrain.flush_notifications();
+    CHECK(sandifier.tiles_dirty() == 1);
+
+    // touches the neighbourhood of the tile boundary
+    terrain.notify_heightmap_changed(TerrainRect(64, 64, 70, 70));
+    terrain.flush_notifications();
+    CHECK(sandifier.tiles_dirty() == 4);
+}
+
+TEST_CASE("sim/sample_terrain/plane")
+{
+    // bilinear interpolation is exact on a plane
+    Terrain terrain(33);
+    {
+        Terrain::Field *field = nullptr;
+        auto lock = terrain.writable_field(field);
+        for (unsigned int y = 0; y < 33; ++y) {
+            for (unsigned int x = 0; x < 33; ++x) {
+                (*field)[y*33+x][Terrain::HEIGHT_ATTR] = 2.f*x + 3.f*y + 5.f;
+            }
+        }
+    }
+
+    std::vector<Vector2f> positions;
+    for (unsigned int i = 0; i < 600; ++i) {
+        positions.emplace_back((i * 7 % 320) / 10.f, (i * 13 % 320) / 10.f);
+    }
+    positions.emplace_back(32.f, 32.f);
+
+    std::vector<float> heights(positions.size());
+    std::vector<Vector2f> slopes(positions.size());
+    std::vector<Vector3f> normals(positions.size());
+    CHECK(terrain.sample(positions.data(), positions.size(),
+                         heights.data(), slopes.data(), normals.data()) == 0);
+
+    const Vector3f expected_normal = Vector3f(-2, -3, 1).normalized();
+    for (unsigned int i = 0; i < positions.size(); ++i) {
+        const Vector2f &p = positions[i];
+        CHECK(heights[i] == Approx(2.f*p[eX] + 3.f*p[eY] + 5.f));
+        CHECK(slopes[i][eX] == Approx(2.f));
+        CHECK(slopes[i][eY] == Approx(3.f));
+        CHECK(normals[i][eX] == Approx(expected_normal[eX]));
+        CHECK(normals[i][eY] == Approx(expected_normal[eY]));
+        CHECK(normals[i][eZ] == Approx(expected_normal[eZ]));
+    }
+}
+
+TEST_CASE("sim/sample_terrain/outside")
+{
+    Terrain terrain(33);
+
+    const Vector2f positions[4] = {
+        Vector2f(-1.f, 10.f),
+        Vector2f(10.f, 10.f),
+        Vector2f(10.f, 32.5f),
+        Vector2f(40.f, 40.f)
+    };
+    float heights[4];
+    CHECK(terrain.sample(positions, 4, heights) == 3);
+    for (float height: heights) {
+        CHECK(height == Terrain::default_height);
+    }
+}
+
+class RecordingTerrainWorker: public TerrainWorker
+{
+public:
+    RecordingTerrainWorker(const unsigned int threads,
+                           const unsigned int margin):
+        TerrainWorker(threads, 16, margin)
+    {
+        start();
+    }
+
+    ~RecordingTerrainWorker() override
+    {
+        tear_down();
+    }
+
+    std::mutex m_rects_mutex;
+    std::vector<TerrainRect> m_rects;
+
+protected:
+    void worker_impl(const TerrainRect &updated_rect) override
+    {
+        std::lock_guard<std::mutex> lock(m_rects_mutex);
+        m_rects.push_back(updated_rect);
+    }
+
+};
+
+
+TEST_CASE("sim/TerrainWorker/disjoint_updates")
+{
+    RecordingTerrainWorker worker(4, 0);
+
+    TerrainRegion region;
+    region.add(TerrainRect(1, 1, 3, 3));
+    region.add(TerrainRect(100, 100, 102, 102));
+    worker.notify_update(region);
+    worker.wait_for_idle();
+
+    std::sort(worker.m_rects.begin(), worker.m_rects.end(),
+              [](const TerrainRect &a, const TerrainRect &b){
+        return a.x0() < b.x0();
+    });
+    REQUIRE(worker.m_rects.size() == 2);
+    CHECK(worker.m_rects[0] == TerrainRect(1, 1, 3, 3));
+    CHECK(worker.m_rects[1] == TerrainRect(100, 100, 102, 102));
+}
+
+TEST_CASE("sim/TerrainWorker/tiles_with_margin")
+{
+    RecordingTerrainWorker worker(2, 1);
+
+    worker.notify_update(TerrainRect(10, 0, 20, 5));
+    worker.wait_for_idle();
+
+    std::sort(worker.m_rects.begin(), worker.m_rects.end(),
+              [](const TerrainRect &a, const TerrainRect &b){
+        return a.x0() < b.x0();
+    });
+    REQUIRE(worker.m_rects.size() == 2);
+    CHECK(worker.m_rects[0] == TerrainRect(9, 0, 16, 6));
+    CHECK(worker.m_rects[1] == TerrainRect(16, 0, 21, 6));
+}
@@ -0,0 +1,262 @@
+/**********************************************************************
+File name: terrain_file.cpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#include <catch.hpp>
+
+#include "ffengine/io/filestream.hpp"
+
+#include "ffengine/sim/server.hpp"
+#include "ffengine/sim/terrain_file.hpp"
+#include "ffengine/sim/world_ops.hpp"
+
+#include "testutils.hpp"
+
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+
+using namespace sim;
+
+
+class TemporaryTerrainFile: public TemporaryPath
+{
+public:
+    TemporaryTerrainFile(const Terrain &terrain, const unsigned int tile_size):
+        TemporaryPath("terrain")
+    {
+        io::FileStream stream(m_path, io::OpenMode::WRITE,
+                              io::WriteMode::OVERWRITE);
+        write_terrain_file(terrain, stream, tile_size);
+    }
+};
+
+
+static void fill_terrain(Terrain &terrain)
+{
+    Terrain::Field *field = nullptr;
+    auto lock = terrain.writable_field(field);
+    for (unsigned int y = 0; y < terrain.size(); ++y) {
+        for (unsigned int x = 0; x < terrain.size(); ++x) {
+            Vector3f &cell = (*field)[y*terrain.size()+x];
+            cell[Terrain::HEIGHT_ATTR] = (x / 8) * 1.5f + y * 0.25f;
+            cell[Terrain::SAND_ATTR] = (x + y) % 3 == 0 ? 1.f : 0.f;
+        }
+    }
+}
+
+static Terrain::Field copy_field(const Terrain &terrain)
+{
+    const Terrain::Field *field = nullptr;
+    auto lock = terrain.readonly_field(field);
+    return *field;
+}
+
+
+TEST_CASE("sim/TerrainFile/roundtrip")
+{
+    Terrain source(65);
+    fill_terrain(source);
+    TemporaryTerrainFile tmp(source, 16);
+
+    auto file = std::make_shared<TerrainFile>(tmp.m_path);
+    CHECK(file->size() == 65);
+    CHECK(file->tile_size() == 16);
+    CHECK(file->tiles_per_axis() == 5);
+    CHECK(file->tile_rect(4, 4) == TerrainRect(64, 64, 65, 65));
+
+    Terrain dest(65);
+    dest.attach(file);
+    CHECK(dest.tiles_pending() == 25);
+
+    SECTION("page_in")
+    {
+        dest.page_in(TerrainRect(10, 10, 20, 20));
+        CHECK(dest.tiles_pending() == 21);
+
+        const Terrain::Field expected = copy_field(source);
+        const Terrain::Field actual = copy_field(dest);
+        CHECK(actual[15*65+15] == expected[15*65+15]);
+        CHECK(actual[31*65+31] == expected[31*65+31]);
+        CHECK(actual[40*65+40] == Vector3f(Terrain::default_height, 0, 0));
+    }
+
+    SECTION("sample_pages_in")
+    {
+        // the first sample reads rows 47 and 48, which are in tiles (2, 2)
+        // and (2, 3); the second is clamped into tile (4, 0)
+        const Vector2f positions[2] = {Vector2f(40.5f, 47.5f),
+                                       Vector2f(200.f, 5.f)};
+        float heights[2];
+        CHECK(dest.sample(positions, 2, heights) == 1);
+        CHECK(dest.tiles_pending() == 22);
+
+        float expected[2];
+        source.sample(positions, 2, expected);
+        CHECK(heights[0] == expected[0]);
+        CHECK(heights[1] == expected[1]);
+    }
+
+    SECTION("page_in_pending")
+    {
+        CHECK(dest.page_in_pending(10) == 10);
+        CHECK(dest.tiles_pending() == 15);
+        CHECK(dest.page_in_pending(100) == 15);
+        CHECK(dest.tiles_pending() == 0);
+        CHECK(dest.page_in_pending(100) == 0);
+
+        CHECK(copy_field(dest) == copy_field(source));
+    }
+}
+
+TEST_CASE("sim/TerrainFile/server_pages_in_fluid")
+{
+    Server server(FramePacing::MANUAL);
+    // all fluid blocks start out active; after a reset, none is
+    server.enqueue_op(std::make_unique<ops::FluidReset>());
+    server.step();
+
+    const unsigned int size = server.state().terrain().size();
+    Terrain source(size);
+    fill_terrain(source);
+    TemporaryTerrainFile tmp(source, 64);
+    {
+        auto lock = server.sync_safe_point();
+        server.state().terrain().attach(std::make_shared<TerrainFile>(tmp.m_path));
+    }
+
+    // far away from the tiles which are paged in in the background first
+    server.enqueue_op(std::make_unique<ops::FluidRaise>(
+                          700.f, 700.f, 4, std::vector<float>(16, 1.f), 1.f));
+    server.step();
+
+    std::vector<float> expected_heights = heights(source);
+    std::vector<float> actual_heights;
+    {
+        auto lock = server.sync_safe_point();
+        CHECK(server.state().terrain().tiles_pending() > 0);
+        actual_heights = heights(server.state());
+    }
+    CHECK(actual_heights[700*size+700] == expected_heights[700*size+700]);
+    CHECK(actual_heights[900*size+10] != expected_heights[900*size+10]);
+}
+
+TEST_CASE("sim/TerrainFile/corrupt_tile_detaches")
+{
+    Terrain source(65);
+    fill_terrain(source);
+    TemporaryTerrainFile tmp(source, 16);
+
+    {
+        // point the index entry of tile (1, 0) beyond the end of the file;
+        // the index is at the end of the file, followed by the trailer
+        const int fd = io::check_fd(open(tmp.m_path.c_str(), O_WRONLY));
+        const off_t index_offset = lseek(fd, 0, SEEK_END)
+                - TerrainFile::TRAILER_SIZE - 25*TerrainFile::TILE_ENTRY_SIZE;
+        const std::uint8_t offset[8] = {0, 0, 0, 0, 0, 1, 0, 0};
+        REQUIRE(pwrite(fd, offset, sizeof(offset),
+                       index_offset + TerrainFile::TILE_ENTRY_SIZE)
+                == sizeof(offset));
+        close(fd);
+    }
+
+    Terrain dest(65);
+    dest.attach(std::make_shared<TerrainFile>(tmp.m_path));
+    // tiles (0, 0) and (1, 0) are decoded in parallel
+    CHECK_NOTHROW(dest.page_in(TerrainRect(10, 10, 20, 12)));
+    CHECK(dest.tiles_pending() == 0);
+    CHECK(dest.page_in_pending(100) == 0);
+}
+
+TEST_CASE("sim/TerrainFile/little_endian")
+{
+    Terrain source(33);
+    {
+        Terrain::Field *field = nullptr;
+        auto lock = source.writable_field(field);
+        for (Vector3f &cell: *field) {
+            cell = Vector3f(1.f, 0.f, 0.f);
+        }
+    }
+    TemporaryPath tmp("terrain");
+    {
+        io::FileStream stream(tmp.m_path, io::OpenMode::WRITE,
+                              io::WriteMode::OVERWRITE);
+        write_terrain_file(source, stream, 32);
+    }
+
+    std::uint8_t header[TerrainFile::HEADER_SIZE];
+    {
+        io::FileStream stream(tmp.m_path, io::OpenMode::READ);
+        REQUIRE(stream.read(header, sizeof(header)) == sizeof(header));
+    }
+    const std::uint8_t expected[TerrainFile::HEADER_SIZE] = {
+        'F', 'F', 'E', 'T', 'E', 'R', 'R', '\0',
+        2, 0, 0, 0,
+        33, 0, 0, 0,
+        32, 0, 0, 0,
+        2, 0, 0, 0,
+    };
+    CHECK(std::memcmp(header, expected, sizeof(header)) == 0);
+}
+
+TEST_CASE("sim/TerrainFile/truncated")
+{
+    Terrain source(65);
+    fill_terrain(source);
+    TemporaryTerrainFile tmp(source, 16);
+    REQUIRE(truncate(tmp.m_path.c_str(), 200) == 0);
+
+    CHECK_THROWS_AS(TerrainFile(tmp.m_path), std::runtime_error);
+}
+
+TEST_CASE("sim/TerrainFile/size_mismatch")
+{
+    Terrain source(33);
+    TemporaryTerrainFile tmp(source, 16);
+
+    Terrain dest(65);
+    CHECK_THROWS_AS(dest.attach(std::make_shared<TerrainFile>(tmp.m_path)),
+                    std::invalid_argument);
+}
+
+TEST_CASE("sim/TerrainFile/attach_null")
+{
+    Terrain dest(65);
+    CHECK_THROWS_AS(dest.attach(nullptr), std::invalid_argument);
+    CHECK(dest.tiles_pending() == 0);
+}
+
+TEST_CASE("sim/TerrainFile/invalid")
+{
+    TemporaryPath tmp("terrain");
+    {
+        io::FileStream stream(tmp.m_path, io::OpenMode::WRITE,
+                              io::WriteMode::OVERWRITE);
+        const char garbage[64] = "this is not a terrain file";
+        stream.write(garbage, sizeof(garbage));
+    }
+
+    CHECK_THROWS_AS(TerrainFile(tmp.m_path), std::runtime_error);
+}
@@ -0,0 +1,105 @@
+/**********************************************************************
+File name: terrain_generator.cpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#include <catch.hpp>
+
+#include "ffengine/sim/terrain_generator.hpp"
+
+
+using namespace sim;
+
+
+static const PerlinNoiseGenerator perlin(Vector3(12, 34, 20),
+                                         Vector3(1, 1, 10),
+                                         0.5, 4, 64);
+
+
+TEST_CASE("sim/TerrainGenerator/matches_from_perlin")
+{
+    Terrain reference(129);
+    reference.from_perlin(perlin);
+
+    Terrain terrain(129);
+    TerrainGenerator generator(terrain,
+                               TerrainGenerator::perlin_sampler(perlin),
+                               Vector2f(0, 0),
+                               32);
+    generator.wait_for_completion();
+    CHECK(generator.tiles_pending() == 0);
+
+    const Terrain::Field *expected = nullptr;
+    auto expected_lock = reference.readonly_field(expected);
+    const Terrain::Field *actual = nullptr;
+    auto actual_lock = terrain.readonly_field(actual);
+
+    CHECK(*actual == *expected);
+}
+
+TEST_CASE("sim/TerrainGenerator/focus_first")
+{
+    Terrain terrain(513);
+
+    // samplers are called from the thread pool; record the order in which
+    // the tiles are generated
+    std::mutex order_mutex;
+    std::vector<TerrainRect> order;
+    const TerrainGenerator::Sampler perlin_tiles =
+            TerrainGenerator::perlin_sampler(perlin);
+    TerrainGenerator generator(
+                terrain,
+                [&](const TerrainRect &rect, float *dest){
+                    perlin_tiles(rect, dest);
+                    std::lock_guard<std::mutex> lock(order_mutex);
+                    order.push_back(rect);
+                },
+                Vector2f(500, 500),
+                16);
+    generator.wait_for_completion();
+
+    std::lock_guard<std::mutex> lock(order_mutex);
+    REQUIRE(order.size() == 33*33);
+    CHECK(order[0].overlaps(TerrainRect(256, 256, 513, 513)));
+    CHECK_FALSE(order[0].overlaps(TerrainRect(0, 0, 1, 1)));
+}
+
+TEST_CASE("sim/TerrainGenerator/changes_flushed_by_owner")
+{
+    Terrain terrain(129);
+
+    std::vector<TerrainRegion> updates;
+    terrain.heightmap_updated().connect([&](const TerrainRegion &region){
+        updates.push_back(region);
+    });
+
+    TerrainGenerator generator(terrain,
+                               TerrainGenerator::perlin_sampler(perlin),
+                               Vector2f(0, 0),
+                               32);
+    generator.wait_for_completion();
+    // the generator only marks the tiles as changed
+    CHECK(updates.empty());
+
+    terrain.flush_notifications();
+    REQUIRE(updates.size() == 1);
+    CHECK(updates[0].bounds() == TerrainRect(0, 0, 129, 129));
+}
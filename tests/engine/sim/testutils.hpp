@@ -0,0 +1,96 @@
+/**********************************************************************
+File name: testutils.hpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#ifndef SCC_TESTS_SIM_TESTUTILS_H
+#define SCC_TESTS_SIM_TESTUTILS_H
+
+#include <string>
+#include <vector>
+
+#include <cstdlib>
+#include <unistd.h>
+
+#include "ffengine/io/filestream.hpp"
+
+#include "ffengine/sim/world.hpp"
+
+
+/**
+ * Create an empty file in /tmp and return its path.
+ *
+ * @param prefix Inserted into the file name, to tell the files of different
+ * tests apart.
+ */
+inline std::string make_temporary_path(const std::string &prefix)
+{
+    std::string path = "/tmp/ffengine-" + prefix + "-XXXXXX";
+    close(io::check_fd(mkstemp(&path[0])));
+    return path;
+}
+
+
+/**
+ * Temporary file which is removed when the object is destroyed.
+ */
+class TemporaryPath
+{
+public:
+    explicit TemporaryPath(const std::string &prefix):
+        m_path(make_temporary_path(prefix))
+    {
+
+    }
+
+    TemporaryPath(const TemporaryPath &ref) = delete;
+    TemporaryPath &operator=(const TemporaryPath &ref) = delete;
+
+    ~TemporaryPath()
+    {
+        unlink(m_path.c_str());
+    }
+
+    const std::string m_path;
+};
+
+
+/**
+ * Return a copy of the heights of \a terrain.
+ */
+inline std::vector<float> heights(const sim::Terrain &terrain)
+{
+    const sim::Terrain::Field *field = nullptr;
+    auto lock = terrain.readonly_field(field);
+    std::vector<float> result;
+    result.reserve(field->size());
+    for (const Vector3f &cell: *field) {
+        result.push_back(cell[sim::Terrain::HEIGHT_ATTR]);
+    }
+    return result;
+}
+
+inline std::vector<float> heights(const sim::WorldState &state)
+{
+    return heights(state.terrain());
+}
+
+#endif
@@ -0,0 +1,516 @@
+/**********************************************************************
+File name: world_ops.cpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#include <catch.hpp>
+
+#include "ffengine/math/algo.hpp"
+
+#include "ffengine/sim/world_ops.hpp"
+
+#include "world_command.pb.h"
+
+#include "testutils.hpp"
+
+#include <cmath>
+#include <limits>
+
+
+using namespace sim;
+
+
+static std::vector<float> brush(const unsigned int size)
+{
+    std::vector<float> result(size*size);
+    for (unsigned int i = 0; i < result.size(); ++i) {
+        result[i] = float((i*7) % 11) / 10.f;
+    }
+    return result;
+}
+
+static void check_fused_equivalent(std::vector<WorldOperationPtr> ops,
+                                   const std::size_t expected_size)
+{
+    WorldState sequential;
+    WorldState fused;
+
+    for (auto &op: ops) {
+        REQUIRE(op->execute(sequential) == NO_ERROR);
+    }
+
+    ops::fuse_brush_operations(ops);
+    CHECK(ops.size() == expected_size);
+    for (auto &op: ops) {
+        REQUIRE(op->execute(fused) == NO_ERROR);
+    }
+
+    const std::vector<float> expected = heights(sequential);
+    const std::vector<float> result = heights(fused);
+    REQUIRE(result.size() == expected.size());
+    for (std::size_t i = 0; i < expected.size(); ++i) {
+        CHECK(result[i] == Approx(expected[i]).epsilon(1e-4));
+    }
+}
+
+
+TEST_CASE("sim/ops/fuse_brush_operations/raise")
+{
+    std::vector<WorldOperationPtr> ops;
+    ops.emplace_back(new ops::TerraformRaise(100.f, 100.f, 8, brush(8), 0.5f));
+    ops.emplace_back(new ops::TerraformRaise(103.f, 101.f, 8, brush(8), 1.f));
+    ops.emplace_back(new ops::TerraformRaise(106.5f, 104.f, 7, brush(7), 0.25f));
+    check_fused_equivalent(std::move(ops), 1);
+}
+
+TEST_CASE("sim/ops/fuse_brush_operations/level")
+{
+    std::vector<WorldOperationPtr> ops;
+    ops.emplace_back(new ops::TerraformLevel(100.f, 100.f, 8, brush(8), 0.5f, 30.f));
+    ops.emplace_back(new ops::TerraformLevel(102.f, 97.f, 8, brush(8), 1.f, 30.f));
+    ops.emplace_back(new ops::TerraformLevel(99.f, 95.f, 6, brush(6), 0.75f, 30.f));
+    check_fused_equivalent(std::move(ops), 1);
+}
+
+TEST_CASE("sim/ops/fuse_brush_operations/clipped_at_terrain_edge")
+{
+    std::vector<WorldOperationPtr> ops;
+    ops.emplace_back(new ops::TerraformRaise(1.f, 1.f, 8, brush(8), 1.f));
+    ops.emplace_back(new ops::TerraformRaise(3.f, 2.f, 8, brush(8), 1.f));
+    check_fused_equivalent(std::move(ops), 1);
+}
+
+TEST_CASE("sim/ops/fuse_brush_operations/incompatible")
+{
+    std::vector<WorldOperationPtr> ops;
+    // disjoint areas
+    ops.emplace_back(new ops::TerraformRaise(100.f, 100.f, 8, brush(8), 1.f));
+    ops.emplace_back(new ops::TerraformRaise(200.f, 100.f, 8, brush(8), 1.f));
+    // opposite signs
+    ops.emplace_back(new ops::TerraformRaise(202.f, 100.f, 8, brush(8), -1.f));
+    // different tool
+    ops.emplace_back(new ops::TerraformLevel(202.f, 100.f, 8, brush(8), 1.f, 10.f));
+    // different reference height
+    ops.emplace_back(new ops::TerraformLevel(202.f, 100.f, 8, brush(8), 1.f, 20.f));
+    // interrupted by another operation
+    ops.emplace_back(new ops::FluidOceanLevelSetHeight(10.f));
+    ops.emplace_back(new ops::TerraformLevel(202.f, 100.f, 8, brush(8), 1.f, 20.f));
+
+    CHECK(ops::fuse_brush_operations(ops) == 0);
+    CHECK(ops.size() == 7);
+}
+
+TEST_CASE("sim/ops/fuse_brush_operations/densities_out_of_range")
+{
+    std::vector<float> negative = brush(8);
+    negative[10] = -0.5f;
+    std::vector<float> overshoot = brush(8);
+    overshoot[10] = 4.f;
+
+    std::vector<WorldOperationPtr> ops;
+    ops.emplace_back(new ops::TerraformRaise(100.f, 100.f, 8, brush(8), 1.f));
+    ops.emplace_back(new ops::TerraformRaise(101.f, 100.f, 8, negative, 1.f));
+    ops.emplace_back(new ops::TerraformLevel(102.f, 100.f, 8, brush(8), 0.5f, 30.f));
+    ops.emplace_back(new ops::TerraformLevel(103.f, 100.f, 8, overshoot, 0.5f, 30.f));
+    CHECK_FALSE(static_cast<const ops::BrushWorldOperation&>(*ops[1])
+                .densities_in_unit_range());
+    CHECK_FALSE(static_cast<const ops::BrushWorldOperation&>(*ops[3])
+                .densities_in_unit_range());
+
+    check_fused_equivalent(std::move(ops), 4);
+}
+
+TEST_CASE("sim/ops/fuse_brush_operations/runs")
+{
+    std::vector<WorldOperationPtr> ops;
+    ops.emplace_back(new ops::TerraformRaise(100.f, 100.f, 8, brush(8), 1.f));
+    ops.emplace_back(new ops::TerraformRaise(102.f, 100.f, 8, brush(8), 1.f));
+    ops.emplace_back(new ops::FluidOceanLevelSetHeight(10.f));
+    ops.emplace_back(new ops::TerraformRaise(104.f, 100.f, 8, brush(8), 1.f));
+    ops.emplace_back(new ops::TerraformRaise(106.f, 100.f, 8, brush(8), 1.f));
+    ops.emplace_back(new ops::TerraformRaise(108.f, 100.f, 8, brush(8), 1.f));
+
+    CHECK(ops::fuse_brush_operations(ops) == 3);
+    REQUIRE(ops.size() == 3);
+    CHECK(dynamic_cast<ops::TerraformRaise*>(ops[0].get()));
+    CHECK(dynamic_cast<ops::FluidOceanLevelSetHeight*>(ops[1].get()));
+    CHECK(dynamic_cast<ops::TerraformRaise*>(ops[2].get()));
+}
+
+
+/**
+ * Fill the terrain of \a state with a bumpy heightfield and return the
+ * heights.
+ */
+static std::vector<float> fill_heights(WorldState &state)
+{
+    const unsigned int size = state.terrain().size();
+    {
+        Terrain::Field *field = nullptr;
+        auto lock = state.terrain().writable_field(field);
+        for (unsigned int y = 0; y < size; ++y) {
+            for (unsigned int x = 0; x < size; ++x) {
+                (*field)[y*size+x][Terrain::HEIGHT_ATTR] =
+                        20.f + 5.f*std::sin(x*0.7f) + 3.f*std::cos(y*0.4f);
+            }
+        }
+    }
+    return heights(state);
+}
+
+/**
+ * Apply a brush tool to \a src one cell at a time.
+ *
+ * This is the straightforward formulation of the brush tools, against which
+ * the row-wise implementations are checked. \a tool is called with the
+ * original heights, the cell coordinates and the brush density of the cell
+ * and returns the new height of the cell.
+ */
+template <typename tool_t>
+static std::vector<float> apply_reference(const std::vector<float> &src,
+                                          const unsigned int size,
+                                          const float xc, const float yc,
+                                          const unsigned int brush_size,
+                                          const std::vector<float> &density,
+                                          const float brush_strength,
+                                          tool_t &&tool)
+{
+    std::vector<float> result(src);
+    const int x0 = std::round(xc - brush_size / 2.f);
+    const int y0 = std::round(yc - brush_size / 2.f);
+    for (int by = 0; by < (int)brush_size; ++by) {
+        for (int bx = 0; bx < (int)brush_size; ++bx) {
+            const int x = x0 + bx;
+            const int y = y0 + by;
+            if (x < 0 || y < 0 || x >= (int)size || y >= (int)size) {
+                continue;
+            }
+            const float t = brush_strength*density[by*brush_size+bx];
+            result[y*size+x] = clamp(tool(src, x, y, t),
+                                     Terrain::min_height,
+                                     Terrain::max_height);
+        }
+    }
+    return result;
+}
+
+static void check_heights(const WorldState &state,
+                          const std::vector<float> &expected)
+{
+    const std::vector<float> actual = heights(state);
+    REQUIRE(actual.size() == expected.size());
+
+    std::size_t mismatches = 0;
+    std::size_t first_mismatch = 0;
+    for (std::size_t i = 0; i < expected.size(); ++i) {
+        const float tolerance = 1e-4f*std::max(1.f, std::fabs(expected[i]));
+        if (!(std::fabs(actual[i] - expected[i]) <= tolerance)) {
+            if (mismatches == 0) {
+                first_mismatch = i;
+            }
+            ++mismatches;
+        }
+    }
+
+    INFO("first mismatch at " << first_mismatch << ": "
+         << actual[first_mismatch] << " != " << expected[first_mismatch]);
+    CHECK(mismatches == 0);
+}
+
+struct BrushPlacement
+{
+    float xc, yc;
+    unsigned int brush_size;
+};
+
+/**
+ * Brush placements in the interior of the terrain and clipped at each of its
+ * edges.
+ */
+static std::vector<BrushPlacement> brush_placements(const WorldState &state)
+{
+    const float last = state.terrain().size() - 1;
+    return {
+        {100.f, 100.f, 8},
+        {100.5f, 200.5f, 7},
+        {1.f, 2.f, 8},
+        {-2.f, 50.f, 8},
+        {last - 0.5f, last - 1.f, 7},
+        {50.f, last + 2.f, 8},
+    };
+}
+
+TEST_CASE("sim/ops/TerraformRaise/reference")
+{
+    WorldState state;
+    const unsigned int size = state.terrain().size();
+    for (const BrushPlacement &at: brush_placements(state)) {
+        // the negative strength drives the terrain below the minimum height
+        for (const float strength: {0.5f, -30.f}) {
+            INFO("brush at " << at.xc << ", " << at.yc
+                 << ", strength " << strength);
+            const std::vector<float> expected = apply_reference(
+                        fill_heights(state), size,
+                        at.xc, at.yc, at.brush_size, brush(at.brush_size),
+                        strength,
+                        [size](const std::vector<float> &src,
+                               int x, int y, float t) {
+                            return src[y*size+x] + t;
+                        });
+
+            ops::TerraformRaise op(at.xc, at.yc, at.brush_size,
+                                   brush(at.brush_size), strength);
+            REQUIRE(op.execute(state) == NO_ERROR);
+            check_heights(state, expected);
+        }
+    }
+}
+
+TEST_CASE("sim/ops/TerraformLevel/reference")
+{
+    WorldState state;
+    const unsigned int size = state.terrain().size();
+    for (const BrushPlacement &at: brush_placements(state)) {
+        INFO("brush at " << at.xc << ", " << at.yc);
+        const float reference_height = 18.f;
+        const std::vector<float> expected = apply_reference(
+                    fill_heights(state), size,
+                    at.xc, at.yc, at.brush_size, brush(at.brush_size), 0.75f,
+                    [size, reference_height](const std::vector<float> &src,
+                                             int x, int y, float t) {
+                        return (1.f-t)*src[y*size+x] + t*reference_height;
+                    });
+
+        ops::TerraformLevel op(at.xc, at.yc, at.brush_size,
+                               brush(at.brush_size), 0.75f, reference_height);
+        REQUIRE(op.execute(state) == NO_ERROR);
+        check_heights(state, expected);
+    }
+}
+
+TEST_CASE("sim/ops/TerraformRamp/reference")
+{
+    WorldState state;
+    const unsigned int size = state.terrain().size();
+    for (const BrushPlacement &at: brush_placements(state)) {
+        INFO("brush at " << at.xc << ", " << at.yc);
+        // the ramp is shorter than the brush, so that the interpolation
+        // factor is clamped at both ends
+        const Vector2f source(at.xc - 2.f, at.yc - 1.f);
+        const Vector2f destination(at.xc + 2.f, at.yc + 1.5f);
+        const float source_height = 10.f;
+        const float destination_height = 40.f;
+        const Vector2f direction = destination - source;
+        const std::vector<float> expected = apply_reference(
+                    fill_heights(state), size,
+                    at.xc, at.yc, at.brush_size, brush(at.brush_size), 1.f,
+                    [&](const std::vector<float> &src, int x, int y, float t) {
+                        const float f = clamp(
+                                    ((Vector2f(x, y) - source) * direction)
+                                    / (direction * direction),
+                                    0.f, 1.f);
+                        const float target = source_height +
+                                (destination_height - source_height)*f;
+                        return (1.f-t)*src[y*size+x] + t*target;
+                    });
+
+        ops::TerraformRamp op(at.xc, at.yc, at.brush_size,
+                              brush(at.brush_size), 1.f,
+                              source, source_height,
+                              destination, destination_height);
+        REQUIRE(op.execute(state) == NO_ERROR);
+        check_heights(state, expected);
+    }
+}
+
+TEST_CASE("sim/ops/TerraformRamp/rejects_short_ramp")
+{
+    WorldState state;
+    const std::vector<float> original = fill_heights(state);
+    ops::TerraformRamp op(100.f, 100.f, 8, brush(8), 1.f,
+                          Vector2f(100.f, 100.f), 10.f,
+                          Vector2f(100.5f, 100.f), 40.f);
+    CHECK(op.execute(state) == INVALID_ARGUMENT);
+    CHECK(heights(state) == original);
+}
+
+TEST_CASE("sim/ops/TerraformSmooth/reference")
+{
+    WorldState state;
+    const int size = state.terrain().size();
+    for (const BrushPlacement &at: brush_placements(state)) {
+        INFO("brush at " << at.xc << ", " << at.yc);
+        // all cells are smoothed based on the original heights, using a
+        // parzen window of radius 3 clipped to the terrain
+        const std::vector<float> expected = apply_reference(
+                    fill_heights(state), size,
+                    at.xc, at.yc, at.brush_size, brush(at.brush_size), 1.f,
+                    [size](const std::vector<float> &src,
+                           int x, int y, float t) {
+                        float weighted_height = 0.f;
+                        float weight = 0.f;
+                        for (int dy = -2; dy <= 2; ++dy) {
+                            for (int dx = -2; dx <= 2; ++dx) {
+                                const int xs = x + dx;
+                                const int ys = y + dy;
+                                if (xs < 0 || ys < 0 ||
+                                        xs >= size || ys >= size)
+                                {
+                                    continue;
+                                }
+                                const float k = parzen(
+                                            std::sqrt(float(dx*dx + dy*dy))
+                                            / 3.f);
+                                weighted_height += k*src[ys*size+xs];
+                                weight += k;
+                            }
+                        }
+                        return (1.f-t)*src[y*size+x]
+                                + t*weighted_height/weight;
+                    });
+
+        ops::TerraformSmooth op(at.xc, at.yc, at.brush_size,
+                                brush(at.brush_size), 1.f);
+        REQUIRE(op.execute(state) == NO_ERROR);
+        check_heights(state, expected);
+    }
+}
+
+
+static std::shared_ptr<messages::WorldCommand> raise_command(
+        const unsigned int brush_size)
+{
+    auto msg = std::make_shared<messages::WorldCommand>();
+    messages::TerraformRaise &cmd = *msg->mutable_tf_raise();
+    cmd.set_xc(100.5f);
+    cmd.set_yc(200.f);
+    cmd.set_brush_size(brush_size);
+    cmd.set_brush_strength(0.5f);
+    for (float value: brush(brush_size)) {
+        cmd.add_density_map(value);
+    }
+    return msg;
+}
+
+TEST_CASE("sim/WorldOperation/from_message/raise")
+{
+    auto msg = raise_command(16);
+
+    WorldOperationPtr borrowed = WorldOperation::from_message(
+                std::shared_ptr<const messages::WorldCommand>(msg));
+    WorldOperationPtr copied = WorldOperation::from_message(*msg);
+    REQUIRE(borrowed);
+    REQUIRE(copied);
+
+    const auto &op = dynamic_cast<const ops::TerraformRaise&>(*borrowed);
+    CHECK(op.xc() == 100.5f);
+    CHECK(op.yc() == 200.f);
+    CHECK(op.brush_size() == 16);
+    CHECK(op.brush_strength() == 0.5f);
+    CHECK(op.density_map().data() == msg->tf_raise().density_map().data());
+    CHECK(dynamic_cast<const ops::TerraformRaise&>(*copied).density_map().data()
+          != msg->tf_raise().density_map().data());
+
+    // the operation keeps the message alive
+    const std::vector<float> expected = brush(16);
+    msg.reset();
+    CHECK(std::vector<float>(op.density_map().begin(),
+                             op.density_map().end()) == expected);
+
+    WorldState state_borrowed;
+    WorldState state_copied;
+    CHECK(borrowed->execute(state_borrowed) == NO_ERROR);
+    CHECK(copied->execute(state_copied) == NO_ERROR);
+    CHECK(heights(state_borrowed) == heights(state_copied));
+}
+
+TEST_CASE("sim/WorldOperation/from_message/level")
+{
+    messages::WorldCommand msg;
+    messages::TerraformLevel &cmd = *msg.mutable_tf_level();
+    cmd.set_xc(10.f);
+    cmd.set_yc(20.f);
+    cmd.set_brush_size(4);
+    cmd.set_brush_strength(1.f);
+    cmd.set_reference_height(30.f);
+    for (float value: brush(4)) {
+        cmd.add_density_map(value);
+    }
+
+    WorldOperationPtr result = WorldOperation::from_message(msg);
+    REQUIRE(result);
+    const auto &op = dynamic_cast<const ops::TerraformLevel&>(*result);
+    CHECK(op.reference_height() == 30.f);
+    CHECK(op.density_map().size() == 16);
+}
+
+TEST_CASE("sim/WorldOperation/from_message/rejects_invalid")
+{
+    CHECK_FALSE(WorldOperation::from_message(messages::WorldCommand()));
+
+    auto msg = raise_command(16);
+    msg->mutable_tf_raise()->add_density_map(1.f);
+    CHECK_FALSE(WorldOperation::from_message(*msg));
+
+    msg = raise_command(0);
+    CHECK_FALSE(WorldOperation::from_message(*msg));
+
+    msg = raise_command(4);
+    msg->mutable_tf_raise()->set_xc(std::numeric_limits<float>::quiet_NaN());
+    CHECK_FALSE(WorldOperation::from_message(*msg));
+}
+
+TEST_CASE("sim/WorldOperation/from_message/rejects_invalid_density")
+{
+    auto msg = raise_command(4);
+    msg->mutable_tf_raise()->set_density_map(
+                5, std::numeric_limits<float>::quiet_NaN());
+    CHECK_FALSE(WorldOperation::from_message(*msg));
+
+    msg = raise_command(4);
+    msg->mutable_tf_raise()->set_density_map(
+                5, std::numeric_limits<float>::infinity());
+    CHECK_FALSE(WorldOperation::from_message(*msg));
+
+    msg = raise_command(4);
+    msg->mutable_tf_raise()->set_density_map(5, -0.5f);
+    CHECK_FALSE(WorldOperation::from_message(*msg));
+
+    msg = raise_command(4);
+    msg->mutable_tf_raise()->set_density_map(5, 1.5f);
+    CHECK_FALSE(WorldOperation::from_message(*msg));
+
+    messages::WorldCommand level;
+    messages::TerraformLevel &cmd = *level.mutable_tf_level();
+    cmd.set_xc(10.f);
+    cmd.set_yc(20.f);
+    cmd.set_brush_size(1);
+    cmd.set_brush_strength(1.f);
+    cmd.set_reference_height(30.f);
+    cmd.add_density_map(std::numeric_limits<float>::quiet_NaN());
+    CHECK_FALSE(WorldOperation::from_message(level));
+
+    // the bounds themselves are valid
+    msg = raise_command(4);
+    msg->mutable_tf_raise()->set_density_map(0, 0.f);
+    msg->mutable_tf_raise()->set_density_map(5, 1.f);
+    CHECK(WorldOperation::from_message(*msg));
+}
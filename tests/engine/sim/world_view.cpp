@@ -0,0 +1,96 @@
+/**********************************************************************
+File name: world_view.cpp
+This file is part of: SCC (working title)
+
+LICENSE
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program.  If not, see <http://www.gnu.org/licenses/>.
+
+FEEDBACK & QUESTIONS
+
+For feedback and questions about SCC please e-mail one of the authors named in
+the AUTHORS file.
+**********************************************************************/
+#include <catch.hpp>
+
+#include "ffengine/sim/world_view.hpp"
+
+
+using namespace sim;
+
+
+static void set_height(Terrain &terrain,
+                       const unsigned int x, const unsigned int y,
+                       const float height)
+{
+    Terrain::Field *field = nullptr;
+    auto lock = terrain.writable_field(field);
+    (*field)[y*terrain.size() + x][Terrain::HEIGHT_ATTR] = height;
+}
+
+
+TEST_CASE("sim/WorldView/snapshot")
+{
+    // not a multiple of the tile size, to cover clipped edge tiles
+    Terrain terrain(WorldView::TILE_SIZE*2 + 5);
+    const unsigned int size = terrain.size();
+    set_height(terrain, 0, 0, 10.f);
+    set_height(terrain, size-1, size-1, 20.f);
+    set_height(terrain, 70, 3, 30.f);
+
+    auto view = WorldView::snapshot(terrain, nullptr, TerrainRegion(), 7);
+    CHECK(view->frame() == 7);
+    CHECK(view->terrain_size() == size);
+    CHECK(view->height(0, 0) == 10.f);
+    CHECK(view->height(size-1, size-1) == 20.f);
+    CHECK(view->height(70, 3) == 30.f);
+    CHECK(view->height(1, 1) == Terrain::default_height);
+
+    const TerrainRect rect(60, 0, size, 4);
+    std::vector<float> heights(rect.area());
+    view->copy_heights(rect, heights.data());
+    CHECK(heights[3*(size-60) + (70-60)] == 30.f);
+    CHECK(heights[0] == Terrain::default_height);
+}
+
+TEST_CASE("sim/WorldView/shares_unchanged_tiles")
+{
+    Terrain terrain(WorldView::TILE_SIZE*3);
+    auto first = WorldView::snapshot(terrain, nullptr, TerrainRegion(), 0);
+
+    set_height(terrain, 70, 70, 5.f);
+    const TerrainRegion changed(TerrainRect(70, 70, 71, 71));
+    auto second = WorldView::snapshot(terrain, first.get(), changed, 1);
+
+    // the previous view is immutable
+    CHECK(first->height(70, 70) == Terrain::default_height);
+    CHECK(second->height(70, 70) == 5.f);
+    CHECK(second->changed().bounds() == changed.bounds());
+
+    for (unsigned int ty = 0; ty < 3; ++ty) {
+        for (unsigned int tx = 0; tx < 3; ++tx) {
+            const bool shared = first->tile(tx, ty) == second->tile(tx, ty);
+            CHECK(shared == !(tx == 1 && ty == 1));
+        }
+    }
+}
+
+TEST_CASE("sim/WorldView/size_change_copies_all")
+{
+    Terrain small(WorldView::TILE_SIZE);
+    Terrain large(WorldView::TILE_SIZE*2);
+    auto first = WorldView::snapshot(small, nullptr, TerrainRegion(), 0);
+    auto second = WorldView::snapshot(large, first.get(), TerrainRegion(), 1);
+    CHECK(second->terrain_size() == large.size());
+    CHECK(second->tile(0, 0) != first->tile(0, 0));
+}